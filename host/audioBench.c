@@ -0,0 +1,334 @@
+/*
+ *	audioBench.c
+ *
+ *	Runs the audio analysis (audioAnalysis.c) on the host, on a WAV file, raw samples from stdin or a generated signal, and benchmarks it.
+ *	The headers from stm32utils and the device are replaced by the ones in host/port. Build it from the top folder:
+ *
+ *		gcc -O2 -iquote host/port -Iinclude src/audioAnalysis.c host/audioBench.c -o audioBench -lm
+ *
+ *	Usage:
+ *		./audioBench						Benchmarks a generated signal (a kick every 500 ms over a tone and noise, at 48 kHz)
+ *		./audioBench in.wav					Prints the band levels and onsets of each block of a WAV file, then benchmarks it
+ *		./audioBench - [rate] < in.raw		The same for raw samples on stdin (16 bit little endian mono, 48000 Hz if no rate is given)
+ *
+ *	The WAV file shall be 16 bit PCM. Only the first channel is used.
+ *	Each line of levels is the time of the block (ms), the level of each band (0-65535, see audioGetBand) and the onsets in the block.
+ *	The benchmark gives the time of audioProcessBlock for each block, and of audioOnsetProcess for each sample.
+ *	It's the time on the host. To know the time on an MCU, the same loop has to be timed there.
+ */
+
+#include "audioAnalysis.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+//The sample rate of the generated signal and of raw samples (if no rate is given)
+#define BENCH_DEFAULT_RATE		48000
+//The length of the generated signal in seconds
+#define BENCH_GEN_SECONDS		10
+//The shortest time each benchmark runs for (in ns)
+#define BENCH_MIN_NS			500e6
+
+static int16_t* benchSamples=NULL;
+static uint32_t benchNofSamples=0;
+static uint32_t benchRate=BENCH_DEFAULT_RATE;
+static uint32_t benchModTriggers=0;
+
+/*
+ * The engine functions the analysis calls (through the bindings and onset targets), which aren't linked in here
+ */
+bool ledSegModSetInput(uint8_t mod, uint16_t value)
+{
+	return true;
+}
+
+bool ledSegModTrigger(uint8_t mod)
+{
+	benchModTriggers++;
+	return true;
+}
+
+bool ledSegModRelease(uint8_t mod)
+{
+	return true;
+}
+
+bool ledSegSetPulseActiveState(uint8_t seg, bool state)
+{
+	return true;
+}
+
+bool ledSegRestart(uint8_t seg, bool restartFade, bool restartPulse)
+{
+	return true;
+}
+
+bool ledSegExists(uint8_t seg)
+{
+	return true;
+}
+
+void animSeqTrigTransition(animSeqHandle_t seqNum)
+{
+}
+
+void animBeatAdd(uint32_t time)
+{
+}
+
+static double nowNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec*1e9+ts.tv_nsec;
+}
+
+/*
+ * Adds samples to the buffer. Returns false if out of memory
+ */
+static bool benchAddSamples(const int16_t* samples, uint32_t n)
+{
+	int16_t* buf=realloc(benchSamples,(benchNofSamples+n)*sizeof(int16_t));
+	if(buf==NULL)
+	{
+		return false;
+	}
+	benchSamples=buf;
+	memcpy(&benchSamples[benchNofSamples],samples,n*sizeof(int16_t));
+	benchNofSamples+=n;
+	return true;
+}
+
+static uint32_t readLe(const uint8_t* p, uint8_t bytes)
+{
+	uint32_t val=0;
+	for(uint8_t i=0;i<bytes;i++)
+	{
+		val|=(uint32_t)p[i]<<(8*i);
+	}
+	return val;
+}
+
+/*
+ * Reads 16 bit little endian samples with nofChannels channels, and keeps the first channel
+ * maxBytes is the number of bytes to read (or 0 to read to the end)
+ */
+static bool benchReadSamples(FILE* f, uint8_t nofChannels, uint32_t maxBytes)
+{
+	uint8_t raw[4096];
+	int16_t samples[sizeof(raw)/2];
+	const uint32_t frameSize=2*nofChannels;
+	const uint32_t chunk=(sizeof(raw)/frameSize)*frameSize;
+	uint32_t left=maxBytes;
+	while(!maxBytes || left)
+	{
+		const uint32_t len=fread(raw,1,(maxBytes && left<chunk) ? left : chunk,f);
+		const uint32_t n=len/frameSize;
+		for(uint32_t i=0;i<n;i++)
+		{
+			samples[i]=(int16_t)readLe(&raw[i*frameSize],2);
+		}
+		if(!benchAddSamples(samples,n))
+		{
+			return false;
+		}
+		left-=len;
+		if(len<chunk)
+		{
+			break;
+		}
+	}
+	return true;
+}
+
+/*
+ * Reads a 16 bit PCM WAV file. Returns false if it can't be read
+ */
+static bool benchReadWav(const char* name)
+{
+	FILE* f=fopen(name,"rb");
+	if(f==NULL)
+	{
+		printf("Can't open %s\n",name);
+		return false;
+	}
+	uint8_t head[12];
+	if(fread(head,1,12,f)!=12 || memcmp(head,"RIFF",4) || memcmp(&head[8],"WAVE",4))
+	{
+		printf("%s is not a WAV file\n",name);
+		fclose(f);
+		return false;
+	}
+	uint8_t nofChannels=0;
+	bool ok=false;
+	uint8_t chunk[8];
+	while(fread(chunk,1,8,f)==8)
+	{
+		const uint32_t size=readLe(&chunk[4],4);
+		if(!memcmp(chunk,"fmt ",4))
+		{
+			uint8_t fmt[16];
+			if(size<16 || fread(fmt,1,16,f)!=16)
+			{
+				break;
+			}
+			if(readLe(fmt,2)!=1 || readLe(&fmt[14],2)!=16)
+			{
+				printf("%s is not 16 bit PCM\n",name);
+				break;
+			}
+			nofChannels=(uint8_t)readLe(&fmt[2],2);
+			benchRate=readLe(&fmt[4],4);
+			fseek(f,size-16+(size&1),SEEK_CUR);
+		}
+		else if(!memcmp(chunk,"data",4) && nofChannels)
+		{
+			ok=benchReadSamples(f,nofChannels,size);
+			break;
+		}
+		else
+		{
+			//Chunks are padded to an even size
+			fseek(f,size+(size&1),SEEK_CUR);
+		}
+	}
+	fclose(f);
+	if(!ok || !benchNofSamples || !benchRate)
+	{
+		printf("No samples in %s\n",name);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Generates BENCH_GEN_SECONDS of a kick (a falling tone) every 500 ms, over a steady tone and some noise
+ */
+static bool benchGenerate()
+{
+	const uint32_t n=BENCH_GEN_SECONDS*benchRate;
+	int16_t* buf=malloc(n*sizeof(int16_t));
+	if(buf==NULL)
+	{
+		return false;
+	}
+	srand(1);
+	double phase=0;
+	for(uint32_t i=0;i<n;i++)
+	{
+		const double t=(double)(i%(benchRate/2))/benchRate;
+		phase+=2*M_PI*(50+100*exp(-t*30))/benchRate;
+		double val=12000*exp(-t*12)*sin(phase);
+		val+=2000*sin(2*M_PI*880*i/benchRate);
+		val+=(rand()%1001)-500;
+		buf[i]=(int16_t)val;
+	}
+	benchSamples=buf;
+	benchNofSamples=n;
+	return true;
+}
+
+/*
+ * Prints the band levels and onsets of each block
+ */
+static void benchPrintLevels()
+{
+	audioReset();
+	audioOnsetInit(benchRate,0,0,0,false);
+	const uint8_t onsetTarget=audioOnsetAddTarget(AUDIO_ONSET_MOD,0);
+	for(uint32_t i=0;i+AUDIO_FFT_SIZE<=benchNofSamples;i+=AUDIO_FFT_SIZE)
+	{
+		const uint32_t time=(uint32_t)(((uint64_t)i*1000)/benchRate);
+		audioProcessBlock(&benchSamples[i]);
+		const uint8_t onsets=audioOnsetProcess(&benchSamples[i],AUDIO_FFT_SIZE,time);
+		printf("%8u",(unsigned)time);
+		for(uint8_t b=0;b<AUDIO_NOF_BANDS;b++)
+		{
+			printf(" %5u",audioGetBand(b));
+		}
+		printf(onsets ? "  onset\n" : "\n");
+	}
+	audioOnsetRemoveTarget(onsetTarget);
+}
+
+/*
+ * Times audioProcessBlock and audioOnsetProcess on all the samples (repeated until BENCH_MIN_NS has passed)
+ */
+static void benchRun()
+{
+	const uint32_t nofBlocks=benchNofSamples/AUDIO_FFT_SIZE;
+	if(!nofBlocks)
+	{
+		printf("Less than one block (%u samples)\n",AUDIO_FFT_SIZE);
+		return;
+	}
+	audioReset();
+	uint32_t blocks=0;
+	const double start=nowNs();
+	double elapsed=0;
+	while(elapsed<BENCH_MIN_NS)
+	{
+		for(uint32_t i=0;i<nofBlocks;i++)
+		{
+			audioProcessBlock(&benchSamples[i*AUDIO_FFT_SIZE]);
+		}
+		blocks+=nofBlocks;
+		elapsed=nowNs()-start;
+	}
+	const double blockUs=elapsed/blocks/1000;
+	const double realTimeUs=(AUDIO_FFT_SIZE*1e6)/benchRate;
+	printf("audioProcessBlock  %8.2f us/block (%.2f%% of the %.0f us of audio in a block)\n",blockUs,blockUs*100/realTimeUs,realTimeUs);
+
+	audioOnsetInit(benchRate,0,0,0,false);
+	benchModTriggers=0;
+	audioOnsetAddTarget(AUDIO_ONSET_MOD,0);
+	uint64_t samples=0;
+	uint32_t onsets=0;
+	const double onsetStart=nowNs();
+	elapsed=0;
+	while(elapsed<BENCH_MIN_NS)
+	{
+		for(uint32_t i=0;i<nofBlocks;i++)
+		{
+			onsets+=audioOnsetProcess(&benchSamples[i*AUDIO_FFT_SIZE],AUDIO_FFT_SIZE,(uint32_t)((samples*1000)/benchRate));
+			samples+=AUDIO_FFT_SIZE;
+		}
+		elapsed=nowNs()-onsetStart;
+	}
+	printf("audioOnsetProcess  %8.2f ns/sample (%u onsets, %u triggers)\n",elapsed/samples,(unsigned)onsets,(unsigned)benchModTriggers);
+}
+
+int main(int argc, char** argv)
+{
+	bool ok;
+	if(argc<2)
+	{
+		ok=benchGenerate();
+	}
+	else if(!strcmp(argv[1],"-"))
+	{
+		if(argc>2)
+		{
+			benchRate=(uint32_t)atol(argv[2]);
+		}
+		ok=(benchRate && benchReadSamples(stdin,1,0) && benchNofSamples);
+	}
+	else
+	{
+		ok=benchReadWav(argv[1]);
+	}
+	if(!ok)
+	{
+		return 1;
+	}
+	printf("%u samples at %u Hz\n",(unsigned)benchNofSamples,(unsigned)benchRate);
+	if(argc>=2)
+	{
+		benchPrintLevels();
+	}
+	benchRun();
+	free(benchSamples);
+	return 0;
+}
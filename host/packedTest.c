@@ -0,0 +1,267 @@
+/*
+ *	packedTest.c
+ *
+ *	Checks the packed colour kernels (ledSegmentPacked.h) against a byte by byte version, and benchmarks them.
+ *	Runs on the host. Build it once for the SIMD version of the host and once for the portable version:
+ *
+ *		gcc -O2 -Iinclude host/packedTest.c -o packedTest && ./packedTest
+ *		gcc -O2 -Iinclude -DLEDSEG_PACKED_PORTABLE host/packedTest.c -o packedTestPortable && ./packedTestPortable
+ *
+ *	The add, subtract, less-than, equal, min and max kernels are checked for all pairs of bytes in all byte positions
+ *	(with random values in the other bytes). The blend is checked for all pairs of bytes and all weights.
+ *	The benchmark gives the time for each kernel, and for the same operation done one byte at a time.
+ *	The DSP version (Cortex-M4) can't be built for the host, so it's not covered here.
+ *	Returns 0 if all checks pass.
+ */
+
+#include "ledSegmentPacked.h"
+#include <stdio.h>
+#include <stdbool.h>
+#include <time.h>
+
+//The number of words the benchmark runs each kernel on, and how many times
+#define BENCH_WORDS		4096
+#define BENCH_ROUNDS	4000
+
+//Keeps the compiler from removing the benchmarked code
+static volatile uint32_t sink;
+static uint32_t randState=0x2545F491;
+
+static uint32_t randWord()
+{
+	//xorshift32, the same as the segments use
+	randState^=randState<<13;
+	randState^=randState>>17;
+	randState^=randState<<5;
+	return randState;
+}
+
+/*
+ * The byte by byte versions, to check the kernels against
+ */
+static uint8_t refAddSat(uint8_t a, uint8_t b)
+{
+	return (a+b>255 ? 255 : a+b);
+}
+
+static uint8_t refSubSat(uint8_t a, uint8_t b)
+{
+	return (a>b ? a-b : 0);
+}
+
+static uint8_t refLessThan(uint8_t a, uint8_t b)
+{
+	return (a<b ? 0xFF : 0);
+}
+
+static uint8_t refEqual(uint8_t a, uint8_t b)
+{
+	return (a==b ? 0xFF : 0);
+}
+
+static uint8_t refMin(uint8_t a, uint8_t b)
+{
+	return (a<b ? a : b);
+}
+
+static uint8_t refMax(uint8_t a, uint8_t b)
+{
+	return (a>b ? a : b);
+}
+
+typedef uint32_t (*packedFunc_t)(uint32_t a, uint32_t b);
+typedef uint8_t (*refFunc_t)(uint8_t a, uint8_t b);
+
+/*
+ * Applies a byte function to all bytes of two words
+ */
+static uint32_t refWord(refFunc_t f, uint32_t a, uint32_t b)
+{
+	uint32_t res=0;
+	for(uint8_t i=0;i<32;i+=8)
+	{
+		res|=(uint32_t)f((uint8_t)(a>>i),(uint8_t)(b>>i))<<i;
+	}
+	return res;
+}
+
+/*
+ * Checks a kernel for all pairs of bytes in all positions
+ */
+static bool checkKernel(const char* name, packedFunc_t f, refFunc_t ref)
+{
+	uint32_t errors=0;
+	for(uint32_t x=0;x<256;x++)
+	{
+		for(uint32_t y=0;y<256;y++)
+		{
+			for(uint8_t pos=0;pos<32;pos+=8)
+			{
+				const uint32_t mask=0xFFu<<pos;
+				const uint32_t a=(randWord()&~mask)|(x<<pos);
+				const uint32_t b=(randWord()&~mask)|(y<<pos);
+				const uint32_t res=f(a,b);
+				const uint32_t exp=refWord(ref,a,b);
+				if(res!=exp)
+				{
+					if(errors<5)
+					{
+						printf("%s(%08x, %08x) gave %08x, expected %08x\n",name,(unsigned)a,(unsigned)b,(unsigned)res,(unsigned)exp);
+					}
+					errors++;
+				}
+			}
+		}
+	}
+	printf("%-10s %s\n",name,errors ? "FAILED" : "ok");
+	return (errors==0);
+}
+
+/*
+ * Checks the blend for all pairs of bytes and all weights
+ */
+static bool checkBlend()
+{
+	uint32_t errors=0;
+	for(uint32_t w=0;w<=256;w++)
+	{
+		for(uint32_t x=0;x<256;x++)
+		{
+			for(uint32_t y=0;y<256;y++)
+			{
+				//The same pair in all positions, but with different values around it
+				const uint32_t a=(x<<24)|(y<<16)|(x<<8)|y;
+				const uint32_t b=(y<<24)|(x<<16)|(y<<8)|x;
+				const uint32_t res=packedBlend(a,b,(uint16_t)w);
+				uint32_t exp=0;
+				for(uint8_t i=0;i<32;i+=8)
+				{
+					exp|=((((a>>i)&0xFF)*(256-w)+((b>>i)&0xFF)*w)>>8)<<i;
+				}
+				if(res!=exp)
+				{
+					if(errors<5)
+					{
+						printf("packedBlend(%08x, %08x, %u) gave %08x, expected %08x\n",(unsigned)a,(unsigned)b,(unsigned)w,(unsigned)res,(unsigned)exp);
+					}
+					errors++;
+				}
+			}
+		}
+	}
+	printf("%-10s %s\n","blend",errors ? "FAILED" : "ok");
+	return (errors==0);
+}
+
+static uint32_t wrapAddSat(uint32_t a, uint32_t b)
+{
+	return packedAddSat(a,b);
+}
+
+static uint32_t wrapSubSat(uint32_t a, uint32_t b)
+{
+	return packedSubSat(a,b);
+}
+
+static uint32_t wrapLessThan(uint32_t a, uint32_t b)
+{
+	return packedLessThan(a,b);
+}
+
+static uint32_t wrapEqual(uint32_t a, uint32_t b)
+{
+	return packedEqual(a,b);
+}
+
+static uint32_t wrapMin(uint32_t a, uint32_t b)
+{
+	return packedMin(a,b);
+}
+
+static uint32_t wrapMax(uint32_t a, uint32_t b)
+{
+	return packedMax(a,b);
+}
+
+/*
+ * Runs all checks. Returns true if all pass
+ */
+static bool packedTestRun()
+{
+	bool ok=true;
+	ok&=checkKernel("addSat",wrapAddSat,refAddSat);
+	ok&=checkKernel("subSat",wrapSubSat,refSubSat);
+	ok&=checkKernel("lessThan",wrapLessThan,refLessThan);
+	ok&=checkKernel("equal",wrapEqual,refEqual);
+	ok&=checkKernel("min",wrapMin,refMin);
+	ok&=checkKernel("max",wrapMax,refMax);
+	ok&=checkBlend();
+	return ok;
+}
+
+static uint32_t benchA[BENCH_WORDS];
+static uint32_t benchB[BENCH_WORDS];
+
+static double nowNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec*1e9+ts.tv_nsec;
+}
+
+/*
+ * Times a kernel on all the benchmark words (the kernel is inlined into the loop, as it is in ledSegment.c)
+ * The result of each word is fed into the next one, so that the calls can't be removed or merged
+ */
+#define BENCH(name,expr) \
+	do \
+	{ \
+		uint32_t acc=0; \
+		const double start=nowNs(); \
+		for(uint32_t r=0;r<BENCH_ROUNDS;r++) \
+		{ \
+			for(uint32_t i=0;i<BENCH_WORDS;i++) \
+			{ \
+				const uint32_t a=benchA[i]^acc; \
+				const uint32_t b=benchB[i]; \
+				acc+=(expr); \
+			} \
+		} \
+		const double ns=(nowNs()-start)/((double)BENCH_ROUNDS*BENCH_WORDS); \
+		sink=acc; \
+		printf("%-18s %6.2f ns\n",name,ns); \
+	}while(0)
+
+/*
+ * Benchmarks all kernels, and the byte by byte versions of the same operations
+ */
+static void packedBenchRun()
+{
+	for(uint32_t i=0;i<BENCH_WORDS;i++)
+	{
+		benchA[i]=randWord()&PACK_RGB_MASK;
+		benchB[i]=randWord()&PACK_RGB_MASK;
+	}
+	BENCH("addSat",packedAddSat(a,b));
+	BENCH("addSat bytewise",refWord(refAddSat,a,b));
+	BENCH("subSat",packedSubSat(a,b));
+	BENCH("subSat bytewise",refWord(refSubSat,a,b));
+	BENCH("lessThan",packedLessThan(a,b));
+	BENCH("lessThan bytewise",refWord(refLessThan,a,b));
+	BENCH("equal",packedEqual(a,b));
+	BENCH("equal bytewise",refWord(refEqual,a,b));
+	BENCH("min",packedMin(a,b));
+	BENCH("max",packedMax(a,b));
+	BENCH("blend",packedBlend(a,b,(uint16_t)(i&0xFF)));
+}
+
+int main()
+{
+	printf("Packed kernels: %s\n",LEDSEG_PACKED_IMPL);
+	if(!packedTestRun())
+	{
+		return 1;
+	}
+	packedBenchRun();
+	return 0;
+}
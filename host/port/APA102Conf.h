@@ -0,0 +1,13 @@
+/*
+ *	APA102Conf.h
+ *
+ *	Host stand-in for the strip configuration. Only what the library headers use.
+ */
+
+#ifndef HOST_APA102CONF_H_
+#define HOST_APA102CONF_H_
+
+#define APA_NOF_STRIPS		3
+#define APA_MAX_NOF_LEDS	300
+
+#endif /* HOST_APA102CONF_H_ */
@@ -0,0 +1,17 @@
+/*
+ *	events.h
+ *
+ *	Host stand-in for events.h from stm32utils. Only the parts the library headers use.
+ */
+
+#ifndef HOST_EVENTS_H_
+#define HOST_EVENTS_H_
+
+#include <stdint.h>
+
+typedef struct
+{
+	uint32_t avgTime;
+}eventTimeList;
+
+#endif /* HOST_EVENTS_H_ */
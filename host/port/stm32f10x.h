@@ -0,0 +1,12 @@
+/*
+ *	stm32f10x.h
+ *
+ *	Host stand-in for the device header, so that the library headers can be included in the host programs (see host/audioBench.c).
+ */
+
+#ifndef HOST_STM32F10X_H_
+#define HOST_STM32F10X_H_
+
+#include <stdint.h>
+
+#endif /* HOST_STM32F10X_H_ */
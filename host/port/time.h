@@ -0,0 +1,13 @@
+/*
+ *	time.h
+ *
+ *	Host stand-in for time.h from stm32utils. The host programs keep their own time, so it's empty.
+ *	It's only found by #include "time.h" (with -iquote), so <time.h> is still the one of the host.
+ */
+
+#ifndef HOST_TIME_H_
+#define HOST_TIME_H_
+
+#include <stdint.h>
+
+#endif /* HOST_TIME_H_ */
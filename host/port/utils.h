@@ -0,0 +1,20 @@
+/*
+ *	utils.h
+ *
+ *	Host stand-in for utils.h from stm32utils. Only the types the library headers use.
+ */
+
+#ifndef HOST_UTILS_H_
+#define HOST_UTILS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct
+{
+	uint8_t r;
+	uint8_t g;
+	uint8_t b;
+}RGB_t;
+
+#endif /* HOST_UTILS_H_ */
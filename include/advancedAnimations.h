@@ -15,11 +15,40 @@
 
 //The call period for the animation task in ms
 #define ANIM_TASK_PERIOD	37
+//The maximum number of sequences stepped (or points loaded by members) in one call to animTask (loading a point can take a while)
+#define ANIM_TASK_MAX_STEPS	2
+
+//The number of animation points in RAM, shared by all sequences (each point is sizeof(animSeqPoint_t), 96B of SRAM on a 32-bit MCU). Each sequence only takes the points it has
+#define ANIM_SEQ_ARENA_POINTS	75
+//The maximum number of animation sequences at the same time (each slot uses about 90B of SRAM, not counting the points). At most 16
+#define ANIM_SEQ_MAX_SEQS	16
+//The number of segments that follow a sequence with a time offset, shared by all sequences (see animSeqAddMember). Each takes 20B of SRAM
+#define ANIM_SEQ_MAX_MEMBERS	24
+
+//The maximum number of animation scripts loaded at the same time (see animScriptLoad)
+#define ANIM_SCRIPT_MAX_SCRIPTS	4
+//The maximum number of instructions each script runs per call to animTask (so that a script that never waits can't lock up the task)
+#define ANIM_SCRIPT_MAX_STEPS	16
+//The number of loop counters of each script
+#define ANIM_SCRIPT_NOF_COUNTERS	4
+//Enables the script assembler (animScriptAssemble). It's meant for the host (a tool that turns text into code to send to the target),
+//so it's left out of the target by default. Define it as 1 when building the library for the host
+#ifndef ANIM_SCRIPT_ASSEMBLER_ENABLED
+#define ANIM_SCRIPT_ASSEMBLER_ENABLED 0
+#endif
+//The number of the last beat intervals the beat tracker takes the median of (see animBeatAdd)
+#define ANIM_BEAT_NOF_INTERVALS	8
+//The shortest and longest time between beats the beat tracker follows (in ms, 240 and 30 BPM)
+#define ANIM_BEAT_MIN_PERIOD	250
+#define ANIM_BEAT_MAX_PERIOD	2000
+//The number of beats in a row that are off the predicted beat before the beat tracker starts over
+#define ANIM_BEAT_MAX_MISSES	4
 
-//The maximum number of allowed animation points in one sequence (each point consumes 60B of SRAM)
-#define ANIM_SEQ_MAX_POINTS	15
-//The maximum possible of saved animation sequences (each animation sequence uses ANIM_SEQ_MAX_POINTS*60B+12B SRAM)
-#define ANIM_SEQ_MAX_SEQS	5
+/*
+ * Refers to an animation sequence in the pool. Holds the slot and the generation of the slot, so that a handle to a destroyed sequence stays invalid when the slot is re-used
+ * LEDSEG_ALL refers to all sequences. ANIM_SEQ_MAX_SEQS+1 is returned when something went wrong (neither is ever a valid handle)
+ */
+typedef uint16_t animSeqHandle_t;
 
 /*
  * Handles the types of the different advanced animation modes
@@ -75,6 +104,28 @@ typedef enum
 	ITALY_COL_NOF_COLOURS
 }italyCols_t;
 
+/*
+ * The instructions of an animation script. Each instruction is the op code followed by its operands
+ * All operands are little endian and unaligned, so a script is the same on all platforms. Addresses are byte offsets in the script
+ */
+typedef enum
+{
+	ANIM_OP_END=0,			//Stops the script
+	ANIM_OP_FADE,			//Sets a fade: mode, r_min, g_min, b_min, r_max, g_max, b_max (u8), fadeTime (u32), startDir (i8), cycles (u32), globalSetting, syncGroup (u8)
+	ANIM_OP_PULSE,			//Sets a pulse: mode, r_max, g_max, b_max (u8), ledsMaxPower, ledsFadeBefore, ledsFadeAfter, startLed (u16), startDir (i8), pixelsPerIteration, pixelTime (u16), cycles (u32), globalSetting (u8)
+	ANIM_OP_FADE_ACTIVE,	//Turns the fade on or off: state (u8)
+	ANIM_OP_PULSE_ACTIVE,	//Turns the pulse on or off: state (u8)
+	ANIM_OP_SEG,			//Changes the segment the script runs on: seg (u8)
+	ANIM_OP_WAIT,			//Waits: time in ms (u32)
+	ANIM_OP_WAIT_DONE,		//Waits until the fade (bit 0) and/or pulse (bit 1) is done: mask (u8)
+	ANIM_OP_WAIT_TRIG,		//Waits for a trigger (see animScriptTrigger)
+	ANIM_OP_JUMP,			//Jumps: address (u16)
+	ANIM_OP_COUNT,			//Sets a loop counter: counter (u8), value (u16)
+	ANIM_OP_LOOP,			//Decreases a loop counter and jumps if it's not 0: counter (u8), address (u16)
+	ANIM_OP_RAND,			//Jumps with the chance of chance/256: chance (u8), address (u16)
+	ANIM_OP_NOF_OPS
+}animScriptOp_t;
+
 /*
  * Defines a single point of animation setting
  * the mode and cycles of the fade and pulse controls how long this point runs for
@@ -95,17 +146,26 @@ typedef struct
 	bool switchAtMax;
 	bool fadeToNext;				//Indicates if we should fade into the next point or not Todo: Consider renaming to fadeToThis or something
 	bool switchOnTime;				//Indicates that the switch shall happen based on time only, disregarding if they're done. This uses the waitAfter time. If switchOnTime and waitForTrigger are both given, the trigger can be activated at any time.
+
+	ledSegmentFadeRates_t fadeRates;	//The rates of the fade setting, calculated when the point is given to the sequence. This doesn't need to be set by the user
 }animSeqPoint_t;
 
 
+/*
+ * Makes point n of a generated sequence (see animSeqInitGenerator). The point is cleared before the call
+ * state is the copy of the state given to animSeqInitGenerator. It may be changed by the generator, but it may move between calls (don't keep pointers into it)
+ */
+typedef void (*animSeqGenerator_t)(void* state, uint16_t n, animSeqPoint_t* point);
+
 extern const RGB_t coloursSimple[SIMPLE_COL_NOF_COLOURS];
 extern const RGB_t coloursPride[PRIDE_COL_NOF_COLOURS];
 extern const RGB_t coloursPan[PAN_COL_NOF_COLOURS];
 extern const RGB_t coloursItaly[ITALY_COL_NOF_COLOURS];
 
 RGB_t animGetColour(simpleCols_t col, uint8_t normalize);
+void animSetRandSeed(uint32_t seed);
 RGB_t animGetColourPride(prideCols_t col, uint8_t normalize);
-RGB_t animGetColourFromSequence(RGB_t* colourList, uint8_t num, uint8_t normalize);
+RGB_t animGetColourFromSequence(RGB_t* colourList, uint16_t num, uint8_t normalize);
 RGB_t animNormalizeColours(const RGB_t* cols, uint8_t normalVal);
 void animLoadLedSegFadeColour(simpleCols_t col,ledSegmentFadeSetting_t* st, uint8_t minScale, uint8_t maxScale);
 void animLoadLedSegPulseColour(simpleCols_t col,ledSegmentPulseSetting_t* st, uint8_t maxScale);
@@ -117,21 +177,52 @@ void animSetPrideWheelState(bool active);
 bool animPrideWheelGetDone();
 prideCols_t animLoadNextRainbowWheel(ledSegmentFadeSetting_t* fs, uint8_t seg, prideCols_t colIndex);
 
-uint8_t animSeqInit(uint8_t seg, bool isSyncGroup, uint32_t cycles, animSeqPoint_t* points, uint8_t nofPoints);
-uint8_t animSeqInitExisting(uint8_t existingSeq, uint8_t seg, bool isSyncGroup, uint32_t cycles, animSeqPoint_t* points, uint8_t nofPoints);
+animSeqHandle_t animSeqInit(uint8_t seg, bool isSyncGroup, uint32_t cycles, animSeqPoint_t* points, uint8_t nofPoints);
+animSeqHandle_t animSeqInitExisting(animSeqHandle_t existingSeq, uint8_t seg, bool isSyncGroup, uint32_t cycles, animSeqPoint_t* points, uint8_t nofPoints);
+uint32_t animSeqPack(const animSeqPoint_t* points, uint16_t nofPoints, uint8_t* buf, uint32_t size);
+animSeqHandle_t animSeqInitPacked(uint8_t seg, bool isSyncGroup, uint32_t cycles, const uint8_t* packed, uint32_t size);
+animSeqHandle_t animSeqInitGenerator(uint8_t seg, bool isSyncGroup, uint32_t cycles, animSeqGenerator_t generator, const void* state, uint16_t stateSize, uint16_t nofPoints);
+animSeqHandle_t animSeqInitConst(uint8_t seg, bool isSyncGroup, uint32_t cycles, const animSeqPoint_t* points, uint16_t nofPoints);
 void animSeqFillPoint(animSeqPoint_t* point, ledSegmentFadeSetting_t* fs, ledSegmentPulseSetting_t* ps, uint32_t waitAfter, bool fadePeristFromLast, bool pulsePeristFromLast, bool waitForTrigger, bool switchOnTime, bool fadeToNext, bool switchAtMax);
-bool animSeqExists(uint8_t seqNum);
-bool animSeqAppendPoint(uint8_t seqNum, animSeqPoint_t* point);
-bool animSeqRemovePoint(uint8_t seqNum, uint8_t n);
-void animSeqSetRestart(uint8_t seqNum);
-bool animSeqTrigReady(uint8_t seqNum);
-void animSeqTrigTransition(uint8_t seqNum);
-void animSeqSetActive(uint8_t seqNum, bool active);
-bool animSeqIsActive(uint8_t seqNum);
-
-uint8_t animGenerateFadeSequence(uint8_t existingSeq, uint8_t seg, uint8_t syncGroup, uint32_t cycles, uint8_t nofPoints, RGB_t* sequence, uint32_t fadeTime, uint32_t waitTime, uint8_t maxScaling, bool addPulse);
-uint8_t animGenerateBeatSequence(uint8_t existingSeq, uint8_t seg, uint8_t syncGroup, uint32_t cycles, uint8_t nofPoints, ledSegmentFadeSetting_t* fade, ledSegmentPulseSetting_t* pulse, bool useFade, bool usePulse, uint8_t globalMax, eventTimeList* events, bool useAvgTime);
-uint8_t animSeqModifyToBeat(uint8_t existingSeq, eventTimeList* events, bool useAvgTime);
+bool animSeqDestroy(animSeqHandle_t seqNum);
+bool animSeqExists(animSeqHandle_t seqNum);
+uint16_t animSeqGetArenaPoints(animSeqHandle_t seqNum);
+bool animSeqAppendPoint(animSeqHandle_t seqNum, animSeqPoint_t* point);
+bool animSeqRemovePoint(animSeqHandle_t seqNum, uint8_t n);
+bool animSeqRemoveAllPoints(animSeqHandle_t seqNum);
+bool animSeqAddMember(animSeqHandle_t seqNum, uint8_t seg, uint32_t offset);
+bool animSeqRemoveMember(animSeqHandle_t seqNum, uint8_t seg);
+void animSeqSetRestart(animSeqHandle_t seqNum);
+void animSeqSetTransition(animSeqHandle_t seqNum, ledSegmentTransition_t type, uint32_t time, ledSegmentEase_t ease);
+bool animSeqTrigReady(animSeqHandle_t seqNum);
+void animSeqTrigTransition(animSeqHandle_t seqNum);
+bool animSeqTrigTransitionImmediate(animSeqHandle_t seqNum);
+void animSeqSetActive(animSeqHandle_t seqNum, bool active);
+bool animSeqIsActive(animSeqHandle_t seqNum);
+void animSeqSetOnBeat(animSeqHandle_t seqNum, bool onBeat);
+
+animSeqHandle_t animGenerateFadeSequence(animSeqHandle_t existingSeq, uint8_t seg, uint8_t syncGroup, uint32_t cycles, uint16_t nofPoints, RGB_t* sequence, uint32_t fadeTime, uint32_t waitTime, uint8_t maxScaling, bool addPulse);
+animSeqHandle_t animGenerateBeatSequence(animSeqHandle_t existingSeq, uint8_t seg, uint8_t syncGroup, uint32_t cycles, uint16_t nofPoints, ledSegmentFadeSetting_t* fade, ledSegmentPulseSetting_t* pulse, bool useFade, bool usePulse, uint8_t globalMax, eventTimeList* events, bool useAvgTime);
+animSeqHandle_t animSeqModifyToBeat(animSeqHandle_t existingSeq, eventTimeList* events, bool useAvgTime);
+void animBeatAdd(uint32_t time);
+void animBeatReset();
+void animBeatSetLatency(uint32_t latency);
+bool animBeatIsLocked();
+uint32_t animBeatGetPeriod();
+uint32_t animBeatGetNext(uint32_t time);
+bool animBeatFillEvents(eventTimeList* events);
+uint32_t animSeqSnapshot(uint8_t* buf, uint32_t size);
+bool animSeqRestore(const uint8_t* buf, uint32_t size, bool apply);
+
+uint8_t animScriptLoad(uint8_t seg, const uint8_t* code, uint32_t size);
+bool animScriptFree(uint8_t script);
+void animScriptSetActive(uint8_t script, bool active);
+bool animScriptIsActive(uint8_t script);
+void animScriptRestart(uint8_t script);
+void animScriptTrigger(uint8_t script);
+#if ANIM_SCRIPT_ASSEMBLER_ENABLED
+uint32_t animScriptAssemble(const char* text, uint8_t* buf, uint32_t size);
+#endif
 
 void animTask();
 
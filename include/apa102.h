@@ -13,6 +13,10 @@
 #include "utils.h"
 #include "APA102Conf.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef struct
 {
 	uint8_t global;
@@ -56,7 +60,13 @@ bool apa102DMABusy(uint8_t strip);
 void apa102FillRange(uint8_t strip, uint16_t start, uint16_t stop, uint8_t r, uint8_t g, uint8_t b, uint8_t global);
 void apa102FillStrip(uint8_t strip, uint8_t r, uint8_t g, uint8_t b, uint8_t global);
 void apa102ClearStrip(uint8_t strip);
+bool apa102ReadRange(uint8_t strip, uint16_t start, uint16_t stop, apa102Pixel_t* out);
+bool apa102WriteRange(uint8_t strip, uint16_t start, uint16_t stop, const apa102Pixel_t* in);
 void apa102UpdateStripBitbang(uint8_t strip);
 bool apa102IsValidPixel(uint8_t strip, uint16_t pixel);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* APA102_H_ */
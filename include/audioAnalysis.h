@@ -0,0 +1,75 @@
+/*
+ * audioAnalysis.h
+ */
+
+#ifndef INCLUDE_AUDIOANALYSIS_H_
+#define INCLUDE_AUDIOANALYSIS_H_
+
+#include "ledSegment.h"
+#include "advancedAnimations.h"
+#include "utils.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//The number of samples in each block given to audioProcessBlock (the FFT is written for this size)
+#define AUDIO_FFT_SIZE	512
+//The number of log-spaced frequency bands the spectrum is reduced to
+#define AUDIO_NOF_BANDS	8
+//The number of bindings from bands to modulators (see audioBind)
+#define AUDIO_MAX_BINDINGS	8
+//The range of each band below its peak that is mapped onto the level (in dB)
+#define AUDIO_AGC_RANGE_DB	36
+//The lowest peak a band follows (in dB below full scale). Below it, the level goes down instead of the gain going up
+#define AUDIO_AGC_FLOOR_DB	60
+//How fast the peak of each band falls (in tenths of dB per block)
+#define AUDIO_AGC_DECAY_DB10	2
+//The smoothing of the levels, in shifts (0 is no smoothing). Rising levels use the attack, falling levels the release
+#define AUDIO_ATTACK_SHIFT	1
+#define AUDIO_RELEASE_SHIFT	3
+
+//The onset detector (see audioOnsetProcess)
+//The number of things an onset can trigger
+#define AUDIO_MAX_ONSET_TARGETS	8
+//The smoothing of the fast and slow envelopes, in shifts (the time constant is 2^shift samples)
+#define AUDIO_ONSET_FAST_SHIFT	4
+#define AUDIO_ONSET_SLOW_SHIFT	11
+//The removal of the DC offset, in shifts (the time constant is 2^shift samples)
+#define AUDIO_ONSET_DC_SHIFT	12
+//How much the fast envelope must be above the slow one for an onset (in 1/16, so 32 is twice as loud)
+#define AUDIO_ONSET_DEFAULT_RATIO	32
+//The largest ratio (almost 8 times as loud). Larger ratios would overflow the threshold
+#define AUDIO_ONSET_MAX_RATIO	127
+//The lowest fast envelope that can be an onset (keeps noise in quiet parts from triggering)
+#define AUDIO_ONSET_DEFAULT_MIN_LEVEL	256
+//The time after an onset when no new onset is detected (in ms)
+#define AUDIO_ONSET_DEFAULT_REFRACTORY	100
+
+/*
+ * What an onset triggers
+ */
+typedef enum
+{
+	AUDIO_ONSET_SEQ=0,		//Trigger the transition of an animation sequence (the target is an animSeqHandle_t)
+	AUDIO_ONSET_PULSE,		//Restart the pulse of a segment (the target is a segment)
+	AUDIO_ONSET_MOD,		//Trigger an envelope modulator (the target is a modulator)
+}audioOnsetTargetType_t;
+
+bool audioProcessBlock(const int16_t* samples);
+uint16_t audioGetBand(uint8_t band);
+void audioReset();
+uint8_t audioBind(uint8_t band, uint8_t mod, uint16_t threshold);
+bool audioUnbind(uint8_t binding);
+
+void audioOnsetInit(uint32_t sampleRate, uint16_t ratio, uint16_t minLevel, uint16_t refractory, bool useBeatTracker);
+uint8_t audioOnsetProcess(const int16_t* samples, uint16_t nofSamples, uint32_t time);
+uint32_t audioOnsetGetLast();
+uint8_t audioOnsetAddTarget(audioOnsetTargetType_t type, uint32_t target);
+bool audioOnsetRemoveTarget(uint8_t target);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* INCLUDE_AUDIOANALYSIS_H_ */
@@ -12,6 +12,10 @@
 #include "utils.h"
 #include "time.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 //The maximum number of LED segments allowed (each segment costs almost 100 byte of RAM)
 //Without some library rewriting, this value cannot be larger than 254
 #define LEDSEG_MAX_SEGMENTS	30
@@ -21,6 +25,27 @@
 #define LEDSEG_UPDATE_PERIOD_TIME 20
 //The number of calculation sub-cycles per update period
 #define LEDSEG_CALCULATION_CYCLES 4
+//The size of the effect registry. Modes from LEDSEG_MODE_NOF_MODES and up can be used for custom effects
+#define LEDSEG_MAX_EFFECTS (LEDSEG_MODE_NOF_MODES+4)
+//Set to 0 to leave out the built-in pulse (loop, loop_end, bounce) or glitter effects from the build (saves flash)
+#ifndef LEDSEG_EFFECT_PULSE_ENABLED
+#define LEDSEG_EFFECT_PULSE_ENABLED 1
+#endif
+#ifndef LEDSEG_EFFECT_GLITTER_ENABLED
+#define LEDSEG_EFFECT_GLITTER_ENABLED 1
+#endif
+//The version of the snapshot format (change when the contents of a snapshot change)
+#define LEDSEG_SNAPSHOT_VERSION 5
+//The seed used for the random generator of each segment, unless set by ledSegSetRandSeed
+#define LEDSEG_RAND_DEFAULT_SEED 0x2545F491
+//Generates a (never 0) random generator state from a seed and a segment number, so that segments with the same seed still get different sequences
+#define LEDSEG_RAND_SEED_FROM_ID(seed,seg) (((uint32_t)(seed)^(((uint32_t)(seg)+1)*0x9E3779B9u))|1u)
+//The number of modulators, and the number of bindings from modulators to segment settings (see ledSegModInit and ledSegModBind)
+#define LEDSEG_MAX_MODULATORS 8
+#define LEDSEG_MAX_MOD_BINDINGS 16
+//The number of completion events that can be queued within a calculation cycle, and the number of callbacks that can receive them (see ledSegAddEventCallback)
+#define LEDSEG_EVENT_QUEUE_SIZE 16
+#define LEDSEG_MAX_EVENT_CALLBACKS 4
 
 /*
  * The modes the ledSegment controller can use
@@ -39,6 +64,74 @@ typedef enum
 	LEDSEG_MODE_NOF_MODES
 }ledSegmentMode_t;
 
+/*
+ * Easing curves used for transitions
+ */
+typedef enum
+{
+	LEDSEG_EASE_LINEAR=0,		//Constant speed
+	LEDSEG_EASE_IN,				//Starts slow and ends fast
+	LEDSEG_EASE_OUT,			//Starts fast and ends slow
+	LEDSEG_EASE_IN_OUT,			//Starts and ends slow
+}ledSegmentEase_t;
+
+/*
+ * The ways the old and new settings can be combined during a transition
+ */
+typedef enum
+{
+	LEDSEG_TRANS_CROSSFADE=0,	//All LEDs are blended from the old to the new setting
+	LEDSEG_TRANS_WIPE_UP,		//The new setting sweeps in from the start of the segment to the end
+	LEDSEG_TRANS_WIPE_DOWN,		//The new setting sweeps in from the end of the segment to the start
+	LEDSEG_TRANS_CENTRE_OUT,	//The new setting grows from the centre of the segment towards both ends
+	LEDSEG_TRANS_CENTRE_IN,		//The new setting grows from both ends towards the centre
+	LEDSEG_TRANS_DISSOLVE,		//LEDs switch to the new setting one by one, in random order
+}ledSegmentTransition_t;
+
+/*
+ * Completion events raised by the segments (see ledSegAddEventCallback)
+ */
+typedef enum
+{
+	LEDSEG_EVENT_FADE_CYCLE_DONE=0,	//The fade has reached min or max (and the sync group has been released, if it has one)
+	LEDSEG_EVENT_FADE_DONE,			//The fade has run all its cycles
+	LEDSEG_EVENT_FADE_SWITCH_DONE,	//A mode change (see ledSegSetModeChange) is done, and the fade it switched to is loaded
+	LEDSEG_EVENT_PULSE_DONE,		//The pulse (or glitter) has run all its cycles
+	LEDSEG_EVENT_SYNC_RELEASE,		//All fades in the sync group of the segment have reached their end, and are released
+	LEDSEG_EVENT_OVERFLOW,			//The event queue was full, so events have been lost (seg is LEDSEG_ALL). Anything waiting for an event shall check its state again
+}ledSegmentEvent_t;
+
+/*
+ * The sources a modulator can use to generate its value
+ */
+typedef enum
+{
+	LEDSEG_MOD_SINE=0,			//LFO: sine wave
+	LEDSEG_MOD_TRIANGLE,		//LFO: triangle wave
+	LEDSEG_MOD_SQUARE,			//LFO: square wave (max the first half of the period)
+	LEDSEG_MOD_ENVELOPE,		//Attack/decay/sustain/release envelope, started by ledSegModTrigger and ended by ledSegModRelease
+	LEDSEG_MOD_RANDOM_WALK,		//Takes a random step up or down at a regular interval
+	LEDSEG_MOD_EXTERNAL,		//The value is set from outside (see ledSegModSetInput), for instance from a sensor
+	LEDSEG_MOD_NOF_SOURCES
+}ledSegmentModSource_t;
+
+/*
+ * The settings a modulator can be bound to
+ */
+typedef enum
+{
+	LEDSEG_MOD_TARGET_PULSE_SPEED=0,	//pixelTime of the pulse (min 1). Glitter: The update periods between new glitter points, which sets the glitter density
+	LEDSEG_MOD_TARGET_PULSE_R_MAX,
+	LEDSEG_MOD_TARGET_PULSE_G_MAX,
+	LEDSEG_MOD_TARGET_PULSE_B_MAX,
+	LEDSEG_MOD_TARGET_PULSE_GLOBAL,
+	LEDSEG_MOD_TARGET_FADE_R_MAX,		//The fade rate is kept, so the fade takes longer for a larger span
+	LEDSEG_MOD_TARGET_FADE_G_MAX,
+	LEDSEG_MOD_TARGET_FADE_B_MAX,
+	LEDSEG_MOD_TARGET_FADE_GLOBAL,
+	LEDSEG_MOD_NOF_TARGETS
+}ledSegmentModTarget_t;
+
 typedef enum
 {
 	LEDSEG_FADE_NOT_DONE,
@@ -75,6 +168,16 @@ typedef struct
 	RGB_t* colourSeqPtr;			//Pointer to the colour sequence list.
 }ledSegmentPulseSetting_t;
 
+/*
+ * A colour in a keyframe fade (see keyframePtr in ledSegmentFadeSetting_t)
+ */
+typedef struct
+{
+	RGB_t colour;
+	uint32_t hold;					//The time to stay at this colour before fading to the next keyframe (in ms)
+	uint32_t time;					//The time to fade to the next keyframe (in ms)
+}ledSegmentKeyframe_t;
+
 /*
  * Describes the fade setting for an LED segment
  */
@@ -96,8 +199,23 @@ typedef struct
 	uint8_t globalSetting;			//The global setting to be used
 	uint8_t syncGroup;				//Indicates which sync group a fade segment belongs to. All fades of the same syncGroup will sync up at min/max. syncGroup=0 turns this feature off
 
+	uint8_t keyframeNum;			//Number of keyframes. If keyframeNum=0, keyframes are not used. If used, the fade goes through the keyframes instead of between min and max (which are then set internally)
+	const ledSegmentKeyframe_t* keyframePtr;	//Pointer to the keyframe list. Each fade to the next keyframe is a half-cycle. Loop modes go from the last keyframe to the first, bounce goes back and forth.
+											//startDir is not used (it always starts at the first keyframe), and fadeTime is only used when switching to the setting (see ledSegSetModeChange)
 }ledSegmentFadeSetting_t;
 
+/*
+ * The values ledSegSetFade derives from a fade setting (see ledSegCompileFade)
+ */
+typedef struct
+{
+	uint8_t r_rate;
+	uint8_t g_rate;
+	uint8_t b_rate;
+	uint16_t periodMultiplier;
+	uint32_t cycles;				//The cycles to run (0 if the setting has so many that it's considered to run forever)
+}ledSegmentFadeRates_t;
+
 /*
  * This struct describes the state of an LED segment.
  */
@@ -129,6 +247,13 @@ typedef struct
 	//Saved variables to be restored when switch is done
 	int8_t savedDir;
 	uint32_t savedCycles;
+	const ledSegmentKeyframe_t* savedKeyframePtr;
+	uint8_t savedKeyframeNum;
+
+	//Keyframe fade state
+	uint8_t keyframe;					//The keyframe the fade is going to
+	int8_t keyframeDir;					//The direction the keyframes are gone through in (-1 when a bounce goes back)
+	uint32_t keyframeHold;				//The number of fade steps left to stay at the current colour
 
 	//Pulse state
 	int8_t pulseDir;					//The wander direction for the LED
@@ -145,7 +270,10 @@ typedef struct
 	uint8_t glitterR;
 	uint8_t glitterG;
 	uint8_t glitterB;
-	uint16_t* glitterActiveLeds;		//The numbers (indexed within strip) of the LEDs active in glitter
+	void* effectMem;					//Extra memory allocated for the pulse effect (the size is given by the effect). For glitter, this is the numbers (indexed within segment) of the LEDs active in glitter
+	uint16_t effectMemSize;				//The size of effectMem (in bytes)
+	bool effectMemExternal;				//Indicates that effectMem is not allocated by the library (and shall not be freed)
+	uint32_t randState;					//State of the random generator for this segment (xorshift32). Used for glitter, so the same seed gives the exact same glitter
 
 }ledSegmentState_t;
 
@@ -164,12 +292,87 @@ typedef struct
 	ledSegmentState_t state;
 }ledSegment_t;
 
+/*
+ * Describes an effect run by the pulse part of a segment. Each ledSegmentMode_t has an entry in the effect registry.
+ * The update loop dispatches through the registry once per segment and update period.
+ * The effect is given the segment directly, so it does not have to look it up.
+ */
+typedef struct
+{
+	void (*init)(ledSegment_t* sg);								//Called when a new pulse setting has been loaded (after effect memory is allocated). Sets up the start state
+	bool (*advance)(ledSegment_t* sg);							//Moves the effect one step (every pixelTime update periods). Returns true if new data was generated
+	void (*render)(ledSegment_t* sg, bool advanced);			//Writes the effect into the LED buffer (every update period). advanced is the return value of advance (false if it was not called)
+	uint16_t (*memSize)(const ledSegmentPulseSetting_t* ps);	//Returns the number of bytes of effect memory needed for a setting. May be NULL if no memory is used
+}ledSegmentEffect_t;
+
+//Calculates a single segment for one update period (used by ledSegRunIterationCustom)
+typedef void (*ledSegCalcFunc_t)(uint8_t seg);
+//Returns the time the engine runs on, in ms (see ledSegSetClock)
+typedef uint32_t (*ledSegClockFunc_t)();
+//Receives the completion events of the segments (see ledSegAddEventCallback)
+typedef void (*ledSegEventCallback_t)(uint8_t seg, ledSegmentEvent_t event);
+
+/*
+ * The position of a pulse at a given time (see ledSegEvalPulse)
+ */
+typedef struct
+{
+	int16_t currentLed;		//The first LED in the pulse (absolute on the strip, same as currentLed in the state)
+	int8_t dir;				//The direction the pulse is moving in
+	bool active;			//False if the pulse has finished all its cycles
+	bool lastCycle;			//True if the pulse is running off the end of the segment on its last cycle
+}ledSegmentPulsePos_t;
+
+/*
+ * Describes a modulator (see ledSegModInit). A modulator generates a value from 0 to 65535 once every update period
+ * The value is mapped onto segment settings by bindings (see ledSegModBind)
+ */
+typedef struct
+{
+	ledSegmentModSource_t source;	//What generates the value
+	uint32_t period;				//LFO: The time of one period (ms). Random walk: The time between steps (ms)
+	uint16_t phase;					//LFO: The phase to start at (0-65535 is one period). Random walk: The value to start at
+	uint16_t step;					//Random walk: The largest change in each step
+	uint32_t attack;				//Envelope: The time from 0 to max after a trigger (ms)
+	uint32_t decay;					//Envelope: The time from max down to the sustain level (ms)
+	uint16_t sustain;				//Envelope: The level kept until released
+	uint32_t release;				//Envelope: The time from max to 0 after a release (ms). Released from a lower level, it takes proportionally shorter
+}ledSegmentModSetting_t;
+
+//The built-in effects
+#if LEDSEG_EFFECT_PULSE_ENABLED
+extern const ledSegmentEffect_t ledSegEffectPulseLoop;
+extern const ledSegmentEffect_t ledSegEffectPulseLoopEnd;
+extern const ledSegmentEffect_t ledSegEffectPulseBounce;
+#endif
+#if LEDSEG_EFFECT_GLITTER_ENABLED
+extern const ledSegmentEffect_t ledSegEffectGlitter;
+#endif
+
 uint8_t ledSegInitSegment(uint8_t strip, uint16_t start, uint16_t stop, bool invertPulse, bool excludeFromAll, ledSegmentPulseSetting_t* pulse, ledSegmentFadeSetting_t* fade);
 bool ledSegExists(uint8_t seg);
 bool ledSegExistsNotAll(uint8_t seg);
 bool ledSegSetPulse(uint8_t seg, ledSegmentPulseSetting_t* ps);
 bool ledSegSetFade(uint8_t seg, ledSegmentFadeSetting_t* fs);
+void ledSegCompileFade(const ledSegmentFadeSetting_t* fs, ledSegmentFadeRates_t* rates);
+bool ledSegSetFadeCompiled(uint8_t seg, const ledSegmentFadeSetting_t* fs, const ledSegmentFadeRates_t* rates);
 void ledSegRunIteration();
+void ledSegRunIterationCustom(ledSegCalcFunc_t calcSeg);
+bool ledSegStepPeriod();
+void ledSegSetClock(ledSegClockFunc_t clock);
+uint32_t ledSegGetTime();
+bool ledSegRenderNow(uint8_t seg);
+void ledSegCalcFade(uint8_t seg);
+void ledSegCalcPulse(uint8_t seg, const ledSegmentEffect_t* fx);
+#if LEDSEG_EFFECT_PULSE_ENABLED
+void ledSegCalcPulseLoop(uint8_t seg);
+void ledSegCalcPulseLoopEnd(uint8_t seg);
+void ledSegCalcPulseBounce(uint8_t seg);
+#endif
+#if LEDSEG_EFFECT_GLITTER_ENABLED
+void ledSegCalcGlitter(uint8_t seg);
+#endif
+bool ledSegAttachSegments(ledSegment_t* table, uint8_t nofSegments);
 bool ledSegSetFadeMode(uint8_t seg, ledSegmentMode_t mode);
 bool ledSegSetPulseMode(uint8_t seg, ledSegmentMode_t mode);
 bool ledSegSetLed(uint8_t seg, uint16_t led, uint8_t r, uint8_t g, uint8_t b);
@@ -196,5 +399,42 @@ void ledSegSetModeChange(ledSegmentFadeSetting_t* fs, uint8_t segment, bool swit
 bool ledSegisGlitterMode(ledSegmentMode_t mode);
 bool ledSegRestart(uint8_t seg, bool restartFade, bool restartPulse);
 
+bool ledSegSetRandSeed(uint8_t seg, uint32_t seed);
+uint32_t ledSegRandNext(uint32_t* state);
+uint16_t ledSegRandRange(uint32_t* state, uint16_t range);
+void ledSegRandFill(uint32_t* state, uint16_t* out, uint16_t n, uint16_t range, uint16_t offset);
+
+bool ledSegStartTransition(uint8_t seg, ledSegmentFadeSetting_t* fs, ledSegmentPulseSetting_t* ps, uint32_t time, ledSegmentEase_t ease);
+bool ledSegStartTransitionWithType(uint8_t seg, ledSegmentFadeSetting_t* fs, ledSegmentPulseSetting_t* ps, ledSegmentTransition_t type, uint32_t time, ledSegmentEase_t ease);
+bool ledSegGetTransitionActive(uint8_t seg);
+
+bool ledSegEvalFade(uint8_t seg, uint32_t time, RGB_t* col);
+bool ledSegEvalPulse(uint8_t seg, uint32_t time, ledSegmentPulsePos_t* pos);
+bool ledSegEvalLed(uint8_t seg, uint16_t led, uint32_t time, RGB_t* col);
+
+uint32_t ledSegSnapshotSize();
+uint32_t ledSegSnapshot(uint8_t* buf, uint32_t size);
+bool ledSegRestore(const uint8_t* buf, uint32_t size);
+
+bool ledSegAddEventCallback(ledSegEventCallback_t cb);
+bool ledSegRemoveEventCallback(ledSegEventCallback_t cb);
+
+uint8_t ledSegModInit(ledSegmentModSetting_t* ms);
+bool ledSegModSet(uint8_t mod, ledSegmentModSetting_t* ms);
+bool ledSegModFree(uint8_t mod);
+bool ledSegModSetInput(uint8_t mod, uint16_t value);
+bool ledSegModTrigger(uint8_t mod);
+bool ledSegModRelease(uint8_t mod);
+uint16_t ledSegModGetValue(uint8_t mod);
+uint8_t ledSegModBind(uint8_t mod, uint8_t seg, ledSegmentModTarget_t target, uint16_t min, uint16_t max);
+bool ledSegModUnbind(uint8_t binding);
+
+bool ledSegRegisterEffect(ledSegmentMode_t mode, const ledSegmentEffect_t* fx);
+const ledSegmentEffect_t* ledSegGetEffect(ledSegmentMode_t mode);
+
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif /* LEDSEGMENT_H_ */
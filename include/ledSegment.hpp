@@ -0,0 +1,449 @@
+/*
+ *	ledSegment.hpp
+ *
+ *	Optional compile-time front end (C++17, header only) for ledSegment.
+ *	For installations where all strips, segments and modes are known when building, the segments are declared as a constexpr table:
+ *
+ *		constexpr ledSeg::SegmentDef installation[]=
+ *		{
+ *			{1,1,50,false,false,true,true,pulseSetting,fadeSetting},
+ *			{1,51,120,true,false,false,true,{},fadeSetting2},
+ *		};
+ *		using Leds=ledSeg::Installation<installation>;
+ *		...
+ *		Leds::attach();			//At boot. Hands the segments to ledSegment
+ *		Leds::runIteration();	//Instead of ledSegRunIteration()
+ *
+ *	The table is validated with static_assert, so the settings can't fail. The segments and the glitter buffers are statically
+ *	allocated (no heap is used), and the complete segment state (including the fade rates) is calculated by the compiler, the same
+ *	way as ledSegSetFade/ledSegSetPulse would do it. Attaching only hands the table to ledSegment, so no setup is done at boot.
+ *	The segments are calculated by one function per segment, which calls the effect for the configured pulse mode directly
+ *	(no registry lookup and no function pointer).
+ *	All the regular ledSeg-functions can be used on the segments as usual (changing the pulse mode at runtime falls back to the registry).
+ */
+
+#ifndef LEDSEGMENT_HPP_
+#define LEDSEGMENT_HPP_
+
+#include "ledSegment.h"
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <utility>
+
+namespace ledSeg
+{
+
+/*
+ * Describes a single segment in a static installation
+ * The settings are the same as for ledSegInitSegment
+ */
+struct SegmentDef
+{
+	uint8_t strip;
+	uint16_t start;
+	uint16_t stop;
+	bool invertPulse;
+	bool excludeFromAll;
+	bool usePulse;					//If false, the segment starts without a pulse (same as giving NULL to ledSegInitSegment)
+	bool useFade;					//If false, the segment starts without a fade
+	ledSegmentPulseSetting_t pulse;
+	ledSegmentFadeSetting_t fade;
+};
+
+/*
+ * Returns the built-in effect used by a pulse mode (nullptr if there is none)
+ */
+constexpr const ledSegmentEffect_t* effectFor(ledSegmentMode_t mode)
+{
+	switch(mode)
+	{
+#if LEDSEG_EFFECT_PULSE_ENABLED
+		case LEDSEG_MODE_LOOP:
+			return &ledSegEffectPulseLoop;
+		case LEDSEG_MODE_LOOP_END:
+			return &ledSegEffectPulseLoopEnd;
+		case LEDSEG_MODE_BOUNCE:
+			return &ledSegEffectPulseBounce;
+#endif
+#if LEDSEG_EFFECT_GLITTER_ENABLED
+		case LEDSEG_MODE_GLITTER_LOOP:
+		case LEDSEG_MODE_GLITTER_LOOP_END:
+		case LEDSEG_MODE_GLITTER_LOOP_PERSIST:
+		case LEDSEG_MODE_GLITTER_BOUNCE:
+			return &ledSegEffectGlitter;
+#endif
+		default:
+			return nullptr;
+	}
+}
+
+/*
+ * Returns true if a mode is a glitter mode (same as ledSegisGlitterMode)
+ */
+constexpr bool isGlitterMode(ledSegmentMode_t mode)
+{
+	return (mode>=LEDSEG_MODE_GLITTER_LOOP && mode<=LEDSEG_MODE_GLITTER_BOUNCE);
+}
+
+/*
+ * Returns the number of words in the glitter ring buffer for a segment (at least 1, so it can be used as an array size)
+ */
+constexpr std::size_t glitterWords(const SegmentDef& d)
+{
+	if(d.usePulse && isGlitterMode(d.pulse.mode))
+	{
+		return d.pulse.ledsMaxPower+d.pulse.pixelsPerIteration;
+	}
+	return 1;
+}
+
+/*
+ * Checks that a segment can be set up (the same checks as ledSegInitSegment, plus checks for settings that would fail at runtime)
+ */
+constexpr bool isValid(const SegmentDef& d)
+{
+	if(d.strip==0 || d.strip>APA_NOF_STRIPS || d.start==0 || d.start>d.stop || d.stop>APA_MAX_NOF_LEDS)
+	{
+		return false;
+	}
+	if(d.useFade && d.fade.fadeTime<LEDSEG_UPDATE_PERIOD_TIME &&
+			(d.fade.r_min!=d.fade.r_max || d.fade.g_min!=d.fade.g_max || d.fade.b_min!=d.fade.b_max))
+	{
+		return false;	//The fade rate can't be calculated
+	}
+	if(d.useFade && d.fade.keyframeNum)
+	{
+		return false;	//Keyframe fades are set up at runtime (use ledSegSetFade)
+	}
+	if(d.usePulse)
+	{
+		if(effectFor(d.pulse.mode)==nullptr)
+		{
+			return false;	//Unknown or excluded mode
+		}
+		if(isGlitterMode(d.pulse.mode) && d.pulse.ledsMaxPower==0)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Checks all segments in a table
+ */
+template<std::size_t N>
+constexpr bool allValid(const SegmentDef (&table)[N])
+{
+	for(std::size_t i=0;i<N;i++)
+	{
+		if(!isValid(table[i]))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Same as ledSegCompileFade, evaluated by the compiler
+ */
+constexpr ledSegmentFadeRates_t compileFade(const ledSegmentFadeSetting_t& fs)
+{
+	ledSegmentFadeRates_t rates{};
+	uint16_t periodMultiplier=1;
+	uint32_t masterSteps=0;
+	const uint8_t largestError=50;
+	const uint8_t diff[3]=
+	{
+		(uint8_t)(fs.r_max>fs.r_min ? fs.r_max-fs.r_min : fs.r_min-fs.r_max),
+		(uint8_t)(fs.g_max>fs.g_min ? fs.g_max-fs.g_min : fs.g_min-fs.g_max),
+		(uint8_t)(fs.b_max>fs.b_min ? fs.b_max-fs.b_min : fs.b_min-fs.b_max),
+	};
+	uint8_t rate[3]={0,0,0};
+	while(true)
+	{
+		bool makeItSlower=false;
+		masterSteps=fs.fadeTime/(LEDSEG_UPDATE_PERIOD_TIME*periodMultiplier);
+		for(int i=0;i<3;i++)
+		{
+			//isValid only lets through a fade shorter than the update period if there is nothing to fade
+			rate[i]=(masterSteps ? (uint8_t)(diff[i]/masterSteps) : 0);
+			if(diff[i]!=0 && (rate[i]<1 || (diff[i]%masterSteps)>largestError))
+			{
+				makeItSlower=true;
+			}
+		}
+		if(!makeItSlower)
+		{
+			break;
+		}
+		periodMultiplier++;
+	}
+	rates.r_rate=rate[0];
+	rates.g_rate=rate[1];
+	rates.b_rate=rate[2];
+	rates.periodMultiplier=periodMultiplier;
+	if(fs.cycles==0 || (UINT32_MAX/fs.cycles)<masterSteps)
+	{
+		rates.cycles=0;
+	}
+	else
+	{
+		rates.cycles=fs.cycles;
+	}
+	return rates;
+}
+
+/*
+ * Sets up the fade state of a segment, the same way as ledSegSetFade (keyframe fades are not allowed in a table)
+ */
+constexpr void loadFade(ledSegment_t& sg, const ledSegmentFadeSetting_t& fs)
+{
+	ledSegmentState_t& st=sg.state;
+	const ledSegmentFadeRates_t rates=compileFade(fs);
+	st.confFade=fs;
+	st.r_rate=rates.r_rate;
+	st.g_rate=rates.g_rate;
+	st.b_rate=rates.b_rate;
+	st.confFade.fadePeriodMultiplier=rates.periodMultiplier;
+	st.cyclesToFadeChange=rates.periodMultiplier;
+	if(fs.startDir==-1)
+	{
+		st.r=fs.r_max;
+		st.g=fs.g_max;
+		st.b=fs.b_max;
+	}
+	else
+	{
+		st.r=fs.r_min;
+		st.g=fs.g_min;
+		st.b=fs.b_min;
+	}
+	st.fadeDir=fs.startDir;
+	st.confFade.cycles=rates.cycles;
+	st.fadeCycle=rates.cycles;
+	st.fadeActive=true;
+	st.fadeState=LEDSEG_FADE_NOT_DONE;
+	st.keyframeHold=0;
+}
+
+/*
+ * Sets up the pulse state of a segment, the same way as ledSegSetPulse and the init of the built-in effects
+ * The glitter buffer (effectMem) must already be set, and is all zeros as a new buffer would be
+ */
+constexpr void loadPulse(ledSegment_t& sg, const ledSegmentPulseSetting_t& ps)
+{
+	ledSegmentState_t& st=sg.state;
+	ledSegmentPulseSetting_t& pu=st.confPulse;
+	pu=ps;
+	st.pulseCycle=ps.cycles;
+	if(isGlitterMode(ps.mode))
+	{
+		//Same as glitterInit
+		st.currentLed=0;
+		uint32_t pixelTime=pu.pixelTime/LEDSEG_UPDATE_PERIOD_TIME;
+		pixelTime=pixelTime*pu.pixelsPerIteration/pu.ledsMaxPower;
+		if(pixelTime==0)
+		{
+			pixelTime=1;
+		}
+		pu.pixelTime=(uint16_t)pixelTime;
+		st.cyclesToPulseMove=1;
+	}
+	else
+	{
+		//Same as pulseInit
+		while(pu.startLed<0)
+		{
+			pu.startLed=(int16_t)(pu.startLed+sg.stop-sg.start+2);
+		}
+		if(sg.invertPulse)
+		{
+			pu.startLed=(int16_t)(sg.stop-pu.startLed+1);
+			pu.startDir*=-1;
+		}
+		else
+		{
+			pu.startLed=(int16_t)(sg.start+pu.startLed-1);
+		}
+		if(pu.startLed>sg.stop)
+		{
+			pu.startLed=(int16_t)sg.stop;
+		}
+		else if(pu.startLed<sg.start)
+		{
+			pu.startLed=(int16_t)sg.start;
+		}
+		st.currentLed=pu.startLed;
+		st.cyclesToPulseMove=pu.pixelTime;
+	}
+	st.pulseDir=pu.startDir;
+	st.pulseDone=false;
+	st.pulseActive=true;
+}
+
+/*
+ * Calculates the pulse of a segment with the built-in effect for Mode, called directly
+ */
+template<ledSegmentMode_t Mode>
+inline void calcPulse(uint8_t seg)
+{
+#if LEDSEG_EFFECT_PULSE_ENABLED
+	if constexpr(Mode==LEDSEG_MODE_LOOP)
+	{
+		ledSegCalcPulseLoop(seg);
+		return;
+	}
+	else if constexpr(Mode==LEDSEG_MODE_LOOP_END)
+	{
+		ledSegCalcPulseLoopEnd(seg);
+		return;
+	}
+	else if constexpr(Mode==LEDSEG_MODE_BOUNCE)
+	{
+		ledSegCalcPulseBounce(seg);
+		return;
+	}
+#endif
+#if LEDSEG_EFFECT_GLITTER_ENABLED
+	if constexpr(isGlitterMode(Mode))
+	{
+		ledSegCalcGlitter(seg);
+		return;
+	}
+#endif
+	ledSegCalcPulse(seg,nullptr);
+}
+
+/*
+ * A complete installation, built from a constexpr table of SegmentDef
+ * Table must be a constexpr array with static storage
+ */
+template<const auto& Table>
+class Installation
+{
+public:
+	static constexpr std::size_t nofSegments=std::size(Table);
+	static_assert(nofSegments>0 && nofSegments<=LEDSEG_MAX_SEGMENTS, "Too many (or no) segments in the installation");
+	static_assert(allValid(Table), "Invalid segment in installation (check strip, range, fade time and pulse mode)");
+
+	/*
+	 * Hands the segments to ledSegment
+	 * The segments are fully set up by the compiler, so they start with the settings from the table. Only attach once (the state is not reset)
+	 */
+	static bool attach()
+	{
+		return ledSegAttachSegments(segments,(uint8_t)nofSegments);
+	}
+
+	/*
+	 * Runs the update loop (use instead of ledSegRunIteration)
+	 */
+	static void runIteration()
+	{
+		ledSegRunIterationCustom(calcSegment);
+	}
+
+	/*
+	 * Returns the segment number of a table entry (entries are numbered in table order)
+	 */
+	static constexpr uint8_t segNum(std::size_t index)
+	{
+		return (uint8_t)index;
+	}
+
+private:
+	//Glitter ring buffer for each segment (only used by glitter segments)
+	template<std::size_t I>
+	static inline uint16_t glitterMem[glitterWords(Table[I])]={};
+
+	template<std::size_t I>
+	static constexpr ledSegment_t makeSegment()
+	{
+		const SegmentDef& d=Table[I];
+		ledSegment_t sg{};
+		sg.strip=d.strip;
+		sg.start=d.start;
+		sg.stop=d.stop;
+		sg.invertPulse=d.invertPulse;
+		sg.excludeFromAll=d.excludeFromAll;
+		sg.state.randState=LEDSEG_RAND_SEED_FROM_ID(LEDSEG_RAND_DEFAULT_SEED,I);
+		if(d.usePulse && isGlitterMode(d.pulse.mode))
+		{
+			//ledSegSetPulse uses it instead of allocating if the pulse is changed at runtime
+			sg.state.effectMem=glitterMem<I>;
+			sg.state.effectMemSize=(uint16_t)sizeof(glitterMem<I>);
+			sg.state.effectMemExternal=true;
+		}
+		if(d.useFade)
+		{
+			loadFade(sg,d.fade);
+		}
+		if(d.usePulse)
+		{
+			loadPulse(sg,d.pulse);
+		}
+		return sg;
+	}
+
+	/*
+	 * Calculates segment I with the effect for its configured pulse mode
+	 * If the pulse mode has been changed at runtime, the registry is used instead
+	 */
+	template<std::size_t I>
+	static void calcSegmentI(uint8_t seg)
+	{
+		constexpr const SegmentDef& d=Table[I];
+		ledSegCalcFade(seg);
+		if constexpr(d.usePulse)
+		{
+			if(segments[I].state.confPulse.mode==d.pulse.mode)
+			{
+				calcPulse<d.pulse.mode>(seg);
+				return;
+			}
+		}
+		ledSegCalcPulse(seg,nullptr);
+	}
+
+	template<std::size_t... I>
+	static constexpr auto makeCalcTable(std::index_sequence<I...>)
+	{
+		struct CalcTable
+		{
+			ledSegCalcFunc_t f[sizeof...(I)];
+		};
+		return CalcTable{{&calcSegmentI<I>...}};
+	}
+
+	static void calcSegment(uint8_t seg)
+	{
+		static constexpr auto calcTable=makeCalcTable(std::make_index_sequence<nofSegments>{});
+		if(seg<nofSegments)
+		{
+			calcTable.f[seg](seg);
+		}
+	}
+
+	template<std::size_t... I>
+	struct Builder
+	{
+		ledSegment_t s[sizeof...(I)];
+	};
+
+	template<std::size_t... I>
+	static constexpr Builder<I...> build(std::index_sequence<I...>)
+	{
+		return Builder<I...>{{makeSegment<I>()...}};
+	}
+
+	//The segments (constant initialized with the complete state)
+	static inline auto storage=build(std::make_index_sequence<nofSegments>{});
+	static inline ledSegment_t* const segments=storage.s;
+};
+
+}	//namespace ledSeg
+
+#endif /* LEDSEGMENT_HPP_ */
@@ -0,0 +1,198 @@
+/*
+ *	ledSegmentPacked.h
+ *
+ *	Packed colour kernels, used by ledSegment.c. All colours of a segment are packed in a single word, so that they can be calculated at once.
+ *	The kernels work on all four bytes of a word, with the colours in the three low bytes (see PACK_RGB).
+ *
+ *	The add, subtract and less-than kernels have one version for each kind of core:
+ *	- Cores with the DSP extension (such as Cortex-M4) use the SIMD instructions (UQADD8, UQSUB8, USUB8/SEL)
+ *	- Hosts with SSE2 or NEON use the matching vector instructions on the low word of a register
+ *	- All other cores (such as Cortex-M3) use a portable SWAR version
+ *	Define LEDSEG_PACKED_PORTABLE to always use the portable version.
+ *	On a DSP core, the CMSIS core header must be included first (the target gets it through ledSegment.h).
+ *
+ *	This is in a header (and not in ledSegment.c) so that host/packedTest.c can check and benchmark the kernels.
+ */
+
+#ifndef LEDSEGMENTPACKED_H_
+#define LEDSEGMENTPACKED_H_
+
+#include <stdint.h>
+
+//Packed colour: all colours in a single word, so that they can be calculated at once (SWAR). r is bits 0-7, g 8-15 and b 16-23
+#define PACK_RGB(r,g,b) ((uint32_t)(r) | ((uint32_t)(g)<<8) | ((uint32_t)(b)<<16))
+#define UNPACK_R(x) ((uint8_t)(x))
+#define UNPACK_G(x) ((uint8_t)((x)>>8))
+#define UNPACK_B(x) ((uint8_t)((x)>>16))
+#define PACK_RGB_MASK 0x00FFFFFF
+#define PACK_HIGH_BITS 0x80808080
+
+#if !defined(LEDSEG_PACKED_PORTABLE) && defined(__ARM_FEATURE_DSP) && (__ARM_FEATURE_DSP==1)
+#define LEDSEG_PACKED_IMPL "dsp"
+
+/*
+ * Saturating add of each byte
+ */
+static inline uint32_t packedAddSat(uint32_t a, uint32_t b)
+{
+	return __UQADD8(a,b);
+}
+
+/*
+ * Saturating subtraction of each byte (a-b, stops at 0)
+ */
+static inline uint32_t packedSubSat(uint32_t a, uint32_t b)
+{
+	return __UQSUB8(a,b);
+}
+
+/*
+ * Returns 0xFF for each byte where a<b, otherwise 0
+ */
+static inline uint32_t packedLessThan(uint32_t a, uint32_t b)
+{
+	uint32_t res;
+	//USUB8 sets the GE-flags for each byte where a>=b, which SEL then picks from
+	//They are in the same asm block, so that the compiler can't put anything that changes the flags between them
+	__asm__("usub8 %0, %1, %2\n\t"
+			"sel %0, %3, %4"
+			: "=&r"(res)
+			: "r"(a), "r"(b), "r"(0), "r"(0xFFFFFFFF)
+			: "cc");
+	return res;
+}
+#elif !defined(LEDSEG_PACKED_PORTABLE) && defined(__SSE2__)
+#define LEDSEG_PACKED_IMPL "sse2"
+#include <emmintrin.h>
+
+/*
+ * Saturating add of each byte
+ */
+static inline uint32_t packedAddSat(uint32_t a, uint32_t b)
+{
+	return (uint32_t)_mm_cvtsi128_si32(_mm_adds_epu8(_mm_cvtsi32_si128((int32_t)a),_mm_cvtsi32_si128((int32_t)b)));
+}
+
+/*
+ * Saturating subtraction of each byte (a-b, stops at 0)
+ */
+static inline uint32_t packedSubSat(uint32_t a, uint32_t b)
+{
+	return (uint32_t)_mm_cvtsi128_si32(_mm_subs_epu8(_mm_cvtsi32_si128((int32_t)a),_mm_cvtsi32_si128((int32_t)b)));
+}
+
+/*
+ * Returns 0xFF for each byte where a<b, otherwise 0
+ * SSE2 has no unsigned compare, but a<b if b-a (saturated) is not 0
+ */
+static inline uint32_t packedLessThan(uint32_t a, uint32_t b)
+{
+	__m128i diff=_mm_subs_epu8(_mm_cvtsi32_si128((int32_t)b),_mm_cvtsi32_si128((int32_t)a));
+	return ~(uint32_t)_mm_cvtsi128_si32(_mm_cmpeq_epi8(diff,_mm_setzero_si128()));
+}
+#elif !defined(LEDSEG_PACKED_PORTABLE) && defined(__ARM_NEON)
+#define LEDSEG_PACKED_IMPL "neon"
+#include <arm_neon.h>
+
+/*
+ * Saturating add of each byte
+ */
+static inline uint32_t packedAddSat(uint32_t a, uint32_t b)
+{
+	return vget_lane_u32(vreinterpret_u32_u8(vqadd_u8(vreinterpret_u8_u32(vdup_n_u32(a)),vreinterpret_u8_u32(vdup_n_u32(b)))),0);
+}
+
+/*
+ * Saturating subtraction of each byte (a-b, stops at 0)
+ */
+static inline uint32_t packedSubSat(uint32_t a, uint32_t b)
+{
+	return vget_lane_u32(vreinterpret_u32_u8(vqsub_u8(vreinterpret_u8_u32(vdup_n_u32(a)),vreinterpret_u8_u32(vdup_n_u32(b)))),0);
+}
+
+/*
+ * Returns 0xFF for each byte where a<b, otherwise 0
+ */
+static inline uint32_t packedLessThan(uint32_t a, uint32_t b)
+{
+	return vget_lane_u32(vreinterpret_u32_u8(vclt_u8(vreinterpret_u8_u32(vdup_n_u32(a)),vreinterpret_u8_u32(vdup_n_u32(b)))),0);
+}
+#else
+#define LEDSEG_PACKED_IMPL "portable"
+
+/*
+ * Saturating add of each byte
+ * The low 7 bits are added without carries between bytes. The top bit and the carry out of each byte is then calculated separately
+ */
+static inline uint32_t packedAddSat(uint32_t a, uint32_t b)
+{
+	uint32_t sum=(a&~PACK_HIGH_BITS)+(b&~PACK_HIGH_BITS);
+	uint32_t carry=((a&b)|((a|b)&sum))&PACK_HIGH_BITS;
+	sum^=(a^b)&PACK_HIGH_BITS;
+	return sum|((carry>>7)*0xFF);
+}
+
+/*
+ * Saturating subtraction of each byte (a-b, stops at 0)
+ * The top bit of each byte in a is set before subtracting, so that no byte borrows from the next one
+ */
+static inline uint32_t packedSubSat(uint32_t a, uint32_t b)
+{
+	uint32_t diff=((a|PACK_HIGH_BITS)-(b&~PACK_HIGH_BITS))^((a^~b)&PACK_HIGH_BITS);
+	uint32_t borrow=(((~a&b)|(~(a^b)&diff))&PACK_HIGH_BITS)>>7;
+	return diff&~(borrow*0xFF);
+}
+
+/*
+ * Returns 0xFF for each byte where a<b, otherwise 0 (a byte is less if the subtraction borrows)
+ */
+static inline uint32_t packedLessThan(uint32_t a, uint32_t b)
+{
+	uint32_t diff=((a|PACK_HIGH_BITS)-(b&~PACK_HIGH_BITS))^((a^~b)&PACK_HIGH_BITS);
+	uint32_t borrow=(((~a&b)|(~(a^b)&diff))&PACK_HIGH_BITS)>>7;
+	return borrow*0xFF;
+}
+#endif
+
+/*
+ * Returns 0xFF for each byte where a==b, otherwise 0
+ */
+static inline uint32_t packedEqual(uint32_t a, uint32_t b)
+{
+	uint32_t x=a^b;
+	//The top bit of each byte is set if any bit in the byte is set
+	uint32_t nonZero=((x&~PACK_HIGH_BITS)+~PACK_HIGH_BITS)|x;
+	return ((~nonZero&PACK_HIGH_BITS)>>7)*0xFF;
+}
+
+/*
+ * The smallest value for each byte
+ */
+static inline uint32_t packedMin(uint32_t a, uint32_t b)
+{
+	uint32_t lt=packedLessThan(a,b);
+	return (a&lt)|(b&~lt);
+}
+
+/*
+ * The largest value for each byte
+ */
+static inline uint32_t packedMax(uint32_t a, uint32_t b)
+{
+	uint32_t lt=packedLessThan(a,b);
+	return (b&lt)|(a&~lt);
+}
+
+/*
+ * Blends all four bytes of two packed words. w is the weight of b (0-256), so w=0 gives a and w=256 gives b
+ * Two bytes are calculated at once with 16 bits for each
+ */
+static inline uint32_t packedBlend(uint32_t a, uint32_t b, uint16_t w)
+{
+	const uint32_t wa=256-w;
+	uint32_t even=((a&0x00FF00FF)*wa+(b&0x00FF00FF)*w)>>8;
+	uint32_t odd=((a>>8)&0x00FF00FF)*wa+((b>>8)&0x00FF00FF)*w;
+	return (even&0x00FF00FF)|(odd&0xFF00FF00);
+}
+
+#endif /* LEDSEGMENTPACKED_H_ */
@@ -0,0 +1,68 @@
+/*
+ * midiInput.h
+ */
+
+#ifndef INCLUDE_MIDIINPUT_H_
+#define INCLUDE_MIDIINPUT_H_
+
+#include "ledSegment.h"
+#include "advancedAnimations.h"
+#include "utils.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//The number of mappings from MIDI messages to actions (see midiMap)
+#define MIDI_MAX_MAPPINGS	32
+//The number of scenes that can be selected from MIDI (see midiSetScene)
+#define MIDI_MAX_SCENES	8
+//Used as channel in midiMap to match messages on any channel
+#define MIDI_CHANNEL_ALL	0xFF
+//The lowest value of a controller seen as "on" (for triggers mapped to a CC)
+#define MIDI_CC_ON_THRESHOLD	64
+//The number of received bytes that can wait for midiTask (at most 256). At 31250 baud, 64 bytes is about 20 ms of MIDI
+#define MIDI_RX_BUFFER_SIZE	64
+
+/*
+ * The messages that can be mapped
+ */
+typedef enum
+{
+	MIDI_MSG_NOTE=0,		//Note on (a note on with velocity 0 or a note off is a release). The value is the velocity
+	MIDI_MSG_CC,			//Control change. The value is the controller value
+	MIDI_MSG_PROGRAM,		//Program change (the number is the program). Always a press
+	MIDI_MSG_NOF_TYPES
+}midiMsgType_t;
+
+/*
+ * What a mapped message does. The target depends on the action
+ */
+typedef enum
+{
+	MIDI_ACTION_TRIG_SEQ=0,	//Triggers the transition of an animation sequence on a press (target: animSeqHandle_t)
+	MIDI_ACTION_DIMMER,		//Sets the global setting of a segment from the value (target: segment). The next fade/pulse setting of the segment overrides it
+	MIDI_ACTION_PULSE,		//Restarts the pulse of a segment on a press (target: segment)
+	MIDI_ACTION_SCENE,		//Loads a scene on a press (target: scene, see midiSetScene)
+	MIDI_ACTION_MOD,		//Gives the value to an external modulator, or triggers/releases an envelope modulator (target: modulator)
+	MIDI_ACTION_NOF_ACTIONS
+}midiAction_t;
+
+//Called for each complete channel message (after the mapped actions). data2 is 0 for messages with one data byte
+typedef void (*midiCallback_t)(uint8_t status, uint8_t data1, uint8_t data2);
+
+void midiReset();
+bool midiReceiveByte(uint8_t byte);
+uint16_t midiTask();
+bool midiParseByte(uint8_t byte);
+uint16_t midiParse(const uint8_t* data, uint16_t len);
+uint8_t midiMap(midiMsgType_t type, uint8_t channel, uint8_t number, midiAction_t action, uint32_t target);
+bool midiUnmap(uint8_t mapping);
+bool midiSetScene(uint8_t scene, const uint8_t* snapshot, uint32_t size);
+void midiSetCallback(midiCallback_t cb);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* INCLUDE_MIDIINPUT_H_ */
@@ -0,0 +1,55 @@
+/*
+ * timecode.h
+ */
+
+#ifndef INCLUDE_TIMECODE_H_
+#define INCLUDE_TIMECODE_H_
+
+#include "ledSegment.h"
+#include "advancedAnimations.h"
+#include "utils.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//The number of cues (see tcAddCue)
+#define TC_MAX_CUES	16
+//A difference between the timecode and the show time larger than this (in ms) is a jump, and the show time is moved right away. Smaller differences are drift, which is corrected smoothly
+#define TC_JUMP_THRESHOLD	100
+//The time a drift is corrected over (in ms)
+#define TC_SLEW_TIME	500
+//How much of each drift correction is kept as a change of the speed (in shifts)
+#define TC_SPEED_SHIFT	4
+//The show time stops if no timecode has come for this long (in ms). An external clock must be given more often than this
+#define TC_TIMEOUT	50
+//The longest time the engine is fast-forwarded from a cue after a jump (in ms)
+#define TC_MAX_CATCH_UP	5000
+
+/*
+ * The frame rates of MIDI timecode (in the order used by MTC)
+ */
+typedef enum
+{
+	TC_FPS_24=0,
+	TC_FPS_25,
+	TC_FPS_30_DROP,		//29.97 fps drop frame
+	TC_FPS_30,
+}tcFrameRate_t;
+
+void tcEnable(bool enable);
+void tcReset();
+void tcTask();
+void tcMtcQuarterFrame(uint8_t data);
+void tcMtcFullFrame(uint8_t hours, uint8_t minutes, uint8_t seconds, uint8_t frames);
+void tcSetExternalTime(uint32_t time);
+uint32_t tcGetShowTime();
+bool tcIsRunning();
+uint8_t tcAddCue(uint32_t time, const uint8_t* snapshot, uint32_t size);
+bool tcRemoveCue(uint8_t cue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* INCLUDE_TIMECODE_H_ */
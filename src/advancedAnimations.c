@@ -24,10 +24,18 @@
  * The program will run a the sequence and load a new point (new settings) whenever each point is done (when both fade and pulse are done).
  * The sequence has a cycle counter itself, and can be set to run for any number of cycles. As usual, if 0 is set, it will run forever.
  * Animation sequence supports running using LEDSEG_ALL.
+ * - Sequences are created (animSeqInit etc) and destroyed (animSeqDestroy) in a pool, and referred to by handles. The points in RAM share one arena (ANIM_SEQ_ARENA_POINTS).
+ * - A sequence can also run on other segments (members), each loading the points a fixed time after the segment of the sequence (animSeqAddMember). This makes a chase from one sequence.
+ * - The beat tracker (animBeatAdd) follows the tempo and phase of tapped or detected beats. Sequences can release their points on the predicted beats (animSeqSetOnBeat).
+ *
+ * Animation scripts (animScriptLoad) are small bytecode programs for shows that need more than a list of points (loops, branches, random choices).
+ * They are run by animTask with a bounded number of instructions per call, and can be kept in flash or loaded over a serial link. See animScriptAssemble for the text form (only built for the host, see ANIM_SCRIPT_ASSEMBLER_ENABLED).
  *
  */
 
 #include "advancedAnimations.h"
+#include "stddef.h"
+#include "stdlib.h"
 
 typedef enum
 {
@@ -41,9 +49,10 @@ typedef enum
  */
 typedef struct
 {
-	animSeqPoint_t points[ANIM_SEQ_MAX_POINTS];	//A list of the animation points used for this animation sequence
-	uint8_t currentPoint;		//The current point of animation we're one
-	uint8_t nofPoints;
+	uint16_t currentPoint;		//The current point of animation we're one
+	uint16_t nofPoints;
+	bool used;					//Indicates if this slot of the pool holds a sequence
+	uint8_t generation;			//Increased each time the slot is freed, so that old handles are not valid (never 0)
 	uint32_t cyclesSetting;		//The number of cycles the animation shall run for. If cycles = 0 from the start, it will loop indefinitely
 	uint32_t cyclesLeft;		//The number of cycles the animation has left
 	uint8_t seg;				//Segment to run this animation sequence on. If isSyncGroup is true, this is instead the sync group
@@ -52,13 +61,259 @@ typedef struct
 	uint32_t waitReleaseTime;	//The time at which the next point shall be loaded (set internally)
 	animTriggerState_t waitReleaseTrigger;	//Is true if we're waiting for a manual trigger (set internally)
 	bool isFadingToNextPoint;	//Indicates if we're currently fading to the next point (set internally)
+	uint32_t transitionTime;	//If not 0, each new point is transitioned in over this time (in ms), instead of the fade to next point
+	ledSegmentTransition_t transitionType;	//The type of transition (cross-fade, wipe etc)
+	ledSegmentEase_t transitionEase;	//The easing curve used for the transition
+	bool stepPending;			//Indicates that the state of the sequence shall be checked by the next animTask (set internally)
+	const animSeqPoint_t* points;	//The points of the sequence, read in place (in RAM or flash)
+	animSeqPoint_t* ramPoints;	//The block of the arena owned by the sequence (the points, or the decoded points of compact sequences). NULL for points that are not owned by the sequence (see animSeqInitConst)
+	uint16_t ramCapacity;		//The number of points in the block in the arena
+	const uint8_t* packed;		//The compact points of the sequence (see animSeqPack), or NULL if points is used. Not copied, so it must be kept by the caller (this also goes for snapshots)
+	uint32_t packedSize;
+	uint16_t packedPoint[2];	//The points decoded (or generated) into the two first points of the block in the arena (ANIM_PACK_NO_POINT if none)
+	uint32_t packedNext[2];		//The position in packed of the point after each decoded point
+	animSeqGenerator_t generator;	//Makes the points of a generated sequence (see animSeqInitGenerator), or NULL. Its state follows the decoded points in the block in the arena
+	bool onBeat;				//Indicates that the time each point is released at is moved to the closest predicted beat (see animSeqSetOnBeat)
 }animSequence_t;
 
+/*
+ * A segment that runs the points of a sequence a fixed time after the segment of the sequence (see animSeqAddMember)
+ * The points and the progression are those of the sequence. The member only keeps which point it shall load, and when
+ */
+typedef struct
+{
+	bool used;					//Indicates if the member is used
+	uint8_t seqSlot;			//The slot of the pool of the sequence the member follows
+	uint8_t seg;
+	bool pending;				//Indicates that point has not been loaded yet (set internally)
+	bool firstPoint;			//Indicates that point is loaded as the first point of the sequence (set internally)
+	bool isFadingToNextPoint;	//Same as for the sequence, but for the segment of the member (set internally)
+	uint16_t point;				//The point the member shall load at loadTime (set internally)
+	uint16_t loadedPoint;		//The point the member has loaded (set internally)
+	uint32_t offset;			//The time after the sequence each point is loaded (in ms)
+	uint32_t loadTime;			//The time at which point shall be loaded (set internally)
+}animSeqMember_t;
+
+/*
+ * A field of a point, as stored in the compact format (see animSeqPack)
+ */
+typedef struct
+{
+	uint8_t offset;		//The offset in animSeqPoint_t
+	uint8_t size;
+}animPackField_t;
+
+#define ANIM_PACK_FIELD(f) {offsetof(animSeqPoint_t,f),sizeof(((animSeqPoint_t*)0)->f)}
+#define ANIM_PACK_NO_POINT 0xFFFF
+//Each compact point starts with a mask of the fields that are stored (uint32_t) and the flags of the point (one byte)
+#define ANIM_PACK_POINT_HEADER_SIZE 5
+
+//A handle holds the slot of the pool in the low byte and the generation of the slot in the high byte
+#define ANIM_SEQ_HANDLE(slot,gen)	((animSeqHandle_t)(((gen)<<8)|(slot)))
+#define ANIM_SEQ_HANDLE_SLOT(h)		((h)&0xFF)
+#define ANIM_SEQ_HANDLE_GEN(h)		((h)>>8)
+
+/*
+ * The fields of a point that are stored in the compact format, in the order they are stored. The mask of a compact point has bit n set if field n is stored
+ * Fields that are not stored are the same as in the previous point (or 0 for the first point)
+ */
+static const animPackField_t animPackFields[]=
+{
+	ANIM_PACK_FIELD(fade.mode),
+	ANIM_PACK_FIELD(fade.r_min),
+	ANIM_PACK_FIELD(fade.g_min),
+	ANIM_PACK_FIELD(fade.b_min),
+	ANIM_PACK_FIELD(fade.r_max),
+	ANIM_PACK_FIELD(fade.g_max),
+	ANIM_PACK_FIELD(fade.b_max),
+	ANIM_PACK_FIELD(fade.fadeTime),
+	ANIM_PACK_FIELD(fade.startDir),
+	ANIM_PACK_FIELD(fade.cycles),
+	ANIM_PACK_FIELD(fade.globalSetting),
+	ANIM_PACK_FIELD(fade.syncGroup),
+	ANIM_PACK_FIELD(fade.keyframeNum),
+	ANIM_PACK_FIELD(fade.keyframePtr),
+	ANIM_PACK_FIELD(pulse.mode),
+	ANIM_PACK_FIELD(pulse.r_max),
+	ANIM_PACK_FIELD(pulse.g_max),
+	ANIM_PACK_FIELD(pulse.b_max),
+	ANIM_PACK_FIELD(pulse.ledsMaxPower),
+	ANIM_PACK_FIELD(pulse.ledsFadeBefore),
+	ANIM_PACK_FIELD(pulse.ledsFadeAfter),
+	ANIM_PACK_FIELD(pulse.startLed),
+	ANIM_PACK_FIELD(pulse.startDir),
+	ANIM_PACK_FIELD(pulse.pixelsPerIteration),
+	ANIM_PACK_FIELD(pulse.pixelTime),
+	ANIM_PACK_FIELD(pulse.cycles),
+	ANIM_PACK_FIELD(pulse.globalSetting),
+	ANIM_PACK_FIELD(pulse.colourSeqNum),
+	ANIM_PACK_FIELD(pulse.colourSeqLoops),
+	ANIM_PACK_FIELD(pulse.colourSeqPtr),
+	ANIM_PACK_FIELD(waitAfter),
+};
+#define ANIM_PACK_NOF_FIELDS (sizeof(animPackFields)/sizeof(animPackField_t))
+
+/*
+ * What an animation script is waiting for
+ */
+typedef enum
+{
+	ANIM_SCRIPT_WAIT_NONE=0,
+	ANIM_SCRIPT_WAIT_TIME,
+	ANIM_SCRIPT_WAIT_DONE,
+	ANIM_SCRIPT_WAIT_TRIG
+}animScriptWait_t;
+
+/*
+ * The state of an animation script (see animScriptLoad)
+ */
+typedef struct
+{
+	const uint8_t* code;		//The script, read in place. NULL if the slot is free
+	uint16_t size;
+	uint16_t pc;				//The position of the next instruction
+	uint8_t seg;				//The segment the script runs on (can be changed by the script)
+	bool isActive;
+	animScriptWait_t wait;		//What the script is waiting for
+	uint8_t waitMask;			//What shall be done (for ANIM_SCRIPT_WAIT_DONE)
+	bool triggered;				//Indicates that a trigger was received while waiting for it
+	uint32_t waitUntil;			//The time the wait ends (for ANIM_SCRIPT_WAIT_TIME)
+	uint32_t timeBase;			//The time waits are counted from. Waits in a row are counted from the end of the previous one, so they don't drift
+	uint16_t counters[ANIM_SCRIPT_NOF_COUNTERS];
+}animScript_t;
+
+//The size of the operands of each instruction (see animScriptOp_t)
+static const uint8_t animScriptOpSize[ANIM_OP_NOF_OPS]=
+{
+	0,		//ANIM_OP_END
+	18,		//ANIM_OP_FADE
+	22,		//ANIM_OP_PULSE
+	1,		//ANIM_OP_FADE_ACTIVE
+	1,		//ANIM_OP_PULSE_ACTIVE
+	1,		//ANIM_OP_SEG
+	4,		//ANIM_OP_WAIT
+	1,		//ANIM_OP_WAIT_DONE
+	0,		//ANIM_OP_WAIT_TRIG
+	2,		//ANIM_OP_JUMP
+	3,		//ANIM_OP_COUNT
+	3,		//ANIM_OP_LOOP
+	3,		//ANIM_OP_RAND
+};
+
 static void animSeqLoadCurrentPoint(animSequence_t* seq, bool firstPoint);
+static void animSeqLoadPoint(animSequence_t* seq, uint8_t seg, uint16_t n, bool firstPoint, bool* isFadingToNextPoint);
+static void animSeqLoadPulseAfterFade(animSequence_t* seq, uint8_t seg, uint16_t n, bool* isFadingToNextPoint);
+static void animSeqQueueMembers(animSequence_t* seq, bool firstPoint);
+static void animSeqLoadMember(animSequence_t* seq, animSeqMember_t* member);
+static void animSeqClampPoints(animSequence_t* seq);
+static bool animSeqMemberDue(const animSeqMember_t* m, uint32_t now, uint32_t* deadline);
+static void animSeqMemberStep(animSeqMember_t* m);
+static void animSeqStep(animSequence_t* seq);
+static void animSeqHandleEvent(uint8_t seg, ledSegmentEvent_t event);
+static const animSeqPoint_t* animSeqGetPoint(animSequence_t* seq, uint16_t n);
+static uint8_t animPackFlags(const animSeqPoint_t* point);
+static uint32_t animUnpackPoint(const uint8_t* buf, uint32_t size, animSeqPoint_t* point);
+static animSequence_t* animSeqGet(animSeqHandle_t seqNum);
+static animSeqHandle_t animSeqSetupGenerator(animSeqHandle_t existingSeq, uint8_t seg, bool isSyncGroup, uint32_t cycles, animSeqGenerator_t generator, uint32_t stateSize, uint16_t nofPoints);
+static void animGenFadePoint(void* state, uint16_t n, animSeqPoint_t* point);
+static void animGenBeatPoint(void* state, uint16_t n, animSeqPoint_t* point);
+static void animScriptRun();
+static uint16_t animBeatMedian();
+static void animBeatAdvance();
+static uint32_t animBeatQuantise(uint32_t time);
+static void animScriptStep(animScript_t* sc);
+static bool animScriptIsInstruction(const uint8_t* code, uint32_t size, uint32_t addr);
+static uint32_t animScriptRead(const uint8_t* p, uint8_t bytes);
+static bool animSeqSetup(animSequence_t* seq, uint8_t seg, bool isSyncGroup, uint32_t cycles, const animSeqPoint_t* points, uint16_t nofPoints);
+static bool animSeqIsEditable(const animSequence_t* seq);
+static bool animSeqHasFadeRates(const animSequence_t* seq);
+static uint16_t animSeqSnapshotPoints(const animSequence_t* seq, uint16_t* first);
+static bool animArenaResize(animSequence_t* seq, uint16_t nofPoints);
+static bool animArenaIsFree(const animSequence_t* seq, uint16_t start, uint16_t nofPoints);
+static uint16_t animArenaCompact(animSequence_t* seq, uint16_t nofPoints);
+static void animArenaSetBlock(animSequence_t* seq, animSeqPoint_t* block, uint16_t capacity);
+
+//The generated points and the state of a generator come first in the block of a generated sequence
+#define ANIM_SEQ_GEN_STATE(seq) ((void*)&(seq)->ramPoints[2])
 
+/*
+ * The state of the colour wheel made by animGenerateFadeSequence
+ */
+typedef struct
+{
+	uint32_t fadeTime;
+	uint32_t waitTime;
+	RGB_t* colours;				//The colours given by the user (read in place by the points and the pulse)
+	uint16_t segLen;
+	uint16_t nofColours;
+	uint8_t maxScaling;
+	uint8_t syncGroup;
+	bool addPulse;
+}animGenFadeState_t;
+
+/*
+ * The state of the beat program made by animGenerateBeatSequence
+ */
+typedef struct
+{
+	ledSegmentFadeSetting_t fade;
+	ledSegmentPulseSetting_t pulse;
+	eventTimeList* events;		//The beat times given by the user (read in place by the points)
+	uint16_t segLen;
+	uint8_t globalMax;
+	bool usePulse;
+	bool useAvgTime;
+}animGenBeatState_t;
+
+/*
+ * The state of the beat tracker (see animBeatAdd)
+ * The period and the phase are followed by a phase-locked loop. The median of the last intervals keeps the period from being pulled away by single bad beats
+ */
+typedef struct
+{
+	uint32_t lastBeat;			//The time of the last beat given (0 if none)
+	uint16_t intervals[ANIM_BEAT_NOF_INTERVALS];	//The last intervals between beats (in ms)
+	uint8_t nofIntervals;
+	uint8_t nextInterval;		//The place of the next interval in intervals
+	uint8_t misses;				//The number of beats in a row that were too far from the predicted beat
+	uint8_t nextBeatFrac;		//The part of nextBeat that is less than 1 ms (in 1/16 ms)
+	uint32_t period;			//The predicted time between beats, in 1/16 ms (0 if the tracker is not locked)
+	uint32_t nextBeat;			//The time of the next predicted beat (in ms)
+	uint32_t latency;			//The time it takes to detect a beat (in ms). It's subtracted from the time of each beat
+}animBeatTracker_t;
+
+//The part of the beat error (difference between a beat and the predicted beat) the phase and period are corrected with, in shifts
+#define ANIM_BEAT_PHASE_GAIN_SHIFT	1
+#define ANIM_BEAT_PERIOD_GAIN_SHIFT	3
+//The part of the difference to the median interval the period is pulled with for each beat, in shifts
+#define ANIM_BEAT_MEDIAN_GAIN_SHIFT	3
+
+//The size of the state of a sequence
+#define ANIM_SEQ_STATE_SIZE (sizeof(animSequence_t)-offsetof(animSequence_t,currentPoint))
 
+/*
+ * The header of the animation part of a snapshot. It's followed by the state and used points of each sequence, and then the used members.
+ */
+typedef struct
+{
+	uint8_t nofSeqs;
+	uint8_t nofMembers;		//The number of members (see animSeqAddMember). They're stored after the sequences
+	uint16_t pointSize;		//sizeof(animSeqPoint_t), to detect snapshots from a build with a different layout
+	uint16_t stateSize;		//ANIM_SEQ_STATE_SIZE
+	uint16_t usedSlots;		//Bit n is set if slot n of the pool is stored (the sequences are stored in the order of the slots)
+	uint32_t randState;		//The state of the random generator used for random colours
+}animSnapshotHeader_t;
+
+//The pool of sequences. A slot is free if used is false
 static animSequence_t animSeqs[ANIM_SEQ_MAX_SEQS];
-static uint8_t animSeqsNofSeqs=0;
+//The RAM storage of the points, shared by all sequences. Each sequence with points in RAM owns a block of it (see animArenaResize). Sequences with points in flash don't use it (except compact sequences, which decode into it)
+static animSeqPoint_t animSeqArena[ANIM_SEQ_ARENA_POINTS];
+//The segments following sequences, shared by all sequences
+static animSeqMember_t animSeqMembers[ANIM_SEQ_MAX_MEMBERS];
+//State of the random generator used for random colours
+static uint32_t animRandState=LEDSEG_RAND_SEED_FROM_ID(LEDSEG_RAND_DEFAULT_SEED,LEDSEG_ALL);
+static animScript_t animScripts[ANIM_SCRIPT_MAX_SCRIPTS];
+static animBeatTracker_t animBeat;
 
 
 const RGB_t coloursSimple[SIMPLE_COL_NOF_COLOURS]=
@@ -106,7 +361,7 @@ RGB_t animGetColour(simpleCols_t col, uint8_t normalize)
 	RGB_t temp={0,0,0};
 	if(col == SIMPLE_COL_RANDOM)
 	{
-		temp=coloursSimple[utilRandRange(SIMPLE_COL_NOF_COLOURS-1)];
+		temp=coloursSimple[ledSegRandRange(&animRandState,SIMPLE_COL_NOF_COLOURS)];
 	}
 	else if(col < SIMPLE_COL_NOF_COLOURS)
 	{
@@ -119,11 +374,20 @@ RGB_t animGetColour(simpleCols_t col, uint8_t normalize)
 	return temp;
 }
 
+/*
+ * Seeds the random generator used for random colours (such as SIMPLE_COL_RANDOM)
+ * Using the same seed gives the same sequence of colours
+ */
+void animSetRandSeed(uint32_t seed)
+{
+	animRandState=LEDSEG_RAND_SEED_FROM_ID(seed,LEDSEG_ALL);
+}
+
 /*
  * Extracts and normalizes (if given) a colour from a given colour list.
  * Will NOT check if num is out of sequence.
  */
-RGB_t animGetColourFromSequence(RGB_t* colourList, uint8_t num, uint8_t normalize)
+RGB_t animGetColourFromSequence(RGB_t* colourList, uint16_t num, uint8_t normalize)
 {
 	RGB_t tmp={0,0,0};
 	if(colourList==NULL)
@@ -233,57 +497,236 @@ void animSetModeChange(simpleCols_t col, ledSegmentFadeSetting_t* fs, uint8_t se
 
 
 /*
- * Inits an animation sequence. Will return a number to use to refer to the animation sequence
- * If existingSequence is a valid and existing sequence, this sequence will be over-written
- * Todo: Support for sync group is not done yet, don't use it
+ * Inits an animation sequence. Will return a handle to use to refer to the animation sequence
+ * The points are copied into the arena, which is shared by all sequences
+ * Returns ANIM_SEQ_MAX_SEQS+1 if something went wrong (all slots are used, or there is not enough room in the arena)
+ * Todo: Support for sync group is not done yet, don't use it. To run a set of segments, see animSeqAddMember
  */
-uint8_t animSeqInit(uint8_t seg, bool isSyncGroup, uint32_t cycles, animSeqPoint_t* points, uint8_t nofPoints)
+animSeqHandle_t animSeqInit(uint8_t seg, bool isSyncGroup, uint32_t cycles, animSeqPoint_t* points, uint8_t nofPoints)
 {
 	//Check validity
-	if(animSeqsNofSeqs>=ANIM_SEQ_MAX_SEQS || !ledSegExists(seg) || nofPoints>ANIM_SEQ_MAX_POINTS)
+	if(!ledSegExists(seg))
 	{
 		return ANIM_SEQ_MAX_SEQS+1;
 	}
-	//Load all settings into state and reset everything accordingly
-	animSequence_t* seq=&animSeqs[animSeqsNofSeqs];
-	memset(seq,0,sizeof(animSequence_t));
-	seq->cyclesSetting=cycles;
-	seq->cyclesLeft=cycles;
-	seq->currentPoint=0;
-	seq->isFadingToNextPoint=false;
-	seq->isSyncGroup=isSyncGroup;
-	seq->nofPoints=nofPoints;
-	seq->seg=seg;
-	seq->waitReleaseTime=0;
-	memcpy(seq->points,points,nofPoints*sizeof(animSeqPoint_t));
-
+	uint8_t slot=0;
+	while(slot<ANIM_SEQ_MAX_SEQS && animSeqs[slot].used)
+	{
+		slot++;
+	}
+	if(slot>=ANIM_SEQ_MAX_SEQS)
+	{
+		return ANIM_SEQ_MAX_SEQS+1;
+	}
+	animSequence_t* seq=&animSeqs[slot];
+	if(!animSeqSetup(seq,seg,isSyncGroup,cycles,points,nofPoints))
+	{
+		return ANIM_SEQ_MAX_SEQS+1;
+	}
+	if(seq->generation==0)
+	{
+		seq->generation=1;
+	}
+	seq->used=true;
 	//Load first point (if it's a fade, it will be handled by the task later)
 	//animSeqLoadCurrentPoint(seq,true);
-	animSeqsNofSeqs++;
-	return animSeqsNofSeqs-1;
+	return ANIM_SEQ_HANDLE(slot,seq->generation);
 }
 
 /*
  * Takes an existing animation sequence and re-inits it as a new one
- * Returns the number of the animation sequence given. If any other number is returned (specifically ANIM_SEQ_MAX_SEQS or larger), something went wrong
+ * The handle stays the same. Returns the handle given. If any other value is returned (specifically ANIM_SEQ_MAX_SEQS+1), something went wrong and the sequence is unchanged
+ */
+animSeqHandle_t animSeqInitExisting(animSeqHandle_t existingSeq, uint8_t seg, bool isSyncGroup, uint32_t cycles, animSeqPoint_t* points, uint8_t nofPoints)
+{
+	animSequence_t* seq=animSeqGet(existingSeq);
+	if(seq==NULL || !ledSegExists(seg))
+	{
+		return ANIM_SEQ_MAX_SEQS+1;
+	}
+	if(!animSeqSetup(seq,seg,isSyncGroup,cycles,points,nofPoints))
+	{
+		return ANIM_SEQ_MAX_SEQS+1;
+	}
+	return existingSeq;
+}
+
+/*
+ * Destroys an animation sequence and gives its points back to the arena
+ * The segments keep running what was last loaded. The handle (and any copy of it) is never valid again
+ * If LEDSEG_ALL is given, all sequences are destroyed
+ */
+bool animSeqDestroy(animSeqHandle_t seqNum)
+{
+	if(seqNum==LEDSEG_ALL)
+	{
+		for(uint8_t i=0;i<ANIM_SEQ_MAX_SEQS;i++)
+		{
+			if(animSeqs[i].used)
+			{
+				animSeqDestroy(ANIM_SEQ_HANDLE(i,animSeqs[i].generation));
+			}
+		}
+		return true;
+	}
+	animSequence_t* seq=animSeqGet(seqNum);
+	if(seq==NULL)
+	{
+		return false;
+	}
+	animSeqRemoveMember(seqNum,LEDSEG_ALL);
+	uint8_t generation=seq->generation+1;
+	if(generation==0)
+	{
+		generation=1;
+	}
+	memset(seq,0,sizeof(animSequence_t));
+	seq->generation=generation;
+	return true;
+}
+
+/*
+ * Encodes points into the compact format used by animSeqInitPacked
+ * Each point only stores the fields that differ from the previous point, so a sequence where each point changes a colour or a time takes a fraction of the size
+ * The fields are stored with their native size, and colour sequences and keyframes as native pointers, so the data is only valid for the build that packed it
+ * (it can't be generated offline). Once packed, it's only read, so it can be written to flash and kept there
+ * If buf is NULL, the needed size is returned. Otherwise the number of bytes written is returned (0 if buf is too small).
+ */
+uint32_t animSeqPack(const animSeqPoint_t* points, uint16_t nofPoints, uint8_t* buf, uint32_t size)
+{
+	animSeqPoint_t prev;
+	memset(&prev,0,sizeof(animSeqPoint_t));
+	uint32_t used=0;
+	for(uint16_t i=0;i<nofPoints;i++)
+	{
+		const uint8_t* pt=(const uint8_t*)&points[i];
+		uint32_t mask=0;
+		uint32_t pointSize=ANIM_PACK_POINT_HEADER_SIZE;
+		for(uint8_t f=0;f<ANIM_PACK_NOF_FIELDS;f++)
+		{
+			if(memcmp(pt+animPackFields[f].offset,((const uint8_t*)&prev)+animPackFields[f].offset,animPackFields[f].size))
+			{
+				mask|=1UL<<f;
+				pointSize+=animPackFields[f].size;
+			}
+		}
+		if(buf!=NULL)
+		{
+			if(used+pointSize>size)
+			{
+				return 0;
+			}
+			uint8_t* p=buf+used;
+			memcpy(p,&mask,sizeof(uint32_t));
+			p[sizeof(uint32_t)]=animPackFlags(&points[i]);
+			p+=ANIM_PACK_POINT_HEADER_SIZE;
+			for(uint8_t f=0;f<ANIM_PACK_NOF_FIELDS;f++)
+			{
+				if(mask&(1UL<<f))
+				{
+					memcpy(p,pt+animPackFields[f].offset,animPackFields[f].size);
+					p+=animPackFields[f].size;
+				}
+			}
+		}
+		used+=pointSize;
+		memcpy(&prev,&points[i],sizeof(animSeqPoint_t));
+	}
+	return used;
+}
+
+/*
+ * Sets up an animation sequence that runs compact points (see animSeqPack)
+ * The points are read in place and never copied, so the data must be kept for as long as the sequence is used (it can be in flash).
+ * There is no limit on the number of points (other than 65535). Points can't be appended or removed
+ * Returns the handle of the sequence, or ANIM_SEQ_MAX_SEQS+1 if something went wrong (such as invalid data)
+ */
+animSeqHandle_t animSeqInitPacked(uint8_t seg, bool isSyncGroup, uint32_t cycles, const uint8_t* packed, uint32_t size)
+{
+	if(packed==NULL)
+	{
+		return ANIM_SEQ_MAX_SEQS+1;
+	}
+	//Check the data and count the points
+	uint32_t pos=0;
+	uint32_t nofPoints=0;
+	animSeqPoint_t point;
+	while(pos<size)
+	{
+		const uint32_t pointSize=animUnpackPoint(packed+pos,size-pos,&point);
+		if(!pointSize || nofPoints>=ANIM_PACK_NO_POINT)
+		{
+			return ANIM_SEQ_MAX_SEQS+1;
+		}
+		pos+=pointSize;
+		nofPoints++;
+	}
+	const animSeqHandle_t seqNum=animSeqInit(seg,isSyncGroup,cycles,NULL,0);
+	animSequence_t* seq=animSeqGet(seqNum);
+	if(seq==NULL)
+	{
+		return ANIM_SEQ_MAX_SEQS+1;
+	}
+	seq->packed=packed;
+	seq->packedSize=size;
+	//The points are decoded into a block of two points in the arena
+	if(!animArenaResize(seq,2))
+	{
+		animSeqDestroy(seqNum);
+		return ANIM_SEQ_MAX_SEQS+1;
+	}
+	seq->nofPoints=nofPoints;
+	seq->packedPoint[0]=ANIM_PACK_NO_POINT;
+	seq->packedPoint[1]=ANIM_PACK_NO_POINT;
+	return seqNum;
+}
+
+/*
+ * Sets up an animation sequence that runs points stored elsewhere, typically a const table in flash
+ * The points are read in place and never copied, so only the state of the sequence uses RAM. The points must be kept for as long as the sequence is used.
+ * There is no limit on the number of points (other than 65535). Points can't be appended or removed
+ * Returns the handle of the sequence, or ANIM_SEQ_MAX_SEQS+1 if something went wrong
+ */
+animSeqHandle_t animSeqInitConst(uint8_t seg, bool isSyncGroup, uint32_t cycles, const animSeqPoint_t* points, uint16_t nofPoints)
+{
+	if(points==NULL || nofPoints>=ANIM_PACK_NO_POINT)
+	{
+		return ANIM_SEQ_MAX_SEQS+1;
+	}
+	const animSeqHandle_t seqNum=animSeqInit(seg,isSyncGroup,cycles,NULL,0);
+	animSequence_t* seq=animSeqGet(seqNum);
+	if(seq==NULL)
+	{
+		return ANIM_SEQ_MAX_SEQS+1;
+	}
+	seq->nofPoints=nofPoints;
+	seq->points=points;
+	return seqNum;
+}
+
+/*
+ * Sets up an animation sequence whose points are made when they're needed, by a generator
+ * The state (of stateSize bytes) is copied into the arena, and given to the generator for each point. The generator is called with the point number n, and shall give the same point for the same n and state
+ * Only the state and two points use RAM, so the number of points can be large (up to 65534) at constant memory. Points can't be appended or removed
+ * Returns the handle of the sequence, or ANIM_SEQ_MAX_SEQS+1 if something went wrong (such as there being no room for the state)
  */
-uint8_t animSeqInitExisting(uint8_t existingSeq, uint8_t seg, bool isSyncGroup, uint32_t cycles, animSeqPoint_t* points, uint8_t nofPoints)
+animSeqHandle_t animSeqInitGenerator(uint8_t seg, bool isSyncGroup, uint32_t cycles, animSeqGenerator_t generator, const void* state, uint16_t stateSize, uint16_t nofPoints)
 {
-	if(!animSeqExists(existingSeq))
+	if(state==NULL && stateSize)
 	{
 		return ANIM_SEQ_MAX_SEQS+1;
 	}
-	//Set nofSeqs to the seq we want to to change, to fool the Init-function to change the correct sequence
-	const uint8_t savedNofSeqs=animSeqsNofSeqs;
-	animSeqsNofSeqs=existingSeq;
-	uint8_t returnSeq=animSeqInit(seg,isSyncGroup,cycles,points,nofPoints);
-	//Restore the saved number of seqs
-	animSeqsNofSeqs=savedNofSeqs;
-	if(returnSeq!=existingSeq)
+	const animSeqHandle_t seqNum=animSeqSetupGenerator(ANIM_SEQ_MAX_SEQS+1,seg,isSyncGroup,cycles,generator,stateSize,nofPoints);
+	animSequence_t* seq=animSeqGet(seqNum);
+	if(seq==NULL)
 	{
 		return ANIM_SEQ_MAX_SEQS+1;
 	}
-	return returnSeq;
+	if(stateSize)
+	{
+		memcpy(ANIM_SEQ_GEN_STATE(seq),state,stateSize);
+	}
+	return seqNum;
 }
 
 /*
@@ -324,120 +767,283 @@ void animSeqFillPoint(animSeqPoint_t* point, ledSegmentFadeSetting_t* fs, ledSeg
 
 /*
  * Append a single point into an animation sequence
+ * The block of the sequence in the arena grows as needed. Returns false if there is no room for it
  */
-bool animSeqAppendPoint(uint8_t seqNum, animSeqPoint_t* point)
+bool animSeqAppendPoint(animSeqHandle_t seqNum, animSeqPoint_t* point)
 {
-	if(!animSeqExists(seqNum))
+	animSequence_t* seq=animSeqGet(seqNum);
+	if(seq==NULL || !animSeqIsEditable(seq) || seq->nofPoints>=ANIM_PACK_NO_POINT-1)
 	{
 		return false;
 	}
-	animSequence_t* seq=&animSeqs[seqNum];
-	if(seq->nofPoints>ANIM_SEQ_MAX_POINTS)
+	if(seq->nofPoints>=seq->ramCapacity && !animArenaResize(seq,seq->nofPoints+1))
 	{
 		return false;
 	}
 	seq->nofPoints++;
-	memcpy(&(seq->points[seq->nofPoints-1]),point,sizeof(animSeqPoint_t));
+	memcpy(&(seq->ramPoints[seq->nofPoints-1]),point,sizeof(animSeqPoint_t));
+	ledSegCompileFade(&point->fade,&seq->ramPoints[seq->nofPoints-1].fadeRates);
 	return true;
 }
 
 /*
  * Removes the n last points in an animation sequence
+ * The removed points are given back to the arena
  * If all points are removed, the segment will not update
  */
-bool animSeqRemovePoint(uint8_t seqNum, uint8_t n)
+bool animSeqRemovePoint(animSeqHandle_t seqNum, uint8_t n)
 {
-	if(!animSeqExists(seqNum))
+	animSequence_t* seq=animSeqGet(seqNum);
+	if(seq==NULL || !animSeqIsEditable(seq))
 	{
 		return false;
 	}
-	uint8_t currentPoints=animSeqs[seqNum].nofPoints;
+	uint16_t currentPoints=seq->nofPoints;
 	if(n>currentPoints)
 	{
 		n=currentPoints;
 	}
-	animSeqs[seqNum].nofPoints=currentPoints-n;
+	seq->nofPoints=currentPoints-n;
+	//Shrinking always works
+	animArenaResize(seq,seq->nofPoints);
+	animSeqClampPoints(seq);
 	return true;
 }
 
 /*
  * Removes all points from an animation sequence
  */
-bool animSeqRemoveAllPoints(uint8_t seqNum)
+bool animSeqRemoveAllPoints(animSeqHandle_t seqNum)
+{
+	animSequence_t* seq=animSeqGet(seqNum);
+	if(seq==NULL)
+	{
+		return false;
+	}
+	return animSeqRemovePoint(seqNum,seq->nofPoints);
+}
+
+/*
+ * Makes a segment follow an animation sequence. Each point the sequence loads is loaded on the segment offset ms later (by the first call of animTask after that)
+ * The points and the progression (points done, triggers and cycles) are only checked for the segment of the sequence, so one sequence can run a set of segments. Increasing offsets make a chase
+ * The loads of the members count against ANIM_TASK_MAX_STEPS, like the steps of the sequences
+ * If the sequence loads a new point before a member has loaded the previous one, the previous one is skipped. So the offset should be shorter than the points
+ * If the segment already follows the sequence, the offset is changed. Returns false if all members are used (see ANIM_SEQ_MAX_MEMBERS)
+ */
+bool animSeqAddMember(animSeqHandle_t seqNum, uint8_t seg, uint32_t offset)
+{
+	animSequence_t* seq=animSeqGet(seqNum);
+	if(seq==NULL || !ledSegExistsNotAll(seg))
+	{
+		return false;
+	}
+	const uint8_t slot=seq-animSeqs;
+	animSeqMember_t* member=NULL;
+	for(uint8_t i=0;i<ANIM_SEQ_MAX_MEMBERS;i++)
+	{
+		animSeqMember_t* m=&animSeqMembers[i];
+		if(m->used && m->seqSlot==slot && m->seg==seg)
+		{
+			m->offset=offset;
+			return true;
+		}
+		if(!m->used && member==NULL)
+		{
+			member=m;
+		}
+	}
+	if(member==NULL)
+	{
+		return false;
+	}
+	memset(member,0,sizeof(animSeqMember_t));
+	member->used=true;
+	member->seqSlot=slot;
+	member->seg=seg;
+	member->offset=offset;
+	return true;
+}
+
+/*
+ * Stops a segment from following an animation sequence. The segment keeps running what was last loaded
+ * If LEDSEG_ALL is given as seg, all members of the sequence are removed
+ */
+bool animSeqRemoveMember(animSeqHandle_t seqNum, uint8_t seg)
 {
-	return animSeqRemovePoint(seqNum,animSeqs[seqNum].nofPoints);
+	animSequence_t* seq=animSeqGet(seqNum);
+	if(seq==NULL)
+	{
+		return false;
+	}
+	const uint8_t slot=seq-animSeqs;
+	bool removed=false;
+	for(uint8_t i=0;i<ANIM_SEQ_MAX_MEMBERS;i++)
+	{
+		animSeqMember_t* m=&animSeqMembers[i];
+		if(m->used && m->seqSlot==slot && (m->seg==seg || seg==LEDSEG_ALL))
+		{
+			m->used=false;
+			removed=true;
+		}
+	}
+	return removed || seg==LEDSEG_ALL;
 }
 
 /*
  * Returns true if an animation sequence exists
+ * A handle of a destroyed sequence never exists again, even if the slot is re-used
  */
-bool animSeqExists(uint8_t seqNum)
+bool animSeqExists(animSeqHandle_t seqNum)
 {
-	if(seqNum<animSeqsNofSeqs || seqNum==LEDSEG_ALL)
+	if(seqNum==LEDSEG_ALL || animSeqGet(seqNum)!=NULL)
 	{
 		return true;
 	}
 	return false;
 }
 
+/*
+ * Returns the number of points an animation sequence has room for in the arena (see ANIM_SEQ_ARENA_POINTS)
+ * If LEDSEG_ALL is given, the number of free points in the arena is returned
+ */
+uint16_t animSeqGetArenaPoints(animSeqHandle_t seqNum)
+{
+	if(seqNum==LEDSEG_ALL)
+	{
+		uint16_t freePoints=ANIM_SEQ_ARENA_POINTS;
+		for(uint8_t i=0;i<ANIM_SEQ_MAX_SEQS;i++)
+		{
+			freePoints-=animSeqs[i].ramCapacity;
+		}
+		return freePoints;
+	}
+	animSequence_t* seq=animSeqGet(seqNum);
+	if(seq==NULL)
+	{
+		return 0;
+	}
+	return seq->ramCapacity;
+}
+
 /*
  * Returns true if the animation sequence is active
  * If LEDSEG_ALL (255) is given, it will return true if any animationSequence is active
  */
-bool animSeqIsActive(uint8_t seqNum)
+bool animSeqIsActive(animSeqHandle_t seqNum)
 {
 	if(seqNum==LEDSEG_ALL)
 	{
-		for(uint8_t i=0; i<animSeqsNofSeqs;i++)
+		for(uint8_t i=0; i<ANIM_SEQ_MAX_SEQS;i++)
 		{
-			if(animSeqIsActive(i))
+			if(animSeqs[i].used && animSeqs[i].isActive)
 			{
 				return true;
 			}
 		}
 		return false;
 	}
-	if(!animSeqExists(seqNum))
+	animSequence_t* seq=animSeqGet(seqNum);
+	if(seq==NULL)
 	{
 		return false;
 	}
-	return animSeqs[seqNum].isActive;
+	return seq->isActive;
 }
 
 /*
  * Enables/disables an animation sequence
  */
-void animSeqSetActive(uint8_t seqNum, bool active)
+void animSeqSetActive(animSeqHandle_t seqNum, bool active)
+{
+	if(seqNum==LEDSEG_ALL)
+	{
+		for(uint8_t i=0;i<ANIM_SEQ_MAX_SEQS;i++)
+		{
+			if(animSeqs[i].used)
+			{
+				animSeqSetActive(ANIM_SEQ_HANDLE(i,animSeqs[i].generation),active);
+			}
+		}
+		return;
+	}
+	animSequence_t* seq=animSeqGet(seqNum);
+	if(seq==NULL)
+	{
+		return;
+	}
+	seq->isActive=active;
+	seq->stepPending=active;
+}
+
+/*
+ * Sets a transition between the points of an animation sequence
+ * Each new point (except the first) is transitioned in over time (in ms), including pulse and glitter (see ledSegStartTransitionWithType)
+ * This replaces the fade to next point (fadeToNext). Setting time to 0 turns the transition off
+ */
+void animSeqSetTransition(animSeqHandle_t seqNum, ledSegmentTransition_t type, uint32_t time, ledSegmentEase_t ease)
 {
-	if(!animSeqExists(seqNum))
+	if(seqNum==LEDSEG_ALL)
 	{
+		for(uint8_t i=0;i<ANIM_SEQ_MAX_SEQS;i++)
+		{
+			if(animSeqs[i].used)
+			{
+				animSeqSetTransition(ANIM_SEQ_HANDLE(i,animSeqs[i].generation),type,time,ease);
+			}
+		}
 		return;
 	}
+	animSequence_t* seq=animSeqGet(seqNum);
+	if(seq==NULL)
+	{
+		return;
+	}
+	seq->transitionTime=time;
+	seq->transitionType=type;
+	seq->transitionEase=ease;
+}
+
+/*
+ * Sets if an animation sequence shall follow the beat tracker (see animBeatAdd)
+ * Each point is then released on the predicted beat closest to when it would have been, and a trigger releases the point on the next beat. So the lights land on the beat, and not one detection later
+ * Nothing changes while the beat tracker is not locked
+ */
+void animSeqSetOnBeat(animSeqHandle_t seqNum, bool onBeat)
+{
 	if(seqNum==LEDSEG_ALL)
 	{
-		for(uint8_t i=0;i<animSeqsNofSeqs;i++)
+		for(uint8_t i=0;i<ANIM_SEQ_MAX_SEQS;i++)
 		{
-			animSeqSetActive(i,active);
+			if(animSeqs[i].used)
+			{
+				animSeqSetOnBeat(ANIM_SEQ_HANDLE(i,animSeqs[i].generation),onBeat);
+			}
 		}
 		return;
 	}
-	animSeqs[seqNum].isActive=active;
+	animSequence_t* seq=animSeqGet(seqNum);
+	if(seq==NULL)
+	{
+		return;
+	}
+	seq->onBeat=onBeat;
 }
 
 /*
  * Restarts an animation sequence from the first point
  * Will activate an animation sequence, if not active
  */
-void animSeqSetRestart(uint8_t seqNum)
+void animSeqSetRestart(animSeqHandle_t seqNum)
 {
-	if(!animSeqExists(seqNum))
+	animSequence_t* seq=animSeqGet(seqNum);
+	if(seq==NULL)
 	{
 		return;
 	}
-	animSeqs[seqNum].cyclesLeft=animSeqs[seqNum].cyclesSetting;
-	animSeqs[seqNum].currentPoint=0;
-	animSeqs[seqNum].isActive=true;
-	animSeqLoadCurrentPoint(&animSeqs[seqNum],true);
+	seq->cyclesLeft=seq->cyclesSetting;
+	seq->currentPoint=0;
+	seq->isActive=true;
+	animSeqLoadCurrentPoint(seq,true);
 }
 
 /*
@@ -445,138 +1051,215 @@ void animSeqSetRestart(uint8_t seqNum)
  * If LEDSEG_ALL is given, it will try to trigger all animSeqs
  * Note: A trigger cannot be ready unless enabled for the point
  */
-void animSeqTrigTransition(uint8_t seqNum)
+void animSeqTrigTransition(animSeqHandle_t seqNum)
 {
 	if(seqNum==LEDSEG_ALL)
 	{
-		for(uint8_t i=0;i<animSeqsNofSeqs;i++)
+		for(uint8_t i=0;i<ANIM_SEQ_MAX_SEQS;i++)
 		{
-			animSeqTrigTransition(i);
+			if(animSeqs[i].used)
+			{
+				animSeqTrigTransition(ANIM_SEQ_HANDLE(i,animSeqs[i].generation));
+			}
 		}
+		return;
 	}
-	if(!animSeqExists(seqNum))
+	animSequence_t* seq=animSeqGet(seqNum);
+	if(seq==NULL)
 	{
 		return;
 	}
-	if(animSeqs[seqNum].waitReleaseTrigger==ANIM_TRIG_READY)
+	if(seq->waitReleaseTrigger==ANIM_TRIG_READY)
 	{
-		animSeqs[seqNum].waitReleaseTrigger=ANIM_TRIG_ACTIVATED;
+		seq->waitReleaseTrigger=ANIM_TRIG_ACTIVATED;
+		seq->stepPending=true;
 	}
 }
 
 /*
- * Returns true if an animation sequence is ready to be triggered.
- * If LEDSEG_ALL is given, true will only be returned if all seqs are ready
+ * Same as animSeqTrigTransition, but the next point is loaded and shown right away, instead of on the next animTask and update period
+ * The segments of the sequence are calculated and pushed to the strips at once (see ledSegRenderNow), so the trigger is seen within one strip transfer
+ * This only works if the point waits for nothing after the trigger (waitAfter=0). Otherwise, it works like animSeqTrigTransition
+ * Returns true if a new point was loaded
  */
-bool animSeqTrigReady(uint8_t seqNum)
+bool animSeqTrigTransitionImmediate(animSeqHandle_t seqNum)
 {
 	if(seqNum==LEDSEG_ALL)
 	{
-		for(uint8_t i=0;i<animSeqsNofSeqs;i++)
+		bool loaded=false;
+		for(uint8_t i=0;i<ANIM_SEQ_MAX_SEQS;i++)
 		{
-			if(!animSeqTrigReady(i))
+			if(animSeqs[i].used && animSeqTrigTransitionImmediate(ANIM_SEQ_HANDLE(i,animSeqs[i].generation)))
 			{
-				return false;
+				loaded=true;
 			}
 		}
-		return true;
+		return loaded;
 	}
-	if(!animSeqExists(seqNum))
+	animSequence_t* seq=animSeqGet(seqNum);
+	if(seq==NULL || seq->waitReleaseTrigger!=ANIM_TRIG_READY)
 	{
 		return false;
 	}
-	if(animSeqs[seqNum].waitReleaseTrigger==ANIM_TRIG_READY)
-	{
-		return true;
-	}
-	else
+	seq->waitReleaseTrigger=ANIM_TRIG_ACTIVATED;
+	animSeqStep(seq);
+	//A loaded point always resets the trigger
+	if(seq->waitReleaseTrigger==ANIM_TRIG_ACTIVATED || !seq->isActive)
 	{
 		return false;
 	}
-}
-
-/*
+	if(seq->isSyncGroup)
+	{
+		for(uint8_t i=0;i<LEDSEG_MAX_SEGMENTS;i++)
+		{
+			if(ledSegExistsNotAll(i) && ledSegGetSyncGroup(i)==seq->seg)
+			{
+				ledSegRenderNow(i);
+			}
+		}
+	}
+	else
+	{
+		ledSegRenderNow(seq->seg);
+	}
+	//Members without offset have loaded the point too
+	const uint8_t slot=seq-animSeqs;
+	for(uint8_t i=0;i<ANIM_SEQ_MAX_MEMBERS;i++)
+	{
+		if(animSeqMembers[i].used && animSeqMembers[i].seqSlot==slot && !animSeqMembers[i].offset)
+		{
+			ledSegRenderNow(animSeqMembers[i].seg);
+		}
+	}
+	return true;
+}
+
+/*
+ * Returns true if an animation sequence is ready to be triggered.
+ * If LEDSEG_ALL is given, true will only be returned if all seqs are ready
+ */
+bool animSeqTrigReady(animSeqHandle_t seqNum)
+{
+	if(seqNum==LEDSEG_ALL)
+	{
+		for(uint8_t i=0;i<ANIM_SEQ_MAX_SEQS;i++)
+		{
+			if(animSeqs[i].used && animSeqs[i].waitReleaseTrigger!=ANIM_TRIG_READY)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+	animSequence_t* seq=animSeqGet(seqNum);
+	if(seq==NULL)
+	{
+		return false;
+	}
+	if(seq->waitReleaseTrigger==ANIM_TRIG_READY)
+	{
+		return true;
+	}
+	else
+	{
+		return false;
+	}
+}
+
+/*
  * Generates and allocates an animation sequence that performs a colour wheel with the given colour sequence
+ * The points are made when they're needed from the colours given, which are read in place (so they must be kept for as long as the sequence is used).
+ * The sequence takes the same space in the arena for any number of colours.
  * Fadetime is the time to switch from one colour fully to the next.
  * Syncgroup is used to be able to set this for multiple segments
- * If addPulse is given, it will generate a pulse from the same colour sequence
+ * If addPulse is given, it will generate a pulse from the same colour sequence (the pulse can only use the first 255 colours)
  */
-uint8_t animGenerateFadeSequence(uint8_t existingSeq, uint8_t seg, uint8_t syncGroup, uint32_t cycles, uint8_t nofPoints, RGB_t* sequence, uint32_t fadeTime, uint32_t waitTime, uint8_t maxScaling, bool addPulse)
+animSeqHandle_t animGenerateFadeSequence(animSeqHandle_t existingSeq, uint8_t seg, uint8_t syncGroup, uint32_t cycles, uint16_t nofPoints, RGB_t* sequence, uint32_t fadeTime, uint32_t waitTime, uint8_t maxScaling, bool addPulse)
 {
-	if((animSeqsNofSeqs>=ANIM_SEQ_MAX_SEQS && !animSeqExists(existingSeq)) || !ledSegExists(seg) || nofPoints>ANIM_SEQ_MAX_POINTS)
+	if(!ledSegExists(seg) || (sequence==NULL && nofPoints))
 	{
 		return ANIM_SEQ_MAX_SEQS+1;
 	}
-	animSeqPoint_t pts[nofPoints];
-	/*
-	 * Create a fade from the current colour into the first colour in the list (use fade into, however this is done for animation sequence)
-	 * Create a fade from col1 to col2. Switch directly to the next fade, which is from col2 to col3, then continue as this.
-	 * The last segment shall fade from col_n to col1, no fade switch.
-	 */
+	const animSeqHandle_t seqNum=animSeqSetupGenerator(existingSeq,seg,false,cycles,animGenFadePoint,sizeof(animGenFadeState_t),nofPoints);
+	animSequence_t* seq=animSeqGet(seqNum);
+	if(seq==NULL)
+	{
+		return ANIM_SEQ_MAX_SEQS+1;
+	}
+	animGenFadeState_t* st=ANIM_SEQ_GEN_STATE(seq);
+	st->fadeTime=fadeTime;
+	st->waitTime=waitTime;
+	st->colours=sequence;
+	st->segLen=ledSegGetLen(seg);
+	st->nofColours=nofPoints;
+	st->maxScaling=maxScaling;
+	st->syncGroup=syncGroup;
+	st->addPulse=addPulse;
+	return seqNum;
+}
+
+/*
+ * Makes point n of a colour wheel (see animGenerateFadeSequence)
+ * Each point fades from colour n to colour n+1, and the last one fades back to the first colour. The first point also starts the pulse
+ */
+static void animGenFadePoint(void* state, uint16_t n, animSeqPoint_t* point)
+{
+	animGenFadeState_t* st=state;
 	ledSegmentFadeSetting_t fd;
-	fd.fadeTime=fadeTime;
+	memset(&fd,0,sizeof(ledSegmentFadeSetting_t));
+	fd.fadeTime=st->fadeTime;
 	fd.mode=LEDSEG_MODE_LOOP_END;
 	fd.cycles=1;
 	fd.globalSetting=0;
-	fd.syncGroup=syncGroup;
+	fd.syncGroup=st->syncGroup;
 	fd.startDir=1;	//Always fade from min to max
-	for(uint8_t i=0;i<nofPoints;i++)
+	RGB_t RGBTmpFrom=animGetColourFromSequence(st->colours,n,st->maxScaling);
+	//This was the last point. Next colour must be colour 0
+	RGB_t RGBTmpTo={0,0,0};
+	if(n==(st->nofColours-1))
 	{
-		RGB_t RGBTmpFrom=animGetColourFromSequence(sequence,i,maxScaling);
-		//This was the last point. Next colour must be colour 0
-		RGB_t RGBTmpTo={0,0,0};
-		if(i==(nofPoints-1))
-		{
-			RGBTmpTo=animGetColourFromSequence(sequence,0,maxScaling);
-		}
-		else
-		{
-			RGBTmpTo=animGetColourFromSequence(sequence,i+1,maxScaling);
-		}
-		fd.r_min=RGBTmpFrom.r;
-		fd.r_max=RGBTmpTo.r;
-		fd.g_min=RGBTmpFrom.g;
-		fd.g_max=RGBTmpTo.g;
-		fd.b_min=RGBTmpFrom.b;
-		fd.b_max=RGBTmpTo.b;
-		if(i==0 && addPulse)	//Load a pulse for the first one
+		RGBTmpTo=animGetColourFromSequence(st->colours,0,st->maxScaling);
+	}
+	else
+	{
+		RGBTmpTo=animGetColourFromSequence(st->colours,n+1,st->maxScaling);
+	}
+	fd.r_min=RGBTmpFrom.r;
+	fd.r_max=RGBTmpTo.r;
+	fd.g_min=RGBTmpFrom.g;
+	fd.g_max=RGBTmpTo.g;
+	fd.b_min=RGBTmpFrom.b;
+	fd.b_max=RGBTmpTo.b;
+	if(n==0 && st->addPulse)	//Load a pulse for the first one
+	{
+		ledSegmentPulseSetting_t ps;
+		memset(&ps,0,sizeof(ledSegmentPulseSetting_t));
+		ps.colourSeqLoops=1;
+		ps.colourSeqNum=(st->nofColours>UINT8_MAX ? UINT8_MAX : st->nofColours);
+		ps.colourSeqPtr=st->colours;
+		ps.cycles=0;
+		ps.ledsMaxPower=st->segLen/25;
+		if(ps.ledsMaxPower==0)
 		{
-			ledSegmentPulseSetting_t ps;
-			ps.colourSeqLoops=1;
-			ps.colourSeqNum=nofPoints;
-			ps.colourSeqPtr = (RGB_t*)sequence;
-			ps.cycles=0;
-			ps.ledsMaxPower=ledSegGetLen(seg)/25;
-			if(ps.ledsMaxPower==0)
-			{
-				ps.ledsMaxPower=50;
-			}
-			ps.ledsFadeBefore=ps.ledsMaxPower/4;
-			ps.ledsFadeAfter=ps.ledsMaxPower/4;
-			ps.mode = LEDSEG_MODE_LOOP_END;
-			ps.pixelTime=fadeTime/500;
-			if(ps.pixelTime == 0)
-			{
-				ps.pixelTime=1;
-			}
-			ps.pixelsPerIteration = 2;
-			ps.startDir=1;
-			ps.startLed=1;
-			ps.globalSetting=0;
-			animSeqFillPoint(&pts[i],&fd,&ps,waitTime,false,true,false,false,false,false);
+			ps.ledsMaxPower=50;
 		}
-		else
+		ps.ledsFadeBefore=ps.ledsMaxPower/4;
+		ps.ledsFadeAfter=ps.ledsMaxPower/4;
+		ps.mode = LEDSEG_MODE_LOOP_END;
+		ps.pixelTime=st->fadeTime/500;
+		if(ps.pixelTime == 0)
 		{
-			animSeqFillPoint(&pts[i],&fd,NULL,waitTime,false,addPulse,false,false,false,false);
+			ps.pixelTime=1;
 		}
-	}
-	if(animSeqExists(existingSeq))
-	{
-		return animSeqInitExisting(existingSeq,seg,false,cycles,pts,nofPoints);
+		ps.pixelsPerIteration = 2;
+		ps.startDir=1;
+		ps.startLed=1;
+		ps.globalSetting=0;
+		animSeqFillPoint(point,&fd,&ps,st->waitTime,false,true,false,false,false,false);
 	}
 	else
 	{
-		return animSeqInit(seg,false,cycles,pts,nofPoints);
+		animSeqFillPoint(point,&fd,NULL,st->waitTime,false,st->addPulse,false,false,false,false);
 	}
 }
 
@@ -589,49 +1272,74 @@ volatile uint16_t beatFadeUpFactor=10;
  * The beat sequence uses a fade and a pulse setting, but will match speeds to the beat.
  * Each beat consists of a quick fade from min to max (with higher global setting), then a slower fade from max to min with the pulse having a reasonably similar timing setting
  * The timings given set the total time for for each two accompanying points (the up + down)
+ * The points are made when they're needed from the beat times in events, which is read in place (so it must be kept for as long as the sequence is used, and changes to it are followed).
+ * The sequence takes the same space in the arena for any number of beats. If events has fewer beats than nofPoints, the beats are looped
+ * A list filled by the beat tracker (see animBeatFillEvents) only has the average time, so useAvgTime shall be set for it
  */
-uint8_t animGenerateBeatSequence(uint8_t existingSeq, uint8_t seg, uint8_t syncGroup, uint32_t cycles, uint8_t nofPoints,
+animSeqHandle_t animGenerateBeatSequence(animSeqHandle_t existingSeq, uint8_t seg, uint8_t syncGroup, uint32_t cycles, uint16_t nofPoints,
 		ledSegmentFadeSetting_t* fade, ledSegmentPulseSetting_t* pulse, bool useFade, bool usePulse, uint8_t globalMax, eventTimeList* events, bool useAvgTime)
 {
-	if((animSeqsNofSeqs>=ANIM_SEQ_MAX_SEQS && !animSeqExists(existingSeq)) || !ledSegExists(seg) || nofPoints>(ANIM_SEQ_MAX_POINTS/2))
+	if(!ledSegExists(seg) || fade==NULL || events==NULL || (usePulse && pulse==NULL) || nofPoints>=ANIM_PACK_NO_POINT/2)
+	{
+		return ANIM_SEQ_MAX_SEQS+1;
+	}
+	//For avg time, we will only use 2 points, because it will always have the same time
+	if(useAvgTime)
+	{
+		nofPoints=1;
+	}
+	const animSeqHandle_t seqNum=animSeqSetupGenerator(existingSeq,seg,false,cycles,animGenBeatPoint,sizeof(animGenBeatState_t),2*nofPoints);
+	animSequence_t* seq=animSeqGet(seqNum);
+	if(seq==NULL)
 	{
 		return ANIM_SEQ_MAX_SEQS+1;
 	}
-	animSeqPoint_t pts[2*nofPoints];
+	animGenBeatState_t* st=ANIM_SEQ_GEN_STATE(seq);
 	//Copy settings to avoid destroying them
-	ledSegmentFadeSetting_t fadeTmp;
-	ledSegmentPulseSetting_t pulseTmp;
-	memcpy(&fadeTmp,fade,sizeof(ledSegmentFadeSetting_t));
+	memcpy(&st->fade,fade,sizeof(ledSegmentFadeSetting_t));
 	if(usePulse)
 	{
-		memcpy(&pulseTmp,pulse,sizeof(ledSegmentPulseSetting_t));
+		memcpy(&st->pulse,pulse,sizeof(ledSegmentPulseSetting_t));
 	}
-	fadeTmp.cycles=1;
+	st->fade.cycles=1;
+	st->usePulse=usePulse;
+	st->globalMax=globalMax;
+	st->segLen=ledSegGetLen(seg);
+	if(st->segLen==0)
+	{
+		st->segLen=150;	//Use a default segment length (yes, this is pulled out of my ass)
+	}
+	st->events=events;
+	st->useAvgTime=useAvgTime;
+	return seqNum;
+}
 
-	uint16_t segLen=ledSegGetLen(seg);
-	if(segLen==0)
+/*
+ * Makes point n of a beat program (see animGenerateBeatSequence)
+ * Even points are the fade up of beat n/2, and odd points the fade down
+ */
+static void animGenBeatPoint(void* state, uint16_t n, animSeqPoint_t* point)
+{
+	animGenBeatState_t* st=state;
+	ledSegmentFadeSetting_t fadeTmp=st->fade;
+	ledSegmentPulseSetting_t pulseTmp=st->pulse;
+	const uint8_t nofEvents=eventTimeGetNofEventsRecorded(st->events);
+	uint32_t totalTime=st->events->avgTime;
+	if(!st->useAvgTime && nofEvents)
 	{
-		segLen=150;	//Use a default segment length (yes, this is pulled out of my ass)
+		totalTime=st->events->eventTimes[(n/2)%nofEvents];
 	}
-	//Create points
-	for(uint8_t i=0;i<nofPoints;i++)
+	uint32_t fadeUpTime=(totalTime*beatFadeUpFactor)/beatFadeUpFactorMax;
+	uint32_t fadeDownTime=(totalTime*(beatFadeUpFactorMax-beatFadeUpFactor))/beatFadeUpFactorMax;
+	if(n%2==0)
 	{
-		uint32_t totalTime=events->eventTimes[i];
-		//For avg time, we will only use 2 points, because it will always have the same time
-		if(useAvgTime)
-		{
-			nofPoints=1;
-			totalTime=events->avgTime;
-		}
-		uint32_t fadeUpTime=(totalTime*beatFadeUpFactor)/beatFadeUpFactorMax;
-		uint32_t fadeDownTime=(totalTime*(beatFadeUpFactorMax-beatFadeUpFactor))/beatFadeUpFactorMax;
 		//Prepare fade up
-		fadeTmp.globalSetting=globalMax;
+		fadeTmp.globalSetting=st->globalMax;
 		fadeTmp.fadeTime=fadeUpTime;
 		fadeTmp.startDir=1;
-		if(usePulse)
+		if(st->usePulse)
 		{
-			pulseTmp.globalSetting=globalMax;
+			pulseTmp.globalSetting=st->globalMax;
 			//Fade up shall not have a pulse
 			if(ledSegisGlitterMode(pulseTmp.mode))
 			{
@@ -642,61 +1350,50 @@ uint8_t animGenerateBeatSequence(uint8_t existingSeq, uint8_t seg, uint8_t syncG
 			else
 			{
 				pulseTmp.pixelTime=1;
-				pulseTmp.pixelsPerIteration=(segLen*pulseTmp.pixelTime*LEDSEG_UPDATE_PERIOD_TIME)/fadeDownTime;
+				pulseTmp.pixelsPerIteration=(st->segLen*pulseTmp.pixelTime*LEDSEG_UPDATE_PERIOD_TIME)/fadeDownTime;
 				if(pulseTmp.pixelsPerIteration<1)
 				{
 					pulseTmp.pixelsPerIteration=1;
 				}
 				pulseTmp.cycles=0;
 			}
-		}
-		if(usePulse)
-		{
-			animSeqFillPoint(&pts[2*i],&fadeTmp,&pulseTmp,2*fadeUpTime,false,false,false,true,false,false);
+			animSeqFillPoint(point,&fadeTmp,&pulseTmp,2*fadeUpTime,false,false,false,true,false,false);
 		}
 		else
 		{
-			animSeqFillPoint(&pts[2*i],&fadeTmp,NULL,2*fadeUpTime,false,false,false,true,false,false);
+			animSeqFillPoint(point,&fadeTmp,NULL,2*fadeUpTime,false,false,false,true,false,false);
 		}
+	}
+	else
+	{
 		//Prepare fade down
-		if(usePulse)
-		{
-			pulseTmp.globalSetting=0;
-		}
 		fadeTmp.globalSetting=0;
 		fadeTmp.fadeTime=fadeDownTime;
 		fadeTmp.startDir=-1;
 		//Fade down pulse shall finish during the fade Todo: Find a way to reset the global while still persisting pulse
-		animSeqFillPoint(&pts[2*i+1],&fadeTmp,NULL,fadeDownTime-2*fadeUpTime,false,usePulse,false,true,false,false);
-	}
-	if(animSeqExists(existingSeq))
-	{
-		return animSeqInitExisting(existingSeq,seg,false,cycles,pts,2*nofPoints);
-	}
-	else
-	{
-		return animSeqInit(seg,false,cycles,pts,2*nofPoints);
+		animSeqFillPoint(point,&fadeTmp,NULL,fadeDownTime-2*fadeUpTime,false,st->usePulse,false,true,false,false);
 	}
 }
 
 /*
  * Takes an existing animation sequence and modifies times so that it fits a beat
  * If the beat list is shorter than the number of points, the beat list will loop.
+ * A list filled by the beat tracker (see animBeatFillEvents) only has the average time, so useAvgTime shall be set for it
  * Todo: This is bare minimum and could be improved in several steps
  */
-uint8_t animSeqModifyToBeat(uint8_t existingSeq, eventTimeList* events, bool useAvgTime)
+animSeqHandle_t animSeqModifyToBeat(animSeqHandle_t existingSeq, eventTimeList* events, bool useAvgTime)
 {
-	//We only allow existing segments
-	if(!animSeqExists(existingSeq))
+	//We only allow existing segments (with points that can be changed)
+	animSequence_t* seq=animSeqGet(existingSeq);
+	if(seq==NULL || !animSeqIsEditable(seq))
 	{
 		return ANIM_SEQ_MAX_SEQS+1;
 	}
-	animSequence_t* seq=&animSeqs[existingSeq];
 	const uint8_t eventPointsMax=eventTimeGetNofEventsRecorded(events);
 	uint8_t eventPoint=0;
-	for(uint8_t i=0;i<seq->nofPoints;i++)
+	for(uint16_t i=0;i<seq->nofPoints;i++)
 	{
-		animSeqPoint_t* pt=&seq->points[i];
+		animSeqPoint_t* pt=&seq->ramPoints[i];
 		pt->switchOnTime=true;
 		if(useAvgTime)
 		{
@@ -715,207 +1412,1864 @@ uint8_t animSeqModifyToBeat(uint8_t existingSeq, eventTimeList* events, bool use
 }
 
 /*
- * Loads the current point into from an animation sequence
- * Does not change any point state or anything
+ * Gives a beat to the beat tracker. time is the time (see ledSegGetTime) the beat was detected (or tapped) at
+ * The intervals between beats are median filtered, and beats far from the predicted beat are not used. The tempo and phase are followed by a phase-locked loop, so the predicted beats (animBeatGetNext) don't jitter or drift like the beats given
+ * The tracker locks once it has 3 intervals. If the beats stop for more than 2 ANIM_BEAT_MAX_PERIOD, or don't match the prediction for ANIM_BEAT_MAX_MISSES beats, it starts over
  */
-static void animSeqLoadCurrentPoint(animSequence_t* seq, bool firstPoint)
+void animBeatAdd(uint32_t time)
 {
-	//We have updated the current point and checked everything. Load the new segment settings
-	animSeqPoint_t* point=&(seq->points[seq->currentPoint]);
-	const uint8_t seg=seq->seg;
-	//If mode change fade is used, don't update pulse until we're (Todo: what?)
-	if(point->fadeUsed)
+	animBeatTracker_t* bt=&animBeat;
+	time=(time>bt->latency ? time-bt->latency : 0);
+	if(bt->lastBeat)
 	{
-		//Check if we shall load a new fade or keep the old one
-		if(!point->fadePersistFromLast)
+		const uint32_t interval=time-bt->lastBeat;
+		if(time<bt->lastBeat || interval<ANIM_BEAT_MIN_PERIOD/2)
 		{
-			//Note: This might fuck something up firstPoint
-			if(point->fadeToNext || firstPoint)
-			{
-				animSetModeChange(SIMPLE_COL_NO_CHANGE,&point->fade,seg,point->switchAtMax,0,0,false);
-				seq->isFadingToNextPoint=true;
-			}
-			else
-			{
-				ledSegSetFade(seg,&point->fade);
-			}
+			return;	//Double detection of the same beat
 		}
-		else
+		if(interval>2*ANIM_BEAT_MAX_PERIOD)
 		{
-			ledSegSetFadeActiveState(seg,true);	//Set fade active, but don't restart or update it
+			//The beat was lost. Start over
+			const uint32_t latency=bt->latency;
+			memset(bt,0,sizeof(animBeatTracker_t));
+			bt->latency=latency;
+		}
+		else if(interval>=ANIM_BEAT_MIN_PERIOD && interval<=ANIM_BEAT_MAX_PERIOD)
+		{
+			bt->intervals[bt->nextInterval]=interval;
+			bt->nextInterval=(bt->nextInterval+1)%ANIM_BEAT_NOF_INTERVALS;
+			if(bt->nofIntervals<ANIM_BEAT_NOF_INTERVALS)
+			{
+				bt->nofIntervals++;
+			}
 		}
 	}
-	else
+	bt->lastBeat=time;
+	if(bt->nofIntervals<3)
 	{
-		ledSegSetFadeActiveState(seg,false);	//Set fade active, but don't restart or update it
+		return;
 	}
-	/*
-	 * 4 cases:
-	 * !pActive && !fading - disable pulse immediately
-	 * !pActive && fading - do nothing. Keep existing pulse state until fade is done. Once fade is done, clear existing pulse
-	 * pActive && !fading - update pulse immediately
-	 * pActive && fading - do nothing. Keep existing pulse state until fade is done. Once fade is done, load next pulse
-	 */
-	if(!seq->isFadingToNextPoint || firstPoint)
+	const uint32_t median=((uint32_t)animBeatMedian())<<4;
+	if(!bt->period)
 	{
-		if(point->pulseUsed)
+		//Lock on this beat, with the median as the period
+		bt->period=median;
+		bt->nextBeat=time;
+		bt->nextBeatFrac=0;
+		animBeatAdvance();
+		return;
+	}
+	//Find the predicted beat closest to this one (beats may have been missed)
+	while(bt->nextBeat+(bt->period>>5)<time)
+	{
+		animBeatAdvance();
+	}
+	int32_t error=(int32_t)(time-bt->nextBeat);
+	if((uint32_t)abs(error)>(bt->period>>6))
+	{
+		//Too far from the predicted beat (more than a quarter of a beat) to be used
+		bt->misses++;
+		if(bt->misses>=ANIM_BEAT_MAX_MISSES)
 		{
-			//Check if we shall load a new pulse or keep the old one
-			if(!point->pulsePersistFromLast || firstPoint)
-			{
-				ledSegSetPulse(seg,&point->pulse);
-			}
-			else
-			{
-				ledSegSetPulseActiveState(seg,true);
-			}
+			bt->period=0;
+			bt->misses=0;
 		}
-		else
+		return;
+	}
+	bt->misses=0;
+	//Correct the phase and period by a part of the error, and pull the period towards the median interval
+	bt->nextBeat+=error/(1<<ANIM_BEAT_PHASE_GAIN_SHIFT);
+	int32_t period=(int32_t)bt->period+(error*16)/(1<<ANIM_BEAT_PERIOD_GAIN_SHIFT);
+	period+=((int32_t)median-period)/(1<<ANIM_BEAT_MEDIAN_GAIN_SHIFT);
+	if(period<(ANIM_BEAT_MIN_PERIOD<<4))
+	{
+		period=ANIM_BEAT_MIN_PERIOD<<4;
+	}
+	else if(period>(ANIM_BEAT_MAX_PERIOD<<4))
+	{
+		period=ANIM_BEAT_MAX_PERIOD<<4;
+	}
+	bt->period=period;
+	animBeatAdvance();
+}
+
+/*
+ * Clears the beat tracker (the latency is kept)
+ */
+void animBeatReset()
+{
+	const uint32_t latency=animBeat.latency;
+	memset(&animBeat,0,sizeof(animBeatTracker_t));
+	animBeat.latency=latency;
+}
+
+/*
+ * Sets the time it takes from a beat happens until it's given to animBeatAdd (in ms), such as the delay of the detector
+ * The beats are moved back by this time, so that the predicted beats are when the beats actually happen
+ */
+void animBeatSetLatency(uint32_t latency)
+{
+	animBeat.latency=latency;
+}
+
+/*
+ * Returns true if the beat tracker has locked on to a beat
+ */
+bool animBeatIsLocked()
+{
+	return animBeat.period!=0;
+}
+
+/*
+ * Returns the predicted time between beats (in ms), or 0 if the beat tracker is not locked
+ */
+uint32_t animBeatGetPeriod()
+{
+	return (animBeat.period+8)>>4;
+}
+
+/*
+ * Returns the time of the first predicted beat at or after time
+ * If the beat tracker is not locked, time is returned
+ */
+uint32_t animBeatGetNext(uint32_t time)
+{
+	const animBeatTracker_t* bt=&animBeat;
+	if(!bt->period)
+	{
+		return time;
+	}
+	//The beats are at nextBeat+n*period (the fraction of nextBeat is small enough to be left out)
+	if(time<=bt->nextBeat)
+	{
+		const uint32_t n=((bt->nextBeat-time)<<4)/bt->period;
+		return bt->nextBeat-((n*bt->period)>>4);
+	}
+	const uint32_t n=(((time-bt->nextBeat)<<4)+bt->period-1)/bt->period;
+	return bt->nextBeat+((n*bt->period)>>4);
+}
+
+/*
+ * Sets the average time of an event list to the predicted time between beats
+ * The beat sequences (animGenerateBeatSequence and animSeqModifyToBeat with useAvgTime) then use the filtered tempo instead of the raw one
+ * Only the average time is set. The event times (and how many there are) are kept by the event functions of stm32utils, so the beats are not added to them,
+ * and the beat sequences only follow the beat tracker with useAvgTime
+ * Returns false (and leaves the list unchanged) if the beat tracker is not locked
+ */
+bool animBeatFillEvents(eventTimeList* events)
+{
+	if(events==NULL || !animBeat.period)
+	{
+		return false;
+	}
+	events->avgTime=animBeatGetPeriod();
+	return true;
+}
+
+/*
+ * Returns the median of the last beat intervals
+ */
+static uint16_t animBeatMedian()
+{
+	uint16_t sorted[ANIM_BEAT_NOF_INTERVALS];
+	const uint8_t n=animBeat.nofIntervals;
+	//Insertion sort (there are only a few)
+	for(uint8_t i=0;i<n;i++)
+	{
+		uint16_t v=animBeat.intervals[i];
+		uint8_t j=i;
+		while(j>0 && sorted[j-1]>v)
 		{
-			ledSegSetPulseActiveState(seg,false);
+			sorted[j]=sorted[j-1];
+			j--;
 		}
+		sorted[j]=v;
 	}
-	//Always reset external trigger state when loading a new point
-	seq->waitReleaseTrigger=ANIM_TRIG_NOT_READY;
+	return sorted[n/2];
 }
 
 /*
- * The main task that handles all time stepping things
- * that I didn't want to put into the regular ledSegment loop
+ * Moves the predicted beat of the beat tracker one period forward
  */
-void animTask()
+static void animBeatAdvance()
+{
+	const uint32_t total=animBeat.nextBeatFrac+animBeat.period;
+	animBeat.nextBeat+=total>>4;
+	animBeat.nextBeatFrac=total&0xF;
+}
+
+/*
+ * Moves a time to the predicted beat closest to it, but never before the current time
+ */
+static uint32_t animBeatQuantise(uint32_t time)
 {
-	static uint32_t nextCallTime=0;
-	if(systemTime < nextCallTime)
+	const uint32_t halfPeriod=animBeat.period>>5;
+	const uint32_t now=ledSegGetTime();
+	uint32_t beat=animBeatGetNext(time>halfPeriod ? time-halfPeriod : 0);
+	if(beat<now)
 	{
-		return;
+		beat=animBeatGetNext(now);
 	}
-	nextCallTime=systemTime+ANIM_TASK_PERIOD;
+	return beat;
+}
 
-	//Go through and update all animations sequences
-	//Todo: Consider dividing this into multiple calls to spread out CPU load slightly
-	for(uint8_t i=0;i<animSeqsNofSeqs;i++)
+/*
+ * Adds the animation sequences to a snapshot of the engine state (see ledSegSnapshot)
+ * Only the used slots of the pool and the used points of each sequence are stored, and wait times are stored relative to the time of the snapshot.
+ * If buf is NULL, the needed size is returned. Otherwise the number of bytes written is returned (0 if buf is too small).
+ */
+uint32_t animSeqSnapshot(uint8_t* buf, uint32_t size)
+{
+	uint32_t needed=sizeof(animSnapshotHeader_t);
+	for(uint8_t i=0;i<ANIM_SEQ_MAX_SEQS;i++)
 	{
-		animSequence_t* seq=&animSeqs[i];
-		if(seq->isActive && (seq->nofPoints>0))
+		if(!animSeqs[i].used)
+		{
+			continue;
+		}
+		uint16_t first;
+		needed+=ANIM_SEQ_STATE_SIZE+animSeqSnapshotPoints(&animSeqs[i],&first)*sizeof(animSeqPoint_t);
+	}
+	for(uint8_t i=0;i<ANIM_SEQ_MAX_MEMBERS;i++)
+	{
+		if(animSeqMembers[i].used)
+		{
+			needed+=sizeof(animSeqMember_t);
+		}
+	}
+	if(buf==NULL)
+	{
+		return needed;
+	}
+	if(size<needed)
+	{
+		return 0;
+	}
+	animSnapshotHeader_t hdr;
+	memset(&hdr,0,sizeof(animSnapshotHeader_t));
+	hdr.pointSize=sizeof(animSeqPoint_t);
+	hdr.stateSize=ANIM_SEQ_STATE_SIZE;
+	hdr.randState=animRandState;
+	const uint32_t now=ledSegGetTime();
+	uint8_t* p=buf+sizeof(animSnapshotHeader_t);
+	for(uint8_t i=0;i<ANIM_SEQ_MAX_SEQS;i++)
+	{
+		if(!animSeqs[i].used)
+		{
+			continue;
+		}
+		hdr.nofSeqs++;
+		hdr.usedSlots|=1<<i;
+		animSequence_t seq;
+		memcpy(&seq.currentPoint,&animSeqs[i].currentPoint,ANIM_SEQ_STATE_SIZE);
+		//Store the time left to wait (+1, since 0 means that we're not waiting)
+		if(seq.waitReleaseTime)
+		{
+			seq.waitReleaseTime=(seq.waitReleaseTime>now ? seq.waitReleaseTime-now : 0)+1;
+		}
+		//The stored part of the block is stored after the state. Points owned by the sequence are marked by points being NULL
+		uint16_t first;
+		const uint16_t nofStored=animSeqSnapshotPoints(&seq,&first);
+		if(nofStored)
+		{
+			memcpy(p+ANIM_SEQ_STATE_SIZE,&seq.ramPoints[first],nofStored*sizeof(animSeqPoint_t));
+		}
+		if(animSeqIsEditable(&seq))
+		{
+			seq.points=NULL;
+		}
+		//Store the block in the arena as the number of the first point, since the arena may be somewhere else when restored
+		seq.ramPoints=(animSeqPoint_t*)(uintptr_t)(seq.ramCapacity ? seq.ramPoints-animSeqArena : 0);
+		memcpy(p,&seq.currentPoint,ANIM_SEQ_STATE_SIZE);
+		p+=ANIM_SEQ_STATE_SIZE+nofStored*sizeof(animSeqPoint_t);
+	}
+	for(uint8_t i=0;i<ANIM_SEQ_MAX_MEMBERS;i++)
+	{
+		if(!animSeqMembers[i].used)
 		{
-			const uint8_t seg=seq->seg;
-			const bool isSyncGrp=seq->isSyncGroup;
+			continue;
+		}
+		hdr.nofMembers++;
+		animSeqMember_t member=animSeqMembers[i];
+		//Store the time left until the point is loaded
+		member.loadTime=(member.loadTime>now ? member.loadTime-now : 0);
+		memcpy(p,&member,sizeof(animSeqMember_t));
+		p+=sizeof(animSeqMember_t);
+	}
+	memcpy(buf,&hdr,sizeof(animSnapshotHeader_t));
+	return needed;
+}
 
-			//Check if fade and pulse and done (and if the entire segment/syncGroup is done). If not, next.
-			bool fadeDone=false;
-			bool pulseDone=false;
-			if(isSyncGrp)
+/*
+ * Checks (apply=false) or loads (apply=true) the animation sequences from a snapshot (see ledSegRestore)
+ * The sequences are put back into the same slots and blocks of the arena, so the handles from when the snapshot was taken are valid again
+ * Returns false if the data is invalid
+ */
+bool animSeqRestore(const uint8_t* buf, uint32_t size, bool apply)
+{
+	animSnapshotHeader_t hdr;
+	if(size<sizeof(animSnapshotHeader_t))
+	{
+		return false;
+	}
+	memcpy(&hdr,buf,sizeof(animSnapshotHeader_t));
+	if(hdr.pointSize!=sizeof(animSeqPoint_t) || hdr.stateSize!=ANIM_SEQ_STATE_SIZE || (hdr.usedSlots>>ANIM_SEQ_MAX_SEQS))
+	{
+		return false;
+	}
+	const uint8_t* p=buf+sizeof(animSnapshotHeader_t);
+	uint32_t left=size-sizeof(animSnapshotHeader_t);
+	//The blocks of the arena used by the restored sequences (to check that they don't overlap)
+	uint16_t blockStart[ANIM_SEQ_MAX_SEQS];
+	uint16_t blockEnd[ANIM_SEQ_MAX_SEQS];
+	uint8_t nofSeqs=0;
+	for(uint8_t i=0;i<ANIM_SEQ_MAX_SEQS;i++)
+	{
+		if(!(hdr.usedSlots&(1<<i)))
+		{
+			if(apply && animSeqs[i].used)
 			{
-				fadeDone=ledSegGetSyncGroupDone(seg);
-				pulseDone=true;	//Todo: Once we have support for pulse done in sync groups, add this here
+				animSeqDestroy(ANIM_SEQ_HANDLE(i,animSeqs[i].generation));
 			}
-			else
+			continue;
+		}
+		animSequence_t seq;
+		if(left<ANIM_SEQ_STATE_SIZE)
+		{
+			return false;
+		}
+		memcpy(&seq.currentPoint,p,ANIM_SEQ_STATE_SIZE);
+		p+=ANIM_SEQ_STATE_SIZE;
+		left-=ANIM_SEQ_STATE_SIZE;
+		if(!seq.used || seq.generation==0)
+		{
+			return false;
+		}
+		//The block must be within the arena, and not overlap any other block
+		const uintptr_t blockOffset=(uintptr_t)seq.ramPoints;
+		const bool editable=(seq.packed==NULL && seq.generator==NULL && seq.points==NULL);
+		seq.ramPoints=NULL;
+		if(seq.ramCapacity)
+		{
+			if(blockOffset+seq.ramCapacity>ANIM_SEQ_ARENA_POINTS)
 			{
-				//Look ahead and see if the next point has persist. If so, fade/pulse can be considered done
-				uint8_t nextPoint=seq->currentPoint+1;
-				if(nextPoint>=seq->nofPoints)
-				{
-					nextPoint=0;
-				}
-				if(ledSegGetFadeDone(seg) || !seq->points[seq->currentPoint].fadeUsed
-						|| (seq->points[nextPoint].fadePersistFromLast && seq->points[nextPoint].fadeUsed && seq->cyclesLeft!=1))
+				return false;
+			}
+			seq.ramPoints=&animSeqArena[blockOffset];
+			blockStart[nofSeqs]=blockOffset;
+			blockEnd[nofSeqs]=blockStart[nofSeqs]+seq.ramCapacity;
+			for(uint8_t n=0;n<nofSeqs;n++)
+			{
+				if(blockStart[nofSeqs]<blockEnd[n] && blockStart[n]<blockEnd[nofSeqs])
 				{
-					fadeDone=true;
+					return false;
 				}
-				if(ledSegGetPulseDone(seg) || !seq->points[seq->currentPoint].pulseUsed
-						|| (seq->points[nextPoint].pulsePersistFromLast && seq->points[nextPoint].pulseUsed && seq->cyclesLeft!=1))
+			}
+		}
+		else
+		{
+			blockStart[nofSeqs]=0;
+			blockEnd[nofSeqs]=0;
+		}
+		nofSeqs++;
+		if(((seq.packed!=NULL || seq.generator!=NULL) && seq.ramCapacity<2) || (editable && seq.nofPoints>seq.ramCapacity))
+		{
+			return false;
+		}
+		if(editable)
+		{
+			seq.points=seq.ramPoints;
+		}
+		uint16_t first;
+		const uint32_t pointsSize=animSeqSnapshotPoints(&seq,&first)*sizeof(animSeqPoint_t);
+		if(left<pointsSize)
+		{
+			return false;
+		}
+		if(apply)
+		{
+			if(seq.waitReleaseTime)
+			{
+				seq.waitReleaseTime=ledSegGetTime()+seq.waitReleaseTime-1;
+				if(seq.waitReleaseTime==0)
 				{
-					pulseDone=true;
+					seq.waitReleaseTime=1;
 				}
-//				fadeDone=ledSegGetFadeDone(seg);
-//				pulseDone=ledSegGetPulseDone(seg);
 			}
-			if((fadeDone && pulseDone) || seq->points[seq->currentPoint].switchOnTime)
+			animSequence_t* dst=&animSeqs[i];
+			memcpy(&dst->currentPoint,&seq.currentPoint,ANIM_SEQ_STATE_SIZE);
+			if(pointsSize)
 			{
-				//We now know that the point is done. Check if we need to keep waiting.
+				memcpy(&dst->ramPoints[first],p,pointsSize);
+			}
+			//The decoded points are not part of the snapshot
+			dst->packedPoint[0]=ANIM_PACK_NO_POINT;
+			dst->packedPoint[1]=ANIM_PACK_NO_POINT;
+			dst->stepPending=true;	//The segments may have finished in a different way than when the snapshot was taken
+		}
+		p+=pointsSize;
+		left-=pointsSize;
+	}
+	if(nofSeqs!=hdr.nofSeqs)
+	{
+		return false;
+	}
+	//The members must follow restored sequences
+	if(hdr.nofMembers>ANIM_SEQ_MAX_MEMBERS || left<hdr.nofMembers*sizeof(animSeqMember_t))
+	{
+		return false;
+	}
+	for(uint8_t i=0;i<hdr.nofMembers;i++)
+	{
+		animSeqMember_t member;
+		memcpy(&member,p+i*sizeof(animSeqMember_t),sizeof(animSeqMember_t));
+		if(!member.used || member.seqSlot>=ANIM_SEQ_MAX_SEQS || !(hdr.usedSlots&(1<<member.seqSlot)) || !ledSegExistsNotAll(member.seg))
+		{
+			return false;
+		}
+	}
+	if(apply)
+	{
+		memset(animSeqMembers,0,sizeof(animSeqMembers));
+		for(uint8_t i=0;i<hdr.nofMembers;i++)
+		{
+			memcpy(&animSeqMembers[i],p+i*sizeof(animSeqMember_t),sizeof(animSeqMember_t));
+			animSeqMembers[i].loadTime+=ledSegGetTime();
+		}
+		animRandState=hdr.randState;
+	}
+	return true;
+}
 
-				//Check if we are using external trigger and if it's ready
-				bool trigReady=false;
-				//Set trigger to ready, if it's not
-				if(seq->points[seq->currentPoint].waitForTrigger)
-				{
-					if(seq->waitReleaseTrigger == ANIM_TRIG_NOT_READY)
-					{
-						seq->waitReleaseTrigger = ANIM_TRIG_READY;
-					}
-					if(seq->waitReleaseTrigger==ANIM_TRIG_ACTIVATED)
-					{
-						trigReady=true;
-					}
-				}
-				else
-				{
-					trigReady=true;
-				}
-				if(trigReady)
-				{
-					//Check if we have started waiting
-					if(!seq->waitReleaseTime)
-					{
-						seq->waitReleaseTime=seq->points[seq->currentPoint].waitAfter+systemTime;
-					}
-					if(seq->waitReleaseTime <= systemTime)
-					{
-						seq->waitReleaseTime=0;	//Ensure this is done only once (as soon as new settings are loaded, fade and pulse will stop being done)
+/*
+ * Loads the current point into from an animation sequence
+ * Does not change any point state or anything
+ */
+static void animSeqLoadCurrentPoint(animSequence_t* seq, bool firstPoint)
+{
+	//We have updated the current point and checked everything. Load the new segment settings
+	animSeqLoadPoint(seq,seq->seg,seq->currentPoint,firstPoint,&seq->isFadingToNextPoint);
+	//Always reset external trigger state when loading a new point
+	seq->waitReleaseTrigger=ANIM_TRIG_NOT_READY;
+	//The new point may be done right away (for instance if it persists from the last one), which no event will tell
+	//(after a transition, this checks when it's done)
+	seq->stepPending=true;
+	animSeqQueueMembers(seq,firstPoint);
+}
 
-						//We have waited now and the current point is now finished.
-						//Update and check point counter and load a new point accordingly
-						seq->currentPoint++;
-						if(seq->currentPoint>=seq->nofPoints)
-						{
-							//Check cycle counter if we shall continue looping
-							//Cycles==0 means infinite loop
-							if(seq->cyclesLeft==0)
-							{
-								seq->currentPoint=0;
-							}
-							else
-							{
-								seq->cyclesLeft--;
-								if(seq->cyclesLeft)
-								{
-									//We still have cycles left
-									seq->currentPoint=0;
-								}
-								else
-								{
-									seq->isActive=false;
-								}
-							}
-						}
-						if(seq->isActive)
-						{
-							animSeqLoadCurrentPoint(seq,false);
-						}
-					}
-				}
+/*
+ * Loads point n of an animation sequence on a segment (the segment of the sequence, or a member)
+ * isFadingToNextPoint is the flag of the segment, telling if the pulse shall wait for the fade to next point (see animSeqLoadPulseAfterFade)
+ */
+static void animSeqLoadPoint(animSequence_t* seq, uint8_t seg, uint16_t n, bool firstPoint, bool* isFadingToNextPoint)
+{
+	animSeqPoint_t pointTmp=*animSeqGetPoint(seq,n);
+	animSeqPoint_t* point=&pointTmp;
+	if(seq->transitionTime && !firstPoint)
+	{
+		//Transition everything from the previous point. Parts that are kept from the previous point continue unchanged
+		ledSegmentFadeSetting_t* fs=NULL;
+		ledSegmentPulseSetting_t* ps=NULL;
+		if(point->fadeUsed && !point->fadePersistFromLast)
+		{
+			fs=&point->fade;
+		}
+		if(point->pulseUsed && !point->pulsePersistFromLast)
+		{
+			ps=&point->pulse;
+		}
+		ledSegStartTransitionWithType(seg,fs,ps,seq->transitionType,seq->transitionTime,seq->transitionEase);
+		//Parts that are not used are turned off in the new setting only, so they fade out
+		ledSegSetFadeActiveState(seg,point->fadeUsed);
+		ledSegSetPulseActiveState(seg,point->pulseUsed);
+		*isFadingToNextPoint=false;
+		return;
+	}
+	//If mode change fade is used, don't update pulse until we're (Todo: what?)
+	if(point->fadeUsed)
+	{
+		//Check if we shall load a new fade or keep the old one
+		if(!point->fadePersistFromLast)
+		{
+			//Note: This might fuck something up firstPoint
+			if(point->fadeToNext || firstPoint)
+			{
+				animSetModeChange(SIMPLE_COL_NO_CHANGE,&point->fade,seg,point->switchAtMax,0,0,false);
+				*isFadingToNextPoint=true;
 			}
-			if(seq->isFadingToNextPoint && ledSegGetFadeSwitchDone(seg))
+			else if(animSeqHasFadeRates(seq))
 			{
-				if(seq->points[seq->currentPoint].pulseUsed)
-				{
-					if(!seq->points[seq->currentPoint].pulsePersistFromLast)
-					{
-						ledSegmentPulseSetting_t* ps=&(seq->points[seq->currentPoint].pulse);
-						ledSegSetPulse(seg,ps);
-					}
-					else
-					{
-						ledSegSetPulseActiveState(seg,true);
-					}
-				}
-				else
-				{
-					ledSegSetPulseActiveState(seg,false);
-				}
-				seq->isFadingToNextPoint=false;
+				ledSegSetFadeCompiled(seg,&point->fade,&point->fadeRates);
+			}
+			else
+			{
+				ledSegSetFade(seg,&point->fade);
+			}
+		}
+		else
+		{
+			ledSegSetFadeActiveState(seg,true);	//Set fade active, but don't restart or update it
+		}
+	}
+	else
+	{
+		ledSegSetFadeActiveState(seg,false);	//Set fade active, but don't restart or update it
+	}
+	/*
+	 * 4 cases:
+	 * !pActive && !fading - disable pulse immediately
+	 * !pActive && fading - do nothing. Keep existing pulse state until fade is done. Once fade is done, clear existing pulse
+	 * pActive && !fading - update pulse immediately
+	 * pActive && fading - do nothing. Keep existing pulse state until fade is done. Once fade is done, load next pulse
+	 */
+	if(!*isFadingToNextPoint || firstPoint)
+	{
+		if(point->pulseUsed)
+		{
+			//Check if we shall load a new pulse or keep the old one
+			if(!point->pulsePersistFromLast || firstPoint)
+			{
+				ledSegSetPulse(seg,&point->pulse);
+			}
+			else
+			{
+				ledSegSetPulseActiveState(seg,true);
 			}
 		}
-	}	//End of go through animation sequences
+		else
+		{
+			ledSegSetPulseActiveState(seg,false);
+		}
+	}
+}
+
+/*
+ * Loads the pulse of point n on a segment, once the fade to the point is done (see animSeqLoadPoint)
+ */
+static void animSeqLoadPulseAfterFade(animSequence_t* seq, uint8_t seg, uint16_t n, bool* isFadingToNextPoint)
+{
+	const animSeqPoint_t* point=animSeqGetPoint(seq,n);
+	if(point->pulseUsed)
+	{
+		if(!point->pulsePersistFromLast)
+		{
+			ledSegmentPulseSetting_t ps=point->pulse;
+			ledSegSetPulse(seg,&ps);
+		}
+		else
+		{
+			ledSegSetPulseActiveState(seg,true);
+		}
+	}
+	else
+	{
+		ledSegSetPulseActiveState(seg,false);
+	}
+	*isFadingToNextPoint=false;
+}
+
+/*
+ * Gives the point just loaded by a sequence to its members (see animSeqAddMember). The points are only queued, and loaded by animTask when they're due
+ * A member that has not loaded the previous point yet skips it (it's still loaded as the first point, if that one was)
+ */
+static void animSeqQueueMembers(animSequence_t* seq, bool firstPoint)
+{
+	const uint8_t slot=seq-animSeqs;
+	for(uint8_t i=0;i<ANIM_SEQ_MAX_MEMBERS;i++)
+	{
+		animSeqMember_t* m=&animSeqMembers[i];
+		if(!m->used || m->seqSlot!=slot)
+		{
+			continue;
+		}
+		m->firstPoint=(firstPoint || (m->pending && m->firstPoint));
+		m->point=seq->currentPoint;
+		m->loadTime=ledSegGetTime()+m->offset;
+		m->pending=true;
+	}
+}
+
+/*
+ * Makes sure that the sequence and its members don't refer to points that have been removed
+ * A current point that was removed becomes the last point, so the sequence goes on from the first point when it's done. Members do the same.
+ * If there are no points left, pending member points are dropped
+ */
+static void animSeqClampPoints(animSequence_t* seq)
+{
+	const uint8_t slot=seq-animSeqs;
+	const uint16_t last=(seq->nofPoints ? seq->nofPoints-1 : 0);
+	if(seq->currentPoint>last)
+	{
+		seq->currentPoint=last;
+	}
+	if(!seq->nofPoints)
+	{
+		seq->isFadingToNextPoint=false;
+	}
+	for(uint8_t i=0;i<ANIM_SEQ_MAX_MEMBERS;i++)
+	{
+		animSeqMember_t* m=&animSeqMembers[i];
+		if(!m->used || m->seqSlot!=slot)
+		{
+			continue;
+		}
+		if(m->point>last)
+		{
+			m->point=last;
+		}
+		if(m->loadedPoint>last)
+		{
+			m->loadedPoint=last;
+		}
+		if(!seq->nofPoints)
+		{
+			m->pending=false;
+			m->isFadingToNextPoint=false;
+		}
+	}
+}
+
+/*
+ * Loads the pending point of a member of a sequence
+ */
+static void animSeqLoadMember(animSequence_t* seq, animSeqMember_t* member)
+{
+	animSeqLoadPoint(seq,member->seg,member->point,member->firstPoint,&member->isFadingToNextPoint);
+	member->loadedPoint=member->point;
+	member->pending=false;
+}
+
+/*
+ * Returns true if a member has something to load: a pulse that waited for a fade to next point, or a point that is due
+ * deadline is set to the time it was due at
+ */
+static bool animSeqMemberDue(const animSeqMember_t* m, uint32_t now, uint32_t* deadline)
+{
+	if(!m->used)
+	{
+		return false;
+	}
+	if(m->isFadingToNextPoint && ledSegGetFadeSwitchDone(m->seg))
+	{
+		*deadline=now;
+		return true;
+	}
+	if(m->pending && m->loadTime<=now)
+	{
+		*deadline=m->loadTime;
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Does one load for a member that is due (see animSeqMemberDue). The pulse that waited for a fade goes before the next point
+ */
+static void animSeqMemberStep(animSeqMember_t* m)
+{
+	animSequence_t* seq=&animSeqs[m->seqSlot];
+	if(m->isFadingToNextPoint && ledSegGetFadeSwitchDone(m->seg))
+	{
+		animSeqLoadPulseAfterFade(seq,m->seg,m->loadedPoint,&m->isFadingToNextPoint);
+	}
+	else if(m->pending)
+	{
+		animSeqLoadMember(seq,m);
+	}
+}
+
+
+/*
+ * Loads an animation script (see animScriptOp_t) to run on a segment. The script starts right away, and runs from animTask
+ * The code is read in place and never copied, so it must be kept for as long as the script is used (it can be in flash, or a buffer filled from a serial link)
+ * The code is checked when loaded (all instructions complete, and all jumps to the start of an instruction), so it can't make the script run wild
+ * Returns the number of the script, or ANIM_SCRIPT_MAX_SCRIPTS+1 if something went wrong (such as invalid code)
+ */
+uint8_t animScriptLoad(uint8_t seg, const uint8_t* code, uint32_t size)
+{
+	if(code==NULL || size>0xFFFF || !ledSegExists(seg))
+	{
+		return ANIM_SCRIPT_MAX_SCRIPTS+1;
+	}
+	uint32_t pos=0;
+	while(pos<size)
+	{
+		const uint8_t op=code[pos];
+		if(op>=ANIM_OP_NOF_OPS || pos+1+animScriptOpSize[op]>size)
+		{
+			return ANIM_SCRIPT_MAX_SCRIPTS+1;
+		}
+		const uint8_t* args=&code[pos+1];
+		if((op==ANIM_OP_COUNT || op==ANIM_OP_LOOP) && args[0]>=ANIM_SCRIPT_NOF_COUNTERS)
+		{
+			return ANIM_SCRIPT_MAX_SCRIPTS+1;
+		}
+		if((op==ANIM_OP_JUMP && !animScriptIsInstruction(code,size,animScriptRead(args,2)))
+				|| ((op==ANIM_OP_LOOP || op==ANIM_OP_RAND) && !animScriptIsInstruction(code,size,animScriptRead(args+1,2))))
+		{
+			return ANIM_SCRIPT_MAX_SCRIPTS+1;
+		}
+		pos+=1+animScriptOpSize[op];
+	}
+	uint8_t script=0;
+	while(script<ANIM_SCRIPT_MAX_SCRIPTS && animScripts[script].code!=NULL)
+	{
+		script++;
+	}
+	if(script>=ANIM_SCRIPT_MAX_SCRIPTS)
+	{
+		return ANIM_SCRIPT_MAX_SCRIPTS+1;
+	}
+	animScript_t* sc=&animScripts[script];
+	memset(sc,0,sizeof(animScript_t));
+	sc->code=code;
+	sc->size=size;
+	sc->seg=seg;
+	sc->isActive=true;
+	sc->timeBase=ledSegGetTime();
+	return script;
+}
+
+/*
+ * Stops and removes an animation script, so that the slot can be used for another script
+ * If LEDSEG_ALL is given, all scripts are removed
+ */
+bool animScriptFree(uint8_t script)
+{
+	if(script==LEDSEG_ALL)
+	{
+		memset(animScripts,0,sizeof(animScripts));
+		return true;
+	}
+	if(script>=ANIM_SCRIPT_MAX_SCRIPTS || animScripts[script].code==NULL)
+	{
+		return false;
+	}
+	memset(&animScripts[script],0,sizeof(animScript_t));
+	return true;
+}
+
+/*
+ * Pauses (active=false) or continues an animation script
+ * If LEDSEG_ALL is given, this is done for all scripts
+ */
+void animScriptSetActive(uint8_t script, bool active)
+{
+	if(script==LEDSEG_ALL)
+	{
+		for(uint8_t i=0;i<ANIM_SCRIPT_MAX_SCRIPTS;i++)
+		{
+			animScriptSetActive(i,active);
+		}
+		return;
+	}
+	if(script>=ANIM_SCRIPT_MAX_SCRIPTS || animScripts[script].code==NULL)
+	{
+		return;
+	}
+	animScript_t* sc=&animScripts[script];
+	if(active && !sc->isActive)
+	{
+		//A script that ended starts over
+		if(sc->pc>=sc->size)
+		{
+			sc->pc=0;
+		}
+		sc->timeBase=ledSegGetTime();
+	}
+	sc->isActive=active;
+}
+
+/*
+ * Returns true if an animation script is running (it may be waiting)
+ * If LEDSEG_ALL is given, it will return true if any script is running
+ */
+bool animScriptIsActive(uint8_t script)
+{
+	if(script==LEDSEG_ALL)
+	{
+		for(uint8_t i=0;i<ANIM_SCRIPT_MAX_SCRIPTS;i++)
+		{
+			if(animScriptIsActive(i))
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+	if(script>=ANIM_SCRIPT_MAX_SCRIPTS || animScripts[script].code==NULL)
+	{
+		return false;
+	}
+	return animScripts[script].isActive;
+}
+
+/*
+ * Restarts an animation script from the start, with all loop counters cleared
+ */
+void animScriptRestart(uint8_t script)
+{
+	if(script>=ANIM_SCRIPT_MAX_SCRIPTS || animScripts[script].code==NULL)
+	{
+		return;
+	}
+	animScript_t* sc=&animScripts[script];
+	sc->pc=0;
+	sc->wait=ANIM_SCRIPT_WAIT_NONE;
+	sc->triggered=false;
+	memset(sc->counters,0,sizeof(sc->counters));
+	sc->timeBase=ledSegGetTime();
+	sc->isActive=true;
+}
+
+/*
+ * Triggers an animation script that waits for a trigger (ANIM_OP_WAIT_TRIG). It continues on the next animTask
+ * Triggers are ignored if the script is not waiting for one
+ * If LEDSEG_ALL is given, all scripts are triggered
+ */
+void animScriptTrigger(uint8_t script)
+{
+	if(script==LEDSEG_ALL)
+	{
+		for(uint8_t i=0;i<ANIM_SCRIPT_MAX_SCRIPTS;i++)
+		{
+			animScriptTrigger(i);
+		}
+		return;
+	}
+	if(script>=ANIM_SCRIPT_MAX_SCRIPTS || animScripts[script].wait!=ANIM_SCRIPT_WAIT_TRIG)
+	{
+		return;
+	}
+	animScripts[script].triggered=true;
+}
+
+#if ANIM_SCRIPT_ASSEMBLER_ENABLED
+//The maximum number of labels and the maximum length of a word (label, number or mnemonic) in the assembler
+#define ANIM_SCRIPT_MAX_LABELS	16
+#define ANIM_SCRIPT_TOKEN_LEN	16
+
+//The mnemonics of the instructions, in the order of animScriptOp_t
+static const char* const animScriptMnemonics[ANIM_OP_NOF_OPS]=
+{
+	"end","fade","pulse","fadeon","pulseon","seg","wait","waitdone","waittrig","jump","count","loop","rand"
+};
+//The size of each operand of the instructions (ending with 0). The last operand of jump, loop and rand is an address
+static const uint8_t animScriptArgSizes[ANIM_OP_NOF_OPS][14]=
+{
+	{0},
+	{1,1,1,1,1,1,1,4,1,4,1,1,0},
+	{1,1,1,1,2,2,2,2,1,2,2,4,1,0},
+	{1,0},
+	{1,0},
+	{1,0},
+	{4,0},
+	{1,0},
+	{0},
+	{2,0},
+	{1,2,0},
+	{1,2,0},
+	{1,2,0},
+};
+
+/*
+ * Reads the next word of a line into tok. Words are separated by spaces, tabs or commas, and anything after ';' is a comment
+ * Returns false if there are no more words. A word that doesn't fit is returned empty (which is never valid)
+ */
+static bool animAsmToken(const char** p, const char* end, char* tok)
+{
+	const char* c=*p;
+	while(c<end && (*c==' ' || *c=='\t' || *c==',' || *c=='\r'))
+	{
+		c++;
+	}
+	if(c>=end || *c==';')
+	{
+		*p=end;
+		return false;
+	}
+	uint8_t len=0;
+	while(c<end && *c!=' ' && *c!='\t' && *c!=',' && *c!='\r' && *c!=';')
+	{
+		if(len<ANIM_SCRIPT_TOKEN_LEN-1)
+		{
+			tok[len]=*c;
+		}
+		len++;
+		c++;
+	}
+	tok[len<ANIM_SCRIPT_TOKEN_LEN ? len : 0]='\0';
+	*p=c;
+	return true;
+}
+
+/*
+ * Assembles the text form of an animation script into code for animScriptLoad. This is mainly meant to be run on the host, so that shows can be written as text and sent to the target
+ * Each line holds an instruction: the mnemonic (end, fade, pulse, fadeon, pulseon, seg, wait, waitdone, waittrig, jump, count, loop, rand) and its operands, in the order given in animScriptOp_t.
+ * Operands are numbers (decimal, or hex with 0x). Addresses are given as labels, which are defined as "name:" (before an instruction, or on a line of their own). Anything after ';' is a comment.
+ * Example (blinks red three times, then waits for a trigger and starts over):
+ *	start:	count 0 3
+ *	blink:	fade 0 0 0 0 255 0 0 200 1 2 0 0
+ *			waitdone 1
+ *			loop 0 blink
+ *			waittrig
+ *			jump start
+ * If buf is NULL, the needed size is returned. Otherwise the number of bytes written is returned (0 if the text is invalid or buf is too small).
+ */
+uint32_t animScriptAssemble(const char* text, uint8_t* buf, uint32_t size)
+{
+	char labels[ANIM_SCRIPT_MAX_LABELS][ANIM_SCRIPT_TOKEN_LEN];
+	uint16_t labelAddrs[ANIM_SCRIPT_MAX_LABELS];
+	uint8_t nofLabels=0;
+	uint32_t pos=0;
+	if(text==NULL)
+	{
+		return 0;
+	}
+	//The labels are found in the first pass, and the code is written in the second
+	for(uint8_t pass=0;pass<2;pass++)
+	{
+		const char* line=text;
+		pos=0;
+		while(*line)
+		{
+			const char* end=line;
+			while(*end && *end!='\n')
+			{
+				end++;
+			}
+			const char* p=line;
+			line=(*end ? end+1 : end);
+			char tok[ANIM_SCRIPT_TOKEN_LEN];
+			if(!animAsmToken(&p,end,tok))
+			{
+				continue;
+			}
+			const size_t len=strlen(tok);
+			if(len>1 && tok[len-1]==':')
+			{
+				tok[len-1]='\0';
+				if(pass==0)
+				{
+					for(uint8_t i=0;i<nofLabels;i++)
+					{
+						if(!strcmp(labels[i],tok))
+						{
+							return 0;
+						}
+					}
+					if(nofLabels>=ANIM_SCRIPT_MAX_LABELS || pos>0xFFFF)
+					{
+						return 0;
+					}
+					strcpy(labels[nofLabels],tok);
+					labelAddrs[nofLabels]=pos;
+					nofLabels++;
+				}
+				if(!animAsmToken(&p,end,tok))
+				{
+					continue;
+				}
+			}
+			uint8_t op=0;
+			while(op<ANIM_OP_NOF_OPS && strcmp(tok,animScriptMnemonics[op]))
+			{
+				op++;
+			}
+			if(op>=ANIM_OP_NOF_OPS)
+			{
+				return 0;
+			}
+			const bool write=(pass==1 && buf!=NULL);
+			if(write)
+			{
+				if(pos+1+animScriptOpSize[op]>size)
+				{
+					return 0;
+				}
+				buf[pos]=op;
+			}
+			uint32_t argPos=pos+1;
+			for(uint8_t a=0;animScriptArgSizes[op][a];a++)
+			{
+				if(!animAsmToken(&p,end,tok))
+				{
+					return 0;
+				}
+				uint32_t value=0;
+				const bool isAddr=((op==ANIM_OP_JUMP || op==ANIM_OP_LOOP || op==ANIM_OP_RAND) && !animScriptArgSizes[op][a+1]);
+				if(isAddr)
+				{
+					if(pass==1)
+					{
+						uint8_t i=0;
+						while(i<nofLabels && strcmp(labels[i],tok))
+						{
+							i++;
+						}
+						if(i>=nofLabels)
+						{
+							return 0;
+						}
+						value=labelAddrs[i];
+					}
+				}
+				else
+				{
+					char* numEnd;
+					value=strtoul(tok,&numEnd,0);
+					if(numEnd==tok || *numEnd)
+					{
+						return 0;
+					}
+				}
+				for(uint8_t b=0;b<animScriptArgSizes[op][a];b++)
+				{
+					if(write)
+					{
+						buf[argPos]=(uint8_t)(value>>(8*b));
+					}
+					argPos++;
+				}
+			}
+			//Too many operands
+			if(animAsmToken(&p,end,tok))
+			{
+				return 0;
+			}
+			pos=argPos;
+		}
+	}
+	if(pos>0xFFFF)
+	{
+		return 0;
+	}
+	return pos;
+}
+#endif
+
+/*
+ * The main task that handles all time stepping things
+ * that I didn't want to put into the regular ledSegment loop
+ * Sequences are only checked when the segments they wait for raise completion events (see ledSegAddEventCallback), or when a wait time or trigger is due,
+ * so it's cheap to call as often as possible.
+ * At most ANIM_TASK_MAX_STEPS loads are done per call (loading a point can be heavy), starting with the most overdue one. The rest are left for the next call
+ * A load is a step of a sequence, or a point (or a pulse waiting for a fade) of a member (see animSeqAddMember)
+ * If the events can't be used (all event callbacks are taken), all sequences are instead polled every ANIM_TASK_PERIOD
+ * The animation scripts run on every call (see animScriptLoad)
+ */
+void animTask()
+{
+	static bool eventsUsed=false;
+	static uint32_t nextPollTime=0;
+	static uint8_t cursor=0;	//The sequence to start looking from (so that sequences with the same deadline take turns)
+	static uint8_t memberCursor=0;	//The same, for the members
+	const uint32_t now=ledSegGetTime();
+	bool checkSeqs=true;
+	animScriptRun();
+	if(!eventsUsed)
+	{
+		eventsUsed=ledSegAddEventCallback(animSeqHandleEvent);
+		//The clock may have been moved back (see ledSegSetClock)
+		if(!eventsUsed && now < nextPollTime && nextPollTime <= now+ANIM_TASK_PERIOD)
+		{
+			checkSeqs=false;	//Only the members are run until the next poll
+		}
+		else
+		{
+			nextPollTime=now+ANIM_TASK_PERIOD;
+			//Everything is checked once (anything that was done before the events were used was never told)
+			for(uint8_t i=0;i<ANIM_SEQ_MAX_SEQS;i++)
+			{
+				animSeqs[i].stepPending=animSeqs[i].used;
+			}
+		}
+	}
+	for(uint8_t step=0;step<ANIM_TASK_MAX_STEPS;step++)
+	{
+		//Find the sequence with the earliest deadline. A sequence that shall be checked has the deadline now, and an expired wait time has the deadline when it expired
+		uint8_t next=ANIM_SEQ_MAX_SEQS;
+		uint32_t nextDeadline=0;
+		for(uint8_t n=0;n<ANIM_SEQ_MAX_SEQS && checkSeqs;n++)
+		{
+			const uint8_t i=(cursor+n)%ANIM_SEQ_MAX_SEQS;
+			const animSequence_t* seq=&animSeqs[i];
+			if(!seq->used)
+			{
+				continue;
+			}
+			uint32_t deadline=now;
+			if(seq->waitReleaseTime && seq->waitReleaseTime<=now)
+			{
+				deadline=seq->waitReleaseTime;
+			}
+			else if(!seq->stepPending)
+			{
+				continue;
+			}
+			if(next==ANIM_SEQ_MAX_SEQS || deadline<nextDeadline)
+			{
+				next=i;
+				nextDeadline=deadline;
+			}
+		}
+		//The same for the members
+		uint8_t nextMember=ANIM_SEQ_MAX_MEMBERS;
+		uint32_t memberDeadline=0;
+		for(uint8_t n=0;n<ANIM_SEQ_MAX_MEMBERS;n++)
+		{
+			const uint8_t i=(memberCursor+n)%ANIM_SEQ_MAX_MEMBERS;
+			uint32_t deadline=0;
+			if(animSeqMemberDue(&animSeqMembers[i],now,&deadline) && (nextMember==ANIM_SEQ_MAX_MEMBERS || deadline<memberDeadline))
+			{
+				nextMember=i;
+				memberDeadline=deadline;
+			}
+		}
+		if(next==ANIM_SEQ_MAX_SEQS && nextMember==ANIM_SEQ_MAX_MEMBERS)
+		{
+			return;
+		}
+		if(nextMember!=ANIM_SEQ_MAX_MEMBERS && (next==ANIM_SEQ_MAX_SEQS || memberDeadline<=nextDeadline))
+		{
+			animSeqMemberStep(&animSeqMembers[nextMember]);
+			memberCursor=nextMember+1;
+		}
+		else
+		{
+			animSeqStep(&animSeqs[next]);
+			cursor=next+1;
+		}
+	}
+}
+
+/*
+ * Receives the completion events from the segments, and marks the sequences running on the segment to be checked by animTask
+ * (the sequences are not stepped here, so that the work done in each call to animTask stays bounded)
+ */
+static void animSeqHandleEvent(uint8_t seg, ledSegmentEvent_t event)
+{
+	//The end of a single fade cycle doesn't change if a point is done
+	if(event==LEDSEG_EVENT_FADE_CYCLE_DONE)
+	{
+		return;
+	}
+	for(uint8_t i=0;i<ANIM_SEQ_MAX_SEQS;i++)
+	{
+		animSequence_t* seq=&animSeqs[i];
+		if(!seq->used)
+		{
+			continue;
+		}
+		bool affected=(seq->seg==seg || seq->seg==LEDSEG_ALL || seg==LEDSEG_ALL);
+		if(seq->isSyncGroup)
+		{
+			affected=(seg==LEDSEG_ALL || ledSegGetSyncGroup(seg)==seq->seg);
+		}
+		if(affected)
+		{
+			seq->stepPending=true;
+		}
+	}
+}
+
+/*
+ * Checks if the current point of a sequence is done, and loads the next point if it is
+ */
+static void animSeqStep(animSequence_t* seq)
+{
+	seq->stepPending=false;
+	if(seq->isActive && (seq->nofPoints>0))
+	{
+		const uint8_t seg=seq->seg;
+		const bool isSyncGrp=seq->isSyncGroup;
+
+		//Check if fade and pulse and done (and if the entire segment/syncGroup is done). If not, next.
+		bool fadeDone=false;
+		bool pulseDone=false;
+		if(isSyncGrp)
+		{
+			fadeDone=ledSegGetSyncGroupDone(seg);
+			pulseDone=true;	//Todo: Once we have support for pulse done in sync groups, add this here
+		}
+		else
+		{
+			//Look ahead and see if the next point has persist. If so, fade/pulse can be considered done
+			uint16_t nextPoint=seq->currentPoint+1;
+			if(nextPoint>=seq->nofPoints)
+			{
+				nextPoint=0;
+			}
+			const animSeqPoint_t* current=animSeqGetPoint(seq,seq->currentPoint);
+			const animSeqPoint_t* next=animSeqGetPoint(seq,nextPoint);
+			if(ledSegGetFadeDone(seg) || !current->fadeUsed
+					|| (next->fadePersistFromLast && next->fadeUsed && seq->cyclesLeft!=1))
+			{
+				fadeDone=true;
+			}
+			if(ledSegGetPulseDone(seg) || !current->pulseUsed
+					|| (next->pulsePersistFromLast && next->pulseUsed && seq->cyclesLeft!=1))
+			{
+				pulseDone=true;
+			}
+//				fadeDone=ledSegGetFadeDone(seg);
+//				pulseDone=ledSegGetPulseDone(seg);
+		}
+		const animSeqPoint_t* point=animSeqGetPoint(seq,seq->currentPoint);
+		if((fadeDone && pulseDone) || point->switchOnTime)
+		{
+			//We now know that the point is done. Check if we need to keep waiting.
+
+			//Check if we are using external trigger and if it's ready
+			bool trigReady=false;
+			//Set trigger to ready, if it's not
+			if(point->waitForTrigger)
+			{
+				if(seq->waitReleaseTrigger == ANIM_TRIG_NOT_READY)
+				{
+					seq->waitReleaseTrigger = ANIM_TRIG_READY;
+				}
+				if(seq->waitReleaseTrigger==ANIM_TRIG_ACTIVATED)
+				{
+					trigReady=true;
+				}
+			}
+			else
+			{
+				trigReady=true;
+			}
+			if(trigReady)
+			{
+				//Check if we have started waiting
+				if(!seq->waitReleaseTime)
+				{
+					seq->waitReleaseTime=point->waitAfter+ledSegGetTime();
+					if(seq->onBeat)
+					{
+						seq->waitReleaseTime=animBeatQuantise(seq->waitReleaseTime);
+					}
+				}
+				if(seq->waitReleaseTime <= ledSegGetTime())
+				{
+					seq->waitReleaseTime=0;	//Ensure this is done only once (as soon as new settings are loaded, fade and pulse will stop being done)
+
+					//We have waited now and the current point is now finished.
+					//Update and check point counter and load a new point accordingly
+					seq->currentPoint++;
+					if(seq->currentPoint>=seq->nofPoints)
+					{
+						//Check cycle counter if we shall continue looping
+						//Cycles==0 means infinite loop
+						if(seq->cyclesLeft==0)
+						{
+							seq->currentPoint=0;
+						}
+						else
+						{
+							seq->cyclesLeft--;
+							if(seq->cyclesLeft)
+							{
+								//We still have cycles left
+								seq->currentPoint=0;
+							}
+							else
+							{
+								seq->isActive=false;
+							}
+						}
+					}
+					if(seq->isActive)
+					{
+						animSeqLoadCurrentPoint(seq,false);
+					}
+				}
+			}
+		}
+		if(seq->isFadingToNextPoint && ledSegGetFadeSwitchDone(seg))
+		{
+			//The current point may have changed above
+			animSeqLoadPulseAfterFade(seq,seg,seq->currentPoint,&seq->isFadingToNextPoint);
+		}
+	}
+}
+
+/*
+ * Returns point n of a sequence
+ * For compact sequences, the point is decoded into one of two slots (the one not holding the current point), starting from the closest decoded point before it.
+ * Generated sequences use the same two slots, but make the point from scratch.
+ * The returned point is valid until the next call (for another point). Going through the points in order only decodes one point at a time
+ */
+static const animSeqPoint_t* animSeqGetPoint(animSequence_t* seq, uint16_t n)
+{
+	if(seq->packed==NULL && seq->generator==NULL)
+	{
+		return &seq->points[n];
+	}
+	//The decoded points are kept in the block of the sequence in the arena
+	animSeqPoint_t* decodedPoints=seq->ramPoints;
+	for(uint8_t i=0;i<2;i++)
+	{
+		if(seq->packedPoint[i]==n)
+		{
+			return &decodedPoints[i];
+		}
+	}
+	uint8_t slot=0;
+	if(seq->packedPoint[0]==seq->currentPoint && n!=seq->currentPoint)
+	{
+		slot=1;
+	}
+	animSeqPoint_t* pt=&decodedPoints[slot];
+	if(seq->generator!=NULL)
+	{
+		memset(pt,0,sizeof(animSeqPoint_t));
+		seq->generator(ANIM_SEQ_GEN_STATE(seq),n,pt);
+		ledSegCompileFade(&pt->fade,&pt->fadeRates);
+		seq->packedPoint[slot]=n;
+		return pt;
+	}
+	//Start from a decoded point before n if there is one, otherwise from the first point
+	uint8_t start=2;
+	for(uint8_t i=0;i<2;i++)
+	{
+		if(seq->packedPoint[i]<n && (start==2 || seq->packedPoint[i]>seq->packedPoint[start]))
+		{
+			start=i;
+		}
+	}
+	uint16_t decoded=ANIM_PACK_NO_POINT;
+	uint32_t pos=0;
+	if(start==2)
+	{
+		memset(pt,0,sizeof(animSeqPoint_t));
+	}
+	else
+	{
+		decoded=seq->packedPoint[start];
+		pos=seq->packedNext[start];
+		if(start!=slot)
+		{
+			memcpy(pt,&decodedPoints[start],sizeof(animSeqPoint_t));
+		}
+	}
+	//The data was checked when the sequence was set up, so it can always be decoded
+	while(decoded!=n)
+	{
+		pos+=animUnpackPoint(seq->packed+pos,seq->packedSize-pos,pt);
+		decoded++;	//Wraps from ANIM_PACK_NO_POINT to 0
+	}
+	ledSegCompileFade(&pt->fade,&pt->fadeRates);
+	seq->packedPoint[slot]=n;
+	seq->packedNext[slot]=pos;
+	return pt;
+}
+
+/*
+ * Returns the flags (all bools) of a point, as stored in the compact format
+ */
+static uint8_t animPackFlags(const animSeqPoint_t* point)
+{
+	return point->fadeUsed | point->fadePersistFromLast<<1 | point->pulseUsed<<2 | point->pulsePersistFromLast<<3 |
+			point->waitForTrigger<<4 | point->switchAtMax<<5 | point->fadeToNext<<6 | point->switchOnTime<<7;
+}
+
+/*
+ * Decodes a compact point on top of the previous point (the data must be packed by the same build, see animSeqPack)
+ * Returns the size of the compact point, or 0 if it doesn't fit in size
+ */
+static uint32_t animUnpackPoint(const uint8_t* buf, uint32_t size, animSeqPoint_t* point)
+{
+	uint32_t mask;
+	if(size<ANIM_PACK_POINT_HEADER_SIZE)
+	{
+		return 0;
+	}
+	memcpy(&mask,buf,sizeof(uint32_t));
+	const uint8_t flags=buf[sizeof(uint32_t)];
+	uint32_t pos=ANIM_PACK_POINT_HEADER_SIZE;
+	for(uint8_t f=0;f<ANIM_PACK_NOF_FIELDS;f++)
+	{
+		if(mask&(1UL<<f))
+		{
+			if(pos+animPackFields[f].size>size)
+			{
+				return 0;
+			}
+			memcpy(((uint8_t*)point)+animPackFields[f].offset,buf+pos,animPackFields[f].size);
+			pos+=animPackFields[f].size;
+		}
+	}
+	point->fadeUsed=flags&1;
+	point->fadePersistFromLast=(flags>>1)&1;
+	point->pulseUsed=(flags>>2)&1;
+	point->pulsePersistFromLast=(flags>>3)&1;
+	point->waitForTrigger=(flags>>4)&1;
+	point->switchAtMax=(flags>>5)&1;
+	point->fadeToNext=(flags>>6)&1;
+	point->switchOnTime=(flags>>7)&1;
+	return pos;
+}
+
+/*
+ * Returns the sequence a handle refers to, or NULL if the handle is not valid (or LEDSEG_ALL)
+ */
+static animSequence_t* animSeqGet(animSeqHandle_t seqNum)
+{
+	const uint8_t slot=ANIM_SEQ_HANDLE_SLOT(seqNum);
+	if(slot>=ANIM_SEQ_MAX_SEQS || !animSeqs[slot].used || animSeqs[slot].generation!=ANIM_SEQ_HANDLE_GEN(seqNum))
+	{
+		return NULL;
+	}
+	return &animSeqs[slot];
+}
+
+/*
+ * Loads the settings and points of a sequence, and resets its state
+ * The points are copied into the block of the sequence in the arena, which is resized to fit them. The slot of the pool is kept
+ * Returns false if there is not enough room in the arena (the sequence is then unchanged)
+ */
+static bool animSeqSetup(animSequence_t* seq, uint8_t seg, bool isSyncGroup, uint32_t cycles, const animSeqPoint_t* points, uint16_t nofPoints)
+{
+	if(!animArenaResize(seq,nofPoints))
+	{
+		return false;
+	}
+	const bool used=seq->used;
+	const uint8_t generation=seq->generation;
+	animSeqPoint_t* ramPoints=seq->ramPoints;
+	const uint16_t ramCapacity=seq->ramCapacity;
+	memset(seq,0,sizeof(animSequence_t));
+	seq->used=used;
+	seq->generation=generation;
+	seq->ramPoints=ramPoints;
+	seq->ramCapacity=ramCapacity;
+	seq->points=ramPoints;
+	seq->cyclesSetting=cycles;
+	seq->cyclesLeft=cycles;
+	seq->currentPoint=0;
+	seq->isFadingToNextPoint=false;
+	seq->isSyncGroup=isSyncGroup;
+	seq->nofPoints=nofPoints;
+	seq->seg=seg;
+	seq->waitReleaseTime=0;
+	if(nofPoints)
+	{
+		memcpy(seq->ramPoints,points,nofPoints*sizeof(animSeqPoint_t));
+		for(uint16_t i=0;i<nofPoints;i++)
+		{
+			ledSegCompileFade(&seq->ramPoints[i].fade,&seq->ramPoints[i].fadeRates);
+		}
+	}
+	return true;
+}
+
+/*
+ * Returns true if the points of a sequence are owned by the sequence (in the arena) and can be changed
+ */
+static bool animSeqIsEditable(const animSequence_t* seq)
+{
+	return seq->packed==NULL && seq->generator==NULL && seq->points==seq->ramPoints;
+}
+
+/*
+ * Returns true if the fade rates of the points of a sequence are calculated (see ledSegCompileFade)
+ * This is done for points in the arena, and for decoded and generated points. Points kept by the caller (such as in flash) can't be changed
+ */
+static bool animSeqHasFadeRates(const animSequence_t* seq)
+{
+	return seq->packed!=NULL || seq->generator!=NULL || seq->points==seq->ramPoints;
+}
+
+/*
+ * Returns the number of points of the block of a sequence that are stored in a snapshot, and sets first to where they start in the block
+ * These are the points owned by the sequence, or the state of a generated sequence. Decoded and generated points are not stored
+ */
+static uint16_t animSeqSnapshotPoints(const animSequence_t* seq, uint16_t* first)
+{
+	*first=0;
+	if(seq->generator!=NULL)
+	{
+		*first=2;
+		return seq->ramCapacity-2;
+	}
+	if(animSeqIsEditable(seq))
+	{
+		return seq->nofPoints;
+	}
+	return 0;
+}
+
+/*
+ * Sets up a generated sequence, with room for a state of stateSize bytes after the two generated points (see animSeqInitGenerator). The state is cleared
+ * If existingSeq is an existing sequence it's re-used, otherwise a new one is made. An existing sequence is unchanged if there's no room for the state
+ * Returns the handle of the sequence, or ANIM_SEQ_MAX_SEQS+1 if something went wrong
+ */
+static animSeqHandle_t animSeqSetupGenerator(animSeqHandle_t existingSeq, uint8_t seg, bool isSyncGroup, uint32_t cycles, animSeqGenerator_t generator, uint32_t stateSize, uint16_t nofPoints)
+{
+	const uint32_t blockSize=2+(stateSize+sizeof(animSeqPoint_t)-1)/sizeof(animSeqPoint_t);
+	if(generator==NULL || nofPoints>=ANIM_PACK_NO_POINT || blockSize>ANIM_SEQ_ARENA_POINTS || !ledSegExists(seg))
+	{
+		return ANIM_SEQ_MAX_SEQS+1;
+	}
+	animSeqHandle_t seqNum=existingSeq;
+	animSequence_t* seq=animSeqGet(existingSeq);
+	if(seq!=NULL)
+	{
+		if(animSeqGetArenaPoints(LEDSEG_ALL)+seq->ramCapacity<blockSize)
+		{
+			return ANIM_SEQ_MAX_SEQS+1;
+		}
+		animSeqSetup(seq,seg,isSyncGroup,cycles,NULL,0);
+	}
+	else
+	{
+		seqNum=animSeqInit(seg,isSyncGroup,cycles,NULL,0);
+		seq=animSeqGet(seqNum);
+		if(seq==NULL)
+		{
+			return ANIM_SEQ_MAX_SEQS+1;
+		}
+	}
+	seq->generator=generator;
+	if(!animArenaResize(seq,blockSize))
+	{
+		animSeqDestroy(seqNum);
+		return ANIM_SEQ_MAX_SEQS+1;
+	}
+	memset(ANIM_SEQ_GEN_STATE(seq),0,(blockSize-2)*sizeof(animSeqPoint_t));
+	seq->nofPoints=nofPoints;
+	seq->packedPoint[0]=ANIM_PACK_NO_POINT;
+	seq->packedPoint[1]=ANIM_PACK_NO_POINT;
+	return seqNum;
+}
+
+/*
+ * Changes the number of points a sequence has room for in the arena, keeping the points that fit
+ * Shrinking is done in place. Growing uses a free part of the arena that fits (preferably in place), or compacts the arena if the free points are spread out
+ * Returns false if there are not enough free points in the arena (the sequence is then unchanged)
+ */
+static bool animArenaResize(animSequence_t* seq, uint16_t nofPoints)
+{
+	if(nofPoints==0)
+	{
+		animArenaSetBlock(seq,NULL,0);
+		return true;
+	}
+	if(nofPoints<=seq->ramCapacity)
+	{
+		animArenaSetBlock(seq,seq->ramPoints,nofPoints);
+		return true;
+	}
+	if(nofPoints>ANIM_SEQ_ARENA_POINTS)
+	{
+		return false;
+	}
+	uint16_t freePoints=ANIM_SEQ_ARENA_POINTS-nofPoints;
+	for(uint8_t i=0;i<ANIM_SEQ_MAX_SEQS;i++)
+	{
+		if(&animSeqs[i]!=seq)
+		{
+			if(animSeqs[i].ramCapacity>freePoints)
+			{
+				return false;
+			}
+			freePoints-=animSeqs[i].ramCapacity;
+		}
+	}
+	//Look for a free part, starting where the block is now, then at the start of the arena and after each other block
+	uint16_t start=ANIM_SEQ_ARENA_POINTS;
+	if(seq->ramCapacity && animArenaIsFree(seq,seq->ramPoints-animSeqArena,nofPoints))
+	{
+		start=seq->ramPoints-animSeqArena;
+	}
+	for(uint8_t i=0;i<=ANIM_SEQ_MAX_SEQS && start==ANIM_SEQ_ARENA_POINTS;i++)
+	{
+		uint16_t candidate=0;
+		if(i<ANIM_SEQ_MAX_SEQS)
+		{
+			if(&animSeqs[i]==seq || !animSeqs[i].ramCapacity)
+			{
+				continue;
+			}
+			candidate=(animSeqs[i].ramPoints-animSeqArena)+animSeqs[i].ramCapacity;
+		}
+		if(animArenaIsFree(seq,candidate,nofPoints))
+		{
+			start=candidate;
+		}
+	}
+	if(start==ANIM_SEQ_ARENA_POINTS)
+	{
+		start=animArenaCompact(seq,nofPoints);
+	}
+	else if(seq->ramCapacity)
+	{
+		memmove(&animSeqArena[start],seq->ramPoints,seq->ramCapacity*sizeof(animSeqPoint_t));
+	}
+	animArenaSetBlock(seq,&animSeqArena[start],nofPoints);
+	return true;
+}
+
+/*
+ * Returns true if a part of the arena is not used by any other sequence than seq
+ */
+static bool animArenaIsFree(const animSequence_t* seq, uint16_t start, uint16_t nofPoints)
+{
+	if(start+nofPoints>ANIM_SEQ_ARENA_POINTS)
+	{
+		return false;
+	}
+	for(uint8_t i=0;i<ANIM_SEQ_MAX_SEQS;i++)
+	{
+		const animSequence_t* other=&animSeqs[i];
+		if(other==seq || !other->ramCapacity)
+		{
+			continue;
+		}
+		const uint16_t otherStart=other->ramPoints-animSeqArena;
+		if(start<otherStart+other->ramCapacity && otherStart<start+nofPoints)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Moves all blocks to the start of the arena (in order), and makes room for the block of seq to grow to nofPoints
+ * Returns the start of the block of seq (the points of seq are kept)
+ */
+static uint16_t animArenaCompact(animSequence_t* seq, uint16_t nofPoints)
+{
+	uint16_t used=0;
+	while(1)
+	{
+		//Take the first block that is not moved yet
+		animSequence_t* next=NULL;
+		for(uint8_t i=0;i<ANIM_SEQ_MAX_SEQS;i++)
+		{
+			animSequence_t* s=&animSeqs[i];
+			if(s->ramCapacity && s->ramPoints>=&animSeqArena[used] && (next==NULL || s->ramPoints<next->ramPoints))
+			{
+				next=s;
+			}
+		}
+		if(next==NULL)
+		{
+			break;
+		}
+		memmove(&animSeqArena[used],next->ramPoints,next->ramCapacity*sizeof(animSeqPoint_t));
+		animArenaSetBlock(next,&animSeqArena[used],next->ramCapacity);
+		used+=next->ramCapacity;
+	}
+	if(!seq->ramCapacity)
+	{
+		return used;
+	}
+	//Move the blocks after seq up, to make room for it to grow
+	const uint16_t start=seq->ramPoints-animSeqArena;
+	const uint16_t end=start+seq->ramCapacity;
+	const uint16_t grow=nofPoints-seq->ramCapacity;
+	memmove(&animSeqArena[end+grow],&animSeqArena[end],(used-end)*sizeof(animSeqPoint_t));
+	for(uint8_t i=0;i<ANIM_SEQ_MAX_SEQS;i++)
+	{
+		animSequence_t* s=&animSeqs[i];
+		if(s->ramCapacity && s->ramPoints>seq->ramPoints)
+		{
+			animArenaSetBlock(s,s->ramPoints+grow,s->ramCapacity);
+		}
+	}
+	return start;
+}
+
+/*
+ * Sets the block of the arena owned by a sequence. The points of the sequence follow the block (except for compact sequences, which only decode into it)
+ */
+static void animArenaSetBlock(animSequence_t* seq, animSeqPoint_t* block, uint16_t capacity)
+{
+	if(animSeqIsEditable(seq))
+	{
+		seq->points=block;
+	}
+	seq->ramPoints=block;
+	seq->ramCapacity=capacity;
+}
+
+/*
+ * Runs the animation scripts that are done waiting, up to ANIM_SCRIPT_MAX_STEPS instructions each
+ */
+static void animScriptRun()
+{
+	for(uint8_t i=0;i<ANIM_SCRIPT_MAX_SCRIPTS;i++)
+	{
+		animScript_t* sc=&animScripts[i];
+		if(sc->code==NULL || !sc->isActive)
+		{
+			continue;
+		}
+		if(sc->wait==ANIM_SCRIPT_WAIT_TIME)
+		{
+			if(ledSegGetTime()<sc->waitUntil)
+			{
+				continue;
+			}
+			sc->timeBase=sc->waitUntil;
+		}
+		else if(sc->wait==ANIM_SCRIPT_WAIT_DONE)
+		{
+			if(((sc->waitMask&1) && !ledSegGetFadeDone(sc->seg)) || ((sc->waitMask&2) && !ledSegGetPulseDone(sc->seg)))
+			{
+				continue;
+			}
+			sc->timeBase=ledSegGetTime();
+		}
+		else if(sc->wait==ANIM_SCRIPT_WAIT_TRIG)
+		{
+			if(!sc->triggered)
+			{
+				continue;
+			}
+			sc->triggered=false;
+			sc->timeBase=ledSegGetTime();
+		}
+		sc->wait=ANIM_SCRIPT_WAIT_NONE;
+		for(uint8_t step=0;step<ANIM_SCRIPT_MAX_STEPS && sc->isActive && sc->wait==ANIM_SCRIPT_WAIT_NONE;step++)
+		{
+			animScriptStep(sc);
+		}
+	}
+}
+
+/*
+ * Runs one instruction of an animation script
+ */
+static void animScriptStep(animScript_t* sc)
+{
+	if(sc->pc>=sc->size)
+	{
+		sc->isActive=false;
+		return;
+	}
+	const uint8_t op=sc->code[sc->pc];
+	const uint8_t* args=&sc->code[sc->pc+1];
+	sc->pc+=1+animScriptOpSize[op];
+	switch(op)
+	{
+		case ANIM_OP_FADE:
+		{
+			ledSegmentFadeSetting_t fs;
+			memset(&fs,0,sizeof(ledSegmentFadeSetting_t));
+			fs.mode=args[0];
+			fs.r_min=args[1];
+			fs.g_min=args[2];
+			fs.b_min=args[3];
+			fs.r_max=args[4];
+			fs.g_max=args[5];
+			fs.b_max=args[6];
+			fs.fadeTime=animScriptRead(args+7,4);
+			fs.startDir=(int8_t)args[11];
+			fs.cycles=animScriptRead(args+12,4);
+			fs.globalSetting=args[16];
+			fs.syncGroup=args[17];
+			ledSegSetFade(sc->seg,&fs);
+			break;
+		}
+		case ANIM_OP_PULSE:
+		{
+			ledSegmentPulseSetting_t ps;
+			memset(&ps,0,sizeof(ledSegmentPulseSetting_t));
+			ps.mode=args[0];
+			ps.r_max=args[1];
+			ps.g_max=args[2];
+			ps.b_max=args[3];
+			ps.ledsMaxPower=animScriptRead(args+4,2);
+			ps.ledsFadeBefore=animScriptRead(args+6,2);
+			ps.ledsFadeAfter=animScriptRead(args+8,2);
+			ps.startLed=(int16_t)animScriptRead(args+10,2);
+			ps.startDir=(int8_t)args[12];
+			ps.pixelsPerIteration=animScriptRead(args+13,2);
+			ps.pixelTime=animScriptRead(args+15,2);
+			ps.cycles=animScriptRead(args+17,4);
+			ps.globalSetting=args[21];
+			ledSegSetPulse(sc->seg,&ps);
+			break;
+		}
+		case ANIM_OP_FADE_ACTIVE:
+			ledSegSetFadeActiveState(sc->seg,args[0]);
+			break;
+		case ANIM_OP_PULSE_ACTIVE:
+			ledSegSetPulseActiveState(sc->seg,args[0]);
+			break;
+		case ANIM_OP_SEG:
+			sc->seg=args[0];
+			break;
+		case ANIM_OP_WAIT:
+			sc->waitUntil=sc->timeBase+animScriptRead(args,4);
+			sc->wait=ANIM_SCRIPT_WAIT_TIME;
+			break;
+		case ANIM_OP_WAIT_DONE:
+			sc->waitMask=args[0];
+			sc->wait=ANIM_SCRIPT_WAIT_DONE;
+			break;
+		case ANIM_OP_WAIT_TRIG:
+			sc->triggered=false;
+			sc->wait=ANIM_SCRIPT_WAIT_TRIG;
+			break;
+		case ANIM_OP_JUMP:
+			sc->pc=animScriptRead(args,2);
+			break;
+		case ANIM_OP_COUNT:
+			sc->counters[args[0]]=animScriptRead(args+1,2);
+			break;
+		case ANIM_OP_LOOP:
+			if(sc->counters[args[0]])
+			{
+				sc->counters[args[0]]--;
+			}
+			if(sc->counters[args[0]])
+			{
+				sc->pc=animScriptRead(args+1,2);
+			}
+			break;
+		case ANIM_OP_RAND:
+			if(ledSegRandRange(&animRandState,256)<args[0])
+			{
+				sc->pc=animScriptRead(args+1,2);
+			}
+			break;
+		default:	//ANIM_OP_END
+			sc->isActive=false;
+			sc->pc=sc->size;
+			break;
+	}
+}
+
+/*
+ * Returns true if an instruction of a script starts at addr
+ */
+static bool animScriptIsInstruction(const uint8_t* code, uint32_t size, uint32_t addr)
+{
+	uint32_t pos=0;
+	while(pos<addr && pos<size)
+	{
+		if(code[pos]>=ANIM_OP_NOF_OPS)
+		{
+			return false;
+		}
+		pos+=1+animScriptOpSize[code[pos]];
+	}
+	return (pos==addr && pos<size);
+}
+
+/*
+ * Reads a little endian operand of a script
+ */
+static uint32_t animScriptRead(const uint8_t* p, uint8_t bytes)
+{
+	uint32_t value=0;
+	for(uint8_t i=0;i<bytes;i++)
+	{
+		value|=((uint32_t)p[i])<<(8*i);
+	}
+	return value;
 }
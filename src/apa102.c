@@ -23,7 +23,7 @@ union flatPixel_u
 
 //Contains information about all the pixels
 //First pixel is the start frame (all 0) and the last frame is the stop frame (all 1)
-static apa102Pixel_t pixels[APA_NOF_STRIPS][APA_MAX_NOF_LEDS+2];
+static apa102Pixel_t pixels[APA_NOF_STRIPS][APA_MAX_NOF_LEDS+2] __attribute__((aligned(4)));	//Aligned so that a pixel can be written as a single word
 //The number of pixels currently used
 static uint16_t currentNofPixels[APA_NOF_STRIPS];
 //Indicates if we actually need to update
@@ -449,6 +449,8 @@ void apa102FillRange(uint8_t strip, uint16_t start, uint16_t stop, uint8_t r, ui
 	{
 		return;
 	}
+#ifdef APA_ENABLE_SCALING
+	//Scaling is done per pixel, so each pixel must be set on its own
 	do
 	{
 		if(global == 0 || global>APA_MAX_GLOBAL_SETTING)
@@ -461,6 +463,27 @@ void apa102FillRange(uint8_t strip, uint16_t start, uint16_t stop, uint8_t r, ui
 		}
 		start++;
 	}while(start<=stop);
+#else
+	//Build the complete pixel once, and write it as a single word to all pixels
+	union flatPixel_u fp;
+	fp.pix.r=r;
+	fp.pix.g=g;
+	fp.pix.b=b;
+	if(global == 0 || global>APA_MAX_GLOBAL_SETTING)
+	{
+		fp.pix.global=defaultGlobal;
+	}
+	else
+	{
+		fp.pix.global=APA_ADD_GLOBAL_BITS(global);
+	}
+	union flatPixel_u* px=(union flatPixel_u*)&pixels[strip-1][start];
+	for(uint16_t i=start;i<=stop;i++)
+	{
+		(px++)->i=fp.i;
+	}
+	newData[strip-1]=true;
+#endif
 }
 
 /*
@@ -479,6 +502,37 @@ void apa102ClearStrip(uint8_t strip)
 	apa102FillStrip(strip, 0,0,0,0);
 }
 
+/*
+ * Copies a range of pixels (as they are stored, including global) from the pixel buffer
+ * out must have room for stop-start+1 pixels
+ * Returns false if the range is invalid
+ */
+bool apa102ReadRange(uint8_t strip, uint16_t start, uint16_t stop, apa102Pixel_t* out)
+{
+	if(!apa102IsValidPixel(strip,start) || !apa102IsValidPixel(strip,stop) || start>stop)
+	{
+		return false;
+	}
+	memcpy(out,&pixels[strip-1][start],(stop-start+1)*sizeof(apa102Pixel_t));
+	return true;
+}
+
+/*
+ * Copies a range of pixels (as they are stored, including global) into the pixel buffer
+ * No scaling is done, since the pixels are expected to have been read with apa102ReadRange
+ * Returns false if the range is invalid
+ */
+bool apa102WriteRange(uint8_t strip, uint16_t start, uint16_t stop, const apa102Pixel_t* in)
+{
+	if(!apa102IsValidPixel(strip,start) || !apa102IsValidPixel(strip,stop) || start>stop)
+	{
+		return false;
+	}
+	memcpy(&pixels[strip-1][start],in,(stop-start+1)*sizeof(apa102Pixel_t));
+	newData[strip-1]=true;
+	return true;
+}
+
 /*
  * Returns if a pixel is valid or not
  */
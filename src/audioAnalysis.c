@@ -0,0 +1,620 @@
+/*
+ * audioAnalysis.c
+ *
+ * Turns blocks of audio into the levels of a number of frequency bands, which can drive the segments through the modulators.
+ *
+ * Each block of AUDIO_FFT_SIZE samples (such as half of an ADC DMA buffer) goes through:
+ * - Removal of the DC offset, and scaling to use the full range of the FFT
+ * - A Hann window and a fixed-point real FFT (done as a complex FFT of half the size). The FFT is block floating point, so quiet signals keep their resolution
+ * - Reduction to AUDIO_NOF_BANDS log-spaced band energies, in a log scale (dB)
+ * - An AGC for each band (the level follows the peak of the band), and attack/release smoothing
+ * The levels (0-65535) are given to modulators (see audioBind). A modulator can then be bound to the brightness, colour or glitter density of any segment (see ledSegModBind),
+ * or a band can trigger an envelope (such as for a pulse on each kick drum).
+ *
+ * Everything is done in integers, so it runs on an MCU without FPU. host/audioBench.c runs it on a WAV file and times it (on the host, it hasn't been timed on an MCU).
+ *
+ * For MCUs without time for the FFT, there is also an onset detector working directly on the samples (see audioOnsetProcess).
+ * It follows the rectified signal with a fast and a slow envelope, and finds an onset when the fast one rises well above the slow one.
+ * An onset can trigger sequences, pulses and envelopes, and is given to the beat tracker (which in turn can set the average time of an eventTimeList, see animBeatFillEvents).
+ */
+
+#include "audioAnalysis.h"
+#include "stdlib.h"
+
+//The size of the complex FFT the real FFT is made from
+#define AUDIO_HALF_SIZE (AUDIO_FFT_SIZE/2)
+//log2(AUDIO_HALF_SIZE)
+#define AUDIO_HALF_SIZE_BITS 8
+//Converts tenths of dB to the log scale used internally (log2 of the energy, in 1/256)
+#define AUDIO_DB10_TO_LOG(db10) (((int32_t)(db10)*2560)/301)
+//The level (in the internal log scale) of a full-scale sine in one band
+#define AUDIO_LOG_FULL_SCALE (((int32_t)44<<8)+150)
+//The largest value going into a stage of the FFT that doesn't need scaling (the butterfly can grow a value by 1+sqrt(2))
+#define AUDIO_FFT_NO_SCALE_MAX 8191
+
+/*
+ * Binds a band to a modulator (see audioBind)
+ */
+typedef struct
+{
+	bool used;
+	uint8_t band;
+	uint8_t mod;
+	bool above;				//Indicates that the band is above the threshold (set internally)
+	uint16_t threshold;		//0 to give the level to the modulator, otherwise the level that triggers it
+}audioBinding_t;
+
+/*
+ * Something triggered by an onset (see audioOnsetAddTarget)
+ */
+typedef struct
+{
+	bool used;
+	audioOnsetTargetType_t type;
+	uint32_t target;
+}audioOnsetTarget_t;
+
+/*
+ * The state of the onset detector
+ */
+typedef struct
+{
+	uint32_t sampleRate;
+	uint16_t ratio;				//How much the fast envelope must be above the slow one (in 1/16)
+	int32_t minLevel;			//The lowest fast envelope giving an onset (in the scale of the envelopes)
+	uint32_t refractory;		//The time after an onset without new onsets (in samples)
+	bool useBeatTracker;		//Give each onset to the beat tracker
+	int32_t dc;					//The DC offset of the signal (<<8)
+	int32_t fast;				//The fast envelope (<<8)
+	int32_t slow;				//The slow envelope (<<8)
+	uint32_t holdOff;			//The samples left of the refractory time
+	bool armed;					//The fast envelope has fallen below the threshold since the last onset
+	uint32_t lastOnset;			//The time of the last onset
+}audioOnset_t;
+
+//A quarter of a sine period of AUDIO_FFT_SIZE points (Q15)
+static const int16_t audioSinTable[AUDIO_FFT_SIZE/4+1]=
+{
+	0, 402, 804, 1206, 1608, 2009, 2411, 2811, 3212, 3612, 4011, 4410, 4808, 5205, 5602, 5998,
+	6393, 6787, 7180, 7571, 7962, 8351, 8740, 9127, 9512, 9896, 10279, 10660, 11039, 11417, 11793, 12167,
+	12540, 12910, 13279, 13646, 14010, 14373, 14733, 15091, 15447, 15800, 16151, 16500, 16846, 17190, 17531, 17869,
+	18205, 18538, 18868, 19195, 19520, 19841, 20160, 20475, 20788, 21097, 21403, 21706, 22006, 22302, 22595, 22884,
+	23170, 23453, 23732, 24008, 24279, 24548, 24812, 25073, 25330, 25583, 25833, 26078, 26320, 26557, 26791, 27020,
+	27246, 27467, 27684, 27897, 28106, 28311, 28511, 28707, 28899, 29086, 29269, 29448, 29622, 29792, 29957, 30118,
+	30274, 30425, 30572, 30715, 30853, 30986, 31114, 31238, 31357, 31471, 31581, 31686, 31786, 31881, 31972, 32058,
+	32138, 32214, 32286, 32352, 32413, 32470, 32522, 32568, 32610, 32647, 32679, 32706, 32729, 32746, 32758, 32766,
+	32767,
+};
+
+//The data of the FFT
+static int16_t audioRe[AUDIO_HALF_SIZE];
+static int16_t audioIm[AUDIO_HALF_SIZE];
+//The peak of each band (in the internal log scale, above AUDIO_AGC_FLOOR_DB)
+static int32_t audioPeak[AUDIO_NOF_BANDS];
+//The output level of each band
+static uint16_t audioLevel[AUDIO_NOF_BANDS];
+static audioBinding_t audioBindings[AUDIO_MAX_BINDINGS];
+static audioOnset_t audioOnset;
+static audioOnsetTarget_t audioOnsetTargets[AUDIO_MAX_ONSET_TARGETS];
+
+static int16_t audioSin(uint16_t n);
+static uint16_t audioBandStart(uint8_t band);
+static int32_t audioLog2(uint64_t x);
+static uint8_t audioFft();
+static void audioSetLevel(uint8_t band, int32_t level);
+static void audioOnsetFire(uint32_t time);
+
+/*
+ * Analyses a block of AUDIO_FFT_SIZE samples, updates the band levels and gives them to the bound modulators
+ * The samples can have any DC offset (such as unsigned samples from an ADC, as long as they are below 32768)
+ * Call it from the main loop (for instance when a half of the DMA buffer is filled), not from an interrupt, since it sets the modulators
+ * Returns false if samples is NULL
+ */
+bool audioProcessBlock(const int16_t* samples)
+{
+	if(samples==NULL)
+	{
+		return false;
+	}
+	//Remove the DC offset and find the scaling that puts the largest sample close to AUDIO_FFT_NO_SCALE_MAX (the samples are OR'ed together, which is cheaper than the max and close enough)
+	int32_t sum=0;
+	for(uint16_t i=0;i<AUDIO_FFT_SIZE;i++)
+	{
+		sum+=samples[i];
+	}
+	const int32_t mean=sum/AUDIO_FFT_SIZE;
+	uint32_t maxAbs=0;
+	for(uint16_t i=0;i<AUDIO_FFT_SIZE;i++)
+	{
+		maxAbs|=abs(samples[i]-mean);
+	}
+	if(maxAbs==0)
+	{
+		//Silence
+		for(uint8_t b=0;b<AUDIO_NOF_BANDS;b++)
+		{
+			audioSetLevel(b,INT32_MIN/2);
+		}
+		return true;
+	}
+	int8_t shift=0;
+	while(maxAbs>AUDIO_FFT_NO_SCALE_MAX)
+	{
+		maxAbs>>=1;
+		shift--;
+	}
+	while((maxAbs<<1)<=AUDIO_FFT_NO_SCALE_MAX)
+	{
+		maxAbs<<=1;
+		shift++;
+	}
+	//Window the samples, and put them into the FFT in bit-reversed order (even samples as the real part, odd as the imaginary)
+	for(uint16_t n=0;n<AUDIO_HALF_SIZE;n++)
+	{
+		uint16_t rev=0;
+		for(uint8_t bit=0;bit<AUDIO_HALF_SIZE_BITS;bit++)
+		{
+			rev|=((n>>bit)&1)<<(AUDIO_HALF_SIZE_BITS-1-bit);
+		}
+		for(uint8_t odd=0;odd<2;odd++)
+		{
+			const uint16_t i=2*n+odd;
+			int32_t x=samples[i]-mean;
+			x=(shift>=0 ? x*((int32_t)1<<shift) : x>>-shift);	//Multiplied, since a negative sample can't be shifted left
+			const int32_t window=(32768-audioSin(i+AUDIO_FFT_SIZE/4))>>1;
+			x=(x*window)>>15;
+			if(odd)
+			{
+				audioIm[rev]=x;
+			}
+			else
+			{
+				audioRe[rev]=x;
+			}
+		}
+	}
+	const uint8_t fftShift=audioFft();
+	//Separate the spectrum of the real signal from the complex FFT, and sum the energy of each band
+	//X[k] = (Z[k]+Z*[M-k])/2 - j*W^k*(Z[k]-Z*[M-k])/2, where W=e^(-j*2*pi/N). Each part is halved once more to make room for the energy
+	uint8_t band=0;
+	uint16_t bandEnd=audioBandStart(1);
+	uint64_t energy=0;
+	for(uint16_t k=audioBandStart(0);k<=AUDIO_HALF_SIZE;k++)
+	{
+		const uint16_t a=k%AUDIO_HALF_SIZE;
+		const uint16_t b=(AUDIO_HALF_SIZE-k)%AUDIO_HALF_SIZE;
+		const int32_t er=((int32_t)audioRe[a]+audioRe[b])>>1;
+		const int32_t ei=((int32_t)audioIm[a]-audioIm[b])>>1;
+		//The odd part, multiplied by -j
+		const int32_t odr=((int32_t)audioIm[a]+audioIm[b])>>1;
+		const int32_t odi=((int32_t)audioRe[b]-audioRe[a])>>1;
+		const int32_t c=audioSin(k+AUDIO_FFT_SIZE/4);
+		const int32_t s=audioSin(k);
+		const int32_t xr=(er+((odr*c+odi*s)>>15))>>1;
+		const int32_t xi=(ei+((odi*c-odr*s)>>15))>>1;
+		energy+=(uint32_t)(xr*xr)+(uint32_t)(xi*xi);
+		if(k+1==bandEnd || k==AUDIO_HALF_SIZE)
+		{
+			//The energy is scaled back by the scaling of the FFT and the input
+			int32_t level=(energy ? audioLog2(energy) : INT32_MIN/4);
+			level+=(int32_t)2*(fftShift+1-shift)*256;
+			audioSetLevel(band,level-AUDIO_LOG_FULL_SCALE);
+			energy=0;
+			band++;
+			if(band>=AUDIO_NOF_BANDS)
+			{
+				break;
+			}
+			bandEnd=audioBandStart(band+1);
+		}
+	}
+	//Give the levels to the modulators
+	for(uint8_t i=0;i<AUDIO_MAX_BINDINGS;i++)
+	{
+		audioBinding_t* bd=&audioBindings[i];
+		if(!bd->used)
+		{
+			continue;
+		}
+		const uint16_t level=audioLevel[bd->band];
+		if(!bd->threshold)
+		{
+			ledSegModSetInput(bd->mod,level);
+		}
+		else if(!bd->above && level>=bd->threshold)
+		{
+			bd->above=true;
+			ledSegModTrigger(bd->mod);
+		}
+		else if(bd->above && level<bd->threshold/2)
+		{
+			bd->above=false;
+			ledSegModRelease(bd->mod);
+		}
+	}
+	return true;
+}
+
+/*
+ * Returns the level of a band (0-65535), or 0 if the band doesn't exist
+ * Band 0 is the lowest frequencies
+ */
+uint16_t audioGetBand(uint8_t band)
+{
+	if(band>=AUDIO_NOF_BANDS)
+	{
+		return 0;
+	}
+	return audioLevel[band];
+}
+
+/*
+ * Clears the levels and the AGC (the bindings are kept)
+ */
+void audioReset()
+{
+	memset(audioPeak,0,sizeof(audioPeak));
+	memset(audioLevel,0,sizeof(audioLevel));
+}
+
+/*
+ * Binds a band to a modulator, which is then updated for each block
+ * If threshold is 0, the level of the band is given to an external modulator (LEDSEG_MOD_EXTERNAL). It can then drive brightness, colour or glitter density (see ledSegModBind)
+ * Otherwise, an envelope modulator (LEDSEG_MOD_ENVELOPE) is triggered each time the level rises to threshold, and released when it falls below half of it
+ * Returns the number of the binding, or AUDIO_MAX_BINDINGS+1 if something went wrong
+ */
+uint8_t audioBind(uint8_t band, uint8_t mod, uint16_t threshold)
+{
+	if(band>=AUDIO_NOF_BANDS || mod>=LEDSEG_MAX_MODULATORS)
+	{
+		return AUDIO_MAX_BINDINGS+1;
+	}
+	for(uint8_t i=0;i<AUDIO_MAX_BINDINGS;i++)
+	{
+		audioBinding_t* bd=&audioBindings[i];
+		if(!bd->used)
+		{
+			bd->used=true;
+			bd->band=band;
+			bd->mod=mod;
+			bd->threshold=threshold;
+			bd->above=false;
+			return i;
+		}
+	}
+	return AUDIO_MAX_BINDINGS+1;
+}
+
+/*
+ * Removes a binding made by audioBind. The modulator keeps its last value
+ */
+bool audioUnbind(uint8_t binding)
+{
+	if(binding>=AUDIO_MAX_BINDINGS || !audioBindings[binding].used)
+	{
+		return false;
+	}
+	audioBindings[binding].used=false;
+	return true;
+}
+
+/*
+ * Sets up the onset detector
+ * sampleRate is the sample rate of the audio given to audioOnsetProcess (in Hz)
+ * ratio is how much louder the fast envelope must be than the slow one (in 1/16, 0 gives AUDIO_ONSET_DEFAULT_RATIO). It's limited to AUDIO_ONSET_MAX_RATIO
+ * minLevel is the lowest fast envelope (in the scale of the samples) that can be an onset (0 gives AUDIO_ONSET_DEFAULT_MIN_LEVEL)
+ * refractory is the time after an onset when nothing new is detected (in ms, 0 gives AUDIO_ONSET_DEFAULT_REFRACTORY)
+ * If useBeatTracker is set, each onset is given to animBeatAdd, so sequences can follow the beat (and animBeatFillEvents works)
+ * The state of the detector (but not the targets) is reset
+ */
+void audioOnsetInit(uint32_t sampleRate, uint16_t ratio, uint16_t minLevel, uint16_t refractory, bool useBeatTracker)
+{
+	audioOnset_t* on=&audioOnset;
+	memset(on,0,sizeof(audioOnset_t));
+	on->sampleRate=sampleRate;
+	on->ratio=(ratio ? ratio : AUDIO_ONSET_DEFAULT_RATIO);
+	if(on->ratio>AUDIO_ONSET_MAX_RATIO)
+	{
+		on->ratio=AUDIO_ONSET_MAX_RATIO;
+	}
+	on->minLevel=((int32_t)(minLevel ? minLevel : AUDIO_ONSET_DEFAULT_MIN_LEVEL))<<8;
+	on->refractory=((uint32_t)(refractory ? refractory : AUDIO_ONSET_DEFAULT_REFRACTORY)*sampleRate)/1000;
+	on->useBeatTracker=useBeatTracker;
+	on->armed=true;
+}
+
+/*
+ * Runs the onset detector on a number of samples (any number, such as half of an ADC DMA buffer)
+ * time is the time of the first sample (in ms, see ledSegGetTime)
+ * The targets are triggered as soon as an onset is found, so the latency is the time since the first sample of the buffer
+ * Returns the number of onsets found
+ */
+uint8_t audioOnsetProcess(const int16_t* samples, uint16_t nofSamples, uint32_t time)
+{
+	audioOnset_t* on=&audioOnset;
+	if(samples==NULL || !on->sampleRate)
+	{
+		return 0;
+	}
+	//Keep everything in locals, so the loop runs in registers
+	int32_t dc=on->dc;
+	int32_t fast=on->fast;
+	int32_t slow=on->slow;
+	uint32_t holdOff=on->holdOff;
+	bool armed=on->armed;
+	const int32_t minLevel=on->minLevel;
+	const uint16_t ratio=on->ratio;
+	uint8_t nofOnsets=0;
+	for(uint16_t i=0;i<nofSamples;i++)
+	{
+		//Remove the DC offset and rectify
+		int32_t x=(int32_t)samples[i]*256;
+		dc+=(x-dc)>>AUDIO_ONSET_DC_SHIFT;
+		x-=dc;
+		if(x<0)
+		{
+			x=-x;
+		}
+		fast+=(x-fast)>>AUDIO_ONSET_FAST_SHIFT;
+		slow+=(x-slow)>>AUDIO_ONSET_SLOW_SHIFT;
+		//The threshold follows the slow envelope (the envelopes are below 2^24 and the ratio below 2^7, so this can't overflow)
+		const int32_t threshold=(slow*ratio)>>4;
+		if(holdOff)
+		{
+			holdOff--;
+		}
+		if(fast<threshold)
+		{
+			armed=true;
+		}
+		else if(armed && !holdOff && fast>=minLevel)
+		{
+			armed=false;
+			holdOff=on->refractory;
+			nofOnsets++;
+			audioOnsetFire(time+((uint32_t)i*1000)/on->sampleRate);
+		}
+	}
+	on->dc=dc;
+	on->fast=fast;
+	on->slow=slow;
+	on->holdOff=holdOff;
+	on->armed=armed;
+	return nofOnsets;
+}
+
+/*
+ * Returns the time of the last onset (0 if there has been none)
+ */
+uint32_t audioOnsetGetLast()
+{
+	return audioOnset.lastOnset;
+}
+
+/*
+ * Adds something to trigger on each onset
+ * type sets what target is: an animation sequence handle, a segment (whose pulse is restarted) or an envelope modulator
+ * Returns the number of the target (used for removing it), or AUDIO_MAX_ONSET_TARGETS+1 if it failed
+ */
+uint8_t audioOnsetAddTarget(audioOnsetTargetType_t type, uint32_t target)
+{
+	if((type==AUDIO_ONSET_PULSE && !ledSegExists(target)) || (type==AUDIO_ONSET_MOD && target>=LEDSEG_MAX_MODULATORS) || type>AUDIO_ONSET_MOD)
+	{
+		return AUDIO_MAX_ONSET_TARGETS+1;
+	}
+	for(uint8_t i=0;i<AUDIO_MAX_ONSET_TARGETS;i++)
+	{
+		audioOnsetTarget_t* tg=&audioOnsetTargets[i];
+		if(!tg->used)
+		{
+			tg->used=true;
+			tg->type=type;
+			tg->target=target;
+			return i;
+		}
+	}
+	return AUDIO_MAX_ONSET_TARGETS+1;
+}
+
+/*
+ * Removes a target of the onset detector
+ */
+bool audioOnsetRemoveTarget(uint8_t target)
+{
+	if(target>=AUDIO_MAX_ONSET_TARGETS || !audioOnsetTargets[target].used)
+	{
+		return false;
+	}
+	audioOnsetTargets[target].used=false;
+	return true;
+}
+
+/*
+ * Returns the sine of n (one period is AUDIO_FFT_SIZE, the result is Q15)
+ */
+static int16_t audioSin(uint16_t n)
+{
+	n%=AUDIO_FFT_SIZE;
+	const uint16_t quarter=AUDIO_FFT_SIZE/4;
+	if(n<=quarter)
+	{
+		return audioSinTable[n];
+	}
+	if(n<=2*quarter)
+	{
+		return audioSinTable[2*quarter-n];
+	}
+	if(n<=3*quarter)
+	{
+		return -audioSinTable[n-2*quarter];
+	}
+	return -audioSinTable[4*quarter-n];
+}
+
+/*
+ * Returns the first bin of the FFT in a band. AUDIO_NOF_BANDS gives the end of the last band
+ * The bands are log-spaced from bin 1 to the highest bin (bin 0 is the DC offset). Each band has at least one bin
+ */
+static uint16_t audioBandStart(uint8_t band)
+{
+	if(band>=AUDIO_NOF_BANDS)
+	{
+		return AUDIO_HALF_SIZE+1;
+	}
+	//2^(AUDIO_HALF_SIZE_BITS*band/AUDIO_NOF_BANDS), with the fraction of the power made linear
+	const uint16_t step=AUDIO_HALF_SIZE_BITS*band;
+	const uint16_t low=1<<(step/AUDIO_NOF_BANDS);
+	uint16_t start=low+(low*(step%AUDIO_NOF_BANDS))/AUDIO_NOF_BANDS;
+	if(band>0)
+	{
+		const uint16_t prev=audioBandStart(band-1);
+		if(start<=prev)
+		{
+			start=prev+1;
+		}
+	}
+	return start;
+}
+
+/*
+ * Returns log2 of x (x>0) in 1/256. The fraction is linear between powers of 2
+ */
+static int32_t audioLog2(uint64_t x)
+{
+	int32_t exp=63;
+	while(!(x>>exp))
+	{
+		exp--;
+	}
+	uint32_t frac;
+	if(exp>=8)
+	{
+		frac=(x>>(exp-8))&0xFF;
+	}
+	else
+	{
+		frac=(x<<(8-exp))&0xFF;
+	}
+	return (exp<<8)+frac;
+}
+
+/*
+ * Runs the FFT on the (bit-reversed) data in audioRe/audioIm
+ * A stage is scaled down by 2 (or 4) if any value going into it is large enough to overflow. Returns the total number of shifts
+ */
+static uint8_t audioFft()
+{
+	uint8_t fftShift=0;
+	uint16_t maxAbs=AUDIO_FFT_NO_SCALE_MAX;	//The input is scaled to fit
+	for(uint16_t size=2;size<=AUDIO_HALF_SIZE;size<<=1)
+	{
+		const uint16_t half=size/2;
+		const uint16_t twiddleStep=AUDIO_FFT_SIZE/size;
+		uint8_t sc=0;
+		if(maxAbs>2*AUDIO_FFT_NO_SCALE_MAX+1)
+		{
+			sc=2;
+		}
+		else if(maxAbs>AUDIO_FFT_NO_SCALE_MAX)
+		{
+			sc=1;
+		}
+		fftShift+=sc;
+		maxAbs=0;
+		for(uint16_t k=0;k<half;k++)
+		{
+			//W^k = cos - j*sin
+			const int32_t c=audioSin(k*twiddleStep+AUDIO_FFT_SIZE/4);
+			const int32_t s=audioSin(k*twiddleStep);
+			for(uint16_t a=k;a<AUDIO_HALF_SIZE;a+=size)
+			{
+				const uint16_t b=a+half;
+				const int32_t tr=((int32_t)audioRe[b]*c+(int32_t)audioIm[b]*s)>>15;
+				const int32_t ti=((int32_t)audioIm[b]*c-(int32_t)audioRe[b]*s)>>15;
+				const int32_t ar=audioRe[a];
+				const int32_t ai=audioIm[a];
+				audioRe[a]=(ar+tr)>>sc;
+				audioIm[a]=(ai+ti)>>sc;
+				audioRe[b]=(ar-tr)>>sc;
+				audioIm[b]=(ai-ti)>>sc;
+				maxAbs|=abs(audioRe[a])|abs(audioIm[a])|abs(audioRe[b])|abs(audioIm[b]);
+			}
+		}
+	}
+	return fftShift;
+}
+
+/*
+ * Runs the AGC and smoothing of a band, with the new level (in the internal log scale, relative to full scale)
+ */
+static void audioSetLevel(uint8_t band, int32_t level)
+{
+	//The peak follows the level right away, and falls slowly. It doesn't follow the level below the floor
+	const int32_t floor=-AUDIO_DB10_TO_LOG(AUDIO_AGC_FLOOR_DB*10);
+	int32_t peak=floor+audioPeak[band]-AUDIO_DB10_TO_LOG(AUDIO_AGC_DECAY_DB10);
+	if(level>peak)
+	{
+		peak=level;
+	}
+	if(peak<floor)
+	{
+		peak=floor;
+	}
+	audioPeak[band]=peak-floor;
+	//Map the range below the peak onto the level
+	const int32_t range=AUDIO_DB10_TO_LOG(AUDIO_AGC_RANGE_DB*10);
+	int32_t target=level-(peak-range);
+	if(target<0)
+	{
+		target=0;
+	}
+	target=(target*65535)/range;
+	if(target>65535)
+	{
+		target=65535;
+	}
+	//Move towards the target (rounded up, so that the target is reached)
+	int32_t out=audioLevel[band];
+	if(target>out)
+	{
+		out+=(target-out+(1<<AUDIO_ATTACK_SHIFT)-1)>>AUDIO_ATTACK_SHIFT;
+	}
+	else
+	{
+		out-=(out-target+(1<<AUDIO_RELEASE_SHIFT)-1)>>AUDIO_RELEASE_SHIFT;
+	}
+	audioLevel[band]=out;
+}
+
+/*
+ * Handles an onset: triggers all targets and gives the onset to the beat tracker
+ */
+static void audioOnsetFire(uint32_t time)
+{
+	audioOnset.lastOnset=time;
+	for(uint8_t i=0;i<AUDIO_MAX_ONSET_TARGETS;i++)
+	{
+		const audioOnsetTarget_t* tg=&audioOnsetTargets[i];
+		if(!tg->used)
+		{
+			continue;
+		}
+		switch(tg->type)
+		{
+			case AUDIO_ONSET_SEQ:
+				animSeqTrigTransition(tg->target);
+				break;
+			case AUDIO_ONSET_PULSE:
+				ledSegSetPulseActiveState(tg->target,true);
+				ledSegRestart(tg->target,false,true);
+				break;
+			case AUDIO_ONSET_MOD:
+				ledSegModTrigger(tg->target);
+				break;
+		}
+	}
+	if(audioOnset.useBeatTracker)
+	{
+		animBeatAdd(time);
+	}
+}
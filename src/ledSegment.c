@@ -74,19 +74,168 @@
  */
 
 #include "ledSegment.h"
+#include "ledSegmentPacked.h"
 #include "stdlib.h"
 #include "advancedAnimations.h"
 
 //-----------Internal variables--------//
 //Contains all information for all virtual LED segments
-static ledSegment_t segments[LEDSEG_MAX_SEGMENTS];
+static ledSegment_t segmentStorage[LEDSEG_MAX_SEGMENTS];
+//The segments in use. Points to segmentStorage, unless a pre-built table has been attached
+static ledSegment_t* segments=segmentStorage;
 //The number of initialized segments
 static uint8_t currentNofSegments=0;
+//Indicates that a sync group shall be released (indexed by sync group)
+static bool segSyncReleaseFade[LEDSEG_MAX_SEGMENTS];
+//The current calculation cycle within an update period, and the next segment to calculate
+static uint8_t calcCycle=0;
+static uint8_t currentSeg=0;
+//Segments that shall be shown right away (see ledSegRenderNow), and segments that have been calculated ahead of the regular cycle (and shall be skipped by it once)
+static bool segRenderNow[LEDSEG_MAX_SEGMENTS];
+static bool segCalcAhead[LEDSEG_MAX_SEGMENTS];
+//The calculation function used by the latest ledSegRunIterationCustom (also used for segments rendered out of cycle)
+static ledSegCalcFunc_t lastCalcSeg=NULL;
+//Indicates that the segments are being calculated (so that nothing is rendered out of cycle in the middle of it)
+static bool calcRunning=false;
+//The clock the engine runs on (see ledSegSetClock). NULL for systemTime
+static ledSegClockFunc_t engineClock=NULL;
+
+/*
+ * A transition from one setting of a segment to another (see ledSegStartTransition)
+ * The outgoing setting is kept as a copy of the segment state, and runs on as usual until the transition is done
+ */
+typedef struct
+{
+	ledSegmentState_t out;		//The state of the outgoing setting
+	uint32_t frames;			//The length of the transition (in update periods)
+	uint32_t frame;				//The current update period of the transition
+	ledSegmentEase_t ease;		//The easing curve used for the blend
+	ledSegmentTransition_t type;	//How the old and new settings are combined
+	apa102Pixel_t* lines;		//Two scratch lines (the length of the segment each). The outgoing setting is rendered into the first and the incoming into the second
+	uint16_t* order;			//For dissolve, the order in which the LEDs switch to the new setting (a random permutation of the LEDs). NULL otherwise
+}ledSegTransition_t;
+
+//The running transition of each segment (NULL if there is none). Everything is allocated when the transition starts, and freed when it's done
+static ledSegTransition_t* segTransitions[LEDSEG_MAX_SEGMENTS];
+
+/*
+ * A queued completion event. Events are raised during the calculation of a segment, and sent to the callbacks once the calculation cycle is done
+ * (so that the callbacks can change any segment without disturbing a calculation)
+ */
+typedef struct
+{
+	uint8_t seg;
+	ledSegmentEvent_t event;
+}ledSegEventEntry_t;
+
+static ledSegEventEntry_t eventQueue[LEDSEG_EVENT_QUEUE_SIZE];
+static uint8_t eventQueueStart=0;
+static uint8_t eventQueueCount=0;
+static bool eventQueueOverflow=false;
+static ledSegEventCallback_t eventCallbacks[LEDSEG_MAX_EVENT_CALLBACKS];
+static uint8_t eventNofCallbacks=0;
+//Events are dropped while set (such as when the outgoing setting of a transition is calculated, since it's not the state of the segment)
+static bool eventsMuted=false;
+
+/*
+ * The stages of an envelope modulator
+ */
+typedef enum
+{
+	MOD_ENV_IDLE=0,
+	MOD_ENV_ATTACK,
+	MOD_ENV_DECAY,
+	MOD_ENV_SUSTAIN,
+	MOD_ENV_RELEASE,
+}ledSegModEnvStage_t;
+
+/*
+ * A modulator and its state (see ledSegModInit)
+ */
+typedef struct
+{
+	ledSegmentModSetting_t conf;
+	bool used;
+	uint16_t value;				//The output of the modulator for the current update period
+	uint32_t phase;				//LFO: The current phase (a full uint32 is one period). Random walk: The update periods left to the next step. Envelope: The current level (16.16 fixed point)
+	uint32_t rate;				//LFO: The phase increase each update period. Random walk: The update periods between steps
+	uint32_t envRate[3];		//Envelope: The level change each update period in attack, decay and release (16.16 fixed point)
+	ledSegModEnvStage_t stage;	//Envelope: The current stage
+	uint16_t input;				//External: The latest input
+	uint32_t randState;			//Random walk: State of the random generator
+}ledSegModulator_t;
+
+/*
+ * Maps the value of a modulator onto a setting of a segment (see ledSegModBind)
+ */
+typedef struct
+{
+	bool used;
+	uint8_t mod;
+	uint8_t seg;				//Can be LEDSEG_ALL
+	ledSegmentModTarget_t target;
+	uint16_t min;				//The setting at modulator value 0
+	uint16_t max;				//The setting at modulator value 65535 (can be smaller than min, to invert the modulator)
+}ledSegModBinding_t;
+
+static ledSegModulator_t modulators[LEDSEG_MAX_MODULATORS];
+static ledSegModBinding_t modBindings[LEDSEG_MAX_MOD_BINDINGS];
+//The number of bindings in use (so that nothing is done each update period when modulation is not used)
+static uint8_t modNofBindings=0;
+
+//A quarter of a sine period (amplitude 32767), used for the sine LFO
+static const uint16_t modSineQuarter[33]=
+{
+	0, 1608, 3212, 4808, 6393, 7962, 9512, 11039, 12539, 14010, 15446, 16846, 18204, 19519, 20787, 22005,
+	23170, 24279, 25329, 26319, 27245, 28105, 28898, 29621, 30273, 30852, 31356, 31785, 32137, 32412, 32609, 32728,
+	32767
+};
+
+/*
+ * The header of an engine snapshot. It is followed by (in order):
+ * - All segments (ledSegment_t)
+ * - The effect memory of each segment that has any (effectMemSize bytes each)
+ * - The sync group release flags
+ * - The modulators and their bindings
+ * - The animation sequences (see animSeqSnapshot)
+ * Not included: transitions in progress (they are ended on restore), queued events and the event callbacks
+ * LEDSEG_SNAPSHOT_VERSION shall be increased whenever this layout or any of the saved structs change
+ */
+typedef struct
+{
+	uint32_t magic;			//Always LEDSEG_SNAPSHOT_MAGIC
+	uint16_t version;		//LEDSEG_SNAPSHOT_VERSION
+	uint16_t segSize;		//sizeof(ledSegment_t), to detect snapshots from a build with a different layout
+	uint32_t totalSize;		//The size of the complete snapshot (including the header)
+	uint8_t nofSegments;
+	uint8_t reserved[3];
+}ledSegSnapshotHeader_t;
+
+#define LEDSEG_SNAPSHOT_MAGIC 0x4745534C	//"LSEG"
 
 //---------------Internal functions------------//
 static void fadeCalcColour(uint8_t seg);
-static uint8_t pulseCalcColourPerLed(ledSegmentState_t* st,uint16_t led, colour_t col);
-static void pulseCalcAndSet(uint8_t seg);
+static void fadeKeyframeLoad(ledSegmentState_t* st, uint8_t keyframe);
+static uint32_t pulseCalcColour(ledSegmentState_t* st,uint16_t led);
+static void pulseCalcAndSet(uint8_t seg, const ledSegmentEffect_t* fx);
+static inline void pulseStep(ledSegment_t* sg, bool (*advance)(ledSegment_t* sg), void (*render)(ledSegment_t* sg, bool advanced));
+static uint8_t fadeEvalChannel(uint8_t from, uint8_t to, uint8_t rate, uint32_t steps);
+static uint32_t pulseEvalSteps(int32_t dist, uint32_t ppi);
+static void segCalc(uint8_t seg, ledSegCalcFunc_t calcSeg);
+static void segCalcPeriod(uint8_t seg, ledSegCalcFunc_t calcSeg);
+static void renderNowPending();
+static void transitionCalc(uint8_t seg, ledSegCalcFunc_t calcSeg);
+static uint16_t transitionWeight(const ledSegTransition_t* tr);
+static void transitionCombine(const ledSegment_t* sg, const ledSegTransition_t* tr, const apa102Pixel_t* outLine, apa102Pixel_t* inLine);
+static void transitionKeepSpan(const apa102Pixel_t* outLine, apa102Pixel_t* inLine, uint16_t start, uint16_t stop);
+static void transitionEnd(uint8_t seg);
+static void eventRaise(uint8_t seg, ledSegmentEvent_t event);
+static void eventDispatch();
+static void modUpdate();
+static uint16_t modCalcValue(ledSegModulator_t* m);
+static uint16_t modSine(uint32_t phase);
+static void modApply(uint8_t seg, ledSegmentModTarget_t target, uint16_t value);
+static uint32_t modTimeToPeriods(uint32_t time);
 static bool checkCycleCounter(uint32_t* cycle);
 static bool checkCycleCounterU16(uint16_t* cycle);
 static bool checkSyncReadyFade(uint8_t syncGrp, uint8_t seg);
@@ -94,6 +243,47 @@ static bool checkFadeNotWaitingForSyncAll(uint8_t syncGrp);
 static void resetSyncDoneGroup(uint8_t syncGrp);
 static bool ledIsWithinSeg(uint8_t seg, uint16_t led);
 static bool isExcludedFromAll(uint8_t seg);
+static void segSetLed(ledSegment_t* sg, uint16_t led, uint8_t r, uint8_t g, uint8_t b, uint8_t global);
+
+//---------------Effects------------//
+#if LEDSEG_EFFECT_PULSE_ENABLED
+static void pulseInit(ledSegment_t* sg);
+static bool pulseAdvanceLoopEnd(ledSegment_t* sg);
+static bool pulseAdvanceLoop(ledSegment_t* sg);
+static bool pulseAdvanceBounce(ledSegment_t* sg);
+static void pulseRenderLoopEnd(ledSegment_t* sg, bool advanced);
+static void pulseRenderLoop(ledSegment_t* sg, bool advanced);
+static void pulseRenderBounce(ledSegment_t* sg, bool advanced);
+
+const ledSegmentEffect_t ledSegEffectPulseLoop={pulseInit,pulseAdvanceLoop,pulseRenderLoop,NULL};
+const ledSegmentEffect_t ledSegEffectPulseLoopEnd={pulseInit,pulseAdvanceLoopEnd,pulseRenderLoopEnd,NULL};
+const ledSegmentEffect_t ledSegEffectPulseBounce={pulseInit,pulseAdvanceBounce,pulseRenderBounce,NULL};
+#endif
+#if LEDSEG_EFFECT_GLITTER_ENABLED
+static uint16_t glitterMemSize(const ledSegmentPulseSetting_t* ps);
+static void glitterInit(ledSegment_t* sg);
+static bool glitterAdvance(ledSegment_t* sg);
+static void glitterRender(ledSegment_t* sg, bool advanced);
+
+//All glitter modes share the same effect (the differences are handled within the effect)
+const ledSegmentEffect_t ledSegEffectGlitter={glitterInit,glitterAdvance,glitterRender,glitterMemSize};
+#endif
+
+//The effect registry. Modes that are not in the registry (such as excluded effects) are ignored by the pulse
+static const ledSegmentEffect_t* effects[LEDSEG_MAX_EFFECTS]=
+{
+#if LEDSEG_EFFECT_PULSE_ENABLED
+	[LEDSEG_MODE_LOOP]=&ledSegEffectPulseLoop,
+	[LEDSEG_MODE_LOOP_END]=&ledSegEffectPulseLoopEnd,
+	[LEDSEG_MODE_BOUNCE]=&ledSegEffectPulseBounce,
+#endif
+#if LEDSEG_EFFECT_GLITTER_ENABLED
+	[LEDSEG_MODE_GLITTER_LOOP]=&ledSegEffectGlitter,
+	[LEDSEG_MODE_GLITTER_LOOP_END]=&ledSegEffectGlitter,
+	[LEDSEG_MODE_GLITTER_LOOP_PERSIST]=&ledSegEffectGlitter,
+	[LEDSEG_MODE_GLITTER_BOUNCE]=&ledSegEffectGlitter,
+#endif
+};
 
 
 /*
@@ -103,7 +293,7 @@ static bool isExcludedFromAll(uint8_t seg);
  */
 uint8_t ledSegInitSegment(uint8_t strip, uint16_t start, uint16_t stop, bool invertPulse, bool excludeFromAll, ledSegmentPulseSetting_t* pulse, ledSegmentFadeSetting_t* fade)
 {
-	if(currentNofSegments>=LEDSEG_MAX_SEGMENTS || start>stop)
+	if(currentNofSegments>=LEDSEG_MAX_SEGMENTS || start>stop || segments!=segmentStorage)
 	{
 		return (LEDSEG_MAX_SEGMENTS+1);
 	}
@@ -119,6 +309,7 @@ uint8_t ledSegInitSegment(uint8_t strip, uint16_t start, uint16_t stop, bool inv
 	sg->stop=stop;
 	sg->invertPulse=invertPulse;
 	sg->excludeFromAll=excludeFromAll;
+	sg->state.randState=LEDSEG_RAND_SEED_FROM_ID(LEDSEG_RAND_DEFAULT_SEED,currentNofSegments);
 
 	currentNofSegments++;
 	if(!ledSegSetFade(currentNofSegments-1,fade))
@@ -132,6 +323,24 @@ uint8_t ledSegInitSegment(uint8_t strip, uint16_t start, uint16_t stop, bool inv
 	return (currentNofSegments-1);
 }
 
+/*
+ * Replaces all segments with a pre-built segment table (such as one generated at compile time by ledSegment.hpp)
+ * The table is used in place (nothing is copied or validated), so it must stay valid. The segments are run with the state they have,
+ * so each one must already be set up as ledSegInitSegment would do it (ledSegment.hpp calculates the state at compile time)
+ * Segments can't be added with ledSegInitSegment once a table is attached
+ * Returns false if the table is too large
+ */
+bool ledSegAttachSegments(ledSegment_t* table, uint8_t nofSegments)
+{
+	if(table==NULL || nofSegments>LEDSEG_MAX_SEGMENTS)
+	{
+		return false;
+	}
+	segments=table;
+	currentNofSegments=nofSegments;
+	return true;
+}
+
 /*
  * Get the state and all info for a specific led segment
  * seg is the number of the segment (given from initSegment)
@@ -177,40 +386,35 @@ bool ledSegExistsNotAll(uint8_t seg)
  * seg is the segment given by the init function
  * fs is a pointer to the wanted setting
  * Will reset the current fade cycle
+ * Returns false if the segment doesn't exist or the setting is invalid (such as keyframes without a keyframe list)
  */
 bool ledSegSetFade(uint8_t seg, ledSegmentFadeSetting_t* fs)
 {
-	if(!ledSegExists(seg) || fs==NULL)
+	if(!ledSegExists(seg) || fs==NULL || (fs->keyframeNum && fs->keyframePtr==NULL))
 	{
 		return false;
 	}
-	if(seg==LEDSEG_ALL)
-	{
-		for(uint8_t i=0;i<currentNofSegments;i++)
-		{
-			if(!isExcludedFromAll(i))
-			{
-				ledSegSetFade(i,fs);
-			}
-		}
-		return true;
-	}
-	//Create some temp variables that are easier to use
-	ledSegment_t* sg;
-	sg=&(segments[seg]);
-	ledSegmentState_t* st;
-	st=&(sg->state);
-	ledSegmentFadeSetting_t* fd;
-	fd=&(sg->state.confFade);
-	//Copy new setting into state
-	memcpy(fd,fs,sizeof(ledSegmentFadeSetting_t));
-	//Setup fade parameters
+	ledSegmentFadeRates_t rates;
+	ledSegCompileFade(fs,&rates);
+	return ledSegSetFadeCompiled(seg,fs,&rates);
+}
+
+/*
+ * Calculates the values that ledSegSetFade derives from a fade setting (the rates and the period multiplier)
+ * The result can be kept with the setting and given to ledSegSetFadeCompiled, to set the fade any number of times without redoing the calculation
+ */
+void ledSegCompileFade(const ledSegmentFadeSetting_t* fs, ledSegmentFadeRates_t* rates)
+{
 	uint16_t periodMultiplier=1;
 	bool makeItSlower=false;
 	//The total number update periods we have to achieve the fade time Todo: consider adding a limit if a fade is very small (such as less than 10 steps)
 	uint32_t master_steps=0;
 	const uint8_t largestError=50;
-	do
+	//The rates of a keyframe fade are calculated for each keyframe when it's reached (see fadeKeyframeLoad)
+	rates->r_rate=0;
+	rates->g_rate=0;
+	rates->b_rate=0;
+	while(!fs->keyframeNum)
 	{
 		makeItSlower=false;
 		master_steps=fs->fadeTime/(LEDSEG_UPDATE_PERIOD_TIME*periodMultiplier);
@@ -218,29 +422,73 @@ bool ledSegSetFade(uint8_t seg, ledSegmentFadeSetting_t* fs)
 		uint8_t r_diff= abs(fs->r_max-fs->r_min);
 		uint8_t g_diff= abs(fs->g_max-fs->g_min);
 		uint8_t b_diff= abs(fs->b_max-fs->b_min);
-		st->r_rate = r_diff/master_steps;
-		if(r_diff!=0 && (st->r_rate<1 || ((r_diff%master_steps)>largestError)))
+		rates->r_rate = r_diff/master_steps;
+		if(r_diff!=0 && (rates->r_rate<1 || ((r_diff%master_steps)>largestError)))
 		{
 			makeItSlower=true;
 		}
-		st->g_rate = g_diff/master_steps;
-		if(g_diff!=0 && (st->g_rate<1 || ((g_diff%master_steps)>largestError)))
+		rates->g_rate = g_diff/master_steps;
+		if(g_diff!=0 && (rates->g_rate<1 || ((g_diff%master_steps)>largestError)))
 		{
 			makeItSlower=true;
 		}
-		st->b_rate = b_diff/master_steps;
-		if(b_diff!=0 && (st->b_rate<1 || ((b_diff%master_steps)>largestError)))
+		rates->b_rate = b_diff/master_steps;
+		if(b_diff!=0 && (rates->b_rate<1 || ((b_diff%master_steps)>largestError)))
 		{
 			makeItSlower=true;
 		}
-		if(makeItSlower)
+		if(!makeItSlower)
+		{
+			break;
+		}
+		periodMultiplier++;
+	}
+	rates->periodMultiplier=periodMultiplier;
+	//Check if user wants a very large number of cycles. If so, mark this as run indefinitely
+	if(fs->cycles==0 || (UINT32_MAX/fs->cycles)<master_steps)
+	{
+		rates->cycles=0;
+	}
+	else
+	{
+		rates->cycles=fs->cycles;//*master_steps;	//Each cycle shall be one half cycle (min->max)
+	}
+}
+
+/*
+ * Same as ledSegSetFade, but with the values calculated by ledSegCompileFade for the same setting. This only copies the setting into the state
+ */
+bool ledSegSetFadeCompiled(uint8_t seg, const ledSegmentFadeSetting_t* fs, const ledSegmentFadeRates_t* rates)
+{
+	if(!ledSegExists(seg) || fs==NULL || rates==NULL || (fs->keyframeNum && fs->keyframePtr==NULL))
+	{
+		return false;
+	}
+	if(seg==LEDSEG_ALL)
+	{
+		for(uint8_t i=0;i<currentNofSegments;i++)
 		{
-			periodMultiplier++;
+			if(!isExcludedFromAll(i))
+			{
+				ledSegSetFadeCompiled(i,fs,rates);
+			}
 		}
+		return true;
 	}
-	while(makeItSlower);
-	fd->fadePeriodMultiplier = periodMultiplier;
-	st->cyclesToFadeChange = periodMultiplier;
+	//Create some temp variables that are easier to use
+	ledSegment_t* sg;
+	sg=&(segments[seg]);
+	ledSegmentState_t* st;
+	st=&(sg->state);
+	ledSegmentFadeSetting_t* fd;
+	fd=&(sg->state.confFade);
+	//Copy new setting into state
+	memcpy(fd,fs,sizeof(ledSegmentFadeSetting_t));
+	st->r_rate=rates->r_rate;
+	st->g_rate=rates->g_rate;
+	st->b_rate=rates->b_rate;
+	fd->fadePeriodMultiplier = rates->periodMultiplier;
+	st->cyclesToFadeChange = rates->periodMultiplier;
 	//If the start dir is down, start from max
 	if(fs->startDir ==-1)
 	{
@@ -255,15 +503,7 @@ bool ledSegSetFade(uint8_t seg, ledSegmentFadeSetting_t* fs)
 		st->b=fs->b_min;
 	}
 	st->fadeDir = fs->startDir;
-	//Check if user wants a very large number of cycles. If so, mark this as run indefinitely
-	if(fs->cycles==0 || (UINT32_MAX/fs->cycles)<master_steps)
-	{
-		st->confFade.cycles=0;
-	}
-	else
-	{
-		st->confFade.cycles=fs->cycles;//*master_steps;	//Each cycle shall be one half cycle (min->max)
-	}
+	st->confFade.cycles=rates->cycles;
 	st->fadeCycle=st->confFade.cycles;
 	//If the global setting is not used (set to 0) the default global will be loaded dynamically from the current global
 	if(fd->globalSetting == 0)
@@ -272,6 +512,13 @@ bool ledSegSetFade(uint8_t seg, ledSegmentFadeSetting_t* fs)
 	}
 	st->fadeActive = true;
 	st->fadeState=LEDSEG_FADE_NOT_DONE;
+	//A keyframe fade starts at the first keyframe
+	st->keyframeHold=0;
+	if(fd->keyframeNum)
+	{
+		st->keyframeDir=1;
+		fadeKeyframeLoad(st,0);
+	}
 
 	return true;
 }
@@ -309,52 +556,40 @@ bool ledSegSetPulse(uint8_t seg, ledSegmentPulseSetting_t* ps)
 
 	st->pulseCycle=ps->cycles;
 	st->pulseActive = true;
-	if(ledSegisGlitterMode(pu->mode))
+	//(Re)allocate the memory needed by the effect and let it set up its start state
+	//A buffer of the same size is cleared and kept, so that changing between similar settings (such as in a sequence) doesn't go through the heap
+	//An external buffer (such as one made by ledSegment.hpp) is used as long as it's large enough
+	const ledSegmentEffect_t* fx=ledSegGetEffect(pu->mode);
+	uint16_t memSize=0;
+	if(fx!=NULL && fx->memSize!=NULL)
 	{
-		//Allocate memory for the ring buffer.
-		free(st->glitterActiveLeds);	//Remove old buffer
-		st->glitterActiveLeds = (uint16_t*)calloc(pu->ledsMaxPower+pu->pixelsPerIteration,sizeof(uint16_t));	//Allocate new buffer
-		st->currentLed=0;	//currentLed is used as index in the ringbuffer.
-
-		//For glitter mode, pixelTime setting is the total time for fade of all the glitter pixels together.
-		//Therefore, we calculate the number of LEDSEG_UPDATE_PERIOD_TIME-cycles is needed for each glitter subsegment
-		//(GCC will probably optimize this)
-		uint32_t pixelTimeTemp=0;
-		pixelTimeTemp=pu->pixelTime/LEDSEG_UPDATE_PERIOD_TIME;	//Total number of update periods for all glitter points (until the whole cycle is done)
-		pixelTimeTemp=pixelTimeTemp*pu->pixelsPerIteration/pu->ledsMaxPower;	//The time it will take for each cycle to fade completely from 0 to max
-		if(pixelTimeTemp==0)
-		{
-			pixelTimeTemp=1;
-		}
-		pu->pixelTime=pixelTimeTemp;
-		st->cyclesToPulseMove=1;	//So that we get LEDs from the beginning
+		memSize=fx->memSize(pu);
+	}
+	if(memSize && st->effectMem!=NULL && (st->effectMemExternal ? memSize<=st->effectMemSize : memSize==st->effectMemSize))
+	{
+		memset(st->effectMem,0,memSize);
 	}
 	else
 	{
-		//Allows to start index from the back
-		while(pu->startLed<0)
-		{
-			pu->startLed=pu->startLed+sg->stop-sg->start+2;
-		}
-		if(sg->invertPulse)
+		if(!st->effectMemExternal)
 		{
-			pu->startLed = sg->stop-pu->startLed+1;
-			pu->startDir *= -1;
+			free(st->effectMem);	//Remove old buffer
 		}
-		else
-		{
-			pu->startLed = sg->start + pu->startLed-1;
-		}
-		if(pu->startLed>sg->stop)
-		{
-			pu->startLed=sg->stop;
-		}
-		else if(pu->startLed < sg->start)
+		st->effectMem=NULL;
+		st->effectMemSize=0;
+		st->effectMemExternal=false;
+		if(memSize)
 		{
-			pu->startLed=sg->start;
+			st->effectMem=calloc(memSize,1);	//Allocate new buffer
+			if(st->effectMem!=NULL)
+			{
+				st->effectMemSize=memSize;
+			}
 		}
-		st->currentLed = pu->startLed;
-		st->cyclesToPulseMove = pu->pixelTime;
+	}
+	if(fx!=NULL && fx->init!=NULL)
+	{
+		fx->init(sg);
 	}
 	st->pulseDir=pu->startDir;
 
@@ -502,16 +737,7 @@ bool ledSegSetLedWithGlobal(uint8_t seg, uint16_t led, uint8_t r, uint8_t g, uin
 	{
 		return false;
 	}
-	uint16_t tmp=0;
-	if(segments[seg].invertPulse)
-	{
-		tmp=segments[seg].stop-led+1;
-	}
-	else
-	{
-		tmp=segments[seg].start+led-1;
-	}
-	apa102SetPixelWithGlobal(segments[seg].strip,tmp,r,g,b,global,true);
+	segSetLed(&segments[seg],led,r,g,b,global);
 	return true;
 }
 
@@ -810,6 +1036,11 @@ bool ledSegRestart(uint8_t seg, bool restartFade, bool restartPulse)
 			st->b = st->confFade.b_max;
 			st->fadeDir = -1;
 		}
+		if(st->confFade.keyframeNum && !st->switchMode)
+		{
+			st->keyframeDir=1;
+			fadeKeyframeLoad(st,0);
+		}
 		st->fadeState=LEDSEG_FADE_NOT_DONE;
 		st->fadeCycle=st->confFade.cycles;
 		st->fadeActive=true;
@@ -865,7 +1096,7 @@ bool ledSegSetGlobal(uint8_t seg, uint8_t fadeGlobal, uint8_t pulseGlobal)
  */
 void ledSegSetModeChange(ledSegmentFadeSetting_t* fs, uint8_t seg, bool switchAtMax)
 {
-	if(!ledSegExists(seg))
+	if(!ledSegExists(seg) || fs==NULL || (fs->keyframeNum && fs->keyframePtr==NULL))
 	{
 		return;
 	}
@@ -890,8 +1121,25 @@ void ledSegSetModeChange(ledSegmentFadeSetting_t* fs, uint8_t seg, bool switchAt
 	st->savedCycles = fs->cycles;
 	st->switchMode=true;
 	st->savedDir = fs->startDir;
+	st->savedKeyframeNum = fs->keyframeNum;
+	st->savedKeyframePtr = fs->keyframePtr;
+	fsTmp.keyframeNum=0;
+	if(fs->keyframeNum)
+	{
+		//A keyframe fade is faded to from its first keyframe (it's started from there when the switch is done)
+		fsTmp.r_min = st->r;
+		fsTmp.g_min = st->g;
+		fsTmp.b_min = st->b;
+		fsTmp.r_max = fs->keyframePtr[0].colour.r;
+		fsTmp.g_max = fs->keyframePtr[0].colour.g;
+		fsTmp.b_max = fs->keyframePtr[0].colour.b;
+		fsTmp.startDir=1;
+		st->savedR = fsTmp.r_min;
+		st->savedG = fsTmp.g_min;
+		st->savedB = fsTmp.b_min;
+	}
 	//We will fade from min to max, with dir up. We therefore save the min value and assign that to the current state.
-	if(switchAtMax)
+	else if(switchAtMax)
 	{
 		st->savedR =fs->r_min;
 		st->savedG =fs->g_min;
@@ -917,553 +1165,2423 @@ void ledSegSetModeChange(ledSegmentFadeSetting_t* fs, uint8_t seg, bool switchAt
 }
 
 /*
- * Tells if a mode is a glitter mode
+ * Seeds the random generator of a segment. Re-seeding with the same seed and restarting the pulse gives the exact same glitter
+ * The seed is mixed with the segment number, so that LEDSEG_ALL gives different (but reproducible) sequences to each segment
  */
-bool ledSegisGlitterMode(ledSegmentMode_t mode)
+bool ledSegSetRandSeed(uint8_t seg, uint32_t seed)
 {
-	if(mode>=LEDSEG_MODE_GLITTER_LOOP && mode<=LEDSEG_MODE_GLITTER_BOUNCE)
+	if(!ledSegExists(seg))
 	{
-		return true;
+		return false;
 	}
-	else
+	if(seg==LEDSEG_ALL)
 	{
-		return false;
+		for(uint8_t i=0;i<currentNofSegments;i++)
+		{
+			if(!isExcludedFromAll(i))
+			{
+				ledSegSetRandSeed(i,seed);
+			}
+		}
+		return true;
 	}
+	segments[seg].state.randState=LEDSEG_RAND_SEED_FROM_ID(seed,seg);
+	return true;
 }
 
 /*
- * Returns the total length of a led segment
+ * Steps a random generator (xorshift32) and returns the new value
+ * The state must never be 0
  */
-uint16_t ledSegGetLen(uint8_t seg)
+uint32_t ledSegRandNext(uint32_t* state)
 {
-	if(!ledSegExistsNotAll(seg))
-	{
-		return 0;	//A non-exisiting ledSeg has the length of 0
-	}
-	return segments[seg].stop-segments[seg].start+1;
+	uint32_t x=*state;
+	x^=x<<13;
+	x^=x>>17;
+	x^=x<<5;
+	*state=x;
+	return x;
 }
 
 /*
- * The great big update function. This should be run as often as possible (not from interrupts!)
- * It keeps its own time gate, and will from time to time create a heavy load
- *
- * It uses the following scheme:
- * The whole LED-system (all strips) is updated every LEDSEG_UPDATE_PERIOD_TIME.
- * It has several calculations cycles per period (configurable in ledSegment.h). Each of these iterations, a calculation is performed
- * Each calculation cycle will calculate a fraction of the total number of segments and load this into the big pixel array
- * Note: no calculations are done while the strips are updating (the DMA is running).
- *	 Otherwise, we would need to keep two copies of the whole pixel map, costing about 3kB of additional RAM
- *
- *	 Add an option in fadeSetting or a state in fadeState.
- *	 The fade state or conf will need to remember some parts of the fade setting (the min colours, that it's fade, and the number of cycles)
- *	 Set up the fade as normal, but create that special setting that allows fade between two colours and one cycle.
- *	 Once fadeDone is true, switch the fade to the fade that's it supposed to be and switch to that
- *
+ * Returns a random number from 0 to range-1
+ * Uses multiply-shift instead of modulo (a single multiplication, and no bias towards low numbers from the modulo)
  */
-void ledSegRunIteration()
+uint16_t ledSegRandRange(uint32_t* state, uint16_t range)
 {
-	static uint32_t nextCallTime=0;
-	static uint8_t calcCycle=0;
-	static uint8_t currentSeg=0;
-
-	//Temporary variables
-	uint8_t stopSegment=0;
-	uint16_t start=0;
-	uint16_t stop=0;
-	uint8_t strip=0;
-	ledSegmentState_t* st;
-	//These two are to measure the time the calculation takes
-	volatile uint32_t startVal=0;
-	volatile uint32_t timeTaken=0;
+	return (uint16_t)(((ledSegRandNext(state)>>16)*range)>>16);
+}
 
-	if(systemTime>nextCallTime && !apa102DMABusy(APA_ALL_STRIPS))
+/*
+ * Fills out with n random numbers from offset to offset+range-1
+ */
+void ledSegRandFill(uint32_t* state, uint16_t* out, uint16_t n, uint16_t range, uint16_t offset)
+{
+	uint32_t x=*state;
+	for(uint16_t i=0;i<n;i++)
 	{
-		calcCycle++;
-		nextCallTime=systemTime+LEDSEG_UPDATE_PERIOD_TIME/LEDSEG_CALCULATION_CYCLES;
-		//Calculate the number of segments to calculate this cycle (always try to calculate one segment, even though it doesn't exist)
-		stopSegment=currentSeg+currentNofSegments/LEDSEG_CALCULATION_CYCLES+1;
-		//Calculate all active segments for this cycle
-		while(ledSegExists(currentSeg) && currentSeg<stopSegment)
-		{
-			startVal=microSeconds();
-			//Extract useful variables from the state
-			st=&(segments[currentSeg].state);
-			start=segments[currentSeg].start;
-			stop=segments[currentSeg].stop;
-			strip=segments[currentSeg].strip;
+		x^=x<<13;
+		x^=x>>17;
+		x^=x<<5;
+		out[i]=(uint16_t)(((x>>16)*range)>>16)+offset;
+	}
+	*state=x;
+}
 
-			//Calculate and write fill colour to internal buffer
-			if(st->fadeActive)
-			{
-				if(checkCycleCounterU16(&st->cyclesToFadeChange))
-				{
-					fadeCalcColour(currentSeg);
-					st->cyclesToFadeChange = st->confFade.fadePeriodMultiplier;
-				}
-				//It will most likely take longer time to calculate which LEDs should not be filled,
-				//rather than just filling them and overwriting them. Writing a single pixel with force does not take very long time
-				apa102FillRange(strip,start,stop,st->r,st->g,st->b,st->confFade.globalSetting);
-			}
-			//Calculate and write pulse to internal LED buffer. Will overwrite the fade colour
-			if(st->pulseActive)
-			{
-				pulseCalcAndSet(currentSeg);
-			}
-			timeTaken=microSeconds()-startVal;
-			currentSeg++;
-		}
-		//Update calculation cycle and check if we should update the physical strip
-		if(calcCycle>=LEDSEG_CALCULATION_CYCLES)
+/*
+ * Returns the number of bytes needed for a snapshot of the current engine state
+ */
+uint32_t ledSegSnapshotSize()
+{
+	uint32_t size=sizeof(ledSegSnapshotHeader_t)+currentNofSegments*sizeof(ledSegment_t)+sizeof(segSyncReleaseFade)+sizeof(modulators)+sizeof(modBindings);
+	for(uint8_t i=0;i<currentNofSegments;i++)
+	{
+		if(segments[i].state.effectMem!=NULL)
 		{
-			//Update LEDs and restart calc cycle
-			apa102UpdateStrip(APA_ALL_STRIPS);
-			calcCycle=0;
-			currentSeg=0;
+			size+=segments[i].state.effectMemSize;
 		}
 	}
+	return size+animSeqSnapshot(NULL,0);
 }
 
-
-
-//-------------Internal functions------------------------//
-
 /*
- * Calculate the colour of a led faded in a pulse
- * led is the led within the pulse, counted from currentLed (the first LED with a colour).
- * led is indexed from reality (meaning currentLed has value 1, and that the lowest value is 1)
+ * Saves the complete engine state (all segments, effect memory, sync groups, modulators and animation sequences) into buf
+ * The snapshot is a plain binary blob that can be stored in flash or on disk, and loaded with ledSegRestore.
+ * It's only valid for the same firmware (it contains pointers to colour sequences, and the struct layout is checked on restore)
+ * Returns the number of bytes written, or 0 if buf is too small
  */
-static uint8_t pulseCalcColourPerLed(ledSegmentState_t* st,uint16_t led, colour_t col)
+uint32_t ledSegSnapshot(uint8_t* buf, uint32_t size)
 {
-	typedef enum
+	const uint32_t totalSize=ledSegSnapshotSize();
+	if(buf==NULL || size<totalSize)
 	{
-		PULSE_BEFORE=0,
-		PULSE_MAX,
-		PULSE_AFTER
-	}pulsePart_t;
-	ledSegmentPulseSetting_t* ps;
-	ps=&(st->confPulse);
-	RGB_t RGBMaxTmp;
-
-	if(ps->colourSeqNum)
+		return 0;
+	}
+	ledSegSnapshotHeader_t hdr;
+	memset(&hdr,0,sizeof(ledSegSnapshotHeader_t));
+	hdr.magic=LEDSEG_SNAPSHOT_MAGIC;
+	hdr.version=LEDSEG_SNAPSHOT_VERSION;
+	hdr.segSize=sizeof(ledSegment_t);
+	hdr.totalSize=totalSize;
+	hdr.nofSegments=currentNofSegments;
+	uint8_t* p=buf;
+	memcpy(p,&hdr,sizeof(ledSegSnapshotHeader_t));
+	p+=sizeof(ledSegSnapshotHeader_t);
+	memcpy(p,segments,currentNofSegments*sizeof(ledSegment_t));
+	p+=currentNofSegments*sizeof(ledSegment_t);
+	for(uint8_t i=0;i<currentNofSegments;i++)
 	{
-		uint8_t tmp=1;
-		if(ps->colourSeqLoops)
-		{
-			tmp=ps->colourSeqLoops;
-		}
-		uint16_t ledsPerColour=(ps->ledsFadeBefore+ps->ledsMaxPower+ps->ledsFadeAfter)/(tmp*ps->colourSeqNum);
-		//If the pulse is shorter than PRIDE_COL_NOF_COLOURS, this will not work well
-		if(ledsPerColour<1)
+		const ledSegmentState_t* st=&(segments[i].state);
+		if(st->effectMem!=NULL)
 		{
-			ledsPerColour=1;
+			memcpy(p,st->effectMem,st->effectMemSize);
+			p+=st->effectMemSize;
 		}
-		uint16_t colIndex=((led-1)/ledsPerColour)%ps->colourSeqNum;
-		RGBMaxTmp=animGetColourFromSequence(ps->colourSeqPtr,colIndex,255);//animGetColourPride((prideCols_t)colIndex,255);
 	}
-	else
+	memcpy(p,segSyncReleaseFade,sizeof(segSyncReleaseFade));
+	p+=sizeof(segSyncReleaseFade);
+	memcpy(p,modulators,sizeof(modulators));
+	p+=sizeof(modulators);
+	memcpy(p,modBindings,sizeof(modBindings));
+	p+=sizeof(modBindings);
+	p+=animSeqSnapshot(p,size-(uint32_t)(p-buf));
+	return (uint32_t)(p-buf);
+}
+
+/*
+ * Loads a complete engine state saved with ledSegSnapshot. Phases, cycles and sequence progress continue from where they were saved.
+ * Everything is checked before anything is changed, so the current state is kept if the snapshot is invalid.
+ * Effect memory is re-used when it's large enough, so normally nothing is allocated and the restore is a plain copy.
+ * The current update period is restarted, so that a frame never mixes old and new state.
+ * Returns false if the snapshot is invalid or from another build
+ */
+bool ledSegRestore(const uint8_t* buf, uint32_t size)
+{
+	ledSegSnapshotHeader_t hdr;
+	if(buf==NULL || size<sizeof(ledSegSnapshotHeader_t))
 	{
-		RGBMaxTmp.r=ps->r_max;
-		RGBMaxTmp.g=ps->g_max;
-		RGBMaxTmp.b=ps->b_max;
+		return false;
 	}
-	uint8_t tmpCol=0;
-	uint8_t tmpMax=0;
-	uint8_t tmpMin=0;
-	pulsePart_t part=PULSE_BEFORE;
-	if(led<=ps->ledsFadeBefore)
+	memcpy(&hdr,buf,sizeof(ledSegSnapshotHeader_t));
+	if(hdr.magic!=LEDSEG_SNAPSHOT_MAGIC || hdr.version!=LEDSEG_SNAPSHOT_VERSION || hdr.segSize!=sizeof(ledSegment_t) ||
+			hdr.totalSize>size || hdr.nofSegments>LEDSEG_MAX_SEGMENTS)
 	{
-		part=PULSE_BEFORE;
+		return false;
 	}
-	else if(led<=(ps->ledsFadeBefore+ps->ledsMaxPower))
+	//An attached table can't grow
+	if(segments!=segmentStorage && hdr.nofSegments>currentNofSegments)
 	{
-		part=PULSE_MAX;
+		return false;
 	}
-	else
+	//Check that the segments, effect memory, sync flags and sequences fit within the snapshot, and get memory for the effects
+	uint32_t used=sizeof(ledSegSnapshotHeader_t)+hdr.nofSegments*sizeof(ledSegment_t);
+	if(used>hdr.totalSize)
 	{
-		part=PULSE_AFTER;
+		return false;
 	}
-	switch(col)
+	const ledSegment_t* snapSegs=(const ledSegment_t*)(buf+sizeof(ledSegSnapshotHeader_t));
+	//All entries are cleared, so that only the memory allocated here is freed if the check stops early
+	void* mem[LEDSEG_MAX_SEGMENTS]={NULL};
+	const uint8_t* memSrc[LEDSEG_MAX_SEGMENTS]={NULL};
+	bool memNew[LEDSEG_MAX_SEGMENTS]={false};
+	for(uint8_t i=0;i<hdr.nofSegments;i++)
 	{
-		case COL_RED:
-//			tmpMax=ps->r_max;
-			tmpMax=RGBMaxTmp.r;
-			tmpMin=st->r;
-		break;
-		case COL_GREEN:
-//			tmpMax=ps->g_max;
-			tmpMax=RGBMaxTmp.g;
-			tmpMin=st->g;
-			break;
-		case COL_BLUE:
-//			tmpMax=ps->b_max;
-			tmpMax=RGBMaxTmp.b;
-			tmpMin=st->b;
+		ledSegmentState_t snapSt;
+		memcpy(&snapSt,&(snapSegs[i].state),sizeof(ledSegmentState_t));
+		if(snapSt.effectMem==NULL)
+		{
+			continue;
+		}
+		memSrc[i]=buf+used;
+		used+=snapSt.effectMemSize;
+		if(used>hdr.totalSize)
+		{
 			break;
+		}
+		//Re-use the current memory if it's large enough
+		if(i<currentNofSegments && segments[i].state.effectMem!=NULL && segments[i].state.effectMemSize>=snapSt.effectMemSize)
+		{
+			mem[i]=segments[i].state.effectMem;
+		}
+		else
+		{
+			mem[i]=malloc(snapSt.effectMemSize);
+			memNew[i]=true;
+			if(mem[i]==NULL)
+			{
+				used=UINT32_MAX;
+				break;
+			}
+		}
+	}
+	used+=sizeof(segSyncReleaseFade)+sizeof(modulators)+sizeof(modBindings);
+	if(used>hdr.totalSize || !animSeqRestore(buf+used,hdr.totalSize-used,false))
+	{
+		for(uint8_t i=0;i<hdr.nofSegments;i++)
+		{
+			if(memNew[i])
+			{
+				free(mem[i]);
+			}
+		}
+		return false;
+	}
+	//Everything is checked. Free memory that will no longer be used, and load the new state
+	for(uint8_t i=0;i<currentNofSegments;i++)
+	{
+		transitionEnd(i);
+		ledSegmentState_t* st=&(segments[i].state);
+		if(st->effectMem!=NULL && !st->effectMemExternal && (i>=hdr.nofSegments || mem[i]!=st->effectMem))
+		{
+			free(st->effectMem);
+		}
+		if(i>=hdr.nofSegments)
+		{
+			//Clear segments that are no longer used, so that they start from a clean state if initialized again
+			memset(&segments[i],0,sizeof(ledSegment_t));
+		}
+	}
+	for(uint8_t i=0;i<hdr.nofSegments;i++)
+	{
+		ledSegmentState_t* st=&(segments[i].state);
+		//Keep the ownership of re-used memory
+		bool external=false;
+		if(mem[i]!=NULL && !memNew[i])
+		{
+			external=st->effectMemExternal;
+		}
+		memcpy(&segments[i],&snapSegs[i],sizeof(ledSegment_t));
+		st->effectMem=mem[i];
+		st->effectMemExternal=external;
+		if(mem[i]!=NULL)
+		{
+			memcpy(mem[i],memSrc[i],st->effectMemSize);
+		}
 	}
-	switch(part)
+	currentNofSegments=hdr.nofSegments;
+	const uint8_t* p=buf+used-sizeof(segSyncReleaseFade)-sizeof(modulators)-sizeof(modBindings);
+	memcpy(segSyncReleaseFade,p,sizeof(segSyncReleaseFade));
+	p+=sizeof(segSyncReleaseFade);
+	memcpy(modulators,p,sizeof(modulators));
+	p+=sizeof(modulators);
+	memcpy(modBindings,p,sizeof(modBindings));
+	modNofBindings=0;
+	for(uint8_t i=0;i<LEDSEG_MAX_MOD_BINDINGS;i++)
 	{
-		case PULSE_MAX:
-			tmpCol=tmpMax;
-		break;
-		case PULSE_BEFORE:
-			tmpCol=tmpMin+(led)*(tmpMax-tmpMin)/ps->ledsFadeBefore;
-		break;
-		case PULSE_AFTER:
-			tmpCol=tmpMax-(led-ps->ledsFadeBefore-ps->ledsMaxPower-1)*(tmpMax-tmpMin)/ps->ledsFadeAfter;
-		break;
+		if(modBindings[i].used)
+		{
+			modNofBindings++;
+		}
 	}
-	return tmpCol;
+	animSeqRestore(buf+used,hdr.totalSize-used,true);
+	//Start a new update period
+	calcCycle=0;
+	currentSeg=0;
+	memset(segRenderNow,0,sizeof(segRenderNow));
+	memset(segCalcAhead,0,sizeof(segCalcAhead));
+	return true;
 }
 
 /*
- * Calculate and set the LEDs for a pulse
+ * Tells if a mode is a glitter mode
  */
-static void pulseCalcAndSet(uint8_t seg)
+bool ledSegisGlitterMode(ledSegmentMode_t mode)
 {
-	uint16_t start=0;
-	uint16_t stop=0;
-	uint8_t strip=0;
+	if(mode>=LEDSEG_MODE_GLITTER_LOOP && mode<=LEDSEG_MODE_GLITTER_BOUNCE)
+	{
+		return true;
+	}
+	else
+	{
+		return false;
+	}
+}
 
-	ledSegmentPulseSetting_t* ps;
-	ledSegmentState_t* st;
-	int8_t tmpDir=1;
-	uint16_t pulseLength=0;
+/*
+ * Returns the total length of a led segment
+ */
+uint16_t ledSegGetLen(uint8_t seg)
+{
+	if(!ledSegExistsNotAll(seg))
+	{
+		return 0;	//A non-exisiting ledSeg has the length of 0
+	}
+	return segments[seg].stop-segments[seg].start+1;
+}
 
-	uint8_t tmpR=0;
-	uint8_t tmpG=0;
-	uint8_t tmpB=0;
-	volatile uint8_t tmpSeg=seg;
-	if(!ledSegExists(seg))
+/*
+ * Calculates the fade colour of a segment at a given time, without running (or changing) the segment
+ * time is the time since the fade setting was loaded (in ms). It's counted in update periods (LEDSEG_UPDATE_PERIOD_TIME),
+ * and the result is exactly the colour the fade has after that many update periods.
+ * This is calculated directly (in constant time), so it can be used to seek in a show or preview future frames.
+ * Fades in a sync group or in a mode change can't be calculated, since they depend on other segments or on the time of the switch. Neither can keyframe fades.
+ * Returns false if the fade is not active, or can't be calculated
+ */
+bool ledSegEvalFade(uint8_t seg, uint32_t time, RGB_t* col)
+{
+	if(!ledSegExistsNotAll(seg) || col==NULL)
 	{
-		return;
+		return false;
 	}
-	//Extract useful information
-	st=&(segments[seg].state);
-	ps=&(st->confPulse);
-	start=segments[seg].start;
-	stop=segments[seg].stop;
-	strip=segments[seg].strip;
-	pulseLength=ps->ledsFadeAfter+ps->ledsFadeBefore+ps->ledsMaxPower;
-	uint16_t glitterTotal=ps->ledsMaxPower+ps->pixelsPerIteration;
-	bool glitterJustGenerated=false;
-	//Move LED and update direction
-	//Check if it's time to move a pixel
-	if(checkCycleCounterU16(&st->cyclesToPulseMove) && !st->pulseDone)
+	const ledSegmentState_t* st=&(segments[seg].state);
+	const ledSegmentFadeSetting_t* conf=&(st->confFade);
+	if(!st->fadeActive || st->switchMode || conf->syncGroup || conf->keyframeNum)
+	{
+		return false;
+	}
+	const uint8_t from[3]={conf->r_min,conf->g_min,conf->b_min};
+	const uint8_t to[3]={conf->r_max,conf->g_max,conf->b_max};
+	const uint8_t rate[3]={st->r_rate,st->g_rate,st->b_rate};
+	//The number of steps in each half cycle (all colours have reached their end)
+	uint32_t halfCycle=1;
+	for(uint8_t i=0;i<3;i++)
+	{
+		const uint8_t diff=abs(to[i]-from[i]);
+		if(diff)
+		{
+			if(!rate[i])
+			{
+				return false;
+			}
+			const uint32_t steps=(diff+rate[i]-1)/rate[i];
+			if(steps>halfCycle)
+			{
+				halfCycle=steps;
+			}
+		}
+	}
+	//The number of fade steps taken so far
+	uint32_t steps=time/LEDSEG_UPDATE_PERIOD_TIME;
+	if(conf->fadePeriodMultiplier)
+	{
+		steps/=conf->fadePeriodMultiplier;
+	}
+	const uint32_t halfCycles=steps/halfCycle;
+	uint32_t step=steps%halfCycle;
+	int8_t dir=conf->startDir;
+	if(conf->cycles && halfCycles>=conf->cycles)
+	{
+		//Done, the fade stays at the end of the last half cycle
+		if(conf->mode==LEDSEG_MODE_BOUNCE && !(conf->cycles&1))
+		{
+			dir*=-1;
+		}
+		step=halfCycle;
+	}
+	else if(conf->mode==LEDSEG_MODE_BOUNCE && (halfCycles&1))
+	{
+		dir*=-1;
+	}
+	uint8_t res[3];
+	for(uint8_t i=0;i<3;i++)
+	{
+		if(dir==1)
+		{
+			res[i]=fadeEvalChannel(from[i],to[i],rate[i],step);
+		}
+		else if(dir==-1)
+		{
+			res[i]=fadeEvalChannel(to[i],from[i],rate[i],step);
+		}
+		else
+		{
+			res[i]=from[i];
+		}
+	}
+	col->r=res[0];
+	col->g=res[1];
+	col->b=res[2];
+	return true;
+}
+
+/*
+ * Calculates the position of the pulse of a segment at a given time, without running (or changing) the segment
+ * time is the time since the pulse setting was loaded (in ms), counted in update periods (same as ledSegEvalFade)
+ * This is calculated directly (in constant time) for the loop, loop end and bounce modes.
+ * Bounce can only be calculated if the pulse moves, and moves less than the length of the segment each iteration.
+ * Returns false if the pulse can't be calculated (such as for glitter)
+ */
+bool ledSegEvalPulse(uint8_t seg, uint32_t time, ledSegmentPulsePos_t* pos)
+{
+	if(!ledSegExistsNotAll(seg) || pos==NULL)
+	{
+		return false;
+	}
+#if LEDSEG_EFFECT_PULSE_ENABLED
+	const ledSegment_t* sg=&segments[seg];
+	const ledSegmentPulseSetting_t* ps=&(sg->state.confPulse);
+	const ledSegmentEffect_t* fx=ledSegGetEffect(ps->mode);
+	if(fx==NULL || (fx!=&ledSegEffectPulseLoop && fx!=&ledSegEffectPulseLoopEnd && fx!=&ledSegEffectPulseBounce))
+	{
+		return false;
+	}
+	const int32_t len=sg->stop-sg->start+1;
+	const int32_t pulseLength=ps->ledsFadeAfter+ps->ledsFadeBefore+ps->ledsMaxPower;
+	const uint32_t ppi=ps->pixelsPerIteration;
+	const uint32_t cycles=ps->cycles;
+	//Everything is calculated as if the pulse moves upwards from the start of the segment, and converted back at the end
+	const int8_t startDir=ps->startDir;
+	const int32_t startPos=(startDir==-1) ? sg->stop-ps->startLed : ps->startLed-sg->start;
+	//The distance from the start to where the pulse has run off the end of the segment
+	const int32_t endDist=len-1+pulseLength;
+	int32_t rel=startPos;
+	int8_t dir=1;
+	pos->active=true;
+	pos->lastCycle=false;
+	//The number of times the pulse has moved
+	uint32_t moves=0;
+	if(ps->pixelTime)
+	{
+		moves=(time/LEDSEG_UPDATE_PERIOD_TIME)/ps->pixelTime;
+	}
+	if(fx==&ledSegEffectPulseBounce && (len<2 || ppi==0 || ppi>(uint32_t)(len-1)))
+	{
+		return false;
+	}
+	if(moves && ppi)
 	{
-		if(ps->mode == LEDSEG_MODE_LOOP_END || st->pulseUpdatedCycle)
+		if(fx==&ledSegEffectPulseLoopEnd)
+		{
+			//Each lap ends when the pulse has run off the end, and the next one starts from the beginning
+			const uint32_t firstLap=pulseEvalSteps(endDist-startPos,ppi);
+			const uint32_t lap=pulseEvalSteps(endDist,ppi);
+			uint32_t lapNum=1;
+			if(moves<firstLap)
+			{
+				rel=startPos+moves*ppi;
+			}
+			else
+			{
+				lapNum=2+(moves-firstLap)/lap;
+				rel=((moves-firstLap)%lap)*ppi;
+			}
+			if(cycles && lapNum>cycles)
+			{
+				pos->active=false;
+				rel=(cycles==1) ? startPos+firstLap*ppi : lap*ppi;
+			}
+			else if(cycles && lapNum==cycles && rel>=len)
+			{
+				pos->lastCycle=true;
+			}
+		}
+		else
 		{
-			if((st->currentLed>=start) && (st->currentLed<=stop) && utilValueWillOverflow(st->currentLed,ps->pixelsPerIteration*st->pulseDir,start,stop))
+			//The move which ends the last cycle. After it, the pulse runs off the end of the segment (like loop end)
+			uint64_t lastMove=UINT64_MAX;
+			int32_t lastPos=0;
+			if(fx==&ledSegEffectPulseLoop)
 			{
-				if(checkCycleCounter(&st->pulseCycle))
+				if(cycles)
 				{
-					st->pulseUpdatedCycle=true;
+					if(ppi>=(uint32_t)len)
+					{
+						lastMove=cycles;
+					}
+					else
+					{
+						lastMove=((uint64_t)cycles*len-startPos+ppi-1)/ppi;
+					}
+					//The pulse does not move on the last move
+					lastPos=(((lastMove-1)%len)*ppi+startPos)%len;
+				}
+				if(moves<lastMove)
+				{
+					rel=(((uint64_t)(moves%len))*ppi+startPos)%len;
 				}
 			}
-			st->currentLed =st->currentLed+ps->pixelsPerIteration*st->pulseDir;
-
-			int32_t tmpLed= st->currentLed;
-			if(st->pulseDir==1 && (tmpLed>=(pulseLength+stop)))
+			else
 			{
-				if(st->pulseUpdatedCycle)
+				//The pulse is reflected at each end, which repeats every 2*(len-1) steps
+				const uint32_t period=2*(len-1);
+				if(cycles)
 				{
-					st->pulseDone = true;
-					st->pulseActive = false;
-					st->pulseUpdatedCycle=false;
+					lastMove=((uint64_t)cycles*(len-1)+1-startPos+ppi-1)/ppi;
+					const uint32_t phase=(((lastMove%period)*ppi)+startPos)%period;
+					lastPos=(phase<=(uint32_t)(len-1)) ? phase : period-phase;
 				}
-				else
+				if(moves<lastMove)
+				{
+					const uint32_t phase=(((uint64_t)(moves%period))*ppi+startPos)%period;
+					rel=(phase<=(uint32_t)(len-1)) ? phase : period-phase;
+					if(phase==0 || phase>=(uint32_t)len)
+					{
+						dir=-1;
+					}
+				}
+				else if(!(cycles&1))
 				{
-					st->currentLed = start;
+					//The last cycle ends at the start of the segment
+					dir=-1;
 				}
 			}
-			else if(st->pulseDir==-1 && (tmpLed<=(int32_t)(start-pulseLength)))
+			if(moves>=lastMove)
 			{
-				if(st->pulseUpdatedCycle)
+				//Run off the end of the segment
+				const uint32_t movesOff=moves-lastMove;
+				const int32_t dist=(dir==1) ? endDist-lastPos : lastPos+pulseLength;
+				rel=lastPos+dir*(int32_t)(movesOff*ppi);
+				pos->lastCycle=true;
+				if(movesOff && movesOff>=pulseEvalSteps(dist,ppi))
 				{
-					st->pulseDone = true;
-					st->pulseActive = false;
-					st->pulseUpdatedCycle=false;
+					pos->active=false;
+					pos->lastCycle=false;
 				}
-				else
+			}
+		}
+	}
+	pos->currentLed=(startDir==-1) ? sg->stop-rel : sg->start+rel;
+	pos->dir=dir*startDir;
+	return true;
+#else
+	return false;
+#endif
+}
+
+/*
+ * Calculates the colour of an LED in a segment at a given time (fade with the pulse on top), without running (or changing) the segment
+ * The LED is counted from the first LED in the segment (same as ledSegSetLed)
+ * time is the time since the fade and pulse settings were loaded (in ms). Both are assumed to be loaded at the same time (such as from an animation point)
+ * This is meant for previewing or seeking, and for rendering only some LEDs (the cost does not depend on the segment length)
+ * Returns false if the LED is outside the segment, or if the colour can't be calculated (see ledSegEvalFade and ledSegEvalPulse)
+ */
+bool ledSegEvalLed(uint8_t seg, uint16_t led, uint32_t time, RGB_t* col)
+{
+	if(!ledIsWithinSeg(seg,led) || col==NULL)
+	{
+		return false;
+	}
+	const ledSegment_t* sg=&segments[seg];
+	ledSegmentState_t st=sg->state;
+	const int32_t ledNum=sg->invertPulse ? sg->stop-led+1 : sg->start+led-1;
+	bool hasCol=false;
+	if(st.fadeActive)
+	{
+		if(!ledSegEvalFade(seg,time,col))
+		{
+			return false;
+		}
+		hasCol=true;
+	}
+	else
+	{
+		col->r=st.r;
+		col->g=st.g;
+		col->b=st.b;
+	}
+	//A pulse which is done might still be running at the given time, but a disabled pulse is not
+	if(st.pulseActive || st.pulseDone)
+	{
+		ledSegmentPulsePos_t pos;
+		if(!ledSegEvalPulse(seg,time,&pos))
+		{
+			return false;
+		}
+		if(pos.active)
+		{
+			const ledSegmentPulseSetting_t* ps=&(st.confPulse);
+			const uint16_t pulseLength=ps->ledsFadeAfter+ps->ledsFadeBefore+ps->ledsMaxPower;
+			int32_t pulseLed=-1;
+			//Same order as when rendering, so that the last LED written wins
+			for(uint16_t i=0;i<pulseLength;i++)
+			{
+				int32_t n=pos.currentLed+i*pos.dir*-1;
+				if(!pos.lastCycle && ps->mode==LEDSEG_MODE_LOOP)
+				{
+					n=utilLoopValue(pos.currentLed,i*pos.dir*-1,sg->start,sg->stop);
+				}
+				else if(!pos.lastCycle && ps->mode==LEDSEG_MODE_BOUNCE)
+				{
+					n=utilBounceValue(pos.currentLed,i*pos.dir*-1,sg->start,sg->stop,NULL);
+				}
+				if(n==ledNum)
 				{
-					st->currentLed = stop;
+					pulseLed=i;
 				}
 			}
+			if(pulseLed>=0)
+			{
+				st.r=col->r;
+				st.g=col->g;
+				st.b=col->b;
+				const uint32_t pulseCol=pulseCalcColour(&st,pulseLed+1);
+				col->r=UNPACK_R(pulseCol);
+				col->g=UNPACK_G(pulseCol);
+				col->b=UNPACK_B(pulseCol);
+				hasCol=true;
+			}
+		}
+	}
+	return hasCol;
+}
+
+/*
+ * Starts a transition of a segment to a new fade and pulse setting. The old and the new setting are both rendered, and blended over time (in ms).
+ * Both settings keep running during the transition, so pulses and glitter transition smoothly as well. ease sets the curve of the blend.
+ * If fs or ps is NULL, that part of the setting continues unchanged. The new setting is loaded immediately, so all other functions work on the new setting.
+ * The extra memory and calculation is only used during the transition. If the segment is already in a transition, the old transition is ended first.
+ * Returns false if there is not enough memory (the new setting is then loaded directly) or if the fade setting is invalid (nothing is changed then)
+ */
+bool ledSegStartTransition(uint8_t seg, ledSegmentFadeSetting_t* fs, ledSegmentPulseSetting_t* ps, uint32_t time, ledSegmentEase_t ease)
+{
+	return ledSegStartTransitionWithType(seg,fs,ps,LEDSEG_TRANS_CROSSFADE,time,ease);
+}
+
+/*
+ * Same as ledSegStartTransition, but the old and new settings are combined as given by type (such as a wipe or a dissolve instead of a blend)
+ * For spatial transitions, ease sets how the edge moves (or how fast LEDs switch, for dissolve)
+ */
+bool ledSegStartTransitionWithType(uint8_t seg, ledSegmentFadeSetting_t* fs, ledSegmentPulseSetting_t* ps, ledSegmentTransition_t type, uint32_t time, ledSegmentEase_t ease)
+{
+	if(!ledSegExists(seg) || (fs!=NULL && fs->keyframeNum && fs->keyframePtr==NULL))
+	{
+		return false;
+	}
+	if(seg==LEDSEG_ALL)
+	{
+		bool ok=true;
+		for(uint8_t i=0;i<currentNofSegments;i++)
+		{
+			if(!isExcludedFromAll(i))
+			{
+				ok&=ledSegStartTransitionWithType(i,fs,ps,type,time,ease);
+			}
+		}
+		return ok;
+	}
+	ledSegment_t* sg=&segments[seg];
+	ledSegmentState_t* st=&(sg->state);
+	const uint16_t len=sg->stop-sg->start+1;
+	transitionEnd(seg);
+	uint32_t size=sizeof(ledSegTransition_t)+2*len*sizeof(apa102Pixel_t);
+	if(type==LEDSEG_TRANS_DISSOLVE)
+	{
+		size+=len*sizeof(uint16_t);
+	}
+	ledSegTransition_t* tr=malloc(size);
+	if(tr!=NULL)
+	{
+		memcpy(&tr->out,st,sizeof(ledSegmentState_t));
+		//The outgoing fade must not take part in syncing
+		tr->out.confFade.syncGroup=0;
+		tr->frames=time/LEDSEG_UPDATE_PERIOD_TIME;
+		if(tr->frames==0)
+		{
+			tr->frames=1;
+		}
+		tr->frame=0;
+		tr->ease=ease;
+		tr->type=type;
+		tr->lines=(apa102Pixel_t*)(tr+1);
+		tr->order=NULL;
+		if(type==LEDSEG_TRANS_DISSOLVE)
+		{
+			//Shuffle the LEDs once (Fisher-Yates), so each update only has to look up which LEDs have switched
+			//A copy of the random state is used, so that glitter is not affected
+			uint32_t randState=st->randState;
+			tr->order=(uint16_t*)(tr->lines+2*len);
+			for(uint16_t i=0;i<len;i++)
+			{
+				tr->order[i]=i;
+			}
+			for(uint16_t i=len-1;i>0;i--)
+			{
+				const uint16_t j=ledSegRandRange(&randState,i+1);
+				const uint16_t tmp=tr->order[i];
+				tr->order[i]=tr->order[j];
+				tr->order[j]=tmp;
+			}
+		}
+		if(ps!=NULL)
+		{
+			//The outgoing pulse keeps the effect memory, so the new pulse gets its own
+			st->effectMem=NULL;
+			st->effectMemSize=0;
+			st->effectMemExternal=false;
+		}
+		else if(st->effectMem!=NULL)
+		{
+			//The pulse is the same in both, so the outgoing pulse needs a copy of the effect memory
+			tr->out.effectMem=malloc(st->effectMemSize);
+			tr->out.effectMemExternal=false;
+			if(tr->out.effectMem!=NULL)
+			{
+				memcpy(tr->out.effectMem,st->effectMem,st->effectMemSize);
+			}
+			else
+			{
+				tr->out.pulseActive=false;
+			}
 		}
-		else if(ps->mode == LEDSEG_MODE_BOUNCE)
+	}
+	if(fs!=NULL)
+	{
+		ledSegSetFade(seg,fs);
+	}
+	if(ps!=NULL)
+	{
+		ledSegSetPulse(seg,ps);
+	}
+	segTransitions[seg]=tr;
+	return tr!=NULL;
+}
+
+/*
+ * Returns true if the segment is in a transition
+ * If LEDSEG_ALL is given, it will return true if any segment is in a transition
+ */
+bool ledSegGetTransitionActive(uint8_t seg)
+{
+	if(!ledSegExists(seg))
+	{
+		return false;
+	}
+	if(seg==LEDSEG_ALL)
+	{
+		for(uint8_t i=0;i<currentNofSegments;i++)
+		{
+			if(segTransitions[i]!=NULL)
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+	return segTransitions[seg]!=NULL;
+}
+
+/*
+ * Calculates a segment (or all segments) right away and pushes it to the strip, without waiting for the regular update
+ * This is used to show a new setting with as little delay as possible (for instance on a beat).
+ * If the strip is busy, this is done as soon as the current transfer is done (on the next ledSegRunIteration).
+ * The regular cycle skips the segment once afterwards, so it doesn't run faster
+ */
+bool ledSegRenderNow(uint8_t seg)
+{
+	if(!ledSegExists(seg))
+	{
+		return false;
+	}
+	if(seg==LEDSEG_ALL)
+	{
+		for(uint8_t i=0;i<currentNofSegments;i++)
+		{
+			if(!isExcludedFromAll(i))
+			{
+				segRenderNow[i]=true;
+			}
+		}
+	}
+	else
+	{
+		segRenderNow[seg]=true;
+	}
+	renderNowPending();
+	return true;
+}
+
+/*
+ * Registers a callback for the completion events of all segments (fade done, pulse done etc, see ledSegmentEvent_t)
+ * The events are sent at the end of the calculation cycle in which they happened, so anything waiting for them can react without polling
+ * The callback may change any segment setting. Returns false if there is no room for another callback
+ */
+bool ledSegAddEventCallback(ledSegEventCallback_t cb)
+{
+	if(cb==NULL)
+	{
+		return false;
+	}
+	for(uint8_t i=0;i<eventNofCallbacks;i++)
+	{
+		if(eventCallbacks[i]==cb)
+		{
+			return true;
+		}
+	}
+	if(eventNofCallbacks>=LEDSEG_MAX_EVENT_CALLBACKS)
+	{
+		return false;
+	}
+	eventCallbacks[eventNofCallbacks]=cb;
+	eventNofCallbacks++;
+	return true;
+}
+
+/*
+ * Removes a callback added by ledSegAddEventCallback
+ */
+bool ledSegRemoveEventCallback(ledSegEventCallback_t cb)
+{
+	for(uint8_t i=0;i<eventNofCallbacks;i++)
+	{
+		if(eventCallbacks[i]==cb)
+		{
+			eventNofCallbacks--;
+			eventCallbacks[i]=eventCallbacks[eventNofCallbacks];
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Sets up a modulator. Returns the modulator number, or LEDSEG_MAX_MODULATORS+1 if there is no free modulator (or the setting is invalid)
+ * The modulator does nothing until it's bound to a segment setting (see ledSegModBind)
+ */
+uint8_t ledSegModInit(ledSegmentModSetting_t* ms)
+{
+	if(ms==NULL || ms->source>=LEDSEG_MOD_NOF_SOURCES)
+	{
+		return LEDSEG_MAX_MODULATORS+1;
+	}
+	for(uint8_t i=0;i<LEDSEG_MAX_MODULATORS;i++)
+	{
+		if(!modulators[i].used)
+		{
+			ledSegModulator_t* m=&modulators[i];
+			memset(m,0,sizeof(ledSegModulator_t));
+			m->used=true;
+			m->randState=LEDSEG_RAND_SEED_FROM_ID(LEDSEG_RAND_DEFAULT_SEED,LEDSEG_MAX_SEGMENTS+i);
+			ledSegModSet(i,ms);
+			//Start at the given phase (or value)
+			if(ms->source==LEDSEG_MOD_RANDOM_WALK)
+			{
+				m->value=ms->phase;
+			}
+			else if(ms->source<=LEDSEG_MOD_SQUARE)
+			{
+				m->phase=(uint32_t)ms->phase<<16;
+				m->value=modCalcValue(m);
+				m->phase-=m->rate;	//The phase is advanced before it's used, so the first update period gives the start phase
+			}
+			return i;
+		}
+	}
+	return LEDSEG_MAX_MODULATORS+1;
+}
+
+/*
+ * Changes the setting of a modulator. The state (such as the LFO phase or the envelope level) is kept, so that the modulator continues smoothly
+ */
+bool ledSegModSet(uint8_t mod, ledSegmentModSetting_t* ms)
+{
+	if(mod>=LEDSEG_MAX_MODULATORS || !modulators[mod].used || ms==NULL || ms->source>=LEDSEG_MOD_NOF_SOURCES)
+	{
+		return false;
+	}
+	ledSegModulator_t* m=&modulators[mod];
+	if(m->conf.source!=ms->source)
+	{
+		//The phase means different things for different sources
+		m->phase=0;
+		m->stage=MOD_ENV_IDLE;
+	}
+	m->conf=*ms;
+	switch(ms->source)
+	{
+		case LEDSEG_MOD_SINE:
+		case LEDSEG_MOD_TRIANGLE:
+		case LEDSEG_MOD_SQUARE:
+		{
+			m->rate=(uint32_t)(((uint64_t)1<<32)/modTimeToPeriods(ms->period));
+			break;
+		}
+		case LEDSEG_MOD_RANDOM_WALK:
+		{
+			m->rate=modTimeToPeriods(ms->period);
+			if(m->phase>m->rate)
+			{
+				m->phase=m->rate;
+			}
+			break;
+		}
+		case LEDSEG_MOD_ENVELOPE:
+		{
+			m->envRate[0]=((uint32_t)0xFFFF<<16)/modTimeToPeriods(ms->attack);
+			m->envRate[1]=((uint32_t)(0xFFFF-ms->sustain)<<16)/modTimeToPeriods(ms->decay);
+			m->envRate[2]=((uint32_t)0xFFFF<<16)/modTimeToPeriods(ms->release);
+			break;
+		}
+		default:
+		{
+			break;
+		}
+	}
+	return true;
+}
+
+/*
+ * Frees a modulator, and removes all its bindings. The settings it was bound to keep their last value
+ */
+bool ledSegModFree(uint8_t mod)
+{
+	if(mod>=LEDSEG_MAX_MODULATORS || !modulators[mod].used)
+	{
+		return false;
+	}
+	for(uint8_t i=0;i<LEDSEG_MAX_MOD_BINDINGS;i++)
+	{
+		if(modBindings[i].used && modBindings[i].mod==mod)
+		{
+			ledSegModUnbind(i);
+		}
+	}
+	modulators[mod].used=false;
+	return true;
+}
+
+/*
+ * Sets the value of an external modulator. It's used from the next update period
+ */
+bool ledSegModSetInput(uint8_t mod, uint16_t value)
+{
+	if(mod>=LEDSEG_MAX_MODULATORS || !modulators[mod].used || modulators[mod].conf.source!=LEDSEG_MOD_EXTERNAL)
+	{
+		return false;
+	}
+	modulators[mod].input=value;
+	return true;
+}
+
+/*
+ * Starts (or restarts) an envelope. The attack starts from the current level
+ */
+bool ledSegModTrigger(uint8_t mod)
+{
+	if(mod>=LEDSEG_MAX_MODULATORS || !modulators[mod].used || modulators[mod].conf.source!=LEDSEG_MOD_ENVELOPE)
+	{
+		return false;
+	}
+	modulators[mod].stage=MOD_ENV_ATTACK;
+	return true;
+}
+
+/*
+ * Releases an envelope (it goes to 0)
+ */
+bool ledSegModRelease(uint8_t mod)
+{
+	if(mod>=LEDSEG_MAX_MODULATORS || !modulators[mod].used || modulators[mod].conf.source!=LEDSEG_MOD_ENVELOPE)
+	{
+		return false;
+	}
+	if(modulators[mod].stage!=MOD_ENV_IDLE)
+	{
+		modulators[mod].stage=MOD_ENV_RELEASE;
+	}
+	return true;
+}
+
+/*
+ * Returns the current value of a modulator (0 if it doesn't exist)
+ */
+uint16_t ledSegModGetValue(uint8_t mod)
+{
+	if(mod>=LEDSEG_MAX_MODULATORS || !modulators[mod].used)
+	{
+		return 0;
+	}
+	return modulators[mod].value;
+}
+
+/*
+ * Binds a modulator to a setting of a segment (or all segments, with LEDSEG_ALL)
+ * Every update period, the setting is set to min+(max-min)*value/65535, where value is the output of the modulator
+ * The setting is changed in place, so the fade and pulse continue without restarting
+ * Returns the binding number, or LEDSEG_MAX_MOD_BINDINGS+1 if there is no free binding (or the modulator or segment doesn't exist)
+ */
+uint8_t ledSegModBind(uint8_t mod, uint8_t seg, ledSegmentModTarget_t target, uint16_t min, uint16_t max)
+{
+	if(mod>=LEDSEG_MAX_MODULATORS || !modulators[mod].used || !ledSegExists(seg) || target>=LEDSEG_MOD_NOF_TARGETS)
+	{
+		return LEDSEG_MAX_MOD_BINDINGS+1;
+	}
+	for(uint8_t i=0;i<LEDSEG_MAX_MOD_BINDINGS;i++)
+	{
+		if(!modBindings[i].used)
+		{
+			modBindings[i].used=true;
+			modBindings[i].mod=mod;
+			modBindings[i].seg=seg;
+			modBindings[i].target=target;
+			modBindings[i].min=min;
+			modBindings[i].max=max;
+			modNofBindings++;
+			return i;
+		}
+	}
+	return LEDSEG_MAX_MOD_BINDINGS+1;
+}
+
+/*
+ * Removes a binding. The setting keeps its last value
+ */
+bool ledSegModUnbind(uint8_t binding)
+{
+	if(binding>=LEDSEG_MAX_MOD_BINDINGS || !modBindings[binding].used)
+	{
+		return false;
+	}
+	modBindings[binding].used=false;
+	modNofBindings--;
+	return true;
+}
+
+/*
+ * The great big update function. This should be run as often as possible (not from interrupts!)
+ * It keeps its own time gate, and will from time to time create a heavy load
+ *
+ * It uses the following scheme:
+ * The whole LED-system (all strips) is updated every LEDSEG_UPDATE_PERIOD_TIME.
+ * It has several calculations cycles per period (configurable in ledSegment.h). Each of these iterations, a calculation is performed
+ * Each calculation cycle will calculate a fraction of the total number of segments and load this into the big pixel array
+ * Note: no calculations are done while the strips are updating (the DMA is running).
+ *	 Otherwise, we would need to keep two copies of the whole pixel map, costing about 3kB of additional RAM
+ *
+ *	 Add an option in fadeSetting or a state in fadeState.
+ *	 The fade state or conf will need to remember some parts of the fade setting (the min colours, that it's fade, and the number of cycles)
+ *	 Set up the fade as normal, but create that special setting that allows fade between two colours and one cycle.
+ *	 Once fadeDone is true, switch the fade to the fade that's it supposed to be and switch to that
+ *
+ */
+void ledSegRunIteration()
+{
+	ledSegRunIterationCustom(NULL);
+}
+
+/*
+ * Same as ledSegRunIteration, but each segment is calculated by calcSeg instead of the generic calculation.
+ * This is used by front ends that know the segments at compile time (see ledSegment.hpp)
+ * calcSeg shall call ledSegCalcFade and ledSegCalcPulse (or do the equivalent). If NULL, the generic calculation is used
+ */
+void ledSegRunIterationCustom(ledSegCalcFunc_t calcSeg)
+{
+	static uint32_t nextCallTime=0;
+	const uint32_t now=ledSegGetTime();
+
+	//Temporary variables
+	uint8_t stopSegment=0;
+	//These two are to measure the time the calculation takes
+	volatile uint32_t startVal=0;
+	volatile uint32_t timeTaken=0;
+
+	lastCalcSeg=calcSeg;
+	//Segments that shall be shown right away go first, as soon as their strip is free
+	renderNowPending();
+	//The clock may have been moved back (see ledSegSetClock)
+	if(nextCallTime>now+LEDSEG_UPDATE_PERIOD_TIME)
+	{
+		nextCallTime=now;
+	}
+	if(now>nextCallTime && !apa102DMABusy(APA_ALL_STRIPS))
+	{
+		calcRunning=true;
+		calcCycle++;
+		nextCallTime=now+LEDSEG_UPDATE_PERIOD_TIME/LEDSEG_CALCULATION_CYCLES;
+		//The modulators are evaluated once per update period, before any segment is calculated
+		if(calcCycle==1)
+		{
+			modUpdate();
+		}
+		//Calculate the number of segments to calculate this cycle (always try to calculate one segment, even though it doesn't exist)
+		stopSegment=currentSeg+currentNofSegments/LEDSEG_CALCULATION_CYCLES+1;
+		//Calculate all active segments for this cycle
+		while(ledSegExists(currentSeg) && currentSeg<stopSegment)
+		{
+			startVal=microSeconds();
+			//A segment that was rendered out of cycle has already been calculated for this update period
+			if(segCalcAhead[currentSeg])
+			{
+				segCalcAhead[currentSeg]=false;
+			}
+			else
+			{
+				segCalcPeriod(currentSeg,calcSeg);
+			}
+			timeTaken=microSeconds()-startVal;
+			currentSeg++;
+		}
+		//Let everyone waiting for the segments react in the same cycle (before the strip is updated)
+		eventDispatch();
+		//Update calculation cycle and check if we should update the physical strip
+		if(calcCycle>=LEDSEG_CALCULATION_CYCLES)
+		{
+			//Update LEDs and restart calc cycle
+			apa102UpdateStrip(APA_ALL_STRIPS);
+			calcCycle=0;
+			currentSeg=0;
+		}
+		calcRunning=false;
+	}
+}
+
+/*
+ * Calculates all segments for one complete update period right away, without updating the strips
+ * This is used to fast-forward the engine, such as when the show time jumps (see timecode.h). animTask should be called after each period
+ * Whatever was left of the current update period is skipped, and a new one is started
+ * Returns false if the segments are already being calculated
+ */
+bool ledSegStepPeriod()
+{
+	if(calcRunning)
+	{
+		return false;
+	}
+	calcRunning=true;
+	modUpdate();
+	for(uint8_t i=0;i<currentNofSegments;i++)
+	{
+		segCalcPeriod(i,lastCalcSeg);
+	}
+	eventDispatch();
+	calcCycle=0;
+	currentSeg=0;
+	memset(segCalcAhead,0,sizeof(segCalcAhead));
+	calcRunning=false;
+	return true;
+}
+
+/*
+ * Sets the clock the engine runs on (in ms). The update periods and the animation sequences follow it
+ * This can be a show time that follows timecode (see timecode.h). If the clock stops, everything stops, and if it runs fast, everything runs fast
+ * Set to NULL to use systemTime
+ */
+void ledSegSetClock(ledSegClockFunc_t clock)
+{
+	engineClock=clock;
+}
+
+/*
+ * Returns the time of the clock the engine runs on (see ledSegSetClock)
+ */
+uint32_t ledSegGetTime()
+{
+	return (engineClock!=NULL ? engineClock() : systemTime);
+}
+
+/*
+ * Calculates the fade of a segment for one update period and writes the fill colour to the LED buffer
+ * Does nothing if the fade is not active
+ */
+void ledSegCalcFade(uint8_t seg)
+{
+	if(!ledSegExistsNotAll(seg))
+	{
+		return;
+	}
+	ledSegment_t* sg=&segments[seg];
+	ledSegmentState_t* st=&(sg->state);
+	if(st->fadeActive)
+	{
+		if(checkCycleCounterU16(&st->cyclesToFadeChange))
+		{
+			fadeCalcColour(seg);
+			st->cyclesToFadeChange = st->confFade.fadePeriodMultiplier;
+		}
+		//It will most likely take longer time to calculate which LEDs should not be filled,
+		//rather than just filling them and overwriting them. Writing a single pixel with force does not take very long time
+		apa102FillRange(sg->strip,sg->start,sg->stop,st->r,st->g,st->b,st->confFade.globalSetting);
+	}
+}
+
+/*
+ * Calculates the pulse of a segment for one update period and writes it to the LED buffer (on top of the fade colour)
+ * fx is the effect to use. It must be the effect for the current pulse mode. If NULL, it's looked up from the registry
+ * Does nothing if the pulse is not active
+ */
+void ledSegCalcPulse(uint8_t seg, const ledSegmentEffect_t* fx)
+{
+	if(!ledSegExistsNotAll(seg) || !segments[seg].state.pulseActive)
+	{
+		return;
+	}
+	pulseCalcAndSet(seg,fx);
+}
+
+/*
+ * Calculates the pulse of a segment with a given built-in effect, without going through the registry or any function pointer
+ * The effect must be the one for the current pulse mode (ledSegment.hpp uses these when the mode is known at compile time)
+ * Does nothing if the pulse is not active
+ */
+#if LEDSEG_EFFECT_PULSE_ENABLED
+void ledSegCalcPulseLoop(uint8_t seg)
+{
+	if(!ledSegExistsNotAll(seg) || !segments[seg].state.pulseActive)
+	{
+		return;
+	}
+	pulseStep(&segments[seg],pulseAdvanceLoop,pulseRenderLoop);
+}
+
+void ledSegCalcPulseLoopEnd(uint8_t seg)
+{
+	if(!ledSegExistsNotAll(seg) || !segments[seg].state.pulseActive)
+	{
+		return;
+	}
+	pulseStep(&segments[seg],pulseAdvanceLoopEnd,pulseRenderLoopEnd);
+}
+
+void ledSegCalcPulseBounce(uint8_t seg)
+{
+	if(!ledSegExistsNotAll(seg) || !segments[seg].state.pulseActive)
+	{
+		return;
+	}
+	pulseStep(&segments[seg],pulseAdvanceBounce,pulseRenderBounce);
+}
+#endif
+#if LEDSEG_EFFECT_GLITTER_ENABLED
+void ledSegCalcGlitter(uint8_t seg)
+{
+	if(!ledSegExistsNotAll(seg) || !segments[seg].state.pulseActive)
+	{
+		return;
+	}
+	pulseStep(&segments[seg],glitterAdvance,glitterRender);
+}
+#endif
+
+
+
+//-------------Internal functions------------------------//
+
+/*
+ * Calculate the colour of a led faded in a pulse (all colours packed)
+ * led is the led within the pulse, counted from currentLed (the first LED with a colour).
+ * led is indexed from reality (meaning currentLed has value 1, and that the lowest value is 1)
+ */
+static uint32_t pulseCalcColour(ledSegmentState_t* st,uint16_t led)
+{
+	ledSegmentPulseSetting_t* ps;
+	ps=&(st->confPulse);
+	uint32_t maxP=0;
+
+	if(ps->colourSeqNum)
+	{
+		uint8_t tmp=1;
+		if(ps->colourSeqLoops)
+		{
+			tmp=ps->colourSeqLoops;
+		}
+		uint16_t ledsPerColour=(ps->ledsFadeBefore+ps->ledsMaxPower+ps->ledsFadeAfter)/(tmp*ps->colourSeqNum);
+		//If the pulse is shorter than PRIDE_COL_NOF_COLOURS, this will not work well
+		if(ledsPerColour<1)
+		{
+			ledsPerColour=1;
+		}
+		uint16_t colIndex=((led-1)/ledsPerColour)%ps->colourSeqNum;
+		RGB_t RGBMaxTmp=animGetColourFromSequence(ps->colourSeqPtr,colIndex,255);
+		maxP=PACK_RGB(RGBMaxTmp.r,RGBMaxTmp.g,RGBMaxTmp.b);
+	}
+	else
+	{
+		maxP=PACK_RGB(ps->r_max,ps->g_max,ps->b_max);
+	}
+	if(led<=ps->ledsFadeBefore)
+	{
+		//Fade from the fade colour up to max
+		return packedBlend(PACK_RGB(st->r,st->g,st->b),maxP,((uint32_t)led<<8)/ps->ledsFadeBefore);
+	}
+	else if(led<=(ps->ledsFadeBefore+ps->ledsMaxPower))
+	{
+		return maxP;
+	}
+	else
+	{
+		//Fade from max down to the fade colour
+		uint32_t ledAfter=led-ps->ledsFadeBefore-ps->ledsMaxPower-1;
+		return packedBlend(PACK_RGB(st->r,st->g,st->b),maxP,256-(ledAfter<<8)/ps->ledsFadeAfter);
+	}
+}
+
+/*
+ * Calculate and set the LEDs for a pulse
+ * Dispatches to the given effect, or to the effect registered for the pulse mode if fx is NULL
+ */
+static void pulseCalcAndSet(uint8_t seg, const ledSegmentEffect_t* fx)
+{
+	if(!ledSegExistsNotAll(seg))
+	{
+		return;
+	}
+	ledSegment_t* sg=&segments[seg];
+	if(fx==NULL)
+	{
+		fx=ledSegGetEffect(sg->state.confPulse.mode);
+	}
+	if(fx==NULL)
+	{
+		//Invalid (or excluded) mode, fail silently
+		return;
+	}
+	pulseStep(sg,fx->advance,fx->render);
+}
+
+/*
+ * Moves (when it's time) and draws an effect
+ * Inlined, so that callers giving constant functions (the direct entry points) call the effect without going through a pointer
+ */
+static inline void pulseStep(ledSegment_t* sg, bool (*advance)(ledSegment_t* sg), void (*render)(ledSegment_t* sg, bool advanced))
+{
+	ledSegmentState_t* st=&(sg->state);
+	bool advanced=false;
+	//Check if it's time to move the effect
+	if(checkCycleCounterU16(&st->cyclesToPulseMove) && !st->pulseDone)
+	{
+		advanced=advance(sg);
+		st->cyclesToPulseMove = st->confPulse.pixelTime;
+	}
+	//The effect might have finished while advancing
+	if(st->pulseActive)
+	{
+		render(sg,advanced);
+	}
+}
+
+/*
+ * Returns the effect registered for a mode (NULL if there is none)
+ */
+const ledSegmentEffect_t* ledSegGetEffect(ledSegmentMode_t mode)
+{
+	if((uint16_t)mode>=LEDSEG_MAX_EFFECTS)
+	{
+		return NULL;
+	}
+	return effects[mode];
+}
+
+/*
+ * Registers an effect for a mode, replacing any existing effect
+ * This is used to add custom effects (using modes from LEDSEG_MODE_NOF_MODES) without changing the update loop
+ * Giving fx as NULL removes the effect. Should be done before any segment is set to use the mode.
+ * Returns false if the mode is out of range
+ */
+bool ledSegRegisterEffect(ledSegmentMode_t mode, const ledSegmentEffect_t* fx)
+{
+	if((uint16_t)mode>=LEDSEG_MAX_EFFECTS)
+	{
+		return false;
+	}
+	effects[mode]=fx;
+	return true;
+}
+
+#if LEDSEG_EFFECT_PULSE_ENABLED
+/*
+ * Sets up the start LED of a pulse
+ */
+static void pulseInit(ledSegment_t* sg)
+{
+	ledSegmentState_t* st=&(sg->state);
+	ledSegmentPulseSetting_t* pu=&(st->confPulse);
+	//Allows to start index from the back
+	while(pu->startLed<0)
+	{
+		pu->startLed=pu->startLed+sg->stop-sg->start+2;
+	}
+	if(sg->invertPulse)
+	{
+		pu->startLed = sg->stop-pu->startLed+1;
+		pu->startDir *= -1;
+	}
+	else
+	{
+		pu->startLed = sg->start + pu->startLed-1;
+	}
+	if(pu->startLed>sg->stop)
+	{
+		pu->startLed=sg->stop;
+	}
+	else if(pu->startLed < sg->start)
+	{
+		pu->startLed=sg->start;
+	}
+	st->currentLed = pu->startLed;
+	st->cyclesToPulseMove = pu->pixelTime;
+}
+
+/*
+ * Moves a pulse that runs off the end of the segment (loop_end, and the last cycle of the other pulse modes)
+ */
+static bool pulseAdvanceLoopEnd(ledSegment_t* sg)
+{
+	ledSegmentState_t* st=&(sg->state);
+	ledSegmentPulseSetting_t* ps=&(st->confPulse);
+	const uint16_t start=sg->start;
+	const uint16_t stop=sg->stop;
+	const uint16_t pulseLength=ps->ledsFadeAfter+ps->ledsFadeBefore+ps->ledsMaxPower;
+
+	if((st->currentLed>=start) && (st->currentLed<=stop) && utilValueWillOverflow(st->currentLed,ps->pixelsPerIteration*st->pulseDir,start,stop))
+	{
+		if(checkCycleCounter(&st->pulseCycle))
+		{
+			st->pulseUpdatedCycle=true;
+		}
+	}
+	st->currentLed =st->currentLed+ps->pixelsPerIteration*st->pulseDir;
+
+	int32_t tmpLed= st->currentLed;
+	if(st->pulseDir==1 && (tmpLed>=(pulseLength+stop)))
+	{
+		if(st->pulseUpdatedCycle)
+		{
+			st->pulseDone = true;
+			st->pulseActive = false;
+			eventRaise(sg-segments,LEDSEG_EVENT_PULSE_DONE);
+			st->pulseUpdatedCycle=false;
+		}
+		else
+		{
+			st->currentLed = start;
+		}
+	}
+	else if(st->pulseDir==-1 && (tmpLed<=(int32_t)(start-pulseLength)))
+	{
+		if(st->pulseUpdatedCycle)
+		{
+			st->pulseDone = true;
+			st->pulseActive = false;
+			eventRaise(sg-segments,LEDSEG_EVENT_PULSE_DONE);
+			st->pulseUpdatedCycle=false;
+		}
+		else
+		{
+			st->currentLed = stop;
+		}
+	}
+	return false;
+}
+
+/*
+ * Moves a pulse in loop mode
+ */
+static bool pulseAdvanceLoop(ledSegment_t* sg)
+{
+	ledSegmentState_t* st=&(sg->state);
+	ledSegmentPulseSetting_t* ps=&(st->confPulse);
+	if(st->pulseUpdatedCycle)
+	{
+		return pulseAdvanceLoopEnd(sg);
+	}
+	if(utilValueWillOverflow(st->currentLed,ps->pixelsPerIteration*st->pulseDir,sg->start,sg->stop))
+	{
+		if(checkCycleCounter(&st->pulseCycle))
+		{
+			st->pulseUpdatedCycle=true;
+		}
+	}
+	if(!st->pulseUpdatedCycle)
+	{
+		st->currentLed = utilLoopValue(st->currentLed,ps->pixelsPerIteration*st->pulseDir,sg->start,sg->stop);
+	}
+	return false;
+}
+
+/*
+ * Moves a pulse in bounce mode
+ */
+static bool pulseAdvanceBounce(ledSegment_t* sg)
+{
+	ledSegmentState_t* st=&(sg->state);
+	ledSegmentPulseSetting_t* ps=&(st->confPulse);
+	int8_t tmpDir=1;
+	if(st->pulseUpdatedCycle)
+	{
+		return pulseAdvanceLoopEnd(sg);
+	}
+	st->currentLed = utilBounceValue(st->currentLed,ps->pixelsPerIteration*st->pulseDir,sg->start,sg->stop,&tmpDir);
+	if(st->pulseDir!=tmpDir)
+	{
+		if(checkCycleCounter(&st->pulseCycle))
+		{
+			st->pulseUpdatedCycle=true;
+		}
+		else
+		{
+			st->pulseDir=tmpDir;
+		}
+	}
+	return false;
+}
+
+/*
+ * Calculates the colour and writes LED number i in the pulse (counted from 0) to the strip position ledNum
+ * Nothing is written if ledNum is outside of the segment
+ */
+static void pulseSetLed(ledSegment_t* sg, uint16_t i, int16_t ledNum)
+{
+	if(ledNum>=sg->start && ledNum<=sg->stop)
+	{
+		ledSegmentState_t* st=&(sg->state);
+		uint32_t col=pulseCalcColour(st,i+1);
+		apa102SetPixelWithGlobal(sg->strip,ledNum,UNPACK_R(col),UNPACK_G(col),UNPACK_B(col),st->confPulse.globalSetting,true);
+	}
+}
+
+/*
+ * Sets the colour for all LEDs in a pulse that runs off the end of the segment
+ */
+static void pulseRenderLoopEnd(ledSegment_t* sg, bool advanced)
+{
+	(void)advanced;	//A pulse is drawn the same way whether it moved or not
+	ledSegmentState_t* st=&(sg->state);
+	ledSegmentPulseSetting_t* ps=&(st->confPulse);
+	const uint16_t pulseLength=ps->ledsFadeAfter+ps->ledsFadeBefore+ps->ledsMaxPower;
+	for(uint16_t i=0;i<pulseLength;i++)
+	{
+		pulseSetLed(sg,i,st->currentLed+i*st->pulseDir*-1);
+	}
+}
+
+/*
+ * Sets the colour for all LEDs in a looping pulse
+ */
+static void pulseRenderLoop(ledSegment_t* sg, bool advanced)
+{
+	ledSegmentState_t* st=&(sg->state);
+	ledSegmentPulseSetting_t* ps=&(st->confPulse);
+	const uint16_t pulseLength=ps->ledsFadeAfter+ps->ledsFadeBefore+ps->ledsMaxPower;
+	if(st->pulseUpdatedCycle)
+	{
+		pulseRenderLoopEnd(sg,advanced);
+		return;
+	}
+	for(uint16_t i=0;i<pulseLength;i++)
+	{
+		pulseSetLed(sg,i,utilLoopValue(st->currentLed,i*st->pulseDir*-1,sg->start,sg->stop));
+	}
+}
+
+/*
+ * Sets the colour for all LEDs in a bouncing pulse
+ */
+static void pulseRenderBounce(ledSegment_t* sg, bool advanced)
+{
+	ledSegmentState_t* st=&(sg->state);
+	ledSegmentPulseSetting_t* ps=&(st->confPulse);
+	const uint16_t pulseLength=ps->ledsFadeAfter+ps->ledsFadeBefore+ps->ledsMaxPower;
+	if(st->pulseUpdatedCycle)
+	{
+		pulseRenderLoopEnd(sg,advanced);
+		return;
+	}
+	for(uint16_t i=0;i<pulseLength;i++)
+	{
+		pulseSetLed(sg,i,utilBounceValue(st->currentLed,i*st->pulseDir*-1,sg->start,sg->stop,NULL));
+	}
+}
+#endif
+
+#if LEDSEG_EFFECT_GLITTER_ENABLED
+/*
+ * Returns the size of the glitter ring buffer
+ */
+static uint16_t glitterMemSize(const ledSegmentPulseSetting_t* ps)
+{
+	return (ps->ledsMaxPower+ps->pixelsPerIteration)*sizeof(uint16_t);
+}
+
+/*
+ * Sets up the ring buffer index and the glitter timing
+ */
+static void glitterInit(ledSegment_t* sg)
+{
+	ledSegmentState_t* st=&(sg->state);
+	ledSegmentPulseSetting_t* pu=&(st->confPulse);
+	st->currentLed=0;	//currentLed is used as index in the ringbuffer.
+
+	//For glitter mode, pixelTime setting is the total time for fade of all the glitter pixels together.
+	//Therefore, we calculate the number of LEDSEG_UPDATE_PERIOD_TIME-cycles is needed for each glitter subsegment
+	//(GCC will probably optimize this)
+	uint32_t pixelTimeTemp=0;
+	pixelTimeTemp=pu->pixelTime/LEDSEG_UPDATE_PERIOD_TIME;	//Total number of update periods for all glitter points (until the whole cycle is done)
+	pixelTimeTemp=pixelTimeTemp*pu->pixelsPerIteration/pu->ledsMaxPower;	//The time it will take for each cycle to fade completely from 0 to max
+	if(pixelTimeTemp==0)
+	{
+		pixelTimeTemp=1;
+	}
+	pu->pixelTime=pixelTimeTemp;
+	st->cyclesToPulseMove=1;	//So that we get LEDs from the beginning
+}
+
+/*
+ * Generates new glitter LEDs. Returns true if new LEDs were generated
+ */
+static bool glitterAdvance(ledSegment_t* sg)
+{
+	ledSegmentState_t* st=&(sg->state);
+	ledSegmentPulseSetting_t* ps=&(st->confPulse);
+	uint16_t* activeLeds=(uint16_t*)st->effectMem;
+	const uint16_t glitterTotal=ps->ledsMaxPower+ps->pixelsPerIteration;
+	if(activeLeds==NULL)
+	{
+		return false;
+	}
+	//If fade is not active, make sure to clear all LEDs (which is what the fade would have done)
+	if(!st->fadeActive)
+	{
+		for(uint16_t i=0;i<glitterTotal;i++)
+		{
+			segSetLed(sg,activeLeds[i],0,0,0,ps->globalSetting);
+		}
+	}
+	//For glitter mode, we will generate new LEDs now
+	//Here, we also check what we need to do based on mode.
+	if(st->currentLed>=glitterTotal)
+	{
+		if(ps->mode==LEDSEG_MODE_GLITTER_LOOP)
+		{
+			memset(activeLeds,0,glitterTotal*sizeof(uint16_t));
+			st->currentLed=0;
+		}
+	}
+	//This will handle LEDSEG_MODE_GLITTER_LOOP_END (and also other unforeseen things)
+	if(st->currentLed>=glitterTotal)
+	{
+		return false;
+	}
+	//Generate all new random LEDs in one go: from the current index to the end of the ring buffer, and (in loop_persist) from the start
+	//Todo: This method might generate LEDs that are already lit. To avoid this, we would need to look through the entire buffer for each new LED. Sorting might help here. Don't this unless really needed.
+	const uint16_t segLen=sg->stop-sg->start+1;
+	if(st->pulseDir==1)
+	{
+		uint16_t n=glitterTotal-st->currentLed;
+		if(n>ps->pixelsPerIteration)
+		{
+			n=ps->pixelsPerIteration;
+		}
+		ledSegRandFill(&st->randState,&activeLeds[st->currentLed],n,segLen,1);	//LEDs are counted from 1 in the segment
+		if(n<ps->pixelsPerIteration && ps->mode == LEDSEG_MODE_GLITTER_LOOP_PERSIST)
+		{
+			ledSegRandFill(&st->randState,&activeLeds[0],ps->pixelsPerIteration-n,segLen,1);
+		}
+	}
+	for(uint16_t i=0;i<ps->pixelsPerIteration;i++)
+	{
+		if(st->pulseDir==-1)
+		{
+			activeLeds[st->currentLed]=0;	//Clear the current LED if direction is down
+		}
+		if(st->pulseDir==-1 && st->currentLed==0)
+		{
+			st->currentLed=1;
+		}
+		st->currentLed+=st->pulseDir;
+		if(st->currentLed>=glitterTotal)
+		{
+			st->pulseUpdatedCycle=true;
+			//In loop_persist, we will restart the ring buffer from 0
+			if(ps->mode == LEDSEG_MODE_GLITTER_LOOP_PERSIST)
+			{
+				st->currentLed=0;
+			}
+			else if(ps->mode==LEDSEG_MODE_GLITTER_BOUNCE)
+			{
+				st->currentLed=glitterTotal-1;
+				st->pulseDir=-1;
+				break;
+			}
+			else	//For LEDSEG_MODE_GLITTER_LOOP and LOOP_END
+			{
+				st->currentLed=glitterTotal;
+				break;
+			}
+		}
+		else if(st->currentLed==0 && ps->mode==LEDSEG_MODE_GLITTER_BOUNCE)
+		{
+			st->pulseUpdatedCycle=true;
+			st->pulseDir=1;
+			//The rest of this step adds LEDs from the start of the buffer, so they need new positions
+			uint16_t n=ps->pixelsPerIteration-i-1;
+			if(n>glitterTotal)
+			{
+				n=glitterTotal;
+			}
+			ledSegRandFill(&st->randState,&activeLeds[0],n,segLen,1);
+		}
+	}
+	return true;
+}
+
+/*
+ * Returns the max colour for a glitter LED (handles colour sequences)
+ */
+static RGB_t glitterGetMaxColour(ledSegmentPulseSetting_t* ps, uint16_t ledIndex, uint16_t ledsPerCol)
+{
+	RGB_t RGBMaxTmp;
+	if(ps->colourSeqNum)
+	{
+		uint16_t colIndex=((ledIndex-1)/ledsPerCol)%ps->colourSeqNum;
+		RGBMaxTmp=animGetColourFromSequence(ps->colourSeqPtr,colIndex,255);
+	}
+	else
+	{
+		RGBMaxTmp.r=ps->r_max;
+		RGBMaxTmp.g=ps->g_max;
+		RGBMaxTmp.b=ps->b_max;
+	}
+	return RGBMaxTmp;
+}
+
+/*
+ * Fades the newest glitter LEDs and writes all lit glitter LEDs
+ * advanced indicates that new LEDs were just generated (and that the fade colour shall restart)
+ */
+static void glitterRender(ledSegment_t* sg, bool advanced)
+{
+	ledSegmentState_t* st=&(sg->state);
+	ledSegmentPulseSetting_t* ps=&(st->confPulse);
+	const uint16_t* activeLeds=(const uint16_t*)st->effectMem;
+	const uint16_t glitterTotal=ps->ledsMaxPower+ps->pixelsPerIteration;
+	if(activeLeds==NULL)
+	{
+		return;
+	}
+	//Load the current index of the ring buffer
+	uint16_t currentIndex=st->currentLed;
+	if((ps->mode == LEDSEG_MODE_GLITTER_LOOP || ps->mode == LEDSEG_MODE_GLITTER_LOOP_END) && currentIndex==glitterTotal)
+	{
+		currentIndex--;
+	}
+	//Calculate how many leds per colout for rainbowMode
+	uint16_t ledsPerCol=0;
+	if(ps->colourSeqNum)
+	{
+		uint8_t tmp=1;
+		if(ps->colourSeqLoops)
+		{
+			tmp=ps->colourSeqLoops;
+		}
+		ledsPerCol=(sg->stop-sg->start)/(ps->colourSeqNum*tmp);
+	}
+
+	//Handles the LED fading (the newest LEDs) for all modes. If no fading is going on (because we're done), currentIndex==glitterTotal.
+	if(currentIndex<glitterTotal)
+	{
+		//Todo: Check general buffer indexing to see if we miss/use the same LED multiple times, etc
+
+		//Go through the ring buffer in reverse, setting all fade LEDs to the proper colour
+		for(uint16_t i=0;i<ps->pixelsPerIteration;i++)
+		{
+			//Get which LED it is (updating the ring buffer)
+			if(currentIndex>0)
+			{
+				currentIndex--;
+			}
+			else
+			{
+				currentIndex=glitterTotal-1;
+			}
+			uint16_t ledIndex=activeLeds[currentIndex];
+			RGB_t RGBMaxTmp=glitterGetMaxColour(ps,ledIndex,ledsPerCol);
+			//Only reset the colour if new LEDs were just generated
+			if(advanced)
+			{
+				if(ps->mode == LEDSEG_MODE_GLITTER_BOUNCE && st->pulseDir==-1)
+				{
+					st->glitterR=RGBMaxTmp.r;
+					st->glitterG=RGBMaxTmp.g;
+					st->glitterB=RGBMaxTmp.b;
+				}
+				else
+				{
+					//Reset fade colour to 0, to start a new fade cycle
+					st->glitterR=0;//st->r;
+					st->glitterG=0;//st->g;
+					st->glitterB=0;//st->b;
+				}
+			}
+			//Update colour
+			//Todo: Make sure we can fade to and from st->rgb (might require quite a bit of code and possibly syncing to get right...)
+
+			const uint32_t maxP=PACK_RGB(RGBMaxTmp.r,RGBMaxTmp.g,RGBMaxTmp.b);
+			const uint32_t rate=PACK_RGB(RGBMaxTmp.r/ps->pixelTime,RGBMaxTmp.g/ps->pixelTime,RGBMaxTmp.b/ps->pixelTime);
+			uint32_t col=PACK_RGB(st->glitterR,st->glitterG,st->glitterB);
+			if(st->pulseDir==1)
+			{
+				col=packedMin(packedAddSat(col,rate),maxP);
+			}
+			else if(st->pulseDir==-1)
+			{
+				col=packedSubSat(col,rate);
+			}
+			st->glitterR=UNPACK_R(col);
+			st->glitterG=UNPACK_G(col);
+			st->glitterB=UNPACK_B(col);
+			segSetLed(sg,ledIndex,st->glitterR,st->glitterG,st->glitterB,ps->globalSetting);
+
+			//Check if colour is reached
+			if(	(st->pulseDir==1 && st->glitterR == RGBMaxTmp.r && st->glitterG == RGBMaxTmp.g && st->glitterB == RGBMaxTmp.b) ||
+					(st->pulseDir==-1 && st->glitterR == 0 && st->glitterG == 0 && st->glitterB == 0) )
+			{
+				//If colour is reached, check if we have just generated all LEDs and update cycle if needed.
+				if(st->pulseUpdatedCycle)
+				{
+					st->pulseUpdatedCycle=false;
+					if(checkCycleCounter(&st->pulseCycle))
+					{
+						st->currentLed=glitterTotal;
+						st->pulseDone=true;
+						eventRaise(sg-segments,LEDSEG_EVENT_PULSE_DONE);
+					}
+				}
+			}
+
+		}
+	}
+	//Traverse the buffer in reverse from the point stopped to light up the rest of the LEDs fully (This will always run as long as the glitter pulse is active)
+	for(uint16_t i=0;i<ps->ledsMaxPower;i++)
+	{
+		if(currentIndex>0)
+		{
+			currentIndex--;
+		}
+		else
+		{
+			currentIndex=glitterTotal-1;
+		}
+		//Get which LED it is
+		uint16_t ledIndex=activeLeds[currentIndex];
+		//An LED with number 0 indicates that this is something we have not handled yet
+		if(ledIndex==0)
+		{
+			break;
+		}
+		//Generate maxColour for LED
+		RGB_t RGBMaxTmp=glitterGetMaxColour(ps,ledIndex,ledsPerCol);
+		segSetLed(sg,ledIndex,RGBMaxTmp.r,RGBMaxTmp.g,RGBMaxTmp.b,ps->globalSetting);
+	}
+}
+#endif
+
+/*
+ * Calculates a segment for one update period (fade first, and then the pulse on top of it)
+ * calcSeg is used instead of the generic calculation if given (see ledSegRunIterationCustom)
+ */
+static void segCalc(uint8_t seg, ledSegCalcFunc_t calcSeg)
+{
+	if(calcSeg!=NULL)
+	{
+		calcSeg(seg);
+	}
+	else
+	{
+		//Calculate and write fill colour to internal buffer, then the pulse on top of it
+		ledSegCalcFade(seg);
+		ledSegCalcPulse(seg,NULL);
+	}
+}
+
+/*
+ * Calculates a segment for one update period (including any running transition)
+ */
+static void segCalcPeriod(uint8_t seg, ledSegCalcFunc_t calcSeg)
+{
+	if(segTransitions[seg]!=NULL)
+	{
+		transitionCalc(seg,calcSeg);
+	}
+	else
+	{
+		segCalc(seg,calcSeg);
+	}
+}
+
+/*
+ * Calculates the segments marked by ledSegRenderNow, and pushes their strips (if the strips are free)
+ */
+static void renderNowPending()
+{
+	if(calcRunning)
+	{
+		return;
+	}
+	bool pushStrip[APA_NOF_STRIPS+1]={false};	//The strips to push (strips are numbered from 1)
+	bool anyStrip=false;
+	for(uint8_t i=0;i<currentNofSegments;i++)
+	{
+		if(segRenderNow[i] && !apa102DMABusy(segments[i].strip))
+		{
+			segRenderNow[i]=false;
+			calcRunning=true;
+			segCalcPeriod(i,lastCalcSeg);
+			calcRunning=false;
+			//The regular cycle skips the segment once (in this update period, or the next one if it has already been calculated)
+			segCalcAhead[i]=true;
+			pushStrip[segments[i].strip]=true;
+			anyStrip=true;
+		}
+	}
+	if(!anyStrip)
+	{
+		return;
+	}
+	eventDispatch();
+	for(uint8_t strip=1;strip<=APA_NOF_STRIPS;strip++)
+	{
+		if(pushStrip[strip])
+		{
+			apa102UpdateStrip(strip);
+		}
+	}
+}
+
+
+/*
+ * Calculates a segment in a transition for one update period
+ * The outgoing setting is calculated in place of the segment state and saved to the first line, and then the incoming setting is calculated as usual.
+ * The result is the blend of the two lines. Only the incoming setting raises events
+ */
+static void transitionCalc(uint8_t seg, ledSegCalcFunc_t calcSeg)
+{
+	ledSegTransition_t* tr=segTransitions[seg];
+	ledSegment_t* sg=&segments[seg];
+	const uint16_t len=sg->stop-sg->start+1;
+	apa102Pixel_t* outLine=tr->lines;
+	apa102Pixel_t* inLine=tr->lines+len;
+	ledSegmentState_t tmp;
+	//Swap in the outgoing state, calculate it and swap back
+	memcpy(&tmp,&(sg->state),sizeof(ledSegmentState_t));
+	memcpy(&(sg->state),&(tr->out),sizeof(ledSegmentState_t));
+	eventsMuted=true;
+	segCalc(seg,calcSeg);
+	eventsMuted=false;
+	memcpy(&(tr->out),&(sg->state),sizeof(ledSegmentState_t));
+	memcpy(&(sg->state),&tmp,sizeof(ledSegmentState_t));
+	apa102ReadRange(sg->strip,sg->start,sg->stop,outLine);
+	segCalc(seg,calcSeg);
+	tr->frame++;
+	if(tr->frame>=tr->frames)
+	{
+		//Only the incoming setting is left
+		transitionEnd(seg);
+		return;
+	}
+	apa102ReadRange(sg->strip,sg->start,sg->stop,inLine);
+	transitionCombine(sg,tr,outLine,inLine);
+	apa102WriteRange(sg->strip,sg->start,sg->stop,inLine);
+}
+
+/*
+ * Combines the outgoing and incoming lines of a transition into inLine, for the current update period
+ * Wipes are handled as spans (the part that still shows the old setting is copied as a whole), so they cost about the same as a copy of the line
+ */
+static void transitionCombine(const ledSegment_t* sg, const ledSegTransition_t* tr, const apa102Pixel_t* outLine, apa102Pixel_t* inLine)
+{
+	const uint16_t len=sg->stop-sg->start+1;
+	const uint16_t w=transitionWeight(tr);
+	//The number of LEDs that show the new setting (for all spatial transitions)
+	const uint16_t nofNew=((uint32_t)len*w)>>8;
+	ledSegmentTransition_t type=tr->type;
+	//Wipes follow the direction of the segment
+	if(sg->invertPulse)
+	{
+		if(type==LEDSEG_TRANS_WIPE_UP)
+		{
+			type=LEDSEG_TRANS_WIPE_DOWN;
+		}
+		else if(type==LEDSEG_TRANS_WIPE_DOWN)
+		{
+			type=LEDSEG_TRANS_WIPE_UP;
+		}
+	}
+	switch(type)
+	{
+		case LEDSEG_TRANS_WIPE_UP:
+		{
+			transitionKeepSpan(outLine,inLine,nofNew,len);
+			break;
+		}
+		case LEDSEG_TRANS_WIPE_DOWN:
+		{
+			transitionKeepSpan(outLine,inLine,0,len-nofNew);
+			break;
+		}
+		case LEDSEG_TRANS_CENTRE_OUT:
+		{
+			const uint16_t start=(len-nofNew)/2;
+			transitionKeepSpan(outLine,inLine,0,start);
+			transitionKeepSpan(outLine,inLine,start+nofNew,len);
+			break;
+		}
+		case LEDSEG_TRANS_CENTRE_IN:
+		{
+			transitionKeepSpan(outLine,inLine,nofNew/2,len-(nofNew-nofNew/2));
+			break;
+		}
+		case LEDSEG_TRANS_DISSOLVE:
+		{
+			//The LEDs first in the order have switched. The rest still show the old setting
+			for(uint16_t i=nofNew;i<len;i++)
+			{
+				inLine[tr->order[i]]=outLine[tr->order[i]];
+			}
+			break;
+		}
+		case LEDSEG_TRANS_CROSSFADE:
+		default:
+		{
+			for(uint16_t i=0;i<len;i++)
+			{
+				uint32_t a;
+				uint32_t b;
+				memcpy(&a,&outLine[i],sizeof(uint32_t));
+				memcpy(&b,&inLine[i],sizeof(uint32_t));
+				b=packedBlend(a,b,w);
+				memcpy(&inLine[i],&b,sizeof(uint32_t));
+			}
+			break;
+		}
+	}
+}
+
+/*
+ * Copies the LEDs from start to (but not including) stop from the outgoing line to the incoming line
+ */
+static void transitionKeepSpan(const apa102Pixel_t* outLine, apa102Pixel_t* inLine, uint16_t start, uint16_t stop)
+{
+	if(stop>start)
+	{
+		memcpy(&inLine[start],&outLine[start],(stop-start)*sizeof(apa102Pixel_t));
+	}
+}
+
+/*
+ * Returns the weight of the incoming setting (0-256) for the current update period of a transition
+ */
+static uint16_t transitionWeight(const ledSegTransition_t* tr)
+{
+	const uint32_t p=(tr->frame<<8)/tr->frames;
+	switch(tr->ease)
+	{
+		case LEDSEG_EASE_IN:
+		{
+			return (p*p)>>8;
+		}
+		case LEDSEG_EASE_OUT:
+		{
+			return 256-(((256-p)*(256-p))>>8);
+		}
+		case LEDSEG_EASE_IN_OUT:
+		{
+			//Smoothstep (3p^2-2p^3)
+			return (p*p*(768-2*p))>>16;
+		}
+		case LEDSEG_EASE_LINEAR:
+		default:
+		{
+			return p;
+		}
+	}
+}
+
+/*
+ * Ends the transition of a segment (if any). Only the incoming setting is kept
+ */
+static void transitionEnd(uint8_t seg)
+{
+	ledSegTransition_t* tr=segTransitions[seg];
+	if(tr==NULL)
+	{
+		return;
+	}
+	if(!tr->out.effectMemExternal)
+	{
+		free(tr->out.effectMem);
+	}
+	free(tr);
+	segTransitions[seg]=NULL;
+}
+
+/*
+ * Queues a completion event (nothing is done if no one listens)
+ */
+static void eventRaise(uint8_t seg, ledSegmentEvent_t event)
+{
+	if(!eventNofCallbacks || eventsMuted)
+	{
+		return;
+	}
+	if(eventQueueCount>=LEDSEG_EVENT_QUEUE_SIZE)
+	{
+		eventQueueOverflow=true;
+		return;
+	}
+	ledSegEventEntry_t* e=&eventQueue[(eventQueueStart+eventQueueCount)%LEDSEG_EVENT_QUEUE_SIZE];
+	e->seg=seg;
+	e->event=event;
+	eventQueueCount++;
+}
+
+/*
+ * Sends all queued events to all callbacks
+ * The callbacks may raise new events (for instance by loading a setting that is done immediately). These are sent in the same go
+ */
+static void eventDispatch()
+{
+	while(eventQueueCount)
+	{
+		const ledSegEventEntry_t e=eventQueue[eventQueueStart];
+		eventQueueStart=(eventQueueStart+1)%LEDSEG_EVENT_QUEUE_SIZE;
+		eventQueueCount--;
+		for(uint8_t i=0;i<eventNofCallbacks;i++)
+		{
+			eventCallbacks[i](e.seg,e.event);
+		}
+	}
+	if(eventQueueOverflow)
+	{
+		eventQueueOverflow=false;
+		for(uint8_t i=0;i<eventNofCallbacks;i++)
+		{
+			eventCallbacks[i](LEDSEG_ALL,LEDSEG_EVENT_OVERFLOW);
+		}
+	}
+}
+
+/*
+ * Updates all modulators, and applies all bindings (done once every update period)
+ */
+static void modUpdate()
+{
+	if(!modNofBindings)
+	{
+		return;
+	}
+	for(uint8_t i=0;i<LEDSEG_MAX_MODULATORS;i++)
+	{
+		if(modulators[i].used)
 		{
-			st->currentLed = utilBounceValue(st->currentLed,ps->pixelsPerIteration*st->pulseDir,start,stop,&tmpDir);
-			if(st->pulseDir!=tmpDir)
+			ledSegModulator_t* m=&modulators[i];
+			if(m->conf.source<=LEDSEG_MOD_SQUARE)
 			{
-				if(checkCycleCounter(&st->pulseCycle))
-				{
-					st->pulseUpdatedCycle=true;
-				}
-				else
-				{
-					st->pulseDir=tmpDir;
-				}
+				m->phase+=m->rate;
 			}
+			m->value=modCalcValue(m);
 		}
-		else if(ps->mode == LEDSEG_MODE_LOOP)
+	}
+	for(uint8_t i=0;i<LEDSEG_MAX_MOD_BINDINGS;i++)
+	{
+		const ledSegModBinding_t* b=&modBindings[i];
+		if(!b->used || !ledSegExists(b->seg))
 		{
-			if(utilValueWillOverflow(st->currentLed,ps->pixelsPerIteration*st->pulseDir,start,stop))
-			{
-				if(checkCycleCounter(&st->pulseCycle))
-				{
-					st->pulseUpdatedCycle=true;
-				}
-			}
-			if(!st->pulseUpdatedCycle)
-			{
-				st->currentLed = utilLoopValue(st->currentLed,ps->pixelsPerIteration*st->pulseDir,start,stop);
-			}
+			continue;
 		}
-		else if(ledSegisGlitterMode(ps->mode))
+		const int32_t span=(int32_t)b->max-(int32_t)b->min;
+		const uint16_t value=(uint16_t)((int32_t)b->min+(span*(int32_t)modulators[b->mod].value)/65535);
+		if(b->seg==LEDSEG_ALL)
 		{
-			//If fade is not active, make sure to clear all LEDs (which is what the fade would have done)
-			if(!st->fadeActive)
+			for(uint8_t seg=0;seg<currentNofSegments;seg++)
 			{
-				for(uint16_t i=0;i<glitterTotal;i++)
+				if(!isExcludedFromAll(seg))
 				{
-					ledSegSetLedWithGlobal(seg,st->glitterActiveLeds[i],0,0,0,ps->globalSetting);
-				}
-			}
-			//For glitter mode, we will generate new LEDs now
-			//Here, we also check what we need to do based on mode.
-			if(st->currentLed>=glitterTotal)
-			{
-				if(ps->mode==LEDSEG_MODE_GLITTER_LOOP)
-				{
-					memset(st->glitterActiveLeds,0,glitterTotal*sizeof(uint16_t));
-					st->currentLed=0;
-				}
-			}
-			//This will handle LEDSEG_MODE_GLITTER_LOOP_END (and also other unforeseen things)
-			if(st->currentLed<glitterTotal)
-			{
-				for(uint16_t i=0;i<ps->pixelsPerIteration;i++)
-				{
-					//Todo: This method might generate LEDs that are already lit. To avoid this, we would need to look through the entire buffer for each new LED. Sorting might help here. Don't this unless really needed.
-					//Generate a random LED
-					if(st->pulseDir==-1)
-					{
-						st->glitterActiveLeds[st->currentLed]=0;	//Clear the current LED if direction is down
-					}
-					else
-					{
-						st->glitterActiveLeds[st->currentLed]=utilRandRange(stop-start)+1;	//We will skip LED 0 in the segment
-					}
-					if(st->pulseDir==-1 && st->currentLed==0)
-					{
-						st->currentLed=1;
-					}
-					st->currentLed+=st->pulseDir;
-					if(st->currentLed>=glitterTotal)
-					{
-						st->pulseUpdatedCycle=true;
-						//In loop_persist, we will restart the ring buffer from 0
-						if(ps->mode == LEDSEG_MODE_GLITTER_LOOP_PERSIST)
-						{
-							st->currentLed=0;
-						}
-						else if(ps->mode==LEDSEG_MODE_GLITTER_BOUNCE)
-						{
-							st->currentLed=glitterTotal-1;
-							st->pulseDir=-1;
-							break;
-						}
-						else	//For LEDSEG_MODE_GLITTER_LOOP and LOOP_END
-						{
-							st->currentLed=glitterTotal;
-							break;
-						}
-					}
-					else if(st->currentLed==0 && ps->mode==LEDSEG_MODE_GLITTER_BOUNCE)
-					{
-						st->pulseUpdatedCycle=true;
-						st->pulseDir=1;
-					}
+					modApply(seg,b->target,value);
 				}
-				glitterJustGenerated=true;
 			}
 		}
 		else
 		{
-			//Invalid mode, fail silently
-			return;
+			modApply(b->seg,b->target,value);
 		}
-		st->cyclesToPulseMove = ps->pixelTime;
-
-	}//End of Cycles to move
-
-
+	}
+}
 
-	//Glitter mode:
-	if(ledSegisGlitterMode(ps->mode))
+/*
+ * Calculates the output of a modulator for the current update period (the LFO phase is advanced by the caller)
+ */
+static uint16_t modCalcValue(ledSegModulator_t* m)
+{
+	switch(m->conf.source)
 	{
-		//Load the current index of the ring buffer
-		uint16_t currentIndex=st->currentLed;
-		if((ps->mode == LEDSEG_MODE_GLITTER_LOOP || ps->mode == LEDSEG_MODE_GLITTER_LOOP_END) && currentIndex==glitterTotal)
+		case LEDSEG_MOD_SINE:
 		{
-			currentIndex--;
+			return modSine(m->phase);
 		}
-		//Calculate how many leds per colout for rainbowMode
-		uint16_t ledsPerCol=0;
-		if(ps->colourSeqNum)
+		case LEDSEG_MOD_TRIANGLE:
 		{
-			uint8_t tmp=1;
-			if(ps->colourSeqLoops)
+			const uint16_t p=m->phase>>16;
+			if(p<0x8000)
 			{
-				tmp=ps->colourSeqLoops;
+				return p*2;
 			}
-			ledsPerCol=(stop-start)/(ps->colourSeqNum*tmp);
+			return (0xFFFF-p)*2;
 		}
-
-		//Handles the LED fading (the newest LEDs) for all modes. If no fading is going on (because we're done), currentIndex==glitterTotal.
-		if(currentIndex<glitterTotal)
+		case LEDSEG_MOD_SQUARE:
 		{
-			//Todo: Check general buffer indexing to see if we miss/use the same LED multiple times, etc
-
-			//Go through the ring buffer in reverse, setting all fade LEDs to the proper colour
-			for(uint16_t i=0;i<ps->pixelsPerIteration;i++)
+			if(m->phase<0x80000000u)
 			{
-				//Get which LED it is (updating the ring buffer)
-				if(currentIndex>0)
-				{
-					currentIndex--;
-				}
-				else
-				{
-					currentIndex=glitterTotal-1;
-				}
-				uint16_t ledIndex=st->glitterActiveLeds[currentIndex];
-				RGB_t RGBMaxTmp;
-				if(ps->colourSeqNum)
-				{
-					uint16_t colIndex=((ledIndex-1)/ledsPerCol)%ps->colourSeqNum;
-					RGBMaxTmp=animGetColourFromSequence(ps->colourSeqPtr,colIndex,255);
-				}
-				else
+				return 0xFFFF;
+			}
+			return 0;
+		}
+		case LEDSEG_MOD_ENVELOPE:
+		{
+			//The level is kept in phase (16.16)
+			const uint32_t top=(uint32_t)0xFFFF<<16;
+			const uint32_t sustain=(uint32_t)m->conf.sustain<<16;
+			switch(m->stage)
+			{
+				case MOD_ENV_ATTACK:
 				{
-					RGBMaxTmp.r=ps->r_max;
-					RGBMaxTmp.g=ps->g_max;
-					RGBMaxTmp.b=ps->b_max;
+					if(top-m->phase<=m->envRate[0])
+					{
+						m->phase=top;
+						m->stage=MOD_ENV_DECAY;
+					}
+					else
+					{
+						m->phase+=m->envRate[0];
+					}
+					break;
 				}
-				//Only reset the colour if new LEDs were just generated
-				if(glitterJustGenerated)
+				case MOD_ENV_DECAY:
 				{
-					if(ps->mode == LEDSEG_MODE_GLITTER_BOUNCE && st->pulseDir==-1)
+					if(m->phase<=sustain || m->phase-sustain<=m->envRate[1])
 					{
-						st->glitterR=RGBMaxTmp.r;
-						st->glitterG=RGBMaxTmp.g;
-						st->glitterB=RGBMaxTmp.b;
+						m->phase=sustain;
+						m->stage=MOD_ENV_SUSTAIN;
 					}
 					else
 					{
-						//Reset fade colour to 0, to start a new fade cycle
-						st->glitterR=0;//st->r;
-						st->glitterG=0;//st->g;
-						st->glitterB=0;//st->b;
+						m->phase-=m->envRate[1];
 					}
+					break;
 				}
-				//Update colour
-				//Todo: Make sure we can fade to and from st->rgb (might require quite a bit of code and possibly syncing to get right...)
-
-				st->glitterR=utilIncWithDir(st->glitterR,st->pulseDir,RGBMaxTmp.r/ps->pixelTime,0,RGBMaxTmp.r);
-				st->glitterG=utilIncWithDir(st->glitterG,st->pulseDir,RGBMaxTmp.g/ps->pixelTime,0,RGBMaxTmp.g);
-				st->glitterB=utilIncWithDir(st->glitterB,st->pulseDir,RGBMaxTmp.b/ps->pixelTime,0,RGBMaxTmp.b);
-				ledSegSetLedWithGlobal(seg,ledIndex,st->glitterR,st->glitterG,st->glitterB,ps->globalSetting);
-
-				//Check if colour is reached
-				if(	(st->pulseDir==1 && st->glitterR == RGBMaxTmp.r && st->glitterG == RGBMaxTmp.g && st->glitterB == RGBMaxTmp.b) ||
-						(st->pulseDir==-1 && st->glitterR == 0 && st->glitterG == 0 && st->glitterB == 0) )
+				case MOD_ENV_RELEASE:
 				{
-					//If colour is reached, check if we have just generated all LEDs and update cycle if needed.
-					if(st->pulseUpdatedCycle)
+					if(m->phase<=m->envRate[2])
 					{
-						st->pulseUpdatedCycle=false;
-						if(checkCycleCounter(&st->pulseCycle))
-						{
-							st->currentLed=glitterTotal;
-							st->pulseDone=true;
-						}
+						m->phase=0;
+						m->stage=MOD_ENV_IDLE;
 					}
+					else
+					{
+						m->phase-=m->envRate[2];
+					}
+					break;
+				}
+				default:
+				{
+					break;
 				}
-
 			}
+			return m->phase>>16;
 		}
-		//Traverse the buffer in reverse from the point stopped to light up the rest of the LEDs fully (This will always run as long as the glitter pulse is active)
-		for(uint16_t i=0;i<ps->ledsMaxPower;i++)
+		case LEDSEG_MOD_RANDOM_WALK:
 		{
-			if(currentIndex>0)
-			{
-				currentIndex--;
-			}
-			else
+			//phase counts down the update periods to the next step
+			if(m->phase>1)
 			{
-				currentIndex=glitterTotal-1;
+				m->phase--;
+				return m->value;
 			}
-			//Get which LED it is
-			uint16_t ledIndex=st->glitterActiveLeds[currentIndex];
-			//An LED with number 0 indicates that this is something we have not handled yet
-			if(ledIndex==0)
+			m->phase=m->rate;
+			//Step anywhere from -step to +step
+			uint32_t range=2*(uint32_t)m->conf.step+1;
+			if(range>0xFFFF)
 			{
-				break;
+				range=0xFFFF;
 			}
-			//Generate maxColour for LED
-			RGB_t RGBMaxTmp;
-			if(ps->colourSeqNum)
+			int32_t v=(int32_t)m->value+(int32_t)ledSegRandRange(&m->randState,range)-(int32_t)m->conf.step;
+			if(v<0)
 			{
-				uint16_t colIndex=((ledIndex-1)/ledsPerCol)%ps->colourSeqNum;
-				RGBMaxTmp=animGetColourFromSequence(ps->colourSeqPtr,colIndex,255);
+				v=0;
 			}
-			else
+			else if(v>0xFFFF)
 			{
-				RGBMaxTmp.r=ps->r_max;
-				RGBMaxTmp.g=ps->g_max;
-				RGBMaxTmp.b=ps->b_max;
+				v=0xFFFF;
 			}
-			ledSegSetLedWithGlobal(seg,ledIndex,RGBMaxTmp.r,RGBMaxTmp.g,RGBMaxTmp.b,ps->globalSetting);
+			return (uint16_t)v;
+		}
+		case LEDSEG_MOD_EXTERNAL:
+		{
+			return m->input;
 		}
+		default:
+		{
+			return 0;
+		}
+	}
+}
+
+/*
+ * Returns the sine LFO value (0-65535) at the given phase (a full uint32 is one period)
+ * Uses a quarter period table, with linear interpolation between the points
+ */
+static uint16_t modSine(uint32_t phase)
+{
+	const uint8_t quarter=phase>>30;
+	uint32_t pos=(phase>>14)&0xFFFF;	//The position within the quarter (16 bits)
+	if(quarter&1)
+	{
+		pos=0x10000-pos;
+	}
+	const uint16_t i=pos>>11;
+	const uint16_t frac=pos&0x7FF;
+	uint32_t amp=modSineQuarter[i];
+	if(i<32)
+	{
+		amp+=((uint32_t)(modSineQuarter[i+1]-modSineQuarter[i])*frac)>>11;
+	}
+	if(quarter&2)
+	{
+		return (uint16_t)(32768-amp);
 	}
-	else	//Not glitter mode
+	return (uint16_t)(32768+amp);
+}
+
+/*
+ * Writes a modulated value to a setting of a segment. Nothing is restarted, the fade and pulse continue from where they are
+ */
+static void modApply(uint8_t seg, ledSegmentModTarget_t target, uint16_t value)
+{
+	ledSegmentState_t* st=&(segments[seg].state);
+	const uint8_t col=value>255?255:value;
+	const uint8_t global=value>31?31:value;
+	switch(target)
 	{
-		if(st->pulseActive)
+		case LEDSEG_MOD_TARGET_PULSE_SPEED:
 		{
-			//Set colour for all LEDs in pulse
-			for(uint16_t i=0;i<pulseLength;i++)
+			if(value==0)
 			{
-				//Generate where the LED shall be
-				int16_t tmpLedNum=0;
-
-				if(ps->mode == LEDSEG_MODE_LOOP_END || st->pulseUpdatedCycle)
-				{
-					tmpLedNum = st->currentLed+i*st->pulseDir*-1;
-				}
-				else if(ps->mode == LEDSEG_MODE_BOUNCE)
-				{
-					tmpLedNum=utilBounceValue(st->currentLed,i*st->pulseDir*-1,start,stop,NULL);
-				}
-				else if(ps->mode == LEDSEG_MODE_LOOP)
-				{
-					tmpLedNum=utilLoopValue(st->currentLed,i*st->pulseDir*-1,start,stop);
-				}
-				else
-				{
-					//Invalid mode, fail silently
-					return;
-				}
-				//Calculate colours and write LED
-				if(tmpLedNum>=start && tmpLedNum<=stop)
-				{
-					tmpR=pulseCalcColourPerLed(st,i+1,COL_RED);
-					tmpG=pulseCalcColourPerLed(st,i+1,COL_GREEN);
-					tmpB=pulseCalcColourPerLed(st,i+1,COL_BLUE);
-					apa102SetPixelWithGlobal(strip,tmpLedNum,tmpR,tmpG,tmpB,ps->globalSetting,true);
-				}
+				value=1;
+			}
+			st->confPulse.pixelTime=value;
+			//Don't wait for the rest of a long step when the speed increases
+			if(st->cyclesToPulseMove>value)
+			{
+				st->cyclesToPulseMove=value;
 			}
+			break;
+		}
+		case LEDSEG_MOD_TARGET_PULSE_R_MAX:
+		{
+			st->confPulse.r_max=col;
+			break;
+		}
+		case LEDSEG_MOD_TARGET_PULSE_G_MAX:
+		{
+			st->confPulse.g_max=col;
+			break;
+		}
+		case LEDSEG_MOD_TARGET_PULSE_B_MAX:
+		{
+			st->confPulse.b_max=col;
+			break;
+		}
+		case LEDSEG_MOD_TARGET_PULSE_GLOBAL:
+		{
+			st->confPulse.globalSetting=global;
+			break;
+		}
+		case LEDSEG_MOD_TARGET_FADE_R_MAX:
+		{
+			st->confFade.r_max=col;
+			break;
+		}
+		case LEDSEG_MOD_TARGET_FADE_G_MAX:
+		{
+			st->confFade.g_max=col;
+			break;
 		}
+		case LEDSEG_MOD_TARGET_FADE_B_MAX:
+		{
+			st->confFade.b_max=col;
+			break;
+		}
+		case LEDSEG_MOD_TARGET_FADE_GLOBAL:
+		{
+			st->confFade.globalSetting=global;
+			break;
+		}
+		default:
+		{
+			break;
+		}
+	}
+}
+
+/*
+ * Converts a time (in ms) to a number of update periods (at least 1)
+ */
+static uint32_t modTimeToPeriods(uint32_t time)
+{
+	time/=LEDSEG_UPDATE_PERIOD_TIME;
+	if(time==0)
+	{
+		time=1;
 	}
+	return time;
+}
+
+/*
+ * Calculates a fade colour after a number of steps from one end (from) towards the other (to). The colour stops at to
+ */
+static uint8_t fadeEvalChannel(uint8_t from, uint8_t to, uint8_t rate, uint32_t steps)
+{
+	const uint32_t diff=abs(to-from);
+	if(steps>=diff || (uint32_t)rate*steps>=diff)
+	{
+		return to;
+	}
+	if(to>from)
+	{
+		return from+rate*steps;
+	}
+	return from-rate*steps;
+}
+
+/*
+ * Returns the number of pulse moves (of ppi pixels) needed to move at least dist (always at least one move)
+ */
+static uint32_t pulseEvalSteps(int32_t dist, uint32_t ppi)
+{
+	if(dist<=(int32_t)ppi)
+	{
+		return 1;
+	}
+	return (dist+ppi-1)/ppi;
 }
 
 /*
@@ -1505,7 +3623,6 @@ static bool checkCycleCounterU16(uint16_t* cycle)
 	*cycle=tmp;
 	return false;
 }
-static bool segSyncReleaseFade[LEDSEG_MAX_SEGMENTS];
 /*
  * Calculates the colour to set for the fade part of this segment
  * This colour is applied to all parts of the LED fade segment
@@ -1521,83 +3638,39 @@ static void fadeCalcColour(uint8_t seg)
 	}
 	st=&(segments[seg].state);
 	conf=&(st->confFade);
-	bool redReversed=false;
-	bool blueReversed=false;
-	bool greenReversed=false;
 	if(st->fadeActive)
 	{
-		//Check if the direction of any colour is reveresed
-		if(conf->r_min>conf->r_max)
-		{
-			redReversed=true;
-		}
-		if(conf->g_min>conf->g_max)
-		{
-			greenReversed=true;
-		}
-		if(conf->b_min>conf->b_max)
-		{
-			blueReversed=true;
-		}
-		if(redReversed)
-		{
-			st->r=utilIncWithDir(st->r,st->fadeDir*-1,st->r_rate,conf->r_max,conf->r_min);
-		}
-		else
-		{
-			st->r=utilIncWithDir(st->r,st->fadeDir,st->r_rate,conf->r_min,conf->r_max);
-		}
-		if(greenReversed)
-		{
-			st->g=utilIncWithDir(st->g,st->fadeDir*-1,st->g_rate,conf->g_max,conf->g_min);
-		}
-		else
-		{
-			st->g=utilIncWithDir(st->g,st->fadeDir,st->g_rate,conf->g_min,conf->g_max);
-		}
-		if(blueReversed)
+		//A keyframe fade stays at a keyframe before it fades to the next
+		if(st->keyframeHold)
 		{
-			st->b=utilIncWithDir(st->b,st->fadeDir*-1,st->b_rate,conf->b_max,conf->b_min);
+			st->keyframeHold--;
+			return;
 		}
-		else
-		{
-			st->b=utilIncWithDir(st->b,st->fadeDir,st->b_rate,conf->b_min,conf->b_max);
+		//All colours are handled at once, packed in a single word
+		const uint32_t minP=PACK_RGB(conf->r_min,conf->g_min,conf->b_min);
+		const uint32_t maxP=PACK_RGB(conf->r_max,conf->g_max,conf->b_max);
+		const uint32_t rate=PACK_RGB(st->r_rate,st->g_rate,st->b_rate);
+		const uint32_t lo=packedMin(minP,maxP);
+		const uint32_t hi=packedMax(minP,maxP);
+		//A colour is reversed if min>max. Reversed colours decrease when fading up
+		const uint32_t reversed=packedLessThan(maxP,minP)&PACK_RGB_MASK;
+		uint32_t col=PACK_RGB(st->r,st->g,st->b);
+		if(st->fadeDir!=0)
+		{
+			//The colours that increase this step
+			uint32_t upMask=reversed;
+			if(st->fadeDir==1)
+			{
+				upMask=~reversed&PACK_RGB_MASK;
+			}
+			col=(packedMin(packedAddSat(col,rate),hi)&upMask) | (packedMax(packedSubSat(col,rate),lo)&~upMask);
 		}
-		//Check if we have reached an end (regardless of mode)
-		bool bAtMin=false;
-		bool bAtMax=false;
-		bool gAtMin=false;
-		bool gAtMax=false;
-		bool rAtMin=false;
-		bool rAtMax=false;
+		st->r=UNPACK_R(col);
+		st->g=UNPACK_G(col);
+		st->b=UNPACK_B(col);
+		//Check if we have reached an end (regardless of mode). Each colour is kept within min/max, so it has reached its end if it's equal to either
 		bool allReached=false;
-		//Check if each colour has reached its end
-		if((blueReversed && st->b<=conf->b_max) || (!blueReversed && st->b>=conf->b_max))
-		{
-			bAtMax=true;
-		}
-		else if((blueReversed && st->b>=conf->b_min) || (!blueReversed && st->b<=conf->b_min))
-		{
-			bAtMin=true;
-		}
-		if((greenReversed && st->g<=conf->g_max) || (!greenReversed && st->g>=conf->g_max))
-		{
-			gAtMax=true;
-		}
-		else if((greenReversed && st->g>=conf->g_min) || (!greenReversed && st->g<=conf->g_min))
-		{
-			gAtMin=true;
-		}
-		if((redReversed && st->r<=conf->r_max) || (!redReversed && st->r>=conf->r_max))
-		{
-			rAtMax=true;
-		}
-		else if((redReversed && st->r>=conf->r_min) || (!redReversed && st->r<=conf->r_min))
-		{
-			rAtMin=true;
-		}
-
-		if((bAtMin || bAtMax) && (gAtMin || gAtMax) && (rAtMin || rAtMax))
+		if(((packedEqual(col,maxP)|packedEqual(col,minP))&PACK_RGB_MASK)==PACK_RGB_MASK)
 		{
 			allReached=true;
 		}
@@ -1625,9 +3698,10 @@ static void fadeCalcColour(uint8_t seg)
 				{
 					st->fadeState=LEDSEG_FADE_WAITING_FOR_SYNC;
 				}
-				if(checkSyncReadyFade(conf->syncGroup,seg))
+				if(checkSyncReadyFade(conf->syncGroup,seg) && !segSyncReleaseFade[conf->syncGroup])
 				{
 					segSyncReleaseFade[conf->syncGroup]=true;
+					eventRaise(seg,LEDSEG_EVENT_SYNC_RELEASE);
 				}
 				//Check: Have all reached and are we at the lowest seg in the group?
 				//If so, we can release all segs in this group
@@ -1647,6 +3721,11 @@ static void fadeCalcColour(uint8_t seg)
 
 			if(!conf->syncGroup || (conf->syncGroup && segSyncReleaseFade[conf->syncGroup]))
 			{
+				//A finished fade stays at its end, so only the first time counts
+				if(st->fadeState!=LEDSEG_FADE_DONE)
+				{
+					eventRaise(seg,LEDSEG_EVENT_FADE_CYCLE_DONE);
+				}
 				//Check if the fade is done. if so, mark this fade as done. Otherwise, update what is do be done at an extreme
 				if(st->fadeCycle && checkCycleCounter(&st->fadeCycle))
 				{
@@ -1677,13 +3756,23 @@ static void fadeCalcColour(uint8_t seg)
 							conf->startDir = st->fadeDir*-1;
 						}
 						conf->cycles = st->savedCycles;
+						conf->keyframeNum = st->savedKeyframeNum;
+						conf->keyframePtr = st->savedKeyframePtr;
 						ledSegSetFade(seg,conf);
+						eventRaise(seg,LEDSEG_EVENT_FADE_SWITCH_DONE);
 					}
-					else
+					else if(st->fadeState!=LEDSEG_FADE_DONE)
 					{
 						st->fadeState=LEDSEG_FADE_DONE;
+						eventRaise(seg,LEDSEG_EVENT_FADE_DONE);
 					}
 				}
+				else if(conf->keyframeNum)
+				{
+					//Fade on to the next keyframe
+					fadeKeyframeLoad(st,st->keyframe);
+					st->fadeState=LEDSEG_FADE_NOT_DONE;
+				}
 				else
 				{
 					switch (conf->mode)
@@ -1729,6 +3818,89 @@ static void fadeCalcColour(uint8_t seg)
 	}
 }
 
+/*
+ * Sets up the fade from a keyframe to the next one (in the current direction): the colour is set to the keyframe,
+ * min and max are set to the two keyframes, and the rates are calculated for the time between them
+ */
+static void fadeKeyframeLoad(ledSegmentState_t* st, uint8_t keyframe)
+{
+	ledSegmentFadeSetting_t* conf=&(st->confFade);
+	const uint8_t n=conf->keyframeNum;
+	if(keyframe>=n)
+	{
+		keyframe=0;
+	}
+	//Find the next keyframe. The time between two keyframes is kept in the first one
+	uint8_t next=keyframe;
+	uint8_t timeFrame=keyframe;
+	if(n>1)
+	{
+		if(st->keyframeDir==1 && keyframe==n-1)
+		{
+			if(conf->mode==LEDSEG_MODE_BOUNCE)
+			{
+				st->keyframeDir=-1;
+			}
+		}
+		else if(st->keyframeDir==-1 && keyframe==0)
+		{
+			st->keyframeDir=1;
+		}
+		if(st->keyframeDir==1)
+		{
+			next=(keyframe+1)%n;
+		}
+		else
+		{
+			next=keyframe-1;
+			timeFrame=next;
+		}
+	}
+	const ledSegmentKeyframe_t* from=&(conf->keyframePtr[keyframe]);
+	const ledSegmentKeyframe_t* to=&(conf->keyframePtr[next]);
+	conf->r_min=from->colour.r;
+	conf->g_min=from->colour.g;
+	conf->b_min=from->colour.b;
+	conf->r_max=to->colour.r;
+	conf->g_max=to->colour.g;
+	conf->b_max=to->colour.b;
+	conf->fadeTime=conf->keyframePtr[timeFrame].time;
+	st->r=from->colour.r;
+	st->g=from->colour.g;
+	st->b=from->colour.b;
+	st->fadeDir=1;
+	st->keyframe=next;
+	//A fade shorter than an update period is done in one step. A fade between the same colours is held instead
+	uint32_t hold=from->hold;
+	uint16_t periodMultiplier=1;
+	if(conf->fadeTime<LEDSEG_UPDATE_PERIOD_TIME)
+	{
+		st->r_rate=UINT8_MAX;
+		st->g_rate=UINT8_MAX;
+		st->b_rate=UINT8_MAX;
+	}
+	else if(from->colour.r==to->colour.r && from->colour.g==to->colour.g && from->colour.b==to->colour.b)
+	{
+		hold+=conf->fadeTime;
+	}
+	else
+	{
+		//Only the rates are used, so the setting in the state is used as it is (keyframeNum is cleared to get the rates)
+		ledSegmentFadeSetting_t fs=*conf;
+		ledSegmentFadeRates_t rates;
+		fs.keyframeNum=0;
+		fs.cycles=0;
+		ledSegCompileFade(&fs,&rates);
+		st->r_rate=rates.r_rate;
+		st->g_rate=rates.g_rate;
+		st->b_rate=rates.b_rate;
+		periodMultiplier=rates.periodMultiplier;
+	}
+	conf->fadePeriodMultiplier=periodMultiplier;
+	st->cyclesToFadeChange=periodMultiplier;
+	st->keyframeHold=hold/(LEDSEG_UPDATE_PERIOD_TIME*periodMultiplier);
+}
+
 /*
  * Checks if all the fade animations in the same sync group are ready for sync
  * If syncgroup=0 (not part of any sync group), it is by definition synced with itself
@@ -1828,3 +4000,25 @@ static bool isExcludedFromAll(uint8_t seg)
 	}
 	return segments[seg].excludeFromAll;
 }
+
+/*
+ * Sets a single LED within a segment (counted from 1), taking inversion into account
+ * LEDs outside of the segment (including 0) are ignored, so they never end up in a neighbouring segment
+ */
+static void segSetLed(ledSegment_t* sg, uint16_t led, uint8_t r, uint8_t g, uint8_t b, uint8_t global)
+{
+	uint16_t tmp=0;
+	if(led==0 || led>(sg->stop-sg->start+1))
+	{
+		return;
+	}
+	if(sg->invertPulse)
+	{
+		tmp=sg->stop-led+1;
+	}
+	else
+	{
+		tmp=sg->start+led-1;
+	}
+	apa102SetPixelWithGlobal(sg->strip,tmp,r,g,b,global,true);
+}
@@ -0,0 +1,463 @@
+/*
+ * midiInput.c
+ *
+ * Parses a MIDI byte stream and maps notes, controllers and program changes to actions on the segments and animations.
+ *
+ * The actions change segments, load scenes (which may allocate memory) and drive the timecode, so all parsing is done from the main loop.
+ * From a UART interrupt, the bytes are put in a queue with midiReceiveByte, which is then parsed by midiTask in the main loop.
+ * On a host, a buffer of bytes (such as from read() on a serial port or pty) can be given to midiParse directly.
+ * The parser handles running status, skips SysEx and lets real-time messages (such as clock) through anywhere, even in the middle of another message.
+ * MIDI timecode (quarter frames, and full frames in SysEx) is given to the timecode (see timecode.h).
+ * Each message is looked up directly by its type and number, so handling a message takes the same time regardless of the number of mappings.
+ * The actions are done when the message is parsed, so a note is visible at the next update of the LEDs after midiTask.
+ */
+
+#include "midiInput.h"
+#include "timecode.h"
+#include "stdlib.h"
+
+//Marks that there is no mapping (the mapping indexes are stored +1, so that 0 means none)
+#define MIDI_NO_MAPPING 0
+//The highest value of a data byte
+#define MIDI_DATA_MAX 127
+//The number of bytes of a SysEx that are kept (enough for an MTC full frame)
+#define MIDI_SYSEX_KEEP 8
+
+/*
+ * A mapping from a message to an action
+ */
+typedef struct
+{
+	bool used;
+	midiMsgType_t type;
+	uint8_t channel;		//0-15 or MIDI_CHANNEL_ALL
+	uint8_t number;			//The note, controller or program
+	midiAction_t action;
+	uint32_t target;
+	uint8_t next;			//The next mapping for the same type and number (+1, MIDI_NO_MAPPING if last)
+}midiMapping_t;
+
+/*
+ * A scene, which is a snapshot (see ledSegSnapshot)
+ */
+typedef struct
+{
+	const uint8_t* snapshot;
+	uint32_t size;
+}midiScene_t;
+
+/*
+ * The state of the parser
+ */
+typedef struct
+{
+	uint8_t status;			//The current status (kept for running status). 0 if there is none
+	uint8_t data[2];
+	uint8_t nofData;
+	uint8_t needed;			//The number of data bytes of the current status
+	bool inSysEx;
+	uint8_t sysEx[MIDI_SYSEX_KEEP];	//The first bytes of the current SysEx (after 0xF0)
+	uint8_t nofSysEx;				//The number of bytes in the SysEx (saturates at 255)
+}midiParser_t;
+
+static midiParser_t midiParser;
+static midiMapping_t midiMappings[MIDI_MAX_MAPPINGS];
+//The first mapping (+1) of each type and number
+static uint8_t midiFirstMapping[MIDI_MSG_NOF_TYPES][MIDI_DATA_MAX+1];
+static midiScene_t midiScenes[MIDI_MAX_SCENES];
+static midiCallback_t midiCallback=NULL;
+//The bytes received in interrupt, waiting for midiTask. Only the interrupt writes midiRxHead, and only midiTask writes midiRxTail
+//The buffer is volatile, so that the byte is written before midiRxHead is moved past it
+static volatile uint8_t midiRxBuf[MIDI_RX_BUFFER_SIZE];
+static volatile uint8_t midiRxHead=0;
+static volatile uint8_t midiRxTail=0;
+//Set for a position in the buffer if bytes were lost before the byte there (the queue was full). Set by the interrupt and cleared by midiTask
+static volatile bool midiRxGap[MIDI_RX_BUFFER_SIZE];
+
+static void midiHandleMessage(uint8_t status, uint8_t data1, uint8_t data2);
+static void midiHandleSysEx();
+static void midiDoAction(const midiMapping_t* mp, uint8_t value, bool press);
+
+/*
+ * Resets the parser (such as after an error on the UART). The mappings and scenes are kept
+ */
+void midiReset()
+{
+	memset(&midiParser,0,sizeof(midiParser_t));
+}
+
+/*
+ * Puts a received byte in the queue parsed by midiTask. Can be called from an interrupt (such as the UART receive interrupt)
+ * Returns false if the queue is full (the byte is lost, and the parser restarts at the next status byte after the bytes queued before it)
+ */
+bool midiReceiveByte(uint8_t byte)
+{
+	const uint8_t head=midiRxHead;
+	const uint8_t next=(head+1)%MIDI_RX_BUFFER_SIZE;
+	if(next==midiRxTail)
+	{
+		//The gap is before the next byte that is queued (midiTask doesn't read this position until then)
+		midiRxGap[head]=true;
+		return false;
+	}
+	midiRxBuf[head]=byte;
+	midiRxHead=next;
+	return true;
+}
+
+/*
+ * Parses all bytes queued by midiReceiveByte, and does their actions. Shall be called from the main loop
+ * Returns the number of messages handled
+ */
+uint16_t midiTask()
+{
+	uint16_t nofMessages=0;
+	while(midiRxTail!=midiRxHead)
+	{
+		const uint8_t tail=midiRxTail;
+		if(midiRxGap[tail])
+		{
+			//Bytes have been lost here, so the message being parsed is broken (the bytes before the gap have been parsed already)
+			midiRxGap[tail]=false;
+			midiReset();
+		}
+		const uint8_t byte=midiRxBuf[tail];
+		midiRxTail=(tail+1)%MIDI_RX_BUFFER_SIZE;
+		if(midiParseByte(byte))
+		{
+			nofMessages++;
+		}
+	}
+	return nofMessages;
+}
+
+/*
+ * Parses one byte of MIDI. Shall only be called from the main loop (use midiReceiveByte in interrupts)
+ * Returns true if the byte completed a message (which has then been handled)
+ */
+bool midiParseByte(uint8_t byte)
+{
+	midiParser_t* mp=&midiParser;
+	if(byte>=0xF8)
+	{
+		//Real-time messages can come anywhere and don't change anything else
+		return false;
+	}
+	if(byte & 0x80)
+	{
+		//A new status ends a SysEx, even without the end byte (0xF7)
+		if(mp->inSysEx)
+		{
+			midiHandleSysEx();
+		}
+		mp->inSysEx=false;
+		mp->nofData=0;
+		if(byte==0xF0)
+		{
+			mp->inSysEx=true;
+			mp->nofSysEx=0;
+			mp->status=0;
+			return false;
+		}
+		if(byte==0xF7)
+		{
+			mp->status=0;
+			return false;
+		}
+		mp->status=byte;
+		switch(byte & 0xF0)
+		{
+			case 0xC0:
+			case 0xD0:
+				mp->needed=1;
+				break;
+			case 0xF0:
+				//System common
+				mp->needed=(byte==0xF2 ? 2 : ((byte==0xF1 || byte==0xF3) ? 1 : 0));
+				break;
+			default:
+				mp->needed=2;
+				break;
+		}
+		if(mp->needed)
+		{
+			return false;
+		}
+	}
+	else
+	{
+		if(mp->inSysEx)
+		{
+			if(mp->nofSysEx<MIDI_SYSEX_KEEP)
+			{
+				mp->sysEx[mp->nofSysEx]=byte;
+			}
+			if(mp->nofSysEx<0xFF)
+			{
+				mp->nofSysEx++;
+			}
+			return false;
+		}
+		if(!mp->status)
+		{
+			return false;
+		}
+		mp->data[mp->nofData++]=byte;
+		if(mp->nofData<mp->needed)
+		{
+			return false;
+		}
+	}
+	mp->nofData=0;
+	const uint8_t status=mp->status;
+	//System common messages can't use running status
+	if(status>=0xF0)
+	{
+		mp->status=0;
+	}
+	midiHandleMessage(status,mp->data[0],(mp->needed==2 ? mp->data[1] : 0));
+	return true;
+}
+
+/*
+ * Parses a buffer of MIDI bytes. Shall only be called from the main loop
+ * Messages may be split between buffers
+ * Returns the number of messages handled
+ */
+uint16_t midiParse(const uint8_t* data, uint16_t len)
+{
+	uint16_t nofMessages=0;
+	if(data==NULL)
+	{
+		return 0;
+	}
+	for(uint16_t i=0;i<len;i++)
+	{
+		if(midiParseByte(data[i]))
+		{
+			nofMessages++;
+		}
+	}
+	return nofMessages;
+}
+
+/*
+ * Maps a MIDI message to an action
+ * type is the kind of message, and number is the note, controller or program (0-127)
+ * channel is the MIDI channel (0-15), or MIDI_CHANNEL_ALL for any channel
+ * target is what the action is done on (see midiAction_t)
+ * Several mappings can be made for the same message. They are done in the order they were mapped
+ * Returns the number of the mapping (used for removing it), or MIDI_MAX_MAPPINGS+1 if it failed
+ */
+uint8_t midiMap(midiMsgType_t type, uint8_t channel, uint8_t number, midiAction_t action, uint32_t target)
+{
+	if(type>=MIDI_MSG_NOF_TYPES || number>MIDI_DATA_MAX || (channel>15 && channel!=MIDI_CHANNEL_ALL) || action>=MIDI_ACTION_NOF_ACTIONS)
+	{
+		return MIDI_MAX_MAPPINGS+1;
+	}
+	if(((action==MIDI_ACTION_DIMMER || action==MIDI_ACTION_PULSE) && !ledSegExists(target)) ||
+		(action==MIDI_ACTION_SCENE && target>=MIDI_MAX_SCENES) || (action==MIDI_ACTION_MOD && target>=LEDSEG_MAX_MODULATORS))
+	{
+		return MIDI_MAX_MAPPINGS+1;
+	}
+	for(uint8_t i=0;i<MIDI_MAX_MAPPINGS;i++)
+	{
+		midiMapping_t* mp=&midiMappings[i];
+		if(mp->used)
+		{
+			continue;
+		}
+		mp->used=true;
+		mp->type=type;
+		mp->channel=channel;
+		mp->number=number;
+		mp->action=action;
+		mp->target=target;
+		mp->next=MIDI_NO_MAPPING;
+		//Put it last in the list of its message
+		uint8_t* link=&midiFirstMapping[type][number];
+		while(*link!=MIDI_NO_MAPPING)
+		{
+			link=&midiMappings[*link-1].next;
+		}
+		*link=i+1;
+		return i;
+	}
+	return MIDI_MAX_MAPPINGS+1;
+}
+
+/*
+ * Removes a mapping
+ */
+bool midiUnmap(uint8_t mapping)
+{
+	if(mapping>=MIDI_MAX_MAPPINGS || !midiMappings[mapping].used)
+	{
+		return false;
+	}
+	midiMapping_t* mp=&midiMappings[mapping];
+	uint8_t* link=&midiFirstMapping[mp->type][mp->number];
+	while(*link!=mapping+1)
+	{
+		link=&midiMappings[*link-1].next;
+	}
+	*link=mp->next;
+	mp->used=false;
+	return true;
+}
+
+/*
+ * Sets a scene which can be selected from MIDI (see MIDI_ACTION_SCENE)
+ * snapshot is made by ledSegSnapshot and must be kept (it's not copied). Set it to NULL to remove the scene
+ * The snapshot is checked when the scene is loaded (an invalid one leaves everything as it is)
+ * Returns false if the scene is out of range
+ */
+bool midiSetScene(uint8_t scene, const uint8_t* snapshot, uint32_t size)
+{
+	if(scene>=MIDI_MAX_SCENES)
+	{
+		return false;
+	}
+	midiScenes[scene].snapshot=snapshot;
+	midiScenes[scene].size=size;
+	return true;
+}
+
+/*
+ * Sets a function called for every channel message (after the mapped actions). Set to NULL to remove it
+ */
+void midiSetCallback(midiCallback_t cb)
+{
+	midiCallback=cb;
+}
+
+/*
+ * Handles a complete message: does all mapped actions and calls the callback
+ */
+static void midiHandleMessage(uint8_t status, uint8_t data1, uint8_t data2)
+{
+	if(status>=0xF0)
+	{
+		//System common messages aren't mapped
+		if(status==0xF1)
+		{
+			tcMtcQuarterFrame(data1);
+		}
+		return;
+	}
+	const uint8_t channel=status & 0x0F;
+	midiMsgType_t type;
+	uint8_t value;
+	bool press;
+	switch(status & 0xF0)
+	{
+		case 0x80:
+			type=MIDI_MSG_NOTE;
+			value=0;
+			press=false;
+			break;
+		case 0x90:
+			type=MIDI_MSG_NOTE;
+			value=data2;
+			press=(data2>0);
+			break;
+		case 0xB0:
+			type=MIDI_MSG_CC;
+			value=data2;
+			press=(data2>=MIDI_CC_ON_THRESHOLD);
+			break;
+		case 0xC0:
+			type=MIDI_MSG_PROGRAM;
+			value=MIDI_DATA_MAX;
+			press=true;
+			break;
+		default:
+			type=MIDI_MSG_NOF_TYPES;
+			value=0;
+			press=false;
+			break;
+	}
+	if(type<MIDI_MSG_NOF_TYPES)
+	{
+		uint8_t next=midiFirstMapping[type][data1];
+		while(next!=MIDI_NO_MAPPING)
+		{
+			const midiMapping_t* mp=&midiMappings[next-1];
+			if(mp->channel==MIDI_CHANNEL_ALL || mp->channel==channel)
+			{
+				midiDoAction(mp,value,press);
+			}
+			next=mp->next;
+		}
+	}
+	if(midiCallback!=NULL)
+	{
+		midiCallback(status,data1,data2);
+	}
+}
+
+/*
+ * Handles a complete SysEx. Only MTC full frames (F0 7F <device> 01 01 hh mm ss ff F7) are used
+ */
+static void midiHandleSysEx()
+{
+	const uint8_t* d=midiParser.sysEx;
+	if(midiParser.nofSysEx==MIDI_SYSEX_KEEP && d[0]==0x7F && d[2]==0x01 && d[3]==0x01)
+	{
+		tcMtcFullFrame(d[4],d[5],d[6],d[7]);
+	}
+}
+
+/*
+ * Does the action of a mapping
+ * value is the velocity or controller value, and press is true for a note on (or a controller above MIDI_CC_ON_THRESHOLD)
+ */
+static void midiDoAction(const midiMapping_t* mp, uint8_t value, bool press)
+{
+	switch(mp->action)
+	{
+		case MIDI_ACTION_TRIG_SEQ:
+			if(press)
+			{
+				animSeqTrigTransition(mp->target);
+			}
+			break;
+		case MIDI_ACTION_DIMMER:
+			//A note off doesn't turn the dimmer down
+			if(press || mp->type==MIDI_MSG_CC)
+			{
+				const uint8_t global=((uint16_t)value*APA_MAX_GLOBAL_SETTING+MIDI_DATA_MAX/2)/MIDI_DATA_MAX;
+				ledSegSetGlobal(mp->target,global,global);
+			}
+			break;
+		case MIDI_ACTION_PULSE:
+			if(press)
+			{
+				ledSegSetPulseActiveState(mp->target,true);
+				ledSegRestart(mp->target,false,true);
+			}
+			break;
+		case MIDI_ACTION_SCENE:
+			if(press && midiScenes[mp->target].snapshot!=NULL)
+			{
+				ledSegRestore(midiScenes[mp->target].snapshot,midiScenes[mp->target].size);
+			}
+			break;
+		case MIDI_ACTION_MOD:
+			//An external modulator follows the value, an envelope is triggered and released
+			if(!ledSegModSetInput(mp->target,((uint32_t)value*0xFFFF)/MIDI_DATA_MAX))
+			{
+				if(press)
+				{
+					ledSegModTrigger(mp->target);
+				}
+				else
+				{
+					ledSegModRelease(mp->target);
+				}
+			}
+			break;
+		default:
+			break;
+	}
+}
@@ -0,0 +1,369 @@
+/*
+ * timecode.c
+ *
+ * Makes the lights follow timecode, such as MIDI timecode (MTC) from a show controller or a DAW.
+ *
+ * The timecode sets a show time, which the engine runs on instead of systemTime (see ledSegSetClock). So the fades, pulses, sequences and scripts all follow the timecode.
+ * Between the timecode messages, the show time runs on systemTime. Small differences (drift between the clocks) are corrected smoothly,
+ * by changing the speed of the show time for a while and learning the speed of the timecode, so the show time never jumps or stutters.
+ * When the timecode jumps (such as when the operator moves to another scene), the show time is moved right away. To get the lights right after a jump,
+ * cues can be added. A cue is a snapshot of the engine (see ledSegSnapshot) at a show time. After a jump, the last cue before the new time is loaded,
+ * and the engine is fast-forwarded (without showing anything) up to the new time.
+ * If the timecode stops, the show time stops, and the lights freeze.
+ *
+ * MTC is given by the MIDI parser (see midiInput.h), so a recorded MTC byte stream can be played through midiParse. Any other clock (such as SMPTE LTC
+ * from a decoder, or time from the network) can be given by tcSetExternalTime.
+ * The timecode functions shall be called from the main loop, not from an interrupt (buffer the UART bytes in the interrupt).
+ */
+
+#include "timecode.h"
+#include "stdlib.h"
+
+//The speed of real time (Q16)
+#define TC_SPEED_ONE ((int32_t)1<<16)
+//The limit of the difference from real time of the speeds (Q16)
+#define TC_SPEED_LIMIT (TC_SPEED_ONE/2)
+//Marks that there is no cue
+#define TC_NO_CUE (TC_MAX_CUES+1)
+
+/*
+ * A cue (see tcAddCue)
+ */
+typedef struct
+{
+	bool used;
+	uint32_t time;
+	const uint8_t* snapshot;
+	uint32_t size;
+}tcCue_t;
+
+/*
+ * The state of the show time and the MTC parser
+ */
+typedef struct
+{
+	bool locked;				//There has been timecode, so there is a show time
+	bool running;				//The show time is moving
+	uint32_t refShow;			//The show time at refSys
+	uint32_t refSys;			//The systemTime of the last update of the show time
+	int32_t speed;				//The speed of the show time, including the drift correction (Q16, the difference from real time)
+	int32_t baseSpeed;			//The learned speed of the timecode (Q16, the difference from real time)
+	uint32_t lastInput;			//The systemTime of the last timecode
+	bool relocatePending;		//The timecode has jumped (handled by tcTask)
+	bool fastForward;			//The engine is being fast-forwarded. The show time is fastForwardTime
+	uint32_t fastForwardTime;
+	//MTC
+	uint8_t pieces[8];			//The nibbles of the quarter frames
+	uint8_t nextPiece;			//The quarter frame expected next
+	bool haveCycle;				//cycleStart is known
+	uint32_t cycleStart;		//The frame (counted from 00:00:00:00) at the start of the current quarter frame cycle
+	tcFrameRate_t rate;
+}tcState_t;
+
+static tcState_t tc;
+static tcCue_t tcCues[TC_MAX_CUES];
+
+static uint32_t tcShowTimeAt(uint32_t now);
+static int32_t tcLimitSpeed(int32_t speed);
+static void tcInput(uint32_t position);
+static void tcRelocate(uint32_t position, bool running);
+static uint32_t tcToFrames(uint8_t hours, uint8_t minutes, uint8_t seconds, uint8_t frames, tcFrameRate_t rate);
+static uint32_t tcFramesToMs(uint32_t frames, uint8_t quarters, tcFrameRate_t rate);
+
+/*
+ * Lets the engine run on the show time (enable=true), or on systemTime (enable=false)
+ * Until any timecode has come, the show time is 0
+ */
+void tcEnable(bool enable)
+{
+	ledSegSetClock(enable ? tcGetShowTime : NULL);
+}
+
+/*
+ * Forgets the show time (it's 0 until new timecode comes). The cues are kept
+ */
+void tcReset()
+{
+	memset(&tc,0,sizeof(tcState_t));
+}
+
+/*
+ * Handles jumps of the timecode: loads the last cue before the new show time and fast-forwards the engine to the show time
+ * Shall be called in the main loop (before ledSegRunIteration and animTask)
+ */
+void tcTask()
+{
+	if(!tc.relocatePending)
+	{
+		return;
+	}
+	tc.relocatePending=false;
+	const uint32_t target=tcGetShowTime();
+	uint8_t cue=TC_NO_CUE;
+	for(uint8_t i=0;i<TC_MAX_CUES;i++)
+	{
+		if(tcCues[i].used && tcCues[i].time<=target && (cue==TC_NO_CUE || tcCues[i].time>tcCues[cue].time))
+		{
+			cue=i;
+		}
+	}
+	if(cue==TC_NO_CUE)
+	{
+		//Without a cue, everything continues from where it is
+		return;
+	}
+	//The cue is loaded at its own time, so that the wait times of the sequences are counted from it
+	tc.fastForward=true;
+	tc.fastForwardTime=tcCues[cue].time;
+	if(ledSegRestore(tcCues[cue].snapshot,tcCues[cue].size))
+	{
+		//If the cue is too far back, the lights are behind (but run at the right speed)
+		if(target-tc.fastForwardTime>TC_MAX_CATCH_UP)
+		{
+			tc.fastForwardTime=target-TC_MAX_CATCH_UP;
+		}
+		while(tc.fastForwardTime+LEDSEG_UPDATE_PERIOD_TIME<=target)
+		{
+			tc.fastForwardTime+=LEDSEG_UPDATE_PERIOD_TIME;
+			ledSegStepPeriod();
+			animTask();
+		}
+	}
+	tc.fastForward=false;
+}
+
+/*
+ * Gives a quarter frame message of MTC (the data byte of a 0xF1 message)
+ * The show time is updated on every quarter frame, and the full timecode is read every 8 quarter frames (2 frames)
+ */
+void tcMtcQuarterFrame(uint8_t data)
+{
+	const uint8_t piece=(data>>4)&0x07;
+	if(piece!=tc.nextPiece)
+	{
+		//A quarter frame was lost (or the timecode runs backwards). Start over at the next cycle
+		tc.nextPiece=0;
+		tc.haveCycle=false;
+		if(piece!=0)
+		{
+			return;
+		}
+	}
+	tc.pieces[piece]=data&0x0F;
+	tc.nextPiece=(piece+1)&0x07;
+	if(tc.haveCycle)
+	{
+		tcInput(tcFramesToMs(tc.cycleStart,piece,tc.rate));
+	}
+	if(piece==7)
+	{
+		//The timecode is for the frame when the first quarter frame was sent
+		tc.rate=(tcFrameRate_t)((tc.pieces[7]>>1)&0x03);
+		const uint32_t frame=tcToFrames(tc.pieces[6]|((tc.pieces[7]&0x01)<<4),tc.pieces[4]|(tc.pieces[5]<<4),
+				tc.pieces[2]|(tc.pieces[3]<<4),tc.pieces[0]|(tc.pieces[1]<<4),tc.rate);
+		if(!tc.haveCycle || frame!=tc.cycleStart)
+		{
+			tcInput(tcFramesToMs(frame,7,tc.rate));
+		}
+		tc.cycleStart=frame+2;
+		tc.haveCycle=true;
+	}
+}
+
+/*
+ * Gives a full frame message of MTC (sent when the timecode is moved, such as when the operator locates a scene)
+ * hours contains the frame rate (bits 5-6), just as in the message. The show time is moved right away, but doesn't run until quarter frames come
+ */
+void tcMtcFullFrame(uint8_t hours, uint8_t minutes, uint8_t seconds, uint8_t frames)
+{
+	tc.rate=(tcFrameRate_t)((hours>>5)&0x03);
+	tc.nextPiece=0;
+	tc.haveCycle=false;
+	tc.lastInput=systemTime;
+	tcRelocate(tcFramesToMs(tcToFrames(hours&0x1F,minutes,seconds,frames,tc.rate),0,tc.rate),false);
+}
+
+/*
+ * Gives the time of an external clock (in ms), such as from an SMPTE LTC decoder or the network
+ * It shall be given at least every TC_TIMEOUT ms, or the show time stops
+ */
+void tcSetExternalTime(uint32_t time)
+{
+	tcInput(time);
+}
+
+/*
+ * Returns the show time (in ms). This is the clock the engine runs on when tcEnable is set
+ */
+uint32_t tcGetShowTime()
+{
+	if(tc.fastForward)
+	{
+		return tc.fastForwardTime;
+	}
+	if(!tc.running)
+	{
+		return tc.refShow;
+	}
+	const uint32_t now=systemTime;
+	if(now-tc.lastInput>TC_TIMEOUT)
+	{
+		//The timecode has stopped. The quarter frames start over when it starts again
+		tc.refShow=tcShowTimeAt(tc.lastInput+TC_TIMEOUT);
+		tc.refSys=tc.lastInput+TC_TIMEOUT;
+		tc.running=false;
+		tc.nextPiece=0;
+		tc.haveCycle=false;
+		return tc.refShow;
+	}
+	return tcShowTimeAt(now);
+}
+
+/*
+ * Returns true if the show time is moving (timecode is coming in)
+ */
+bool tcIsRunning()
+{
+	tcGetShowTime();
+	return tc.running;
+}
+
+/*
+ * Adds a cue: a snapshot of the engine (see ledSegSnapshot) at a show time (in ms)
+ * When the timecode jumps, the last cue before the new time is loaded. The snapshot must be kept (it's not copied)
+ * Returns the number of the cue (used for removing it), or TC_MAX_CUES+1 if there is no room
+ */
+uint8_t tcAddCue(uint32_t time, const uint8_t* snapshot, uint32_t size)
+{
+	if(snapshot==NULL)
+	{
+		return TC_MAX_CUES+1;
+	}
+	for(uint8_t i=0;i<TC_MAX_CUES;i++)
+	{
+		tcCue_t* cue=&tcCues[i];
+		if(!cue->used)
+		{
+			cue->used=true;
+			cue->time=time;
+			cue->snapshot=snapshot;
+			cue->size=size;
+			return i;
+		}
+	}
+	return TC_MAX_CUES+1;
+}
+
+/*
+ * Removes a cue
+ */
+bool tcRemoveCue(uint8_t cue)
+{
+	if(cue>=TC_MAX_CUES || !tcCues[cue].used)
+	{
+		return false;
+	}
+	tcCues[cue].used=false;
+	return true;
+}
+
+/*
+ * Returns the show time at a systemTime (after the last update)
+ */
+static uint32_t tcShowTimeAt(uint32_t now)
+{
+	return tc.refShow+(uint32_t)(((uint64_t)(now-tc.refSys)*(uint32_t)(TC_SPEED_ONE+tc.speed))>>16);
+}
+
+/*
+ * Limits a speed (the difference from real time)
+ */
+static int32_t tcLimitSpeed(int32_t speed)
+{
+	if(speed>TC_SPEED_LIMIT)
+	{
+		return TC_SPEED_LIMIT;
+	}
+	if(speed<-TC_SPEED_LIMIT)
+	{
+		return -TC_SPEED_LIMIT;
+	}
+	return speed;
+}
+
+/*
+ * Handles a new position of the timecode (in ms), valid now
+ * Small differences from the show time are corrected by the speed of the show time (a PI controller), larger ones move the show time
+ */
+static void tcInput(uint32_t position)
+{
+	const uint32_t now=systemTime;
+	if(!tc.locked)
+	{
+		tc.lastInput=now;
+		tcRelocate(position,true);
+		return;
+	}
+	const uint32_t predicted=tcGetShowTime();
+	const int32_t error=(int32_t)(position-predicted);
+	tc.lastInput=now;
+	if(error>TC_JUMP_THRESHOLD || error<-TC_JUMP_THRESHOLD)
+	{
+		tcRelocate(position,true);
+		return;
+	}
+	if(!tc.running)
+	{
+		//The timecode starts again from where it stopped. It's a new start, so the small step is taken right away
+		tc.refShow=position;
+		tc.refSys=now;
+		tc.speed=tc.baseSpeed;
+		tc.running=true;
+		return;
+	}
+	const int32_t correction=(error*TC_SPEED_ONE)/TC_SLEW_TIME;
+	tc.baseSpeed=tcLimitSpeed(tc.baseSpeed+(correction>>TC_SPEED_SHIFT));
+	tc.speed=tcLimitSpeed(tc.baseSpeed+correction);
+	tc.refShow=predicted;
+	tc.refSys=now;
+}
+
+/*
+ * Moves the show time right away (the timecode has jumped). The engine follows in tcTask
+ */
+static void tcRelocate(uint32_t position, bool running)
+{
+	tc.locked=true;
+	tc.running=running;
+	tc.refShow=position;
+	tc.refSys=tc.lastInput;
+	tc.speed=tc.baseSpeed;
+	tc.relocatePending=true;
+}
+
+/*
+ * Returns the number of frames since 00:00:00:00 of a timecode
+ * With drop frame, frames 0 and 1 are skipped every minute, except every 10th minute
+ */
+static uint32_t tcToFrames(uint8_t hours, uint8_t minutes, uint8_t seconds, uint8_t frames, tcFrameRate_t rate)
+{
+	static const uint8_t fps[]={24,25,30,30};
+	const uint32_t totalMinutes=(uint32_t)hours*60+minutes;
+	uint32_t n=(totalMinutes*60+seconds)*fps[rate]+frames;
+	if(rate==TC_FPS_30_DROP)
+	{
+		n-=2*(totalMinutes-totalMinutes/10);
+	}
+	return n;
+}
+
+/*
+ * Returns the time (in ms) of a frame plus a number of quarter frames
+ */
+static uint32_t tcFramesToMs(uint32_t frames, uint8_t quarters, tcFrameRate_t rate)
+{
+	//The length of a quarter frame (in ms) is num/den
+	static const uint16_t num[]={250,250,1001,250};
+	static const uint8_t den[]={24,25,120,30};
+	return (uint32_t)((((uint64_t)frames*4+quarters)*num[rate])/den[rate]);
+}